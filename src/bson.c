@@ -392,6 +392,13 @@ bson_buffer * bson_buffer_init( bson_buffer * b ){
     return b;
 }
 
+bson_buffer * bson_buffer_reset( bson_buffer * b ){
+    b->cur = b->buf + 4;
+    b->finished = 0;
+    b->stackPos = 0;
+    return b;
+}
+
 void bson_append_byte( bson_buffer * b , char c ){
     b->cur[0] = c;
     b->cur++;
@@ -639,7 +646,6 @@ void bson_fatal_msg( int ok , const char* msg){
     exit(-5);
 }
 
-extern const char bson_numstrs[1000][4];
 void bson_numstr(char* str, int i){
     if(i < 1000)
         memcpy(str, bson_numstrs[i], 4);
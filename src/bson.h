@@ -158,6 +158,8 @@ time_t bson_oid_generated_time(bson_oid_t* oid); /* Gives the time the OID was c
    ------------------------------ */
 
 bson_buffer * bson_buffer_init( bson_buffer * b );
+/* empty the buffer for reuse, keeping its memory */
+bson_buffer * bson_buffer_reset( bson_buffer * b );
 bson_buffer * bson_ensure_space( bson_buffer * b , const int bytesNeeded );
 
 /**
@@ -191,6 +193,8 @@ bson_buffer * bson_append_start_object( bson_buffer * b , const char * name );
 bson_buffer * bson_append_start_array( bson_buffer * b , const char * name );
 bson_buffer * bson_append_finish_object( bson_buffer * b );
 
+/* all the numbers that fit in a 4 byte string, for array keys */
+extern const char bson_numstrs[1000][4];
 void bson_numstr(char* str, int i);
 void bson_incnumstr(char* str);
 
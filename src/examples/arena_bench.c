@@ -0,0 +1,164 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file arena_bench.c
+ * Create and destroy calipers with histograms at a high rate, as for
+ * per-connection calipers, with nlcali_new()/nlcali_free() and with
+ * an arena per thread.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_arena.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 50
+#define EVENTS 4
+#define SLAB 1024
+
+typedef enum { MALLOC=0, ARENA=1 } bench_mode_t;
+
+char *prog = NULL;
+
+struct worker_t {
+    bench_mode_t mode;
+    int live;
+    long ops;
+    unsigned seed;
+};
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <threads> <live calipers per thread> "
+            "<replacements per thread>\n", s, prog);
+}
+
+static nlcali_T make(struct worker_t *w, nlcali_arena_T arena)
+{
+    nlcali_T c;
+
+    if (w->mode == ARENA) {
+        c = nlcali_arena_alloc(arena, 2);
+    }
+    else {
+        c = nlcali_new(2);
+    }
+    assert(c);
+    nlcali_hist_manual(c, HIST_BINS, 0, 10);
+    return c;
+}
+
+static void destroy(struct worker_t *w, nlcali_arena_T arena, nlcali_T c)
+{
+    if (w->mode == ARENA) {
+        nlcali_arena_release(arena, c);
+    }
+    else {
+        nlcali_free(c);
+    }
+}
+
+static void *work(void *arg)
+{
+    struct worker_t *w = (struct worker_t *)arg;
+    nlcali_arena_T arena = NULL;
+    nlcali_T *cali;
+    long k;
+    int i, j;
+
+    if (w->mode == ARENA) {
+        arena = nlcali_arena_new(SLAB, HIST_BINS);
+        assert(arena);
+    }
+    cali = (nlcali_T *)malloc(w->live * sizeof(nlcali_T));
+    for (i = 0; i < w->live; i++) {
+        cali[i] = make(w, arena);
+    }
+    for (k = 0; k < w->ops; k++) {
+        /* a connection closes and another opens */
+        i = rand_r(&w->seed) % w->live;
+        destroy(w, arena, cali[i]);
+        cali[i] = make(w, arena);
+        for (j = 0; j < EVENTS; j++) {
+            nlcali_add(cali[i], 0, 1000 + j, 1 + j);
+        }
+        /* the auto histogram is reconfigured when it leaves pre-init */
+        if ((k & 15) == 0) {
+            nlcali_hist_auto(cali[i], HIST_BINS, 1);
+            nlcali_add(cali[i], 0, 1000, 1);
+            nlcali_calc(cali[i]);
+            assert(cali[i]->h_state == NL_HIST_AUTO_READY);
+        }
+    }
+    if (w->mode == ARENA) {
+        assert(nlcali_arena_used(arena) == (unsigned)w->live);
+        nlcali_arena_reset(arena);
+        assert(nlcali_arena_used(arena) == 0);
+        nlcali_arena_free(arena);
+    }
+    else {
+        for (i = 0; i < w->live; i++) {
+            nlcali_free(cali[i]);
+        }
+    }
+    free(cali);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "malloc", "arena" };
+    int nthreads, live, i, mode;
+    long ops;
+    double t0, sec;
+    pthread_t *tids;
+    struct worker_t *w;
+
+    prog = argv[0];
+    if (argc != 4) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &nthreads) != 1 || nthreads < 1) {
+        usage("bad value for <threads>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%d", &live) != 1 || live < 1) {
+        usage("bad value for <live calipers per thread>");
+        goto ERROR;
+    }
+    if (sscanf(argv[3], "%ld", &ops) != 1 || ops < 1) {
+        usage("bad value for <replacements per thread>");
+        goto ERROR;
+    }
+
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    w = (struct worker_t *)malloc(nthreads * sizeof(struct worker_t));
+    printf("mode,threads,live,replacements_per_sec\n");
+    for (mode = MALLOC; mode <= ARENA; mode++) {
+        t0 = now_sec();
+        for (i = 0; i < nthreads; i++) {
+            w[i].mode = (bench_mode_t)mode;
+            w[i].live = live;
+            w[i].ops = ops;
+            w[i].seed = 42 + i;
+            pthread_create(&tids[i], NULL, work, &w[i]);
+        }
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        sec = now_sec() - t0;
+        printf("%s,%d,%d,%lf\n", modes[mode], nthreads, live,
+               (double)nthreads * ops / sec);
+    }
+    free(tids);
+    free(w);
+    return 0;
+
+ ERROR:
+    return -1;
+}
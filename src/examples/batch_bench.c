@@ -0,0 +1,172 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file batch_bench.c
+ * Check nlcali_add_batch() against one nlcali_add() per event,
+ * for each instruction set, and compare their throughput.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define TOL 1e-9
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events> [rounds]\n", s, prog);
+}
+
+static nlcali_T new_caliper(int loglinear)
+{
+    nlcali_T c = nlcali_new(2);
+    int rc;
+
+    if (loglinear) {
+        rc = nlcali_hist_loglinear(c, 2, 1e-3, 1e3);
+        assert(rc == 0);
+    }
+    else {
+        nlcali_hist_manual(c, NL_MAX_HIST_BINS, 0, 20);
+    }
+    return c;
+}
+
+static int close_to(double a, double b)
+{
+    return fabs(a - b) <= TOL * fmax(fabs(a), fabs(b));
+}
+
+static void check(nlcali_T a, nlcali_T b)
+{
+    unsigned i;
+
+    nlcali_calc(a);
+    nlcali_calc(b);
+    assert(a->vsm.count == b->vsm.count);
+    assert(a->rsm.count == b->rsm.count);
+    assert(a->dur_ticks == b->dur_ticks);
+    assert(a->vsm.min == b->vsm.min && a->vsm.max == b->vsm.max);
+    assert(a->rsm.min == b->rsm.min && a->rsm.max == b->rsm.max);
+    assert(a->gsm.min == b->gsm.min && a->gsm.max == b->gsm.max);
+    assert(close_to(a->vsm.sum, b->vsm.sum));
+    assert(close_to(a->rsm.sum, b->rsm.sum));
+    assert(close_to(a->gsm.sum, b->gsm.sum));
+    assert(close_to(a->vsm.sd, b->vsm.sd));
+    assert(close_to(a->rsm.sd, b->rsm.sd));
+    assert(close_to(a->gsm.sd, b->gsm.sd));
+    for (i = 0; i < a->h_num; i++) {
+        assert(a->h_rdata[i] == b->h_rdata[i]);
+        assert(a->h_gdata[i] == b->h_gdata[i]);
+    }
+}
+
+/* A batch first, then one timed event: `dur` is that event's alone,
+   also once merged */
+static void check_dur(void)
+{
+    const double val[2] = { 1, 2 }, dur[2] = { 1000, 2000 };
+    nlcali_T c = nlcali_new(2), d = nlcali_new(2);
+    int rc;
+
+    nlcali_add_batch(c, val, dur, 2);
+    nlcali_calc(c);
+    assert(c->vsm.count == 2 && c->dur == 0);
+    nlcali_add(c, 5000, 8000, 3.0);
+    nlcali_calc(c);
+    assert(c->dur == NL_TICKS_SEC(c, 3000));
+    nlcali_add_batch(d, val, dur, 2);
+    rc = nlcali_merge(d, c);
+    assert(rc == 0);
+    nlcali_calc(d);
+    assert(d->vsm.count == 5 && d->dur == c->dur);
+    nlcali_clear(d);
+    nlcali_add_batch(d, val, dur, 2);
+    nlcali_begin(d);
+    nlcali_end(d, 3.0);
+    nlcali_calc(d);
+    assert(d->dur >= 0 && d->dur < 1);
+    nlcali_free(c);
+    nlcali_free(d);
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[] = { "auto", "scalar", "avx2", "avx512" };
+    int n, rounds = 10, r, i, ll, simd;
+    double *val, *dur, t0, sec;
+    nlcali_T ref, c;
+
+    prog = argv[0];
+    if (argc < 2 || argc > 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+    if (argc == 3 && (sscanf(argv[2], "%d", &rounds) != 1 || rounds < 1)) {
+        usage("bad value for [rounds]");
+        goto ERROR;
+    }
+
+    check_dur();
+
+    /* I/O-like events: sizes and whole-nanosecond durations,
+       with some zero sizes (no rate or gap) */
+    val = (double *)malloc(n * sizeof(double));
+    dur = (double *)malloc(n * sizeof(double));
+    srand(42);
+    for (i = 0; i < n; i++) {
+        val[i] = (rand() % 10) ? 512 * (1 + rand() % 256) : 0;
+        dur[i] = 1000 + rand() % 100000;
+    }
+
+    printf("mode,simd,events,elements_per_sec\n");
+    for (ll = 0; ll < 2; ll++) {
+        /* reference: one nlcali_add() per event */
+        ref = new_caliper(ll);
+        t0 = now_sec();
+        for (r = 0; r < rounds; r++) {
+            nlcali_clear(ref);
+            for (i = 0; i < n; i++) {
+                nlcali_add(ref, 0, (nl_ticks_t)dur[i], val[i]);
+            }
+        }
+        sec = now_sec() - t0;
+        printf("%s,add,%d,%lf\n", ll ? "loglinear" : "linear", n,
+               (double)n * rounds / sec);
+        for (simd = NL_SIMD_SCALAR; simd <= NL_SIMD_AVX512; simd++) {
+            if (nlcali_batch_simd(simd) < 0) {
+                continue;
+            }
+            c = new_caliper(ll);
+            t0 = now_sec();
+            for (r = 0; r < rounds; r++) {
+                nlcali_clear(c);
+                nlcali_add_batch(c, val, dur, n);
+            }
+            sec = now_sec() - t0;
+            check(ref, c);
+            printf("%s,%s,%d,%lf\n", ll ? "loglinear" : "linear",
+                   names[simd], n, (double)n * rounds / sec);
+            nlcali_free(c);
+        }
+        nlcali_free(ref);
+    }
+
+    free(val);
+    free(dur);
+    return 0;
+
+ ERROR:
+    return -1;
+}
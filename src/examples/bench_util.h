@@ -0,0 +1,23 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file bench_util.h
+ * Timing shared by the example benchmarks.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_BENCH_UTIL_INCLUDED
+#    define NETLOGGER_BENCH_UTIL_INCLUDED
+
+/**
+ * Wall-clock time from the monotonic clock, for timing a loop.
+ *
+ * \return Seconds since an arbitrary point
+ */
+NL_INLINE double now_sec(void)
+{
+    return nl_clock_ticks(NL_CLOCK_MONOTONIC) / 1e9;
+}
+
+#endif /* NETLOGGER_BENCH_UTIL_INCLUDED */
@@ -0,0 +1,85 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file cache_bench.c
+ * Record events into many calipers in random order, so that nearly
+ * every event misses the cache, to show the cost of the cache lines
+ * each event touches.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 100
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <calipers> <events>\n", s, prog);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "value", "rate", "rate+hist" };
+    int n, mode, i;
+    long events, k;
+    uint32_t x;
+    double t0, sec;
+    nlcali_T *cali;
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < 1) {
+        usage("bad value for <calipers>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+
+    cali = (nlcali_T *)malloc(n * sizeof(nlcali_T));
+    printf("mode,calipers,caliper_bytes,ns_per_event\n");
+    for (mode = 0; mode < 3; mode++) {
+        for (i = 0; i < n; i++) {
+            cali[i] = nlcali_new(2);
+            if (mode == 2) {
+                nlcali_hist_manual(cali[i], HIST_BINS, 0, 10);
+            }
+        }
+        /* xorshift, so the order is random but costs no memory */
+        x = 2463534242U;
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            x ^= x << 13;
+            x ^= x >> 17;
+            x ^= x << 5;
+            /* a value of zero has no rate or gap */
+            nlcali_add(cali[x % n], 0, 100 + (x & 1023),
+                       mode == 0 ? 0.0 : 1.0 + (x >> 22));
+        }
+        sec = now_sec() - t0;
+        for (i = 0; i < n; i++) {
+            nlcali_calc(cali[i]);
+            assert(mode == 0 || cali[i]->rsm.count == cali[i]->vsm.count);
+            nlcali_free(cali[i]);
+        }
+        printf("%s,%d,%d,%lf\n", modes[mode], n,
+               (int)sizeof(struct nlcali_t), sec / events * 1e9);
+    }
+    free(cali);
+    return 0;
+
+ ERROR:
+    return -1;
+}
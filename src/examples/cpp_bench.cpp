@@ -0,0 +1,236 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file cpp_bench.cpp
+ * Compare the per-event cost of the C++ wrapper (nl_calipers.hpp)
+ * with the C macros, for events timed elsewhere (add) and timed
+ * with begin/end, and check that both give the same statistics.
+ */
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include "nl_calipers.hpp"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 20
+
+using calipers::Caliper;
+using calipers::Histogram;
+using calipers::RateGap;
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events>\n", s, prog);
+}
+
+/* Events timed elsewhere: durations and values vary with k */
+#define EVENT_B(K) ((nl_ticks_t)(K) * 100)
+#define EVENT_E(K) ((nl_ticks_t)(K) * 100 + 50 + ((K) & 31))
+#define EVENT_V(K) (1.0 + ((K) & 7))
+
+static void report(const char *name, long events, double add_sec,
+                   double be_sec)
+{
+    printf("%s,%ld,%lf,%lf\n", name, events, add_sec / events * 1e9,
+           be_sec / events * 1e9);
+}
+
+/* Same summaries; `rate` if `a` keeps rates and gaps */
+static void check_same(nlcali_T a, nlcali_T b, bool rate)
+{
+    nlcali_calc(a);
+    nlcali_calc(b);
+    assert(a->vsm.count == b->vsm.count);
+    assert(a->vsm.sum == b->vsm.sum && a->vsm.sd == b->vsm.sd);
+    assert(a->vsm.min == b->vsm.min && a->vsm.max == b->vsm.max);
+    if (rate) {
+        assert(a->rsm.count == b->rsm.count);
+        assert(a->rsm.sum == b->rsm.sum && a->rsm.sd == b->rsm.sd);
+        assert(a->gsm.sum == b->gsm.sum && a->gsm.sd == b->gsm.sd);
+    }
+    else {
+        assert(a->rsm.count == 0);
+    }
+    assert(a->dur_ticks == b->dur_ticks);
+    assert(a->first == b->first && a->end == b->end);
+    if (a->h_num > 0) {
+        for (unsigned i = 0; i < 2 * a->h_num; i++) {
+            assert(a->h_rdata[i] == b->h_rdata[i]);
+        }
+    }
+}
+
+template <class Cali>
+static void run_cpp(const char *name, Cali &cxx, nlcali_T c, long events)
+{
+    double t0, add_sec, be_sec;
+    long k;
+
+    t0 = now_sec();
+    for (k = 0; k < events; k++) {
+        cxx.add(EVENT_B(k), EVENT_E(k), EVENT_V(k));
+    }
+    add_sec = now_sec() - t0;
+    /* the C macro gives the same numbers */
+    for (k = 0; k < events; k++) {
+        nlcali_add(c, EVENT_B(k), EVENT_E(k), EVENT_V(k));
+    }
+    check_same(cxx.c(), c, Cali::kRateGap);
+    cxx.clear();
+    t0 = now_sec();
+    for (k = 0; k < events; k++) {
+        cxx.begin();
+        cxx.end(1.0);
+    }
+    be_sec = now_sec() - t0;
+    cxx.calc();
+    assert(cxx.c()->vsm.count == events);
+    report(name, events, add_sec, be_sec);
+}
+
+static void run_c(const char *name, nlcali_T c, long events)
+{
+    double t0, add_sec, be_sec;
+    long k;
+
+    t0 = now_sec();
+    for (k = 0; k < events; k++) {
+        nlcali_add(c, EVENT_B(k), EVENT_E(k), EVENT_V(k));
+    }
+    add_sec = now_sec() - t0;
+    nlcali_clear(c);
+    t0 = now_sec();
+    for (k = 0; k < events; k++) {
+        nlcali_begin(c);
+        nlcali_end(c, 1.0);
+    }
+    be_sec = now_sec() - t0;
+    report(name, events, add_sec, be_sec);
+}
+
+/* Scoped timers: nested, moved and cancelled */
+static void check_timers(void)
+{
+    Caliper<RateGap> cxx;
+
+    {
+        auto outer = cxx.time(2.0);
+        {
+            auto inner = cxx.time();
+            assert(cxx.c()->inflight == 2);
+        }
+        auto moved = std::move(outer);
+        auto dropped = cxx.time();
+        dropped.cancel();
+    }
+    assert(cxx.c()->inflight == 0 && cxx.c()->inflight_max == 2);
+    cxx.calc();
+    assert(cxx.c()->vsm.count == 2 && cxx.c()->vsm.sum == 3.0);
+    assert(cxx.log("cpp.check").find("count=2") != std::string::npos);
+}
+
+/* Same duration histograms */
+static void check_same_dur(nlcali_T a, nlcali_T b)
+{
+    assert(a->h_dur.num == b->h_dur.num);
+    for (unsigned i = 0; i < a->h_dur.num; i++) {
+        assert(a->h_dur.data[i] == b->h_dur.data[i]);
+    }
+}
+
+/* Histograms set up at run time that the features do not cover are
+   still filled, by the C macros, as are those they do */
+static void check_runtime_opts(void)
+{
+    const long events = 1000;
+    nlcali_T ref = nlcali_new(2);
+    int rc;
+
+    rc = nlcali_hist_kind_manual(ref, NL_HIST_DUR, HIST_BINS, 0, 100);
+    assert(rc == 0);
+    {
+        Caliper<RateGap> cxx;
+        rc = nlcali_hist_kind_manual(cxx.c(), NL_HIST_DUR, HIST_BINS,
+                                     0, 100);
+        assert(rc == 0);
+        nlcali_hist_manual(cxx.c(), HIST_BINS, 0, 0.2);
+        nlcali_hist_manual(ref, HIST_BINS, 0, 0.2);
+        for (long k = 0; k < events; k++) {
+            cxx.add(EVENT_B(k), EVENT_E(k), EVENT_V(k));
+            nlcali_add(ref, EVENT_B(k), EVENT_E(k), EVENT_V(k));
+        }
+        check_same(cxx.c(), ref, true);
+        check_same_dur(cxx.c(), ref);
+    }
+    nlcali_free(ref);
+    ref = nlcali_new(2);
+    rc = nlcali_hist_kind_manual(ref, NL_HIST_DUR, HIST_BINS, 0, 100);
+    assert(rc == 0);
+    {
+        Caliper<Histogram> cxx;
+        rc = nlcali_hist_kind_manual(cxx.c(), NL_HIST_DUR, HIST_BINS,
+                                     0, 100);
+        assert(rc == 0);
+        for (long k = 0; k < events; k++) {
+            cxx.add(EVENT_B(k), EVENT_E(k), EVENT_V(k));
+            nlcali_add(ref, EVENT_B(k), EVENT_E(k), EVENT_V(k));
+        }
+        check_same(cxx.c(), ref, false);
+        check_same_dur(cxx.c(), ref);
+    }
+    nlcali_free(ref);
+}
+
+int main(int argc, char **argv)
+{
+    long events;
+    nlcali_T c, ref;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+    check_timers();
+    check_runtime_opts();
+
+    printf("mode,events,ns_per_add,ns_per_begin_end\n");
+    c = nlcali_new(2);
+    ref = nlcali_new(2);
+    run_c("c", c, events);
+    {
+        Caliper<> cxx;
+        nlcali_clear(ref);
+        run_cpp("cpp_value", cxx, ref, events);
+    }
+    {
+        Caliper<RateGap> cxx;
+        nlcali_clear(ref);
+        run_cpp("cpp_rate", cxx, ref, events);
+    }
+    nlcali_clear(c);
+    nlcali_hist_manual(c, HIST_BINS, 0, 0.2);
+    run_c("c_hist", c, events);
+    {
+        Caliper<RateGap, Histogram> cxx;
+        nlcali_hist_manual(cxx.c(), HIST_BINS, 0, 0.2);
+        nlcali_clear(ref);
+        nlcali_hist_manual(ref, HIST_BINS, 0, 0.2);
+        run_cpp("cpp_hist", cxx, ref, events);
+    }
+    nlcali_free(c);
+    nlcali_free(ref);
+    return 0;
+
+ ERROR:
+    return -1;
+}
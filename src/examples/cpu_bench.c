@@ -0,0 +1,179 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file cpu_bench.c
+ * Measure the cost of begin/end pairs with and without the on-/off-CPU
+ * time split, and check that a busy event is counted on the CPU and
+ * a sleeping one as waiting, in the summaries, histograms and output.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+/* Length of the checked events, ns */
+#define EVENT_NS 2000000
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events>\n", s, prog);
+}
+
+static void busy(void)
+{
+    int64_t t0 = nl_cpu_ns();
+
+    while (nl_cpu_ns() - t0 < EVENT_NS)
+        ;
+}
+
+static void sleep_event(void)
+{
+    struct timespec ts = { 0, EVENT_NS };
+
+    nanosleep(&ts, NULL);
+}
+
+/* psdata field `key` of caliper `c` */
+static double psdata_field(nlcali_T c, const char *key)
+{
+    bson *b = nlcali_psdata(c, "cpu.check", "m", 1);
+    bson data;
+    bson_iterator it;
+    double x;
+    int type;
+
+    type = bson_find(&it, b, "data");
+    assert(type == bson_array);
+    bson_iterator_subobject(&it, &data);
+    type = bson_find(&it, &data, key);
+    assert(type == bson_double);
+    x = bson_iterator_double(&it);
+    bson_destroy(b);
+    free(b);
+    return x;
+}
+
+static void check_split(void)
+{
+    nlcali_T c = nlcali_new(2), d;
+    struct nlcali_cpu_t *cpu;
+    char *msg;
+    int i, rc;
+
+    rc = nlcali_cpu(c, 1);
+    assert(rc == 0 && (c->opts & NL_OPT_CPU));
+    /* 0.5 ms bins up to 5 ms */
+    rc = nlcali_hist_kind_manual(c, NL_HIST_CPU, 10, 0, 5e6);
+    rc |= nlcali_hist_kind_manual(c, NL_HIST_WAIT, 10, 0, 5e6);
+    assert(rc == 0);
+    cpu = c->cpu;
+    for (i = 0; i < 5; i++) {
+        nlcali_begin(c);
+        busy();
+        nlcali_end(c, 1.0);
+    }
+    nlcali_calc(c);
+    assert(cpu->cacc.count == 5 && cpu->wacc.count == 5);
+    /* mostly on the CPU, and never more than the duration */
+    assert(cpu->csm.sum <= c->dur_sum * 1e9 + 1);
+    assert(cpu->csm.sum > 0.8 * c->dur_sum * 1e9);
+    assert(cpu->csm.min >= EVENT_NS);
+    assert(c->h_cpu.data[4] + c->h_cpu.data[5] == 5);
+    nlcali_clear(c);
+    assert(cpu->cacc.count == 0 && c->h_cpu.data[4] == 0);
+
+    for (i = 0; i < 5; i++) {
+        nlcali_begin(c);
+        sleep_event();
+        nlcali_end(c, 1.0);
+    }
+    nlcali_calc(c);
+    /* mostly waiting */
+    assert(cpu->wsm.min >= EVENT_NS * 0.9);
+    assert(cpu->wsm.sum > 0.8 * c->dur_sum * 1e9);
+    assert(cpu->csm.sum + cpu->wsm.sum <= c->dur_sum * 1e9 + 1);
+    msg = nlcali_log(c, "cpu.check");
+    assert(NULL != strstr(msg, " cpu.sum=") && NULL != strstr(msg, " wait.sd="));
+    assert(NULL != strstr(msg, " h.cd=") && NULL != strstr(msg, " h.wd="));
+    free(msg);
+    assert(psdata_field(c, "sum_wait") == cpu->wsm.sum);
+    assert(psdata_field(c, "mean_cpu") == cpu->csm.mean);
+
+    /* copied by configure, merged */
+    d = nlcali_new(2);
+    nlcali_configure_like(d, c);
+    assert(NULL != d->cpu && d->h_wait.num == 10);
+    rc = nlcali_merge(d, c);
+    rc |= nlcali_merge(d, c);
+    assert(rc == 0);
+    nlcali_calc(d);
+    assert(d->cpu->wacc.count == 10);
+    assert(d->cpu->wsm.sum == 2 * cpu->wsm.sum);
+    nlcali_free(d);
+
+    /* events timed elsewhere are not split */
+    nlcali_add(c, 0, 100, 1.0);
+    assert(cpu->wacc.count == 5);
+    rc = nlcali_cpu(c, 0);
+    assert(rc == 0 && NULL == c->cpu);
+    assert(0 == (c->opts & NL_OPT_CPU));
+    nlcali_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "off", "split", "split_hist" };
+    long events, k;
+    int mode, rc;
+    double t0;
+    nlcali_T c;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+    check_split();
+
+    printf("mode,events,ns_per_begin_end\n");
+    for (mode = 0; mode < 3; mode++) {
+        c = nlcali_new(2);
+        rc = 0;
+        if (mode > 0) {
+            rc |= nlcali_cpu(c, 1);
+        }
+        if (mode > 1) {
+            rc |= nlcali_hist_kind_loglinear(c, NL_HIST_CPU, 2, 10, 1e9);
+            rc |= nlcali_hist_kind_loglinear(c, NL_HIST_WAIT, 2, 10, 1e9);
+        }
+        assert(rc == 0);
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nlcali_begin(c);
+            nlcali_end(c, 1.0);
+        }
+        printf("%s,%ld,%lf\n", modes[mode], events,
+               (now_sec() - t0) / events * 1e9);
+        if (mode > 0) {
+            assert(c->cpu->cacc.count == events);
+        }
+        nlcali_free(c);
+    }
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/time.h>
 #include "nl_calipers.h"
 
 static const volatile char rcsid[] = "$Id: disk_bench.c 32915 2012-10-06 11:53:27Z dang $";
@@ -18,7 +19,7 @@ static const volatile char rcsid[] = "$Id: disk_bench.c 32915 2012-10-06 11:53:2
 #define RPT_INTERVAL 1000
 
 typedef enum { DISK=0, MEMORY=1 } device_t;
-typedef enum { CSV=0, LOG=1 } output_t;
+typedef enum { CSV=0, LOG=1, PERF=2 } output_t;
 
 static void usage(const char *msg)
 {
@@ -29,7 +30,8 @@ static void usage(const char *msg)
     fprintf(stderr,"-   MODE: dd=disk/disk, dm=disk/mem, md=mem/disk, "
                    "mm=mem/mem\n");
     fprintf(stderr,"-   SIZE: data set size in MB\n");
-    fprintf(stderr,"-   OUTPUT: output type c=csv, n=netlogger\n");
+    fprintf(stderr,"-   OUTPUT: output type c=csv, n=netlogger, "
+                   "p=netlogger with perf_event counters\n");
     fprintf(stderr,"Reports will occur every %.1fMB (%d operations)\n",
              rpt_mb, RPT_INTERVAL);
          exit(1);
@@ -39,9 +41,11 @@ static void usage(const char *msg)
 static void write_output(struct nlcali_t **nl, output_t outp)
 {
     static int write_num = 0;
+    struct timeval now;
     int i, j;
 
     write_num++;
+    gettimeofday(&now, NULL);
     
     if (outp == CSV && write_num == 1) {
         printf("%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s\n",
@@ -54,7 +58,7 @@ static void write_output(struct nlcali_t **nl, output_t outp)
         struct nlcali_t *nlp = nl[i];
         nlcali_calc(nlp);
         if (NL_HIST_HAS_DATA(nlp)) {
-            if (outp == LOG) {
+            if (outp != CSV) {
                 printf("%s\n",nlcali_log(nlp,
                     i ? "dbench.write" : "dbench.read"));
             }
@@ -68,7 +72,7 @@ static void write_output(struct nlcali_t **nl, output_t outp)
                     printf("%s,%d,%lf,%lf,%d,%d,%lf,%lf,%d,%lf,%lf,%d\n",
                            i ? "write" : "read",
                            write_num,
-                           nlp->begin.tv_sec + nlp->begin.tv_usec/1e6,
+                           now.tv_sec + now.tv_usec/1e6,
                            nlp->dur,
                            nlp->h_num,
                            j + 1,
@@ -109,6 +113,9 @@ static int run(device_t src, device_t dst, int size, output_t outp)
     for (i=0; i < 2; i++) {
         nl[i] = nlcali_new(RPT_INTERVAL - 1);
         nlcali_hist_auto(nl[i], 20, 3);
+        if (outp == PERF && nlcali_perf(nl[i], NL_PERF_ALL) <= 0) {
+            fprintf(stderr, "perf_event counters not available\n");
+        }
     }
 
     /* go */
@@ -185,6 +192,8 @@ int main(int argc, char **argv)
         case 'C': outp = CSV; break;
         case 'n':
         case 'N': outp = LOG; break;
+        case 'p':
+        case 'P': outp = PERF; break;
         default: usage("Bad output type");
     }
     /* If parsing was OK, then run */
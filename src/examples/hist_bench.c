@@ -0,0 +1,139 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file hist_bench.c
+ * Compare cost and accuracy of linear and log-linear histograms
+ * on heavy-tailed data.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define DUR_TICKS 1000
+#define DECADES 6
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events> [digits]\n", s, prog);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Time the bin calculation alone */
+static double time_bins(nlcali_T c, const double *rate, int n,
+                        unsigned *sink)
+{
+    double t0;
+    unsigned b;
+    int i;
+
+    t0 = now_sec();
+    if (c->h_state == NL_HIST_LOGLINEAR) {
+        for (i = 0; i < n; i++) {
+            NL_HBIN_LL(c, c->h_rbase, rate[i], b);
+            *sink += b;
+        }
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            NL_HBIN_R(c, rate[i], b);
+            *sink += b;
+        }
+    }
+    return (now_sec() - t0) / n * 1e9;
+}
+
+/* Time the whole event path */
+static double time_add(nlcali_T c, const double *rate, int n)
+{
+    double t0;
+    int i;
+
+    nlcali_clear(c);
+    t0 = now_sec();
+    for (i = 0; i < n; i++) {
+        nlcali_add(c, 0, DUR_TICKS, rate[i] * DUR_TICKS);
+    }
+    return (now_sec() - t0) / n * 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int n, i, j, digits = 2, rc;
+    double *rate, *sorted, lo = 1e-3, hi = lo * pow(10, DECADES);
+    double qs[] = { 0.5, 0.99, 0.999 };
+    unsigned sink = 0;
+    nlcali_T lin, ll;
+
+    prog = argv[0];
+    if (argc < 2 || argc > 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < 1000) {
+        usage("bad value for <events>, must be at least 1000");
+        goto ERROR;
+    }
+    if (argc == 3 && (sscanf(argv[2], "%d", &digits) != 1 ||
+                      digits < 1 || digits > NL_MAX_LL_DIGITS)) {
+        usage("bad value for [digits]");
+        goto ERROR;
+    }
+
+    /* log-uniform rates over several decades */
+    rate = (double *)malloc(n * sizeof(double));
+    sorted = (double *)malloc(n * sizeof(double));
+    srand(42);
+    for (i = 0; i < n; i++) {
+        rate[i] = lo * pow(10, DECADES * (rand() / (RAND_MAX + 1.0)));
+        sorted[i] = rate[i];
+    }
+    qsort(sorted, n, sizeof(double), cmp_double);
+
+    lin = nlcali_new(2);
+    nlcali_hist_manual(lin, NL_MAX_HIST_BINS, lo, hi);
+    ll = nlcali_new(2);
+    rc = nlcali_hist_loglinear(ll, digits, lo, hi);
+    assert(rc == 0);
+
+    printf("mode,bins,ns_per_bin,ns_per_event");
+    for (j = 0; j < 3; j++) {
+        printf(",p%g_relerr", qs[j] * 100);
+    }
+    printf("\n");
+    for (i = 0; i < 2; i++) {
+        nlcali_T c = i ? ll : lin;
+        double bin_ns = time_bins(c, rate, n, &sink);
+        double add_ns = time_add(c, rate, n);
+        printf("%s,%u,%lf,%lf", i ? "loglinear" : "linear", c->h_num,
+               bin_ns, add_ns);
+        for (j = 0; j < 3; j++) {
+            double exact = sorted[(int)(qs[j] * (n - 1))];
+            double est = nlcali_hist_quantile(c, NL_HIST_RATE, qs[j]);
+            printf(",%lf", fabs(est - exact) / exact);
+        }
+        printf("\n");
+    }
+    fprintf(stderr, "(%u)\n", sink);
+
+    nlcali_free(lin);
+    nlcali_free(ll);
+    free(rate);
+    free(sorted);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,197 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file hist_end_bench.c
+ * Measure the cost of recording an event with no histograms, with
+ * the rate and gap histograms, with the duration and value ones,
+ * and with all four; check that the duration and value bins, their
+ * quantiles, merging and output come out right.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 20
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events>\n", s, prog);
+}
+
+/* Events timed elsewhere: 32 durations of 50-81 ns, 8 values */
+#define EVENT_B(K) ((nl_ticks_t)(K) * 100)
+#define EVENT_E(K) ((nl_ticks_t)(K) * 100 + 50 + ((K) & 31))
+#define EVENT_V(K) (1.0 + ((K) & 7))
+
+enum { H_NONE = 0, H_RATE_GAP = 1, H_DUR_VALUE = 2, H_ALL = 3 };
+
+static const char *const modes[] = {
+    "none", "rate_gap", "dur_value", "all", "all_loglinear"
+};
+
+static nlcali_T make_caliper(int mode)
+{
+    nlcali_T c = nlcali_new(2);
+    int loglinear = mode > H_ALL, rc = 0;
+
+    if (mode == H_RATE_GAP || mode >= H_ALL) {
+        if (loglinear) {
+            rc |= nlcali_hist_loglinear(c, 2, 1e-3, 1);
+        }
+        else {
+            nlcali_hist_manual(c, HIST_BINS, 0, 0.2);
+        }
+    }
+    if (mode >= H_DUR_VALUE) {
+        if (loglinear) {
+            rc |= nlcali_hist_kind_loglinear(c, NL_HIST_DUR, 2, 10, 1e6);
+            rc |= nlcali_hist_kind_loglinear(c, NL_HIST_VALUE, 2, 0.5, 100);
+        }
+        else {
+            /* one bin per duration and per value */
+            rc |= nlcali_hist_kind_manual(c, NL_HIST_DUR, 32, 50, 82);
+            rc |= nlcali_hist_kind_manual(c, NL_HIST_VALUE, 8, 0.5, 8.5);
+        }
+    }
+    assert(rc == 0);
+    return c;
+}
+
+static unsigned long bins_total(const struct nlcali_hist_t *h)
+{
+    unsigned long total = 0;
+    unsigned i;
+
+    for (i = 0; i < h->num; i++) {
+        total += h->data[i];
+    }
+    return total;
+}
+
+/* Bins, quantiles, merge and output of the linear "all" caliper */
+static void check_linear(nlcali_T c, long events)
+{
+    nlcali_T d;
+    char *msg;
+    unsigned i;
+    int rc;
+
+    assert(bins_total(&c->h_dur) == (unsigned long)events);
+    assert(bins_total(&c->h_val) == (unsigned long)events);
+    for (i = 0; i < 32; i++) {
+        assert(c->h_dur.data[i] == events / 32);
+    }
+    for (i = 0; i < 8; i++) {
+        assert(c->h_val.data[i] == events / 8);
+    }
+    /* both shared one block, duration bins first */
+    assert(c->h_dur.data == c->h_xdata && c->h_val.data == c->h_xdata + 32);
+    assert(fabs(nlcali_hist_quantile(c, NL_HIST_DUR, 0.5) - 66) < 1);
+    assert(nlcali_hist_quantile(c, NL_HIST_DUR, 1) == 82);
+    assert(fabs(nlcali_hist_quantile(c, NL_HIST_VALUE, 0.5) - 4.5) < 1);
+    assert(nlcali_hist_quantile(c, NL_HIST_VALUE, 1) == 8);
+
+    d = nlcali_new(2);
+    nlcali_configure_like(d, c);
+    rc = nlcali_merge(d, c);
+    rc |= nlcali_merge(d, c);
+    assert(rc == 0);
+    assert(bins_total(&d->h_val) == 2 * (unsigned long)events);
+    /* reconfiguring one keeps the other's bins */
+    rc = nlcali_hist_kind_manual(d, NL_HIST_DUR, 4, 0, 100);
+    assert(rc == 0);
+    assert(bins_total(&d->h_dur) == 0);
+    assert(bins_total(&d->h_val) == 2 * (unsigned long)events);
+    rc = nlcali_merge(d, c);
+    assert(rc == -1);
+    rc = nlcali_hist_kind_manual(d, NL_HIST_RATE, 4, 0, 1);
+    assert(rc == -1);
+    rc = nlcali_hist_kind_manual(d, NL_HIST_DUR, 0, 0, 0);
+    rc |= nlcali_hist_kind_manual(d, NL_HIST_VALUE, 0, 0, 0);
+    assert(rc == 0);
+    assert(0 == (d->opts & NL_OPT_HIST) && NULL == d->h_xdata);
+    nlcali_free(d);
+
+    msg = nlcali_log(c, "hist.check");
+    assert(NULL != strstr(msg, " h.dm=50") && NULL != strstr(msg, " h.dd="));
+    assert(NULL != strstr(msg, " h.vd="));
+    free(msg);
+    nlcali_clear(c);
+    assert(bins_total(&c->h_dur) == 0 && bins_total(&c->h_val) == 0);
+}
+
+static void check_loglinear(nlcali_T c, long events)
+{
+    char *msg;
+
+    assert(bins_total(&c->h_dur) == (unsigned long)events);
+    assert(fabs(nlcali_hist_quantile(c, NL_HIST_DUR, 0.5) - 66) < 2);
+    assert(fabs(nlcali_hist_quantile(c, NL_HIST_VALUE, 0.5) - 4.5) < 1);
+    msg = nlcali_log(c, "hist.check");
+    assert(NULL != strstr(msg, " h.dp99=") && NULL != strstr(msg, " h.vp50="));
+    free(msg);
+}
+
+int main(int argc, char **argv)
+{
+    long events, k;
+    int mode;
+    double t0, add_sec, be_sec;
+    nlcali_T c;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 256) {
+        usage("bad value for <events>, at least 256");
+        goto ERROR;
+    }
+    /* whole bins */
+    events -= events % 256;
+
+    printf("mode,hists,events,ns_per_add,ns_per_begin_end\n");
+    for (mode = 0; mode < 5; mode++) {
+        c = make_caliper(mode);
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nlcali_add(c, EVENT_B(k), EVENT_E(k), EVENT_V(k));
+        }
+        add_sec = now_sec() - t0;
+        if (mode == H_ALL) {
+            check_linear(c, events);
+        }
+        else if (mode > H_ALL) {
+            check_loglinear(c, events);
+        }
+        nlcali_clear(c);
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nlcali_begin(c);
+            nlcali_end(c, EVENT_V(k));
+        }
+        be_sec = now_sec() - t0;
+        if (mode >= H_DUR_VALUE) {
+            assert(bins_total(&c->h_dur) == (unsigned long)events);
+        }
+        printf("%s,%d,%ld,%lf,%lf\n", modes[mode],
+               (mode == H_RATE_GAP || mode == H_DUR_VALUE) ? 2 :
+               mode >= H_ALL ? 4 : 0,
+               events, add_sec / events * 1e9, be_sec / events * 1e9);
+        nlcali_free(c);
+    }
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,194 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file log_bench.c
+ * Compare the rate of formatting log messages with nlcali_log(),
+ * nlcali_log_into() and nlcali_log_buf(), and with plain sprintf()
+ * as nlcali_log() used to do. Also checks that numbers in the
+ * messages read back exactly.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 100
+#define LINE_BUFSZ 8192
+#define ROUND_TRIPS 100000
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <calipers> [rounds]\n", s, prog);
+}
+
+/* Formatting as nlcali_log() did it before, for comparison */
+static char *log_sprintf(nlcali_T c, const char *event)
+{
+    char *msg = malloc(1024), *p = msg, numbuf[32];
+    unsigned i;
+    int need = 0;
+
+    nlcali_calc(c);
+    p += sprintf(p, "ts=2012-01-01T00:00:00.000000Z event=%s "
+            "v.sum=%lf v.min=%lf v.max=%lf v.mean=%lf v.sd=%lf "
+            "r.sum=%lf r.min=%lf r.max=%lf r.mean=%lf r.sd=%lf "
+            "g.sum=%lf g.min=%lf g.max=%lf g.mean=%lf g.sd=%lf "
+            "count=%lld dur=%lf dur.i=%lf", event,
+            c->vsm.sum, c->vsm.min, c->vsm.max, c->vsm.mean, c->vsm.sd,
+            c->rsm.sum, c->rsm.min, c->rsm.max, c->rsm.mean, c->rsm.sd,
+            c->gsm.sum, c->gsm.min, c->gsm.max, c->gsm.mean, c->gsm.sd,
+            c->vsm.count, c->dur, c->dur_sum);
+    for (i = 0; i < c->h_num; i++) {
+        need += 1 + sprintf(numbuf, "%d", c->h_rdata[i]);
+        need += 1 + sprintf(numbuf, "%d", c->h_gdata[i]);
+    }
+    if (need < 1024 - (p - msg) - 100) {
+        p += sprintf(p, " h.rm=%lf h.rw=%lf h.rd=", c->h_rmin, c->h_rwidth);
+        for (i = 0; i < c->h_num; i++) {
+            p += sprintf(p, "%d,", c->h_rdata[i]);
+        }
+        p += sprintf(p, " h.gm=%lf h.gw=%lf h.gd=", c->h_gmin, c->h_gwidth);
+        for (i = 0; i < c->h_num; i++) {
+            p += sprintf(p, "%d,", c->h_gdata[i]);
+        }
+    }
+    return msg;
+}
+
+/* Any finite double, from random bits */
+static double random_double(void)
+{
+    union { double d; uint64_t u; } x;
+
+    do {
+        x.u = ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand();
+    } while ((x.u & 0x7FF0000000000000ULL) == 0x7FF0000000000000ULL);
+    return x.d;
+}
+
+/* Value of `key` in message */
+static double field(const char *msg, const char *key)
+{
+    const char *p = strstr(msg, key);
+
+    assert(p);
+    return strtod(p + strlen(key), NULL);
+}
+
+static void check_round_trip(void)
+{
+    char line[LINE_BUFSZ];
+    nlcali_T c = nlcali_new(2);
+    size_t len;
+    double x;
+    int i;
+
+    srand(1);
+    for (i = 0; i < ROUND_TRIPS; i++) {
+        x = i < 1000 ? rand() / 1000.0 : random_double();
+        nlcali_clear(c);
+        nlcali_add(c, 0, 1000, x);
+        len = nlcali_log_into(c, "rt", line, sizeof(line));
+        assert(len < sizeof(line));
+        assert(field(line, " v.min=") == x);
+        assert(field(line, " v.sum=") == x);
+    }
+    nlcali_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "sprintf", "log", "log_into", "log_buf" };
+    int n, rounds = 10, i, j, r, mode;
+    size_t len, bytes;
+    double t0, sec;
+    char line[LINE_BUFSZ], *msg;
+    struct nlcali_logbuf_t lb = { NULL, 0 };
+    nlcali_T *cali;
+
+    prog = argv[0];
+    if (argc < 2 || argc > 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < 1) {
+        usage("bad value for <calipers>");
+        goto ERROR;
+    }
+    if (argc == 3 && (sscanf(argv[2], "%d", &rounds) != 1 || rounds < 1)) {
+        usage("bad value for [rounds]");
+        goto ERROR;
+    }
+
+    check_round_trip();
+
+    /* calipers with some data and a full histogram */
+    cali = (nlcali_T *)malloc(n * sizeof(nlcali_T));
+    srand(42);
+    for (i = 0; i < n; i++) {
+        cali[i] = nlcali_new(2);
+        nlcali_hist_manual(cali[i], HIST_BINS, 0, 10);
+        for (j = 0; j < 1000; j++) {
+            nlcali_add(cali[i], 0, 1 + rand() % 1000, rand() % 5000);
+        }
+    }
+
+    /* truncated output has the same length, and the same prefix */
+    len = nlcali_log_into(cali[0], "trunc", line, sizeof(line));
+    assert(len < sizeof(line));
+    msg = nlcali_log(cali[0], "trunc");
+    assert(strlen(msg) == len);
+    bytes = nlcali_log_into(cali[0], "trunc", line, 10);
+    assert(bytes == len);
+    assert(strlen(line) == 9 && strncmp(line, msg, 9) == 0);
+    free(msg);
+
+    printf("mode,calipers,lines_per_sec,bytes_per_line\n");
+    for (mode = 0; mode < 4; mode++) {
+        bytes = 0;
+        t0 = now_sec();
+        for (r = 0; r < rounds; r++) {
+            for (i = 0; i < n; i++) {
+                switch (mode) {
+                    case 0:
+                        msg = log_sprintf(cali[i], "bench");
+                        bytes += strlen(msg);
+                        free(msg);
+                        break;
+                    case 1:
+                        msg = nlcali_log(cali[i], "bench");
+                        bytes += strlen(msg);
+                        free(msg);
+                        break;
+                    case 2:
+                        bytes += nlcali_log_into(cali[i], "bench", line,
+                                                 sizeof(line));
+                        break;
+                    case 3:
+                        bytes += strlen(nlcali_log_buf(cali[i], "bench", &lb));
+                        break;
+                }
+            }
+        }
+        sec = now_sec() - t0;
+        printf("%s,%d,%lf,%lf\n", modes[mode], n,
+               (double)n * rounds / sec, (double)bytes / n / rounds);
+    }
+
+    nlcali_logbuf_free(&lb);
+    for (i = 0; i < n; i++) {
+        nlcali_free(cali[i]);
+    }
+    free(cali);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,129 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file merge_bench.c
+ * Compare merging calipers with replaying all their events
+ * into one caliper.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 50
+#define HIST_MAX 10.0
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <calipers> <events per caliper>\n", s, prog);
+}
+
+static nlcali_T new_caliper(void)
+{
+    nlcali_T c = nlcali_new(2);
+    nlcali_hist_manual(c, HIST_BINS, 0, HIST_MAX);
+    return c;
+}
+
+static double rel_err(double a, double b)
+{
+    return b == 0 ? fabs(a) : fabs(a - b) / fabs(b);
+}
+
+int main(int argc, char **argv)
+{
+    int k, m, i, j;
+    nl_ticks_t *dur, t0, t1;
+    double *val, replay_sec, merge_sec;
+    nlcali_T *parts, whole, sum;
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &k) != 1 || k < 1) {
+        usage("bad value for <calipers>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%d", &m) != 1 || m < 1) {
+        usage("bad value for <events per caliper>");
+        goto ERROR;
+    }
+
+    /* synthetic events */
+    dur = (nl_ticks_t *)malloc((size_t)k * m * sizeof(nl_ticks_t));
+    val = (double *)malloc((size_t)k * m * sizeof(double));
+    srand(42);
+    for (i = 0; i < k * m; i++) {
+        dur[i] = 1 + rand() % 1000;
+        val[i] = 1 + rand() % 5000;
+    }
+
+    /* one caliper per part, filled ahead of time */
+    parts = (nlcali_T *)malloc(k * sizeof(nlcali_T));
+    for (i = 0; i < k; i++) {
+        parts[i] = new_caliper();
+        for (j = 0; j < m; j++) {
+            nl_ticks_t b = (nl_ticks_t)j * 2000;
+            nlcali_add(parts[i], b, b + dur[i * m + j], val[i * m + j]);
+        }
+    }
+
+    /* replay every event into one caliper */
+    whole = new_caliper();
+    t0 = nl_clock_ticks(NL_CLOCK_MONOTONIC);
+    for (i = 0; i < k; i++) {
+        for (j = 0; j < m; j++) {
+            nl_ticks_t b = (nl_ticks_t)j * 2000;
+            nlcali_add(whole, b, b + dur[i * m + j], val[i * m + j]);
+        }
+    }
+    nlcali_calc(whole);
+    t1 = nl_clock_ticks(NL_CLOCK_MONOTONIC);
+    replay_sec = (t1 - t0) / 1e9;
+
+    /* merge the parts */
+    t0 = nl_clock_ticks(NL_CLOCK_MONOTONIC);
+    sum = nlcali_reduce(parts, k);
+    nlcali_calc(parts[0]);
+    t1 = nl_clock_ticks(NL_CLOCK_MONOTONIC);
+    merge_sec = (t1 - t0) / 1e9;
+    assert(sum == parts[0]);
+
+    /* results must agree */
+    assert(parts[0]->vsm.count == whole->vsm.count);
+    assert(parts[0]->rsm.count == whole->rsm.count);
+    assert(parts[0]->dur_ticks == whole->dur_ticks);
+    for (i = 0; i < HIST_BINS; i++) {
+        assert(parts[0]->h_rdata[i] == whole->h_rdata[i]);
+        assert(parts[0]->h_gdata[i] == whole->h_gdata[i]);
+    }
+
+    printf("calipers,events,replay_sec,merge_sec,speedup,"
+           "v.sum.err,v.sd.err,r.sd.err,g.sd.err\n");
+    printf("%d,%lld,%lf,%lf,%lf,%g,%g,%g,%g\n", k, whole->vsm.count,
+           replay_sec, merge_sec, replay_sec / merge_sec,
+           rel_err(parts[0]->vsm.sum, whole->vsm.sum),
+           rel_err(parts[0]->vsm.sd, whole->vsm.sd),
+           rel_err(parts[0]->rsm.sd, whole->rsm.sd),
+           rel_err(parts[0]->gsm.sd, whole->gsm.sd));
+
+    for (i = 0; i < k; i++) {
+        nlcali_free(parts[i]);
+    }
+    free(parts);
+    nlcali_free(whole);
+    free(dur);
+    free(val);
+    return 0;
+
+ ERROR:
+    return -1;
+}
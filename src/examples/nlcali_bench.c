@@ -0,0 +1,388 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file nlcali_bench.c
+ * Cost per call of the caliper API, for regression tracking.
+ * Run by `make bench`.
+ *
+ * Each operation is timed on 1, 10, 100, ... calipers, taken in
+ * random order so that with many of them most calls miss the cache.
+ * The process is pinned to one CPU; every measurement is warmed up
+ * and then repeated, and the spread of the trials is reported.
+ * Costs are in TSC cycles where there is a TSC, and in nanoseconds.
+ * The `loop` operation is the cost of choosing a caliper, which is
+ * included in all the others.
+ */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <math.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nl_arena.h"
+#include "nl_calipers.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 20
+/* Kinds of histogram the calipers have */
+#define HIST_NONE 0
+#define HIST_LINEAR 1
+#define HIST_LOGLINEAR 2
+#define MAX_TRIALS 101
+/* Events recorded into each caliper before timing */
+#define PRELOAD 4
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s [-m max calipers] [-t trials] [-i iterations]\n"
+            "          [-c cpu] [-o output base name]\n"
+            "  -m  largest caliper count, a power of 10 (1000000)\n"
+            "  -t  trials per measurement (7)\n"
+            "  -i  calls per trial (100000; a tenth for log/psdata)\n"
+            "  -c  CPU to pin to (the current one)\n"
+            "  -o  also write <name>.csv and <name>.json\n", s, prog);
+}
+
+/* One measurement */
+struct result_t {
+    const char *op;
+    unsigned calipers;
+    int trials;
+    long iters;
+    double min, median, mean, sd; /* clock ticks per call */
+};
+
+static struct result_t *results = NULL;
+static int nresults = 0, maxresults = 0;
+
+static netlogger_clock_t bench_clock = NL_CLOCK_MONOTONIC;
+static double tick_ns = 1;
+static volatile unsigned sink;
+
+/* Choose the next caliper, xorshift so that it costs no memory */
+#define NEXT(X, N) ((X) ^= (X) << 13, (X) ^= (X) >> 17, (X) ^= (X) << 5, \
+                    (X) % (N))
+
+/* Define a function that makes `iters` calls of BODY, each on a
+   random caliper `c` */
+#define BENCH_OP(NAME, BODY)                                        \
+    static void NAME(nlcali_T *cali, unsigned n, long iters,        \
+                     uint32_t *xp)                                  \
+    {                                                               \
+        uint32_t x = *xp;                                           \
+        nlcali_T c;                                                 \
+        long k;                                                     \
+        for (k = 0; k < iters; k++) {                               \
+            c = cali[NEXT(x, n)];                                   \
+            BODY;                                                   \
+        }                                                           \
+        *xp = x;                                                    \
+    }
+
+BENCH_OP(op_loop, sink += (unsigned)c->vacc.count)
+BENCH_OP(op_begin_end, nlcali_begin(c); nlcali_end(c, 1.0 + (x & 7)))
+BENCH_OP(op_add, nlcali_add(c, 0, 100 + (x & 1023), 1.0 + (x & 7)))
+BENCH_OP(op_hbin_r, { unsigned i; NL_HBIN_R(c, (x & 1023) * 0.01, i);
+                      sink += i; })
+BENCH_OP(op_hbin_ll, { unsigned i;
+                       NL_HBIN_LL(c, c->h_rbase, (x & 1023) * 0.01, i);
+                       sink += i; })
+BENCH_OP(op_calc, c->dirty = 1; nlcali_calc(c))
+BENCH_OP(op_log, free(nlcali_log(c, "bench")))
+BENCH_OP(op_psdata, { bson *b = nlcali_psdata(c, "bench", "m", 1);
+                      bson_destroy(b); free(b); })
+BENCH_OP(op_clear, nlcali_clear(c))
+
+typedef void (*op_fn)(nlcali_T *, unsigned, long, uint32_t *);
+
+struct op_t {
+    const char *name;
+    op_fn fn;
+    int hist;   /* calipers with histograms: HIST_* */
+    int slow;   /* a tenth of the iterations */
+};
+
+/* In this order: clear empties the calipers */
+static const struct op_t ops[] = {
+    { "loop",           op_loop,      HIST_NONE,      0 },
+    { "begin_end",      op_begin_end, HIST_NONE,      0 },
+    { "add",            op_add,       HIST_NONE,      0 },
+    { "calc",           op_calc,      HIST_NONE,      0 },
+    { "log",            op_log,       HIST_NONE,      1 },
+    { "psdata",         op_psdata,    HIST_NONE,      1 },
+    { "clear",          op_clear,     HIST_NONE,      0 },
+    { "begin_end_hist", op_begin_end, HIST_LINEAR,    0 },
+    { "add_hist",       op_add,       HIST_LINEAR,    0 },
+    { "hbin_linear",    op_hbin_r,    HIST_LINEAR,    0 },
+    { "calc_hist",      op_calc,      HIST_LINEAR,    0 },
+    { "log_hist",       op_log,       HIST_LINEAR,    1 },
+    { "psdata_hist",    op_psdata,    HIST_LINEAR,    1 },
+    { "clear_hist",     op_clear,     HIST_LINEAR,    0 },
+    { "add_loglinear",  op_add,       HIST_LOGLINEAR, 0 },
+    { "hbin_loglinear", op_hbin_ll,   HIST_LOGLINEAR, 0 },
+};
+#define NOPS (sizeof(ops) / sizeof(ops[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static struct result_t *add_result(void)
+{
+    if (nresults == maxresults) {
+        maxresults = maxresults ? 2 * maxresults : 64;
+        results = (struct result_t *)realloc(results,
+                                             maxresults * sizeof(*results));
+        assert(results);
+    }
+    return &results[nresults++];
+}
+
+/* Warm up, then time `trials` runs of `iters` calls */
+static void measure(const struct op_t *op, nlcali_T *cali, unsigned n,
+                    int trials, long iters)
+{
+    double t[MAX_TRIALS], sum = 0, ss = 0;
+    struct result_t *r;
+    uint32_t x = 2463534242U;
+    nl_ticks_t t0;
+    int i;
+
+    if (op->slow) {
+        iters = iters / 10 > 0 ? iters / 10 : 1;
+    }
+    op->fn(cali, n, iters, &x);
+    for (i = 0; i < trials; i++) {
+        t0 = nl_clock_ticks(bench_clock);
+        op->fn(cali, n, iters, &x);
+        t[i] = (double)(nl_clock_ticks_end(bench_clock) - t0) / iters;
+        sum += t[i];
+    }
+    r = add_result();
+    r->op = op->name;
+    r->calipers = n;
+    r->trials = trials;
+    r->iters = iters;
+    r->mean = sum / trials;
+    for (i = 0; i < trials; i++) {
+        ss += (t[i] - r->mean) * (t[i] - r->mean);
+    }
+    r->sd = trials > 1 ? sqrt(ss / (trials - 1)) : 0;
+    qsort(t, trials, sizeof(double), cmp_double);
+    r->min = t[0];
+    r->median = trials % 2 ? t[trials / 2] :
+        (t[trials / 2 - 1] + t[trials / 2]) / 2;
+}
+
+static const char *csv_header =
+    "op,calipers,trials,iters,cycles_min,cycles_median,cycles_mean,"
+    "cycles_sd,ns_median\n";
+
+static void write_csv(FILE *fp, const struct result_t *r)
+{
+    fprintf(fp, "%s,%u,%d,%ld,", r->op, r->calipers, r->trials, r->iters);
+    if (NL_CLOCK_TSC == bench_clock) {
+        fprintf(fp, "%.2lf,%.2lf,%.2lf,%.2lf,", r->min, r->median, r->mean,
+                r->sd);
+    }
+    else {
+        fprintf(fp, ",,,,");
+    }
+    fprintf(fp, "%.2lf\n", r->median * tick_ns);
+}
+
+static void write_json(FILE *fp, int cpu)
+{
+    const struct result_t *r;
+    int i, tsc = NL_CLOCK_TSC == bench_clock;
+
+    fprintf(fp, "{\"cpu\": %d, \"tsc\": %s, \"tick_ns\": %.6lf, "
+            "\"caliper_bytes\": %d, \"hist_bins\": %d,\n \"results\": [\n",
+            cpu, tsc ? "true" : "false", tick_ns,
+            (int)sizeof(struct nlcali_t), HIST_BINS);
+    for (i = 0; i < nresults; i++) {
+        r = &results[i];
+        fprintf(fp, "  {\"op\": \"%s\", \"calipers\": %u, \"trials\": %d, "
+                "\"iters\": %ld, ", r->op, r->calipers, r->trials, r->iters);
+        if (tsc) {
+            fprintf(fp, "\"cycles_min\": %.2lf, \"cycles_median\": %.2lf, "
+                    "\"cycles_mean\": %.2lf, \"cycles_sd\": %.2lf, ",
+                    r->min, r->median, r->mean, r->sd);
+        }
+        else {
+            fprintf(fp, "\"cycles_min\": null, \"cycles_median\": null, "
+                    "\"cycles_mean\": null, \"cycles_sd\": null, ");
+        }
+        fprintf(fp, "\"ns_median\": %.2lf}%s\n", r->median * tick_ns,
+                i + 1 < nresults ? "," : "");
+    }
+    fprintf(fp, " ]}\n");
+}
+
+static int pin_cpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+#else
+    return -1;
+#endif
+}
+
+/* Calipers from an arena, each with a few events recorded */
+static nlcali_arena_T make_calipers(nlcali_T *cali, unsigned n, int hist)
+{
+    nlcali_arena_T arena;
+    unsigned i;
+    int j, rc;
+
+    arena = nlcali_arena_new(n < 4096 ? n : 4096,
+                             HIST_LINEAR == hist ? HIST_BINS : 0);
+    assert(arena);
+    for (i = 0; i < n; i++) {
+        cali[i] = nlcali_arena_alloc(arena, 2);
+        assert(cali[i]);
+        if (HIST_LINEAR == hist) {
+            nlcali_hist_manual(cali[i], HIST_BINS, 0, 10);
+        }
+        else if (HIST_LOGLINEAR == hist) {
+            rc = nlcali_hist_loglinear(cali[i], 1, 1e-3, 1e3);
+            assert(rc == 0);
+        }
+        for (j = 0; j < PRELOAD; j++) {
+            nlcali_add(cali[i], 0, 100 + j, 1.0 + j);
+        }
+    }
+    return arena;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned max_n = 1000000, n;
+    int trials = 7, cpu = -1, opt, hist;
+    long iters = 100000;
+    const char *base = NULL;
+    char path[1024];
+    nlcali_arena_T arena;
+    nlcali_T *cali;
+    FILE *csv = NULL, *json;
+    size_t o;
+
+    prog = argv[0];
+    while ((opt = getopt(argc, argv, "m:t:i:c:o:h")) != -1) {
+        switch (opt) {
+            case 'm':
+                if (sscanf(optarg, "%u", &max_n) != 1 || max_n < 1) {
+                    usage("bad value for -m");
+                    goto ERROR;
+                }
+                break;
+            case 't':
+                if (sscanf(optarg, "%d", &trials) != 1 || trials < 1 ||
+                    trials > MAX_TRIALS) {
+                    usage("bad value for -t");
+                    goto ERROR;
+                }
+                break;
+            case 'i':
+                if (sscanf(optarg, "%ld", &iters) != 1 || iters < 1) {
+                    usage("bad value for -i");
+                    goto ERROR;
+                }
+                break;
+            case 'c':
+                if (sscanf(optarg, "%d", &cpu) != 1 || cpu < 0) {
+                    usage("bad value for -c");
+                    goto ERROR;
+                }
+                break;
+            case 'o':
+                base = optarg;
+                break;
+            default:
+                usage("");
+                goto ERROR;
+        }
+    }
+#ifdef __linux__
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+#endif
+    if (cpu >= 0 && 0 != pin_cpu(cpu)) {
+        fprintf(stderr, "%s: cannot pin to CPU %d, not pinned\n", prog, cpu);
+        cpu = -1;
+    }
+#ifdef NL_HAVE_TSC
+    tick_ns = nlcali_clock_calibrate(NL_CLOCK_TSC);
+    if (tick_ns > 0) {
+        bench_clock = NL_CLOCK_TSC;
+    }
+    else {
+        tick_ns = 1;
+    }
+#endif
+    if (NULL != base) {
+        snprintf(path, sizeof(path), "%s.csv", base);
+        csv = fopen(path, "w");
+        if (NULL == csv) {
+            perror(path);
+            goto ERROR;
+        }
+        fputs(csv_header, csv);
+    }
+
+    cali = (nlcali_T *)malloc(max_n * sizeof(nlcali_T));
+    assert(cali);
+    fputs(csv_header, stdout);
+    for (n = 1; n <= max_n; n *= 10) {
+        for (hist = HIST_NONE; hist <= HIST_LOGLINEAR; hist++) {
+            arena = make_calipers(cali, n, hist);
+            for (o = 0; o < NOPS; o++) {
+                if (ops[o].hist != hist) {
+                    continue;
+                }
+                measure(&ops[o], cali, n, trials, iters);
+                write_csv(stdout, &results[nresults - 1]);
+                fflush(stdout);
+                if (NULL != csv) {
+                    write_csv(csv, &results[nresults - 1]);
+                }
+            }
+            nlcali_arena_free(arena);
+        }
+        if (n > max_n / 10) {
+            break;
+        }
+    }
+    free(cali);
+    if (NULL != base) {
+        fclose(csv);
+        snprintf(path, sizeof(path), "%s.json", base);
+        json = fopen(path, "w");
+        if (NULL == json) {
+            perror(path);
+            goto ERROR;
+        }
+        write_json(json, cpu);
+        fclose(json);
+    }
+    free(results);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,96 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file nlcali_top.c
+ * Show the calipers in a shared-memory segment (see nl_shm.h) of a
+ * running process, refreshed at an interval, like top(1).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "nl_shm.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <segment> [seconds between reports] [reports]\n",
+            s, prog);
+}
+
+int main(int argc, char **argv)
+{
+    nlcali_shm_reader_T r;
+    const struct nlcali_shm_header_t *hdr;
+    nlcali_T c;
+    long long *prev;
+    double interval = 1, p99;
+    int reports = -1, k;
+    unsigned i, n;
+    const char *event;
+
+    prog = argv[0];
+    if (argc < 2 || argc > 4) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (argc > 2 && (sscanf(argv[2], "%lf", &interval) != 1 ||
+                     interval <= 0)) {
+        usage("bad value for [seconds between reports]");
+        goto ERROR;
+    }
+    if (argc > 3 && (sscanf(argv[3], "%d", &reports) != 1 || reports < 1)) {
+        usage("bad value for [reports]");
+        goto ERROR;
+    }
+    r = nlcali_shm_open(argv[1]);
+    if (NULL == r) {
+        fprintf(stderr, "%s: cannot open segment %s\n", prog, argv[1]);
+        goto ERROR;
+    }
+    hdr = nlcali_shm_header(r);
+    prev = (long long *)calloc(hdr->capacity, sizeof(long long));
+
+    for (k = 0; reports < 0 || k < reports; k++) {
+        if (k > 0) {
+            usleep((useconds_t)(interval * 1e6));
+        }
+        n = nlcali_shm_count(r);
+        printf("\npid %d, %u calipers\n", (int)hdr->pid, n);
+        printf("%-32s %12s %12s %12s %12s %12s %12s\n", "event", "count",
+               "count/s", "v.mean", "v.max", "r.mean", "r.p99");
+        for (i = 0; i < n; i++) {
+            event = nlcali_shm_event(r, i);
+            c = nlcali_shm_read(r, i);
+            if (NULL == event || NULL == c) {
+                continue;
+            }
+            p99 = NL_HIST_HAS_DATA(c) ?
+                nlcali_hist_quantile(c, NL_HIST_RATE, 0.99) : -1;
+            /* the writer may have cleared it since the last report */
+            printf("%-32s %12lld %12.1f %12.6g %12.6g %12.6g ", event,
+                   c->vsm.count,
+                   k == 0 ? 0.0 : (c->vsm.count >= prev[i] ?
+                                   c->vsm.count - prev[i] :
+                                   c->vsm.count) / interval,
+                   c->vsm.mean, c->vsm.max, c->rsm.mean);
+            if (p99 < 0) {
+                printf("%12s\n", "-");
+            }
+            else {
+                printf("%12.6g\n", p99);
+            }
+            prev[i] = c->vsm.count;
+        }
+        fflush(stdout);
+    }
+    free(prev);
+    nlcali_shm_close(r);
+    return 0;
+
+ ERROR:
+    return -1;
+}
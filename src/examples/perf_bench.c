@@ -0,0 +1,142 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file perf_bench.c
+ * Measure the cost of begin/end pairs with no perf_event counters,
+ * with the software ones and with all that can be opened, and check
+ * that page faults and CPU time show up in the summaries and output.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define TOUCH_PAGES 64
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events>\n", s, prog);
+}
+
+static double time_events(nlcali_T c, long events)
+{
+    double t0;
+    long k;
+
+    t0 = now_sec();
+    for (k = 0; k < events; k++) {
+        nlcali_begin(c);
+        nlcali_end(c, 1.0);
+    }
+    return (now_sec() - t0) / events * 1e9;
+}
+
+/* Each event faults in fresh pages; faults and CPU time must show */
+static void check_faults(unsigned have)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    nlcali_T c = nlcali_new(2), d;
+    struct nlcali_perf_t *pf;
+    char *mem, *msg;
+    int i, j, n;
+
+    n = nlcali_perf(c, have);
+    assert(n == (int)have);
+    pf = c->perf;
+    for (i = 0; i < 10; i++) {
+        mem = mmap(NULL, TOUCH_PAGES * page, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        assert(MAP_FAILED != mem);
+        nlcali_begin(c);
+        for (j = 0; j < TOUCH_PAGES; j++) {
+            mem[j * page] = 1;
+        }
+        nlcali_end(c, 1.0);
+        munmap(mem, TOUCH_PAGES * page);
+    }
+    nlcali_calc(c);
+    assert(pf->acc[2].count == 10);
+    /* the kernel may fault around, so fewer faults than pages */
+    assert(pf->sm[2].min >= 1 && pf->sm[2].sum >= 10);
+    /* on the CPU no longer than the event took */
+    assert(pf->sm[0].sum > 0 && pf->sm[0].sum <= c->dur_sum * 1e9 * 1.05);
+    msg = nlcali_log(c, "perf.check");
+    assert(NULL != strstr(msg, " perf.page_faults.sum="));
+    assert(NULL != strstr(msg, " perf.task_clock.mean="));
+    free(msg);
+
+    /* merged only with the same counters, not copied by configure */
+    d = nlcali_new(2);
+    nlcali_configure_like(d, c);
+    assert(NULL == d->perf);
+    n = nlcali_perf(d, have);
+    assert(n == (int)have);
+    nlcali_merge(d, c);
+    nlcali_merge(d, c);
+    nlcali_calc(d);
+    assert(d->perf->acc[2].count == 20);
+    assert(d->perf->sm[2].sum == 2 * pf->sm[2].sum);
+    nlcali_free(d);
+
+    /* events timed elsewhere have no counts */
+    nlcali_clear(c);
+    nlcali_add(c, 0, 100, 1.0);
+    assert(pf->acc[0].count == 0);
+    n = nlcali_perf(c, 0);
+    assert(n == 0 && NULL == c->perf);
+    nlcali_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "none", "software", "all" };
+    unsigned want[] = { 0, NL_PERF_SOFTWARE, NL_PERF_ALL };
+    long events;
+    int mode, have;
+    nlcali_T c;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+
+    printf("mode,counters,events,ns_per_begin_end\n");
+    for (mode = 0; mode < 3; mode++) {
+        c = nlcali_new(2);
+        have = nlcali_perf(c, want[mode]);
+        assert(have >= 0 && 0 == (have & ~want[mode]));
+        printf("%s,0x%x,%ld,%lf\n", modes[mode], have, events,
+               time_events(c, events));
+        nlcali_calc(c);
+        if (have > 0) {
+            assert(c->perf->acc[0].count == 0 ||
+                   c->perf->acc[0].count == events);
+        }
+        nlcali_free(c);
+        if (mode == 1 && have != NL_PERF_SOFTWARE) {
+            fprintf(stderr, "perf_event counters not available (0x%x), "
+                    "skipping checks\n", have);
+            return 0;
+        }
+    }
+    check_faults(NL_PERF_SOFTWARE);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,323 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file prom_bench.c
+ * Measure the cost of rendering many registered calipers in the
+ * Prometheus text format, and the memory allocated once warm; and
+ * check the rendering and the HTTP listener.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "nl_calipers.h"
+#include "nl_registry.h"
+#include "nl_prom.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+/* Renderings timed */
+#define RENDERS 10
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <calipers>\n", s, prog);
+}
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/* Count allocations, passing them on to glibc */
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+
+static long n_alloc = 0;
+
+void *malloc(size_t n) { n_alloc++; return __libc_malloc(n); }
+void *calloc(size_t n, size_t size) { n_alloc++; return __libc_calloc(n, size); }
+void *realloc(void *p, size_t n) { n_alloc++; return __libc_realloc(p, n); }
+void free(void *p) { __libc_free(p); }
+#define ALLOCS() n_alloc
+#else
+#define ALLOCS() -1L
+#endif
+
+/* Value of the first sample line starting with `series` */
+static double sample(const char *text, const char *series)
+{
+    const char *p = text;
+    size_t n = strlen(series);
+    double x;
+    int got;
+
+    for (;;) {
+        p = strstr(p, series);
+        assert(NULL != p);
+        if ((p == text || p[-1] == '\n') && p[n] == ' ') {
+            break;
+        }
+        p += n;
+    }
+    got = sscanf(p + n, "%lf", &x);
+    assert(got == 1);
+    return x;
+}
+
+/* Check that buckets of `family` are cumulative and end with +Inf
+   equal to the count; return the number of buckets */
+static int check_buckets(const char *text, const char *family)
+{
+    char series[256];
+    const char *p = text;
+    double last = 0, x;
+    int n = 0, got;
+
+    snprintf(series, sizeof(series), "%s_bucket{le=\"", family);
+    while (NULL != (p = strstr(p, series))) {
+        p = strchr(p, '}');
+        got = sscanf(p + 1, "%lf", &x);
+        assert(got == 1 && x >= last);
+        last = x;
+        n++;
+    }
+    snprintf(series, sizeof(series), "%s_bucket{le=\"+Inf\"}", family);
+    assert(sample(text, series) == last);
+    snprintf(series, sizeof(series), "%s_count", family);
+    assert(sample(text, series) == last);
+    return n;
+}
+
+static void add_rendered(void *arg, nlcali_prom_T out)
+{
+    int rc = nlcali_prom_add(out, "unix.check", (nlcali_T)arg);
+
+    assert(rc == 0);
+}
+
+static void check_render(void)
+{
+    nlcali_prom_T p = nlcali_prom_new("t_");
+    nlcali_T c = nlcali_new(2);
+    nlcali_token_t tok;
+    const char *text;
+    size_t len;
+    int i, rc;
+
+    /* ten 100 ns bins of duration; log-linear values */
+    rc = nlcali_hist_kind_manual(c, NL_HIST_DUR, 10, 0, 1000);
+    rc |= nlcali_hist_kind_loglinear(c, NL_HIST_VALUE, 2, 1, 1e6);
+    assert(rc == 0);
+    for (i = 0; i < 100; i++) {
+        nlcali_add(c, 0, i * 20, (double)(i + 1));
+    }
+    tok = nlcali_start(c);
+
+    nlcali_prom_begin(p, 0);
+    rc = nlcali_prom_add(p, "svc.db-query", c);
+    assert(rc == 0);
+    text = nlcali_prom_end(p, &len);
+    assert(NULL != text && strlen(text) == len);
+    assert(NULL != strstr(text, "# TYPE t_svc_db_query_events_total counter\n"));
+    assert(sample(text, "t_svc_db_query_events_total") == 100);
+    assert(sample(text, "t_svc_db_query_value_sum") == 5050);
+    assert(sample(text, "t_svc_db_query_value_min") == 1);
+    assert(sample(text, "t_svc_db_query_value_max") == 100);
+    assert(sample(text, "t_svc_db_query_value{quantile=\"0.5\"}") > 45);
+    assert(sample(text, "t_svc_db_query_value{quantile=\"0.5\"}") < 55);
+    assert(NULL != strstr(text, "# TYPE t_svc_db_query_duration_seconds histogram\n"));
+    assert(check_buckets(text, "t_svc_db_query_duration_seconds") == 10);
+    /* durations up to 1980 ns, half past the last edge */
+    assert(sample(text, "t_svc_db_query_duration_seconds_bucket{le=\"1e-7\"}") == 5);
+    assert(sample(text, "t_svc_db_query_duration_seconds_bucket{le=\"+Inf\"}") == 100);
+    assert(NULL != strstr(text, "# TYPE t_svc_db_query_rate summary\n"));
+    assert(sample(text, "t_svc_db_query_gap_count") == 99);
+    assert(sample(text, "t_svc_db_query_inflight") == 1);
+    assert(NULL == strstr(text, "cpu_seconds"));
+    assert(NULL == strstr(text, "# EOF"));
+
+    /* OpenMetrics; sampled counts scaled; the buffer is reused */
+    rc = nlcali_cpu(c, 1);
+    assert(rc == 0);
+    nlcali_stop(c, tok, 1.0);
+    nlcali_begin(c);
+    nlcali_end(c, 1.0);
+    c->untimed = 51;
+    nlcali_prom_begin(p, NL_PROM_OPENMETRICS);
+    rc = nlcali_prom_add(p, "9lives", c);
+    assert(rc == 0);
+    text = nlcali_prom_end(p, &len);
+    assert(NULL != strstr(text, "# TYPE t_9lives_events counter\n"));
+    assert(sample(text, "t_9lives_duration_seconds_bucket{le=\"+Inf\"}") == 204);
+    assert(check_buckets(text, "t_9lives_duration_seconds") == 10);
+    assert(sample(text, "t_9lives_cpu_seconds_count") == 2);
+    assert(NULL != strstr(text, "t_9lives_wait_seconds_sd NaN\n"));
+    assert(len > 6 && 0 == strcmp(text + len - 6, "# EOF\n"));
+
+    nlcali_prom_free(p);
+    p = nlcali_prom_new("");
+    nlcali_prom_begin(p, 0);
+    rc = nlcali_prom_add(p, "9lives", c);
+    assert(rc == 0);
+    assert(NULL != strstr(nlcali_prom_end(p, NULL), "\n_9lives_gap_max "));
+    nlcali_prom_free(p);
+    nlcali_free(c);
+}
+
+/* Send `req` and read the whole response into `buf` */
+static size_t fetch(int fd, const char *req, char *buf, size_t size)
+{
+    size_t n = 0;
+    ssize_t r;
+
+    r = write(fd, req, strlen(req));
+    assert(r == (ssize_t)strlen(req));
+    while (n < size - 1 && (r = read(fd, buf + n, size - 1 - n)) > 0) {
+        n += r;
+    }
+    buf[n] = '\0';
+    close(fd);
+    return n;
+}
+
+static int connect_tcp(int port)
+{
+    struct sockaddr_in sa;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), rc;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    rc = connect(fd, (struct sockaddr *)&sa, sizeof(sa));
+    assert(rc == 0);
+    return fd;
+}
+
+static void check_server(void)
+{
+    static char buf[65536];
+    nlcali_prom_server_T s;
+    struct sockaddr_un sa;
+    nlcali_T c = nlcali_get("server.check");
+    char path[64];
+    int fd, rc;
+
+    nlcali_add(c, 0, 1000, 3.0);
+    s = nlcali_prom_serve("127.0.0.1:0", "nl_", NULL, NULL);
+    assert(NULL != s && nlcali_prom_server_port(s) > 0);
+    fetch(connect_tcp(nlcali_prom_server_port(s)),
+          "GET /metrics HTTP/1.1\r\nHost: x\r\n\r\n", buf, sizeof(buf));
+    assert(0 == strncmp(buf, "HTTP/1.1 200 OK\r\n", 17));
+    assert(NULL != strstr(buf, "text/plain; version=0.0.4"));
+    assert(sample(strstr(buf, "\r\n\r\n") + 4,
+                  "nl_server_check_events_total") == 1);
+    fetch(connect_tcp(nlcali_prom_server_port(s)),
+          "GET /other HTTP/1.0\r\n\r\n", buf, sizeof(buf));
+    assert(0 == strncmp(buf, "HTTP/1.1 404 ", 13));
+    fetch(connect_tcp(nlcali_prom_server_port(s)),
+          "POST /metrics HTTP/1.0\r\n\r\n", buf, sizeof(buf));
+    assert(0 == strncmp(buf, "HTTP/1.1 405 ", 13));
+    nlcali_prom_server_free(s);
+
+    snprintf(path, sizeof(path), "/tmp/prom_bench.%d", (int)getpid());
+    snprintf(buf, sizeof(buf), "unix:%s", path);
+    s = nlcali_prom_serve(buf, "", add_rendered, c);
+    assert(NULL != s && nlcali_prom_server_port(s) == 0);
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    rc = connect(fd, (struct sockaddr *)&sa, sizeof(sa));
+    assert(rc == 0);
+    fetch(fd, "GET / HTTP/1.1\r\n"
+          "Accept: application/openmetrics-text; version=1.0.0\r\n\r\n",
+          buf, sizeof(buf));
+    assert(NULL != strstr(buf, "application/openmetrics-text"));
+    assert(sample(strstr(buf, "\r\n\r\n") + 4, "unix_check_value_sum") == 3);
+    assert(NULL != strstr(buf, "# EOF\n"));
+    nlcali_prom_server_free(s);
+    assert(access(path, F_OK) != 0);
+    nlcali_registry_free();
+}
+
+int main(int argc, char **argv)
+{
+    nlcali_prom_T p;
+    nlcali_T c;
+    const char *text = NULL;
+    char name[64];
+    long calipers, i, allocs;
+    size_t len = 0;
+    double t0, t;
+    int k, rc;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &calipers) != 1 || calipers < 1) {
+        usage("bad value for <calipers>");
+        goto ERROR;
+    }
+    check_render();
+    check_server();
+
+    /* a third each with linear, log-linear and no extra histograms */
+    for (i = 0; i < calipers; i++) {
+        snprintf(name, sizeof(name), "svc.op%ld", i);
+        c = nlcali_get(name);
+        assert(NULL != c);
+        rc = 0;
+        if (i % 3 == 0) {
+            rc = nlcali_hist_kind_manual(c, NL_HIST_DUR, 20, 0, 2e4);
+        }
+        else if (i % 3 == 1) {
+            rc = nlcali_hist_kind_loglinear(c, NL_HIST_VALUE, 2, 1, 1e4);
+        }
+        assert(rc == 0);
+        for (k = 0; k < 50; k++) {
+            nlcali_add(c, 0, (i + k) * 100 % 30000, (double)(i % 1000 + k));
+        }
+    }
+
+    printf("format,calipers,bytes,ns_per_caliper,mb_per_sec,"
+           "allocs_per_render\n");
+    for (k = 0; k < 2; k++) {
+        p = nlcali_prom_new("nlcali_");
+        /* warm up the buffers */
+        text = nlcali_prom_registry(p, k, NULL);
+        assert(NULL != text);
+        allocs = ALLOCS();
+        t0 = now_sec();
+        for (i = 0; i < RENDERS; i++) {
+            text = nlcali_prom_registry(p, k, &len);
+        }
+        t = now_sec() - t0;
+        allocs = allocs < 0 ? -1 : ALLOCS() - allocs;
+        assert(NULL != text);
+        assert(check_buckets(text, "nlcali_svc_op0_duration_seconds") == 20);
+        printf("%s,%ld,%lu,%lf,%lf,%lf\n", k ? "openmetrics" : "text",
+               calipers, (unsigned long)len, t / RENDERS / calipers * 1e9,
+               len * RENDERS / t / 1e6, allocs < 0 ? -1.0 :
+               (double)allocs / RENDERS);
+        if (allocs >= 0) {
+            assert(allocs == 0);
+        }
+        nlcali_prom_free(p);
+    }
+    nlcali_registry_free();
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -16,15 +16,10 @@ static const volatile char rcsid[] = "$Id: ps_calipers_bench.c 27253 2011-02-26
 
 char *prog = NULL;
 
-/* Subtract timeval 'S' from 'E' and return the 
- * number of seconds.
- */
-#define SUBTRACT_TV(E,S) \
-(((E).tv_sec - (S).tv_sec) + ((E).tv_usec - (S).tv_usec)/1e6)
-
 void usage(const char *s) {
     fprintf(stderr,"%s\n"
-            "usage: %s <total_sec> <report_sec> <work>(0..%d)\n", 
+            "usage: %s <total_sec> <report_sec> <work>(0..%d) [clock]\n"
+            "  clock: m=monotonic (default), r=monotonic raw, t=tsc\n",
             s,  prog, MAX_WORK);
 }
 
@@ -50,7 +45,7 @@ void run(nlcali_T c, double dur, int work)
         nlcali_begin(c);
         p = do_something(work);
         nlcali_end(c, 12345);
-    } while (SUBTRACT_TV(c->end, c->first) < dur);
+    } while (NL_TICKS_SEC(c, c->end - c->first) < dur);
 }
 
 void report(nlcali_T c, int is_first, int work)
@@ -77,12 +72,13 @@ int main(int argc, char **argv)
     double elapsed;
     int work = 0;
     int is_first = 1;
-    struct timeval start;
+    netlogger_clock_t clock = NL_CLOCK_DEFAULT;
+    nl_ticks_t start;
     nlcali_T calipers;
 
     prog = argv[0];
 
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         usage("wrong num. of args");
         goto ERROR;
     }
@@ -98,13 +94,27 @@ int main(int argc, char **argv)
         usage("bad value for <work>");
         goto ERROR;
     }
+    if (argc == 5) {
+        switch (argv[4][0]) {
+            case 'm': clock = NL_CLOCK_MONOTONIC; break;
+            case 'r': clock = NL_CLOCK_MONOTONIC_RAW; break;
+            case 't': clock = NL_CLOCK_TSC; break;
+            default:
+                usage("bad value for [clock]");
+                goto ERROR;
+        }
+    }
 
-    gettimeofday(&start, 0);
     calipers = nlcali_new(1);
+    if (nlcali_set_clock(calipers, clock) != 0) {
+        usage("clock not available on this system");
+        goto ERROR;
+    }
+    start = nl_clock_ticks(calipers->clock);
     do {
         run(calipers, sec, work);
         report(calipers, is_first, work);
-        elapsed = SUBTRACT_TV(calipers->end, start);
+        elapsed = NL_TICKS_SEC(calipers, calipers->end - start);
         nlcali_clear(calipers);
         is_first = 0;
     } while(elapsed < ttl);
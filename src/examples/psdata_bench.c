@@ -0,0 +1,155 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file psdata_bench.c
+ * Compare the rate of building perfSONAR data blocks with
+ * nlcali_psdata(), with nlcali_psdata_append() into a reused
+ * buffer, and with nlcali_psdata_multi().
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 100
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <calipers> [rounds]\n", s, prog);
+}
+
+/* Blocks built each way must match, apart from the timestamp */
+static void check(nlcali_T *cali, const char *const *m_ids, int n)
+{
+    bson_buffer bb;
+    bson *one, doc, blk;
+    bson_iterator it, sub;
+    const char *data;
+    int i, j, diff, count = 0, rc;
+
+    bson_buffer_init(&bb);
+    for (i = 0; i < n; i++) {
+        one = nlcali_psdata(cali[i], "check", m_ids[i], 1);
+        bson_buffer_reset(&bb);
+        rc = nlcali_psdata_append(cali[i], &bb, m_ids[i], 1);
+        assert(rc == 0);
+        data = bson_buffer_finish(&bb);
+        assert(bson_size(one) == *(const int *)data);
+        for (diff = 0, j = 0; j < bson_size(one); j++) {
+            diff += one->data[j] != data[j];
+        }
+        assert(diff <= 8);
+        bson_destroy(one);
+        free(one);
+    }
+    bson_buffer_reset(&bb);
+    data = nlcali_psdata_multi(&bb, cali, m_ids, n, 1);
+    assert(data);
+    bson_init(&doc, (char *)data, 0);
+    rc = bson_find(&it, &doc, "blocks");
+    assert(rc == bson_array);
+    bson_iterator_subiterator(&it, &sub);
+    while (bson_iterator_next(&sub)) {
+        bson_iterator_subobject(&sub, &blk);
+        one = nlcali_psdata(cali[count], "check", m_ids[count], 1);
+        assert(bson_size(&blk) == bson_size(one));
+        bson_destroy(one);
+        free(one);
+        count++;
+    }
+    assert(count == n);
+    bson_buffer_destroy(&bb);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "psdata", "append", "multi" };
+    int n, rounds = 10, i, j, r, mode;
+    double t0, sec;
+    size_t bytes;
+    char **m_ids;
+    bson_buffer bb;
+    bson *b;
+    nlcali_T *cali;
+
+    prog = argv[0];
+    if (argc < 2 || argc > 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < 1) {
+        usage("bad value for <calipers>");
+        goto ERROR;
+    }
+    if (argc == 3 && (sscanf(argv[2], "%d", &rounds) != 1 || rounds < 1)) {
+        usage("bad value for [rounds]");
+        goto ERROR;
+    }
+
+    cali = (nlcali_T *)malloc(n * sizeof(nlcali_T));
+    m_ids = (char **)malloc(n * sizeof(char *));
+    srand(42);
+    for (i = 0; i < n; i++) {
+        cali[i] = nlcali_new(2);
+        nlcali_hist_manual(cali[i], HIST_BINS, 0, 10);
+        for (j = 0; j < 1000; j++) {
+            nlcali_add(cali[i], 0, 1 + rand() % 1000, rand() % 5000);
+        }
+        m_ids[i] = malloc(16);
+        sprintf(m_ids[i], "META%d", i);
+    }
+    check(cali, (const char *const *)m_ids, n);
+
+    printf("mode,calipers,blocks_per_sec,bytes_per_block\n");
+    bson_buffer_init(&bb);
+    for (mode = 0; mode < 3; mode++) {
+        bytes = 0;
+        t0 = now_sec();
+        for (r = 0; r < rounds; r++) {
+            switch (mode) {
+                case 0:
+                    for (i = 0; i < n; i++) {
+                        b = nlcali_psdata(cali[i], "bench", m_ids[i], r);
+                        bytes += bson_size(b);
+                        bson_destroy(b);
+                        free(b);
+                    }
+                    break;
+                case 1:
+                    for (i = 0; i < n; i++) {
+                        bson_buffer_reset(&bb);
+                        nlcali_psdata_append(cali[i], &bb, m_ids[i], r);
+                        bytes += *(const int *)bson_buffer_finish(&bb);
+                    }
+                    break;
+                case 2:
+                    bson_buffer_reset(&bb);
+                    bytes += *(const int *)nlcali_psdata_multi(
+                        &bb, cali, (const char *const *)m_ids, n, r);
+                    break;
+            }
+        }
+        sec = now_sec() - t0;
+        printf("%s,%d,%lf,%lf\n", modes[mode], n,
+               (double)n * rounds / sec, (double)bytes / n / rounds);
+    }
+    bson_buffer_destroy(&bb);
+
+    for (i = 0; i < n; i++) {
+        nlcali_free(cali[i]);
+        free(m_ids[i]);
+    }
+    free(cali);
+    free(m_ids);
+    return 0;
+
+ ERROR:
+    return -1;
+}
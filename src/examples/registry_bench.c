@@ -0,0 +1,171 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file registry_bench.c
+ * Measure the cost of finding a caliper by name with nlcali_get(),
+ * compared with a cached handle and with a load-time static handle,
+ * and check registration under concurrent lookups and aggregation
+ * by name prefix.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nl_registry.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define NUM_GROUPS 10
+
+NLCALI_STATIC(static_cali, "bench.static");
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <names> <lookups>\n", s, prog);
+}
+
+struct reader_t {
+    char **names;
+    nlcali_T *handles;
+    int n;
+    volatile int *stop;
+};
+
+/* Look up already-registered names while new ones are added */
+static void *reader(void *arg)
+{
+    struct reader_t *r = (struct reader_t *)arg;
+    long k = 0;
+
+    while (!*r->stop) {
+        int i = k++ % r->n;
+        nlcali_T cali = nlcali_get(r->names[i]);
+        assert(cali == r->handles[i]);
+    }
+    return NULL;
+}
+
+static void count_fn(void *arg, const char *name, nlcali_T cali)
+{
+    assert(nlcali_get(name) == cali);
+    (*(int *)arg)++;
+}
+
+int main(int argc, char **argv)
+{
+    int n, lookups, i, k, half, count;
+    volatile int stop = 0;
+    double t0, sec[4];
+    char **names, buf[64];
+    nlcali_T *handles, agg;
+    pthread_t tid;
+    struct reader_t r;
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < 2 * NUM_GROUPS) {
+        usage("bad value for <names>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%d", &lookups) != 1 || lookups < 1) {
+        usage("bad value for <lookups>");
+        goto ERROR;
+    }
+    assert(static_cali && nlcali_get("bench.static") == static_cali);
+
+    names = (char **)malloc(n * sizeof(char *));
+    handles = (nlcali_T *)malloc(n * sizeof(nlcali_T));
+    for (i = 0; i < n; i++) {
+        sprintf(buf, "svc.%d.op%d", i % NUM_GROUPS, i);
+        names[i] = strdup(buf);
+    }
+
+    /* register half, then the rest while another thread looks up */
+    half = n / 2;
+    for (i = 0; i < half; i++) {
+        handles[i] = nlcali_get(names[i]);
+        assert(handles[i]);
+        assert(0 == strcmp(nlcali_registry_name(handles[i]), names[i]));
+    }
+    r.names = names;
+    r.handles = handles;
+    r.n = half;
+    r.stop = &stop;
+    pthread_create(&tid, NULL, reader, &r);
+    for (i = half; i < n; i++) {
+        handles[i] = nlcali_get(names[i]);
+        assert(handles[i]);
+    }
+    stop = 1;
+    pthread_join(tid, NULL);
+    for (i = 0; i < n; i++) {
+        assert(nlcali_get(names[i]) == handles[i]);
+    }
+    count = 0;
+    k = nlcali_registry_foreach(count_fn, &count);
+    assert(k == n + 1 && count == n + 1);
+
+    /* one event per caliper, then roll up by prefix */
+    for (i = 0; i < n; i++) {
+        nlcali_add(handles[i], 0, 1000, i);
+    }
+    agg = nlcali_new(2);
+    k = nlcali_registry_aggregate("svc.3", agg);
+    assert(k == n / NUM_GROUPS + (n % NUM_GROUPS > 3));
+    assert(agg->vsm.count == n / NUM_GROUPS + (n % NUM_GROUPS > 3));
+    nlcali_clear(agg);
+    k = nlcali_registry_aggregate("svc.3.*", agg);
+    assert(k == agg->vsm.count);
+    nlcali_clear(agg);
+    k = nlcali_registry_aggregate("svc.3.op", agg);
+    assert(k == 0);
+    nlcali_clear(agg);
+    k = nlcali_registry_aggregate("svc", agg);
+    assert(k == n);
+    nlcali_clear(agg);
+    k = nlcali_registry_aggregate(NULL, agg);
+    assert(k == n + 1);
+    assert(agg->vsm.count == n);
+    nlcali_free(agg);
+
+    /* lookup cost */
+    srand(42);
+    for (k = 0; k < 4; k++) {
+        t0 = now_sec();
+        for (i = 0; i < lookups; i++) {
+            int j = rand() % n;
+            nlcali_T c;
+            switch (k) {
+                case 0: c = nlcali_get(names[j]); break;
+                case 1: c = nlcali_get(names[j % NUM_GROUPS]); break;
+                case 2: c = nlcali_get_static("bench.static"); break;
+                default: c = static_cali; break;
+            }
+            nlcali_add(c, 0, 1000, i);
+        }
+        sec[k] = now_sec() - t0;
+    }
+    printf("names,get_random_ns,get_hot_ns,get_static_ns,static_handle_ns\n");
+    printf("%d,%lf,%lf,%lf,%lf\n", n, sec[0] / lookups * 1e9,
+           sec[1] / lookups * 1e9, sec[2] / lookups * 1e9,
+           sec[3] / lookups * 1e9);
+
+    nlcali_registry_free();
+    for (i = 0; i < n; i++) {
+        free(names[i]);
+    }
+    free(names);
+    free(handles);
+    return 0;
+
+ ERROR:
+    return -1;
+}
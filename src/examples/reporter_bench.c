@@ -0,0 +1,178 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file reporter_bench.c
+ * Compare reporting inline on the measured thread, as the other
+ * examples do, with a background reporter. Shows the event rate and
+ * the longest stall seen by the measured thread, and checks that
+ * every event is reported exactly once.
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nl_reporter.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define NUM_CALIPERS 100
+#define HIST_BINS 100
+#define WORK 200
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <total_sec> <report_sec>\n", s, prog);
+}
+
+static volatile unsigned sink;
+
+static void do_work(void)
+{
+    int i;
+
+    for (i = 0; i < WORK; i++) {
+        sink += i;
+    }
+}
+
+/* Output shared by both modes */
+struct output {
+    int fd;
+    long long events;
+    int reports;
+    char line[8192];
+};
+
+static void write_report(struct output *out, const char *name, nlcali_T c)
+{
+    size_t len = nlcali_log_into(c, name, out->line, sizeof(out->line));
+
+    (void)write(out->fd, out->line, len);
+    out->events += c->vsm.count;
+    out->reports++;
+}
+
+static void sink_fn(void *arg, const char *name, nlcali_T c)
+{
+    write_report((struct output *)arg, name, c);
+}
+
+static nlcali_T new_proto(void)
+{
+    nlcali_T c = nlcali_new(2);
+    nlcali_hist_manual(c, HIST_BINS, 0, 1);
+    return c;
+}
+
+int main(int argc, char **argv)
+{
+    double total, interval, t0, t, last, stall, next;
+    long long events;
+    int mode, i;
+    char name[32];
+    struct output out;
+    nlcali_T proto, inl[NUM_CALIPERS];
+    nlcali_reporter_T rep;
+    nlcali_rep_T rc[NUM_CALIPERS];
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%lf", &total) != 1 || total <= 0) {
+        usage("bad value for <total_sec>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%lf", &interval) != 1 || interval <= 0) {
+        usage("bad value for <report_sec>");
+        goto ERROR;
+    }
+    out.fd = open("/dev/null", O_WRONLY);
+    assert(out.fd >= 0);
+    proto = new_proto();
+
+    printf("mode,calipers,events_per_sec,max_stall_usec,reports\n");
+    for (mode = 0; mode < 2; mode++) {
+        out.events = 0;
+        out.reports = 0;
+        events = 0;
+        stall = 0;
+        rep = NULL;
+        for (i = 0; i < NUM_CALIPERS; i++) {
+            sprintf(name, "bench.%d", i);
+            if (mode == 0) {
+                inl[i] = new_proto();
+            }
+            else {
+                if (NULL == rep) {
+                    rep = nlcali_reporter_new(interval, NUM_CALIPERS, -1,
+                                              sink_fn, &out);
+                    assert(rep);
+                }
+                rc[i] = nlcali_reporter_add(rep, name, proto);
+                assert(rc[i]);
+            }
+        }
+        t0 = last = now_sec();
+        next = t0 + interval;
+        do {
+            i = events % NUM_CALIPERS;
+            if (mode == 0) {
+                nlcali_begin(inl[i]);
+                do_work();
+                nlcali_end(inl[i], 1);
+            }
+            else {
+                nlcali_rep_begin(rc[i]);
+                do_work();
+                nlcali_rep_end(rc[i], 1);
+            }
+            events++;
+            t = now_sec();
+            if (mode == 0 && t >= next) {
+                /* report every caliper on this thread */
+                for (i = 0; i < NUM_CALIPERS; i++) {
+                    sprintf(name, "bench.%d", i);
+                    write_report(&out, name, inl[i]);
+                    nlcali_clear(inl[i]);
+                }
+                next += interval;
+                t = now_sec();
+            }
+            if (t - last > stall) {
+                stall = t - last;
+            }
+            last = t;
+        } while (t - t0 < total);
+        t = now_sec() - t0;
+
+        /* remaining data */
+        if (mode == 0) {
+            for (i = 0; i < NUM_CALIPERS; i++) {
+                sprintf(name, "bench.%d", i);
+                write_report(&out, name, inl[i]);
+                nlcali_free(inl[i]);
+            }
+        }
+        else {
+            nlcali_reporter_free(rep);
+        }
+        assert(out.events == events);
+        printf("%s,%d,%lf,%lf,%d\n", mode ? "reporter" : "inline",
+               NUM_CALIPERS, events / t, stall * 1e6, out.reports);
+    }
+
+    nlcali_free(proto);
+    close(out.fd);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,167 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file rollup_bench.c
+ * Push two hours of one-second intervals into a 1s/1m/1h rollup,
+ * check what each resolution holds, and time pushes and queries.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_rollup.h"
+#include "nl_tdigest.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 20
+#define SECONDS 7200
+/* on an hour boundary */
+#define T0 (3600.0 * 400000)
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events per interval>\n", s, prog);
+}
+
+struct check_t {
+    long long count; /* expected per bucket */
+    double prev;     /* start of previous bucket */
+    unsigned n;
+};
+
+static void check_fn(void *arg, double start, nlcali_T cali)
+{
+    struct check_t *c = (struct check_t *)arg;
+    unsigned i, bins = 0;
+
+    assert(start > c->prev);
+    assert(cali->vsm.count == c->count);
+    for (i = 0; i < 2 * HIST_BINS; i++) {
+        bins += cali->h_rdata[i];
+    }
+    assert(bins == 2 * c->count);
+    c->prev = start;
+    c->n++;
+}
+
+static void check(nlcali_rollup_T r, unsigned level, long long count,
+                  unsigned expect)
+{
+    struct check_t c = { count, 0, 0 };
+    unsigned n;
+
+    n = nlcali_rollup_foreach(r, level, 0, 1e300, check_fn, &c);
+    assert(n == expect && c.n == expect);
+}
+
+/* Pushing a caliper leaves it as it was, values still buffered in
+   its sketches included, and the buckets get its sketch values */
+static void check_push_unchanged(void)
+{
+    const double res[1] = { 1 };
+    const unsigned buckets[1] = { 4 };
+    nlcali_T c = nlcali_new(2), out = nlcali_new(2);
+    nlcali_rollup_T r;
+    unsigned buf_num;
+    int k, n;
+
+    n = nlcali_sketch(c, NL_TDIGEST_COMPRESSION);
+    assert(n == 0);
+    r = nlcali_rollup_new(c, 1, res, buckets);
+    assert(r);
+    for (k = 0; k < 10; k++) {
+        nlcali_add(c, 0, 1000, 1.0 + k);
+    }
+    buf_num = c->vsk->buf_num;
+    assert(buf_num > 0);
+    n = nlcali_rollup_push(r, c, T0 + 0.5);
+    assert(n == 1);
+    assert(c->vsk->buf_num == buf_num && c->vsk->num == 0);
+    nlcali_configure_like(out, c);
+    n = nlcali_rollup_merge(r, 0, 0, 1e300, out);
+    assert(n == 1);
+    assert(nl_tdigest_count(out->vsk) == 10);
+    nlcali_rollup_free(r);
+    nlcali_free(out);
+    nlcali_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    const double res[3] = { 1, 60, 3600 };
+    const unsigned buckets[3] = { 60, 60, 24 };
+    long events, k;
+    int s, n;
+    double t0, push_sec, query_sec;
+    nlcali_T c, out;
+    nlcali_rollup_T r;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events per interval>");
+        goto ERROR;
+    }
+    check_push_unchanged();
+
+    c = nlcali_new(2);
+    nlcali_hist_manual(c, HIST_BINS, 0, 0.01);
+    r = nlcali_rollup_new(c, 3, res, buckets);
+    assert(r);
+
+    push_sec = 0;
+    for (s = 0; s < SECONDS; s++) {
+        for (k = 0; k < events; k++) {
+            nlcali_add(c, 0, 1000, 1.0 + (k % 7));
+        }
+        t0 = now_sec();
+        n = nlcali_rollup_push(r, c, T0 + s + 0.5);
+        push_sec += now_sec() - t0;
+        assert(n == 3);
+        nlcali_clear(c);
+    }
+    t0 = now_sec();
+    check(r, 0, events, 60);
+    check(r, 1, events * 60, 60);
+    query_sec = now_sec() - t0;
+    check(r, 2, events * 3600, 2);
+    n = nlcali_rollup_foreach(r, 9, 0, 1e300, NULL, NULL);
+    assert(n == 0);
+
+    /* late data is kept only where its bucket still exists */
+    nlcali_add(c, 0, 1000, 1.0);
+    n = nlcali_rollup_push(r, c, T0 + 0.5);
+    assert(n == 1);
+    nlcali_clear(c);
+
+    /* the last 10 minutes by minute, and everything by hour */
+    out = nlcali_new(2);
+    nlcali_configure_like(out, c);
+    n = nlcali_rollup_merge(r, 1, T0 + SECONDS - 600, T0 + SECONDS, out);
+    assert(n == 10);
+    nlcali_calc(out);
+    assert(out->vsm.count == events * 600);
+    nlcali_clear(out);
+    n = nlcali_rollup_merge(r, 2, 0, 1e300, out);
+    assert(n == 2);
+    nlcali_calc(out);
+    assert(out->vsm.count == events * SECONDS + 1);
+    nlcali_free(out);
+
+    printf("events_per_interval,intervals,push_usec,query_1s_1m_usec\n");
+    printf("%ld,%d,%lf,%lf\n", events, SECONDS, push_sec / SECONDS * 1e6,
+           query_sec * 1e6);
+    nlcali_rollup_free(r);
+    nlcali_free(c);
+    return 0;
+
+ ERROR:
+    return -1;
+}
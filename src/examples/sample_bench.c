@@ -0,0 +1,142 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file sample_bench.c
+ * Measure the overhead of begin/end pairs around a small piece of
+ * work with every event timed, with 1 in N timed (nlcali_sample()),
+ * and with N adapted to an overhead target. Check that counts and
+ * values stay exact and that the scaled estimates are close to the
+ * fully timed ones.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 20
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events> <work> [target overhead %%]\n", s, prog);
+}
+
+static volatile unsigned sink;
+
+static void do_work(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        sink += i;
+    }
+}
+
+/* Sum of the (scaled) bins of the rate histogram */
+static double hist_total(nlcali_T c)
+{
+    double total = 0;
+    unsigned i;
+
+    for (i = 0; i < c->h_num; i++) {
+        total += c->h_rdata[i];
+    }
+    return total * c->scale;
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "all", "1_in_16", "1_in_256", "adaptive" };
+    long events, k;
+    int work, mode, rc = 0;
+    double target = 1, t0, base, sec, vsum, rmean = 0;
+    nlcali_T c;
+
+    prog = argv[0];
+    if (argc != 3 && argc != 4) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1000) {
+        usage("bad value for <events>, at least 1000");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%d", &work) != 1 || work < 1) {
+        usage("bad value for <work>");
+        goto ERROR;
+    }
+    if (argc == 4 && (sscanf(argv[3], "%lf", &target) != 1 ||
+                      target <= 0 || target >= 100)) {
+        usage("bad value for [target overhead %]");
+        goto ERROR;
+    }
+
+    /* the work alone, best of two */
+    base = 0;
+    for (mode = 0; mode < 2; mode++) {
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            do_work(work);
+        }
+        sec = now_sec() - t0;
+        if (0 == mode || sec < base) {
+            base = sec;
+        }
+    }
+
+    printf("mode,events,ns_per_event,pct_overhead,period,scale,"
+           "r_count,r_mean\n");
+    for (mode = 0; mode < 4; mode++) {
+        c = nlcali_new(2);
+        nlcali_hist_manual(c, HIST_BINS, 0, 2);
+        switch (mode) {
+            case 1: rc = nlcali_sample(c, 16, 0); break;
+            case 2: rc = nlcali_sample(c, 256, 0); break;
+            case 3: rc = nlcali_sample(c, 0, target); break;
+        }
+        assert(rc == 0);
+        vsum = 0;
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nlcali_begin(c);
+            do_work(work);
+            nlcali_end(c, 1.0 + (k & 7));
+        }
+        sec = now_sec() - t0;
+        for (k = 0; k < events; k++) {
+            vsum += 1.0 + (k & 7);
+        }
+        nlcali_calc(c);
+        /* every event is counted exactly */
+        assert(c->vsm.count == events);
+        assert(c->vsm.sum == vsum);
+        assert(c->vsm.min == 1 && c->vsm.max == 8);
+        /* rate counts are estimates, and so are the bins */
+        assert(llabs(c->rsm.count - events) < 0.05 * events + 64);
+        assert(fabs(hist_total(c) - c->rsm.count) < 0.01 * events + 64);
+        if (0 == mode) {
+            assert(c->scale == 1 && c->untimed == 0);
+            rmean = c->rsm.mean;
+        }
+        else {
+            /* rates vary with the value, so the mean is a fair test;
+               timed events after untimed ones run a little slower */
+            assert(fabs(c->rsm.mean - rmean) < 0.25 * rmean);
+        }
+        printf("%s,%ld,%lf,%lf,%u,%lf,%lld,%lf\n", modes[mode], events,
+               sec / events * 1e9, (sec - base) / sec * 100,
+               NULL != c->smp ? c->smp->period : 1, c->scale,
+               c->rsm.count, c->rsm.mean);
+        nlcali_free(c);
+    }
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,133 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file sharded_bench.c
+ * Compare a sharded caliper with a mutex-protected one
+ * under many threads.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_sharded.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+char *prog = NULL;
+
+typedef enum { SHARDED=0, LOCKED=1 } bench_mode_t;
+
+struct worker_t {
+    bench_mode_t mode;
+    long iters;
+    nlcali_sharded_T sharded;
+    nlcali_T locked;
+    pthread_mutex_t *lock;
+};
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <threads> <iterations per thread>\n", s, prog);
+}
+
+static void *work(void *arg)
+{
+    struct worker_t *w = (struct worker_t *)arg;
+    long i;
+
+    if (w->mode == SHARDED) {
+        nlcali_T c = nlcali_shard(w->sharded);
+        assert(c);
+        for (i = 0; i < w->iters; i++) {
+            nlcali_begin(c);
+            nlcali_end(c, 1.0 * (i & 1023));
+        }
+    }
+    else {
+        for (i = 0; i < w->iters; i++) {
+            pthread_mutex_lock(w->lock);
+            nlcali_begin(w->locked);
+            nlcali_end(w->locked, 1.0 * (i & 1023));
+            pthread_mutex_unlock(w->lock);
+        }
+    }
+    return NULL;
+}
+
+static double run(bench_mode_t mode, int nthreads, long iters)
+{
+    pthread_t *tids;
+    struct worker_t w;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    nlcali_T proto, out;
+    nl_ticks_t t0, t1;
+    int i;
+
+    proto = nlcali_new(1);
+    nlcali_hist_manual(proto, 20, 0, 1);
+    out = nlcali_new(1);
+    w.mode = mode;
+    w.iters = iters;
+    w.sharded = nlcali_sharded_new(proto, nthreads);
+    w.locked = proto;
+    w.lock = &lock;
+
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    t0 = nl_clock_ticks(NL_CLOCK_MONOTONIC);
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, work, &w);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    t1 = nl_clock_ticks(NL_CLOCK_MONOTONIC);
+
+    /* every event must be accounted for */
+    if (mode == SHARDED) {
+        nlcali_snapshot(w.sharded, out);
+        assert(out->vsm.count == (long long)nthreads * iters);
+    }
+    else {
+        assert(proto->vacc.count == (long long)nthreads * iters);
+    }
+
+    free(tids);
+    nlcali_sharded_free(w.sharded);
+    nlcali_free(out);
+    nlcali_free(proto);
+    return (t1 - t0) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads;
+    long iters;
+    double sec;
+    bench_mode_t mode;
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &nthreads) != 1 || nthreads < 1 ||
+        nthreads > NL_MAX_SHARDS) {
+        usage("bad value for <threads>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%ld", &iters) != 1 || iters < 1) {
+        usage("bad value for <iterations per thread>");
+        goto ERROR;
+    }
+    printf("mode,threads,events,sec,events_per_sec\n");
+    for (mode = SHARDED; mode <= LOCKED; mode++) {
+        sec = run(mode, nthreads, iters);
+        printf("%s,%d,%ld,%lf,%lf\n", mode == SHARDED ? "sharded" : "mutex",
+               nthreads, nthreads * iters, sec, nthreads * iters / sec);
+    }
+    return 0;
+
+ ERROR:
+    return -1;
+}
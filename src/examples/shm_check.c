@@ -0,0 +1,181 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file shm_check.c
+ * Record into calipers in a shared-memory segment from several
+ * threads, while another process reads them as fast as it can, and
+ * check that every copy the reader takes is consistent.
+ *
+ * Every event has value 1 and lasts 1000 ticks, and each writer
+ * clears its caliper now and then, so in any consistent copy the
+ * sum equals the count, all the rates are the same, and the
+ * histograms and duration agree with the count.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "nl_shm.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define HIST_BINS 20
+#define DUR 1000
+#define CLEAR_EVERY 100000
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <writer threads> <seconds>\n", s, prog);
+}
+
+struct writer_t {
+    nlcali_T cali;
+    volatile int *stop;
+    long events;
+};
+
+static void *writer(void *arg)
+{
+    struct writer_t *w = (struct writer_t *)arg;
+    long k;
+
+    for (k = 0; !*w->stop; k++) {
+        nlcali_add(w->cali, 0, DUR, 1.0);
+        if (k % CLEAR_EVERY == CLEAR_EVERY - 1) {
+            nlcali_clear(w->cali);
+        }
+    }
+    w->events = k;
+    return NULL;
+}
+
+static int consistent(nlcali_T c)
+{
+    unsigned i, rbins = 0, gbins = 0;
+
+    for (i = 0; i < c->h_num; i++) {
+        rbins += c->h_rdata[i];
+        gbins += c->h_gdata[i];
+    }
+    if (c->vsm.count == 0) {
+        return c->rsm.count == 0 && rbins == 0 && c->dur_ticks == 0;
+    }
+    return c->vsm.sum == (double)c->vsm.count &&
+        c->vsm.min == 1 && c->vsm.max == 1 &&
+        c->rsm.count == c->vsm.count &&
+        c->rsm.min == c->rsm.max &&
+        c->dur_ticks == (nl_ticks_t)c->vsm.count * DUR &&
+        rbins == c->vsm.count && gbins == c->vsm.count;
+}
+
+/* Child process: read every caliper until time is up */
+static int reader(const char *name, int n, double seconds)
+{
+    nlcali_shm_reader_T r;
+    nlcali_T c;
+    long reads = 0, bad = 0;
+    double t_end = now_sec() + seconds;
+    int i;
+
+    r = nlcali_shm_open(name);
+    if (NULL == r) {
+        fprintf(stderr, "cannot open %s\n", name);
+        return 1;
+    }
+    assert(nlcali_shm_count(r) == (unsigned)n);
+    assert(nlcali_shm_header(r)->hist_bins == HIST_BINS);
+    while (now_sec() < t_end) {
+        for (i = 0; i < n; i++) {
+            c = nlcali_shm_read(r, i);
+            assert(c != NULL);
+            assert(c->h_state == NL_HIST_MANUAL);
+            reads++;
+            if (!consistent(c)) {
+                bad++;
+            }
+        }
+    }
+    printf("reads,inconsistent\n%ld,%ld\n", reads, bad);
+    fflush(stdout);
+    nlcali_shm_close(r);
+    return bad > 0 || reads == 0;
+}
+
+int main(int argc, char **argv)
+{
+    char name[64], event[32];
+    int nthreads, i, status;
+    double seconds, t0, sec;
+    long events = 0;
+    volatile int stop = 0;
+    nlcali_shm_T shm;
+    nlcali_T full;
+    pthread_t *tids;
+    struct writer_t *w;
+    pid_t pid;
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &nthreads) != 1 || nthreads < 1) {
+        usage("bad value for <writer threads>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%lf", &seconds) != 1 || seconds <= 0) {
+        usage("bad value for <seconds>");
+        goto ERROR;
+    }
+    sprintf(name, "/nl_shm_check.%d", (int)getpid());
+    shm = nlcali_shm_create(name, nthreads, HIST_BINS);
+    assert(shm);
+    w = (struct writer_t *)malloc(nthreads * sizeof(struct writer_t));
+    tids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++) {
+        sprintf(event, "check.%d", i);
+        w[i].cali = nlcali_shm_alloc(shm, event, 2);
+        assert(w[i].cali);
+        nlcali_hist_manual(w[i].cali, HIST_BINS, 0, 0.002);
+        w[i].stop = &stop;
+    }
+    full = nlcali_shm_alloc(shm, "full", 2);
+    assert(full == NULL);
+
+    /* fork before starting threads */
+    pid = fork();
+    if (0 == pid) {
+        _exit(reader(name, nthreads, seconds));
+    }
+    assert(pid > 0);
+    t0 = now_sec();
+    for (i = 0; i < nthreads; i++) {
+        pthread_create(&tids[i], NULL, writer, &w[i]);
+    }
+    waitpid(pid, &status, 0);
+    stop = 1;
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+        events += w[i].events;
+    }
+    sec = now_sec() - t0;
+    printf("threads,seconds,events_per_sec\n%d,%lf,%lf\n", nthreads, sec,
+           events / sec);
+    nlcali_shm_free(shm, 1);
+    free(w);
+    free(tids);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "reader found inconsistent copies\n");
+        goto ERROR;
+    }
+    return 0;
+
+ ERROR:
+    return -1;
+}
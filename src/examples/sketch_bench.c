@@ -0,0 +1,173 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file sketch_bench.c
+ * Compare accuracy and throughput of the t-digest quantile sketch
+ * with keeping and sorting all the raw samples.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_tdigest.h"
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define NUM_PARTS 8
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <values> [compression]\n", s, prog);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Heavy-tailed (log-normal) latencies */
+static double lognormal(void)
+{
+    double u1 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double u2 = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return exp(1.5 * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2));
+}
+
+/* nlcali_merge() leaves the source's sketches as they were, values
+   still buffered included */
+static void check_merge_unchanged(double compression)
+{
+    nlcali_T src = nlcali_new(2), dst = nlcali_new(2);
+    unsigned num, buf_num;
+    int k, rc;
+
+    rc = nlcali_sketch(src, compression);
+    rc |= nlcali_sketch(dst, compression);
+    assert(rc == 0);
+    for (k = 0; k < 10; k++) {
+        nlcali_add(src, 0, 100 + k, 1.0 + k);
+    }
+    num = src->vsk->num;
+    buf_num = src->vsk->buf_num;
+    assert(buf_num > 0);
+    rc = nlcali_merge(dst, src);
+    assert(rc == 0);
+    assert(src->vsk->num == num && src->vsk->buf_num == buf_num);
+    assert(nl_tdigest_count(dst->vsk) == 10);
+    nlcali_free(src);
+    nlcali_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    int n, i, j;
+    double compression = NL_TDIGEST_COMPRESSION;
+    double *x, *sorted, t0, td_sec, sort_sec;
+    double qs[] = { 0.5, 0.9, 0.99, 0.999, 0.9999 };
+    nl_tdigest_T td, parts[NUM_PARTS], merged, copy;
+    char *buf;
+    size_t len, wrote;
+
+    prog = argv[0];
+    if (argc < 2 || argc > 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &n) != 1 || n < NUM_PARTS) {
+        usage("bad value for <values>");
+        goto ERROR;
+    }
+    if (argc == 3 && (sscanf(argv[2], "%lf", &compression) != 1 ||
+                      compression <= 0)) {
+        usage("bad value for [compression]");
+        goto ERROR;
+    }
+
+    check_merge_unchanged(compression);
+
+    x = (double *)malloc(n * sizeof(double));
+    sorted = (double *)malloc(n * sizeof(double));
+    srand(42);
+    for (i = 0; i < n; i++) {
+        x[i] = lognormal();
+    }
+
+    /* sketch */
+    td = nl_tdigest_new(compression);
+    t0 = now_sec();
+    for (i = 0; i < n; i++) {
+        nl_tdigest_add(td, x[i]);
+    }
+    nl_tdigest_flush(td);
+    td_sec = now_sec() - t0;
+
+    /* raw samples */
+    t0 = now_sec();
+    for (i = 0; i < n; i++) {
+        sorted[i] = x[i];
+    }
+    qsort(sorted, n, sizeof(double), cmp_double);
+    sort_sec = now_sec() - t0;
+
+    /* sketches of parts, merged; also round-trip one via serialization */
+    merged = nl_tdigest_new(compression);
+    for (j = 0; j < NUM_PARTS; j++) {
+        parts[j] = nl_tdigest_new(compression);
+        for (i = j; i < n; i += NUM_PARTS) {
+            nl_tdigest_add(parts[j], x[i]);
+        }
+        len = nl_tdigest_serialize(parts[j], NULL, 0);
+        buf = malloc(len);
+        wrote = nl_tdigest_serialize(parts[j], buf, len);
+        assert(wrote == len);
+        copy = nl_tdigest_deserialize(buf, len);
+        assert(copy && nl_tdigest_count(copy) == nl_tdigest_count(parts[j]));
+        nl_tdigest_merge(merged, copy);
+        nl_tdigest_free(copy);
+        free(buf);
+    }
+    assert(nl_tdigest_count(merged) == n);
+
+    printf("method,values,mops,bytes");
+    for (j = 0; j < 5; j++) {
+        printf(",p%g_relerr", qs[j] * 100);
+    }
+    printf("\n");
+    printf("sorted,%d,%lf,%lu", n, n / sort_sec / 1e6,
+           (unsigned long)(n * sizeof(double)));
+    for (j = 0; j < 5; j++) {
+        printf(",0");
+    }
+    printf("\n");
+    for (i = 0; i < 2; i++) {
+        nl_tdigest_T t = i ? merged : td;
+        printf("%s,%d,%lf,%lu", i ? "tdigest_merged" : "tdigest", n,
+               i ? 0 : n / td_sec / 1e6,
+               (unsigned long)((t->cap + t->buf_cap) *
+                               sizeof(struct nl_centroid_t)));
+        for (j = 0; j < 5; j++) {
+            double exact = sorted[(int)(qs[j] * (n - 1))];
+            printf(",%lf",
+                   fabs(nl_tdigest_quantile(t, qs[j]) - exact) / exact);
+        }
+        printf("\n");
+    }
+
+    for (j = 0; j < NUM_PARTS; j++) {
+        nl_tdigest_free(parts[j]);
+    }
+    nl_tdigest_free(merged);
+    nl_tdigest_free(td);
+    free(x);
+    free(sorted);
+    return 0;
+
+ ERROR:
+    return -1;
+}
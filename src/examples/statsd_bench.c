@@ -0,0 +1,305 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file statsd_bench.c
+ * Measure the cost of reporting many calipers as StatsD lines, batched
+ * into datagrams or sent one line at a time, with a local socket
+ * standing in for the agent; and check the lines that arrive.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "nl_calipers.h"
+#include "nl_statsd.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+/* Reports timed */
+#define REPORTS 10
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <calipers>\n", s, prog);
+}
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+/* Count allocations, passing them on to glibc */
+extern void *__libc_malloc(size_t n);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t n);
+extern void __libc_free(void *p);
+
+static long n_alloc = 0;
+
+void *malloc(size_t n) { n_alloc++; return __libc_malloc(n); }
+void *calloc(size_t n, size_t size) { n_alloc++; return __libc_calloc(n, size); }
+void *realloc(void *p, size_t n) { n_alloc++; return __libc_realloc(p, n); }
+void free(void *p) { __libc_free(p); }
+#define ALLOCS() n_alloc
+#else
+#define ALLOCS() -1L
+#endif
+
+/* Stand-in for the agent: a UDP socket on a free loopback port */
+static int agent_udp(char *addr, size_t size)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0), rcvbuf = 1 << 22, rc;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    rc = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    rc |= getsockname(fd, (struct sockaddr *)&sa, &len);
+    assert(rc == 0);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    snprintf(addr, size, "127.0.0.1:%d", ntohs(sa.sin_port));
+    return fd;
+}
+
+/* Read every waiting datagram, each no longer than `mtu`, into `out`
+   as lines; return the number of datagrams */
+static int drain(int fd, size_t mtu, char *out, size_t size)
+{
+    char buf[65536];
+    size_t n = 0;
+    ssize_t r;
+    int packets = 0;
+
+    while ((r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        assert((size_t)r <= mtu && buf[r - 1] != '\n');
+        if (NULL != out && n + r + 1 < size) {
+            memcpy(out + n, buf, r);
+            n += r;
+            out[n++] = '\n';
+        }
+        packets++;
+    }
+    if (NULL != out) {
+        out[n] = '\0';
+    }
+    return packets;
+}
+
+static int count_lines(const char *text)
+{
+    int n = 0;
+
+    for (; *text; text++) {
+        n += '\n' == *text;
+    }
+    return n;
+}
+
+/* Value of the first gauge line starting with `series` */
+static double gauge(const char *text, const char *series)
+{
+    const char *p = strstr(text, series);
+    double x;
+    int got;
+
+    assert(NULL != p);
+    got = sscanf(p + strlen(series), "%lf|g", &x);
+    assert(got == 1);
+    return x;
+}
+
+/* Events counted by the bin lines of `series`, e.g. "a.b.duration:" */
+static long long bin_events(const char *text, const char *series)
+{
+    const char *p = text, *at;
+    long long n = 0;
+    double rate;
+    int got;
+
+    while (NULL != (p = strstr(p, series))) {
+        if (p == text || p[-1] == '\n') {
+            at = strchr(p, '\n');
+            p = strstr(p, "|@");
+            if (NULL != p && p < at) {
+                got = sscanf(p + 2, "%lf", &rate);
+                assert(got == 1);
+                n += llround(1 / rate);
+            }
+            else {
+                n++;
+            }
+            p = at;
+        }
+        else {
+            p++;
+        }
+    }
+    return n;
+}
+
+static void fill(nlcali_T c)
+{
+    int i, rc;
+
+    /* ten 100 ns bins of duration; log-linear values, some negative */
+    rc = nlcali_hist_kind_manual(c, NL_HIST_DUR, 10, 0, 1000);
+    rc |= nlcali_hist_kind_loglinear(c, NL_HIST_VALUE, 2, 1, 1e6);
+    assert(rc == 0);
+    for (i = 0; i < 100; i++) {
+        nlcali_add(c, 0, i * 20, (double)(i - 9));
+    }
+}
+
+static void check_lines(void)
+{
+    static char text[1 << 20];
+    nlcali_statsd_T s;
+    const struct nlcali_statsd_stats_t *st;
+    struct sockaddr_un sa;
+    nlcali_T c = nlcali_new(2);
+    char addr[128];
+    int fd, packets, rc;
+
+    fill(c);
+    fd = agent_udp(addr, sizeof(addr));
+    s = nlcali_statsd_new(addr, "t.", "ignored:1", 512, 0);
+    assert(NULL != s);
+    nlcali_statsd_add(s, "svc.db:q", c);
+    st = nlcali_statsd_stats(s);
+    assert(st->syscalls == 0);
+    rc = nlcali_statsd_flush(s);
+    assert(rc == 0);
+    packets = drain(fd, 512, text, sizeof(text));
+    assert(packets > 1 && st->packets == (unsigned)packets);
+    assert(st->syscalls == 1 && st->dropped == 0);
+    assert(st->lines == (unsigned)count_lines(text));
+    assert(NULL != strstr(text, "t.svc.db_q.count:100|c\n"));
+    assert(NULL != strstr(text, "t.svc.db_q.value.sum:4050|g\n"));
+    assert(NULL != strstr(text, "t.svc.db_q.value.min:0|g\n"
+                          "t.svc.db_q.value.min:-9|g\n"));
+    assert(fabs(gauge(text, "t.svc.db_q.duration.sum:") - 0.099) < 1e-12);
+    /* the first bin of durations, and the last with all above it */
+    assert(NULL != strstr(text, "t.svc.db_q.duration:0.00005|ms|@0.2\n"));
+    assert(NULL != strstr(text, "t.svc.db_q.duration:0.00095|ms|@0.01818181818181818\n"));
+    assert(bin_events(text, "t.svc.db_q.duration:") == 100);
+    /* values below 1 are in the first log-linear bin */
+    assert(bin_events(text, "t.svc.db_q.value:") == 100);
+    assert(NULL == strstr(text, "|#"));
+
+    /* one datagram and one system call per line */
+    nlcali_statsd_free(s);
+    s = nlcali_statsd_new(addr, "t.", NULL, 0, NL_STATSD_PER_LINE);
+    nlcali_statsd_add(s, "svc.db:q", c);
+    st = nlcali_statsd_stats(s);
+    assert(st->packets == st->lines && st->syscalls == st->lines);
+    packets = drain(fd, 512, NULL, 0);
+    assert(packets == (int)st->lines);
+    nlcali_statsd_free(s);
+    close(fd);
+
+    /* DogStatsD over a UNIX socket */
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "/tmp/statsd_bench.%d",
+             (int)getpid());
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    unlink(sa.sun_path);
+    rc = bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+    assert(rc == 0);
+    snprintf(addr, sizeof(addr), "unix:%s", sa.sun_path);
+    s = nlcali_statsd_new(addr, "", "env:test,svc:db", 0,
+                          NL_STATSD_DOGSTATSD);
+    assert(NULL != s);
+    nlcali_statsd_add(s, "svc.db:q", c);
+    nlcali_statsd_free(s);
+    packets = drain(fd, NL_STATSD_MTU_UNIX, text, sizeof(text));
+    assert(1 == packets);
+    assert(NULL != strstr(text, "\nsvc.db_q.value.min:-9|g|#env:test,svc:db\n"));
+    assert(NULL == strstr(text, "value.min:0|g"));
+    assert(NULL != strstr(text, "\nsvc.db_q.duration:0.00005|d|@0.2|#env:test,svc:db\n"));
+    close(fd);
+    unlink(sa.sun_path);
+
+    s = nlcali_statsd_new("unix:/nonexistent/x", "", NULL, 0, 0);
+    assert(NULL == s);
+    s = nlcali_statsd_new("127.0.0.1:8125", "", NULL, 100, 0);
+    assert(NULL == s);
+    nlcali_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "sendmmsg", "per_line" };
+    nlcali_statsd_T s;
+    const struct nlcali_statsd_stats_t *st;
+    nlcali_T *c;
+    char addr[128], name[64];
+    long calipers, i, allocs;
+    double t, t0;
+    int fd, mode, k;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &calipers) != 1 || calipers < 1) {
+        usage("bad value for <calipers>");
+        goto ERROR;
+    }
+    check_lines();
+
+    c = (nlcali_T *)malloc(calipers * sizeof(nlcali_T));
+    for (i = 0; i < calipers; i++) {
+        c[i] = nlcali_new(2);
+        fill(c[i]);
+    }
+    fd = agent_udp(addr, sizeof(addr));
+    printf("mode,calipers,lines_per_report,packets_per_report,"
+           "syscalls_per_report,metrics_per_sec,allocs_per_report\n");
+    for (mode = 0; mode < 2; mode++) {
+        s = nlcali_statsd_new(addr, "app.", NULL, 0,
+                              mode ? NL_STATSD_PER_LINE : 0);
+        assert(NULL != s);
+        st = nlcali_statsd_stats(s);
+        t = 0;
+        allocs = ALLOCS();
+        for (k = 0; k < REPORTS; k++) {
+            t0 = now_sec();
+            for (i = 0; i < calipers; i++) {
+                snprintf(name, sizeof(name), "svc.op%ld", i);
+                nlcali_statsd_add(s, name, c[i]);
+            }
+            nlcali_statsd_flush(s);
+            t += now_sec() - t0;
+            drain(fd, NL_STATSD_MTU_UDP, NULL, 0);
+        }
+        allocs = allocs < 0 ? -1 : ALLOCS() - allocs;
+        printf("%s,%ld,%.1lf,%.1lf,%.1lf,%.0lf,%.1lf\n", modes[mode],
+               calipers, (double)st->lines / REPORTS,
+               (double)st->packets / REPORTS,
+               (double)st->syscalls / REPORTS, st->lines / t,
+               allocs < 0 ? -1.0 : (double)allocs / REPORTS);
+        if (allocs >= 0) {
+            assert(allocs == 0);
+        }
+        nlcali_statsd_free(s);
+    }
+    close(fd);
+    for (i = 0; i < calipers; i++) {
+        nlcali_free(c[i]);
+    }
+    free(c);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,103 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file token_bench.c
+ * Time many overlapping operations on one caliper, as for requests
+ * in flight on an asynchronous I/O queue, with nlcali_start()/
+ * nlcali_stop() tokens, and show what nlcali_begin()/nlcali_end()
+ * record for the same pattern.
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <ops in flight> <total ops>\n", s, prog);
+}
+
+int main(int argc, char **argv)
+{
+    int depth, i, k;
+    long ops, op;
+    double t0, sec[2], dur[2];
+    nlcali_token_t *ring;
+    nlcali_T tok, be;
+
+    prog = argv[0];
+    if (argc != 3) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%d", &depth) != 1 || depth < 1) {
+        usage("bad value for <ops in flight>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%ld", &ops) != 1 || ops < depth) {
+        usage("bad value for <total ops>");
+        goto ERROR;
+    }
+    ring = (nlcali_token_t *)malloc(depth * sizeof(nlcali_token_t));
+    tok = nlcali_new(2);
+    be = nlcali_new(2);
+
+    /* submit `depth` ops, then complete the oldest as each new
+       one is submitted, then drain */
+    t0 = now_sec();
+    for (op = 0; op < ops; op++) {
+        i = op % depth;
+        if (op >= depth) {
+            nlcali_stop(tok, ring[i], 4096);
+        }
+        ring[i] = nlcali_start(tok);
+    }
+    assert(tok->inflight == depth && tok->inflight_max == depth);
+    for (k = 0; k < depth; k++) {
+        i = (op + k) % depth;
+        nlcali_stop(tok, ring[i], 4096);
+    }
+    sec[0] = now_sec() - t0;
+    assert(tok->inflight == 0 && tok->vacc.count == ops);
+    nlcali_calc(tok);
+    dur[0] = tok->dur_sum / tok->vsm.count;
+    nlcali_clear(tok);
+    assert(tok->inflight_max == 0);
+
+    /* the same pattern with the single begin/end slot */
+    t0 = now_sec();
+    for (op = 0; op < ops; op++) {
+        if (op >= depth) {
+            nlcali_end(be, 4096);
+        }
+        nlcali_begin(be);
+    }
+    for (k = 0; k < depth; k++) {
+        nlcali_end(be, 4096);
+    }
+    sec[1] = now_sec() - t0;
+
+    nlcali_calc(be);
+    dur[1] = be->vsm.count ? be->dur_sum / be->vsm.count : 0;
+
+    /* an op is in flight for about `depth` steps */
+    printf("mode,depth,ops,recorded,ns_per_step,mean_op_ns\n");
+    printf("start/stop,%d,%ld,%ld,%lf,%lf\n", depth, ops, ops,
+           sec[0] / ops * 1e9, dur[0] * 1e9);
+    printf("begin/end,%d,%ld,%lld,%lf,%lf\n", depth, ops, be->vsm.count,
+           sec[1] / ops * 1e9, dur[1] * 1e9);
+
+    nlcali_free(tok);
+    nlcali_free(be);
+    free(ring);
+    return 0;
+
+ ERROR:
+    return -1;
+}
@@ -0,0 +1,126 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file trace_bench.c
+ * Measure the cost of keeping a raw event trace (nlcali_trace()),
+ * dump the trace to a file, and check that the file holds the most
+ * recent events. Read the file back with trace_replay.
+ */
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events> <trace capacity> <trace file>\n", s, prog);
+}
+
+/* Read the file back and compare it with the last events recorded */
+static void check_file(const char *path, long events, unsigned cap)
+{
+    struct nlcali_trace_file_t hdr;
+    struct nlcali_trace_rec_t rec;
+    uint64_t i;
+    long k;
+    ssize_t r;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    r = read(fd, &hdr, sizeof(hdr));
+    assert(r == (ssize_t)sizeof(hdr));
+    assert(memcmp(hdr.magic, NL_TRACE_MAGIC, sizeof(hdr.magic)) == 0);
+    assert(hdr.count == (uint64_t)(events < cap ? events : cap));
+    assert(hdr.first == (uint64_t)events - hdr.count);
+    for (i = 0; i < hdr.count; i++) {
+        r = read(fd, &rec, sizeof(rec));
+        assert(r == (ssize_t)sizeof(rec));
+        k = hdr.first + i;
+        assert(rec.begin == (uint64_t)k * 100);
+        assert(rec.dur == (uint64_t)(50 + (k & 31)));
+        assert(rec.value == 1.0 + (k & 7));
+    }
+    r = read(fd, &rec, sizeof(rec));
+    assert(r == 0);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "off", "trace" };
+    long events, k;
+    unsigned cap;
+    int mode, fd, rc;
+    long long n = 0;
+    double t0, sec, dump_sec = 1;
+    nlcali_T c;
+
+    prog = argv[0];
+    if (argc != 4) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+    if (sscanf(argv[2], "%u", &cap) != 1 || cap < 1 || (cap & (cap - 1))) {
+        usage("bad value for <trace capacity>, must be a power of 2");
+        goto ERROR;
+    }
+
+    printf("mode,events,ns_per_event,ns_per_begin_end\n");
+    for (mode = 0; mode < 2; mode++) {
+        c = nlcali_new(2);
+        if (mode == 1) {
+            rc = nlcali_trace(c, cap);
+            assert(rc == 0);
+        }
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nlcali_add(c, (nl_ticks_t)k * 100,
+                       (nl_ticks_t)k * 100 + 50 + (k & 31), 1.0 + (k & 7));
+        }
+        sec = now_sec() - t0;
+        assert(c->vacc.count == events);
+        if (mode == 1) {
+            fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                perror(argv[3]);
+                goto ERROR;
+            }
+            t0 = now_sec();
+            n = nlcali_trace_dump(c, fd);
+            dump_sec = now_sec() - t0;
+            close(fd);
+            assert(n == (events < cap ? events : cap));
+            check_file(argv[3], events, cap);
+        }
+        /* the same, timed with the clock */
+        nlcali_clear(c);
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nlcali_begin(c);
+            nlcali_end(c, 1.0);
+        }
+        printf("%s,%ld,%lf,%lf\n", modes[mode], events, sec / events * 1e9,
+               (now_sec() - t0) / events * 1e9);
+        nlcali_free(c);
+    }
+    printf("dumped_events,dump_MB_per_sec\n%lld,%lf\n", n,
+           n * sizeof(struct nlcali_trace_rec_t) / dump_sec / 1e6);
+    return 0;
+
+ ERROR:
+    return -1;
+}
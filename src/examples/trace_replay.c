@@ -0,0 +1,108 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file trace_replay.c
+ * Feed a trace file written by nlcali_trace_dump() back through a
+ * caliper, as if each event had been timed with nlcali_begin() and
+ * nlcali_end(), and print the log messages it would have produced.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nl_calipers.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <trace file> <event name> [seconds per message]\n",
+            s, prog);
+}
+
+int main(int argc, char **argv)
+{
+    const struct nlcali_trace_file_t *hdr;
+    const struct nlcali_trace_rec_t *rec;
+    struct nlcali_logbuf_t lb = { NULL, 0 };
+    struct stat st;
+    double interval = 0;
+    nl_ticks_t span = 0, start;
+    uint64_t i;
+    nlcali_T c;
+    void *p;
+    int fd;
+
+    prog = argv[0];
+    if (argc < 3 || argc > 4) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (argc > 3 && (sscanf(argv[3], "%lf", &interval) != 1 ||
+                     interval <= 0)) {
+        usage("bad value for [seconds per message]");
+        goto ERROR;
+    }
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || 0 != fstat(fd, &st)) {
+        perror(argv[1]);
+        goto ERROR;
+    }
+    if ((size_t)st.st_size < sizeof(struct nlcali_trace_file_t)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        goto ERROR;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p) {
+        perror("mmap");
+        goto ERROR;
+    }
+    hdr = (const struct nlcali_trace_file_t *)p;
+    if (0 != memcmp(hdr->magic, NL_TRACE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != NL_TRACE_VERSION ||
+        hdr->rec_size != sizeof(struct nlcali_trace_rec_t) ||
+        sizeof(*hdr) + hdr->count * hdr->rec_size > (size_t)st.st_size) {
+        fprintf(stderr, "%s: not a trace file, or another version\n",
+                argv[1]);
+        goto ERROR;
+    }
+    rec = (const struct nlcali_trace_rec_t *)(hdr + 1);
+
+    /* the ticks are only meaningful with the recording clock's rate */
+    c = nlcali_new(hdr->baseline);
+    c->clock = (netlogger_clock_t)hdr->clock;
+    c->tick_ns = hdr->tick_ns;
+    if (interval > 0) {
+        span = (nl_ticks_t)(interval * 1e9 / hdr->tick_ns);
+    }
+    start = hdr->count > 0 ? rec[0].begin : 0;
+    for (i = 0; i < hdr->count; i++) {
+        if (span > 0 && rec[i].begin - start >= span && c->vacc.count > 0) {
+            printf("%s\n", nlcali_log_buf(c, argv[2], &lb));
+            nlcali_clear(c);
+            start += (rec[i].begin - start) / span * span;
+        }
+        nlcali_add(c, rec[i].begin, rec[i].begin + rec[i].dur,
+                   rec[i].value);
+    }
+    if (c->vacc.count > 0) {
+        printf("%s\n", nlcali_log_buf(c, argv[2], &lb));
+    }
+    fprintf(stderr, "%s: replayed %llu events, %llu to %llu\n", prog,
+            (unsigned long long)hdr->count, (unsigned long long)hdr->first,
+            (unsigned long long)(hdr->first + hdr->count));
+    nlcali_logbuf_free(&lb);
+    nlcali_free(c);
+    munmap(p, st.st_size);
+    return 0;
+
+ ERROR:
+    return -1;
+}
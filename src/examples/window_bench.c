@@ -0,0 +1,122 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/**
+ * \file window_bench.c
+ * Check the sliding window and moving averages of nlcali_window()
+ * against known events, and measure what they add to each event.
+ */
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "nl_calipers.h"
+#include "bench_util.h"
+
+static const volatile char rcsid[] = "$Id$";
+
+#define SEC 1000000000ULL
+
+char *prog = NULL;
+
+void usage(const char *s) {
+    fprintf(stderr,"%s\n"
+            "usage: %s <events>\n", s, prog);
+}
+
+/* One event per second of age, oldest first, with a value equal to
+   its age in whole seconds; only the last 10s are in the window */
+static void check_window(void)
+{
+    nlcali_T c = nlcali_new(2), w;
+    nl_ticks_t now;
+    int j, rc;
+
+    nlcali_hist_loglinear(c, 2, 1e-6, 1e3);
+    rc = nlcali_window(c, 10, 10, 0);
+    assert(rc == 0);
+    now = nl_clock_ticks(c->clock);
+    for (j = 19; j >= 0; j--) {
+        nl_ticks_t e = now - j * SEC - SEC / 2;
+        nlcali_add(c, e - 1000, e, j + 1);
+    }
+    nlcali_clear(c);
+    w = nlcali_window_calc(c);
+    assert(w != NULL);
+    /* 9 or 10 of them, depending on where the sub-intervals fall */
+    assert(w->vsm.count == 9 || w->vsm.count == 10);
+    assert(w->vsm.min == 1 && w->vsm.max == w->vsm.count);
+    assert(nlcali_hist_quantile(w, NL_HIST_RATE, 0.99) > 0);
+    assert(c->vacc.count == 0);
+    nlcali_free(c);
+}
+
+/* Two events one half-life apart: the first has half the weight */
+static void check_ewma(void)
+{
+    nlcali_T c = nlcali_new(2);
+    double mean, sd;
+    int rc;
+
+    rc = nlcali_window(c, 0, 0, 1.0);
+    assert(rc == 0);
+    assert(nlcali_window_calc(c) == NULL);
+    rc = nlcali_ewma(c, NL_VALUE, &mean, &sd);
+    assert(rc == -1);
+    nlcali_add(c, 5 * SEC - 100, 5 * SEC, 0.0);
+    nlcali_add(c, 6 * SEC - 100, 6 * SEC, 3.0);
+    rc = nlcali_ewma(c, NL_VALUE, &mean, &sd);
+    assert(rc == 0);
+    assert(fabs(mean - 2.0) < 1e-9);
+    assert(fabs(sd - sqrt(2.0)) < 1e-9);
+    /* the first event had no rate */
+    rc = nlcali_ewma(c, NL_RATE, &mean, NULL);
+    assert(rc == 0);
+    assert(fabs(mean - 0.03) < 1e-9);
+    nlcali_free(c);
+}
+
+int main(int argc, char **argv)
+{
+    const char *modes[] = { "off", "window", "window+ewma" };
+    int mode;
+    long events, k;
+    double t0, sec;
+    nlcali_T c;
+
+    prog = argv[0];
+    if (argc != 2) {
+        usage("wrong num. of args");
+        goto ERROR;
+    }
+    if (sscanf(argv[1], "%ld", &events) != 1 || events < 1) {
+        usage("bad value for <events>");
+        goto ERROR;
+    }
+    check_window();
+    check_ewma();
+
+    /* an event every 100ns, so a 1ms window of 10 sub-intervals
+       moves on every 1000 events */
+    printf("mode,events,ns_per_event\n");
+    for (mode = 0; mode < 3; mode++) {
+        c = nlcali_new(2);
+        nlcali_hist_loglinear(c, 2, 1e-3, 1e3);
+        if (mode > 0) {
+            nlcali_window(c, 1e-3, 10, mode == 2 ? 1e-3 : 0);
+        }
+        t0 = now_sec();
+        for (k = 0; k < events; k++) {
+            nl_ticks_t e = 100 * (nl_ticks_t)k + 100;
+            nlcali_add(c, e - 50 - (k & 31), e, 1.0 + (k & 7));
+        }
+        sec = now_sec() - t0;
+        assert(c->vacc.count == events);
+        printf("%s,%ld,%lf\n", modes[mode], events, sec / events * 1e9);
+        nlcali_free(c);
+    }
+    return 0;
+
+ ERROR:
+    return -1;
+}
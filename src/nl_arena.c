@@ -0,0 +1,219 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_arena.c
+ * Pooled allocation of many calipers.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <stdlib.h>
+
+/* Interface */
+#include "nl_arena.h"
+
+#define T nlcali_T
+
+/*
+ * A slot is the caliper, then its histogram bins, then this trailer,
+ * padded to whole cache lines.
+ */
+struct nl_slot_t {
+    struct nl_slot_t *next; /* next free slot */
+    int used;
+};
+
+struct nl_slab_t {
+    struct nl_slab_t *next;
+    char *base; /* `capacity` slots */
+};
+
+struct nlcali_arena_t {
+    unsigned capacity;       /* slots per slab */
+    unsigned hist_bins;      /* bins per histogram, per slot */
+    size_t bins;             /* offset of histogram bins in slot */
+    size_t trailer;          /* offset of trailer in slot */
+    size_t slot_size;        /* bytes per slot */
+    struct nl_slab_t *slabs;
+    struct nl_slot_t *free;  /* free list */
+    unsigned used;           /* slots in use */
+};
+
+typedef struct nlcali_arena_t *A;
+
+#define SLOT_CALI(S) ((T)((char *)(S) - self->trailer))
+#define CALI_SLOT(C) ((struct nl_slot_t *)((char *)(C) + self->trailer))
+
+/* Put every slot of a slab on the free list, lowest address first */
+static void slab_free_all(A self, struct nl_slab_t *slab)
+{
+    struct nl_slot_t *slot;
+    unsigned i;
+
+    for (i = self->capacity; i > 0; i--) {
+        slot = (struct nl_slot_t *)(slab->base + (i - 1) * self->slot_size +
+                                    self->trailer);
+        slot->used = 0;
+        slot->next = self->free;
+        self->free = slot;
+    }
+}
+
+static int slab_add(A self)
+{
+    struct nl_slab_t *slab;
+    void *p;
+
+    slab = (struct nl_slab_t *)malloc(sizeof(struct nl_slab_t));
+    if (NULL == slab) {
+        return -1;
+    }
+    if (0 != posix_memalign(&p, NL_CACHE_LINE,
+                            self->capacity * self->slot_size)) {
+        free(slab);
+        return -1;
+    }
+    slab->base = (char *)p;
+    slab->next = self->slabs;
+    self->slabs = slab;
+    slab_free_all(self, slab);
+    return 0;
+}
+
+/* Take a slot off the free list, adding a slab if it is empty */
+static T slot_take(A self)
+{
+    struct nl_slot_t *slot;
+
+    if (NULL == self->free && 0 != slab_add(self)) {
+        return NULL;
+    }
+    slot = self->free;
+    self->free = slot->next;
+    slot->used = 1;
+    self->used++;
+    return SLOT_CALI(slot);
+}
+
+/* Point an initialized caliper at its slot's histogram bins */
+static void slot_setup(A self, T cali)
+{
+    nlcali_hist_storage(cali, self->hist_bins > 0 ?
+                        (unsigned *)((char *)cali + self->bins) : NULL,
+                        self->hist_bins);
+}
+
+/* ---------------------------------------------------------------
+ * Arena methods
+ */
+
+nlcali_arena_T nlcali_arena_new(unsigned capacity, unsigned hist_bins)
+{
+    A self;
+    size_t hist;
+
+    if (0 == capacity) {
+        return NULL;
+    }
+    self = (A)calloc(1, sizeof(struct nlcali_arena_t));
+    if (NULL == self) {
+        return NULL;
+    }
+    self->capacity = capacity;
+    self->hist_bins = hist_bins;
+    /* bins start on the line after the caliper */
+    hist = 2 * sizeof(unsigned) * hist_bins;
+    self->bins = (sizeof(struct nlcali_t) + NL_CACHE_LINE - 1) /
+        NL_CACHE_LINE * NL_CACHE_LINE;
+    self->trailer = self->bins + hist;
+    self->slot_size = (self->trailer + sizeof(struct nl_slot_t) +
+                       NL_CACHE_LINE - 1) / NL_CACHE_LINE * NL_CACHE_LINE;
+    if (0 != slab_add(self)) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+T nlcali_arena_alloc(nlcali_arena_T self, unsigned baseline)
+{
+    T cali = slot_take(self);
+
+    if (NULL != cali) {
+        nlcali_init(cali, baseline);
+        slot_setup(self, cali);
+    }
+    return cali;
+}
+
+T nlcali_arena_alloc_like(nlcali_arena_T self, T proto)
+{
+    T cali = slot_take(self);
+
+    if (NULL != cali) {
+        nlcali_init(cali, proto->vacc.var.min_items);
+        slot_setup(self, cali);
+        nlcali_configure_like(cali, proto);
+    }
+    return cali;
+}
+
+void nlcali_arena_release(nlcali_arena_T self, T cali)
+{
+    struct nl_slot_t *slot;
+
+    if (NULL == cali) {
+        return;
+    }
+    slot = CALI_SLOT(cali);
+    nlcali_fini(cali);
+    slot->used = 0;
+    slot->next = self->free;
+    self->free = slot;
+    self->used--;
+}
+
+void nlcali_arena_reset(nlcali_arena_T self)
+{
+    struct nl_slab_t *slab;
+    struct nl_slot_t *slot;
+    unsigned i;
+
+    self->free = NULL;
+    for (slab = self->slabs; slab; slab = slab->next) {
+        for (i = 0; i < self->capacity; i++) {
+            slot = (struct nl_slot_t *)(slab->base + i * self->slot_size +
+                                        self->trailer);
+            if (slot->used) {
+                nlcali_fini(SLOT_CALI(slot));
+            }
+        }
+        slab_free_all(self, slab);
+    }
+    self->used = 0;
+}
+
+unsigned nlcali_arena_used(nlcali_arena_T self)
+{
+    return self->used;
+}
+
+void nlcali_arena_free(nlcali_arena_T self)
+{
+    struct nl_slab_t *slab, *next;
+
+    if (NULL == self) {
+        return;
+    }
+    nlcali_arena_reset(self);
+    for (slab = self->slabs; slab; slab = next) {
+        next = slab->next;
+        free(slab->base);
+        free(slab);
+    }
+    free(self);
+}
+
+#undef T
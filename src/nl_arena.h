@@ -0,0 +1,94 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_arena.h
+ * Pooled allocation of many calipers.
+ *
+ * An arena carves calipers out of large slabs. Each slot holds a
+ * caliper followed by room for its histograms, so creating a caliper,
+ * configuring its histograms (up to the arena's bin count) and
+ * releasing it again never calls malloc() or free(). Released slots
+ * go on a free list and are reused first. Quantile sketches, if
+ * turned on, are still allocated on the heap.
+ *
+ * An arena is not thread-safe: use one per thread, or lock around it.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_ARENA_INCLUDED
+#    define NETLOGGER_ARENA_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+struct nlcali_arena_t;
+typedef struct nlcali_arena_t *nlcali_arena_T;
+
+/**
+ * Create an arena.
+ *
+ * \param capacity Calipers per slab. The arena allocates one slab
+ *        now, and another each time all slots are in use.
+ * \param hist_bins Bins per histogram to reserve in every slot;
+ *        0 for none, in which case histograms are allocated
+ * \return New arena, or NULL on error
+ */
+nlcali_arena_T nlcali_arena_new(unsigned capacity, unsigned hist_bins);
+
+/**
+ * Take a caliper from the arena, initialized as with nlcali_init().
+ *
+ * \param self Arena
+ * \param baseline Minimum number of values to get a standard deviation.
+ * \return Caliper, or NULL if a new slab could not be allocated
+ */
+T nlcali_arena_alloc(nlcali_arena_T self, unsigned baseline);
+
+/**
+ * Take a caliper from the arena, initialized as with
+ * nlcali_init_like().
+ *
+ * \param self Arena
+ * \param proto Caliper to copy configuration from
+ * \return Caliper, or NULL if a new slab could not be allocated
+ */
+T nlcali_arena_alloc_like(nlcali_arena_T self, T proto);
+
+/**
+ * Return a caliper to the arena. Do not use nlcali_free() on it.
+ *
+ * \param self Arena that `cali` came from
+ * \param cali Caliper
+ */
+void nlcali_arena_release(nlcali_arena_T self, T cali);
+
+/**
+ * Return every caliper to the arena at once, keeping the slabs.
+ *
+ * \param self Arena
+ */
+void nlcali_arena_reset(nlcali_arena_T self);
+
+/**
+ * Number of calipers in use.
+ *
+ * \param self Arena
+ */
+unsigned nlcali_arena_used(nlcali_arena_T self);
+
+/**
+ * Free the arena, its slabs and all of its calipers.
+ *
+ * \param self Arena
+ */
+void nlcali_arena_free(nlcali_arena_T self);
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_ARENA_INCLUDED */
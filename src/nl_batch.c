@@ -0,0 +1,521 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_batch.c
+ * Batch ingestion of pre-timed events, with SIMD kernels.
+ *
+ * Events are processed in blocks. A kernel computes the count, sum,
+ * min, max and sum of squared deviations (in a second pass) of the
+ * value, rate and gap of the block, and leaves the rates and gaps in
+ * scratch arrays, NaN where an event has none. The block is then
+ * merged into the caliper's summaries like any other partial result.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+/* Interface */
+#include "nl_calipers.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define NL_HAVE_X86_SIMD 1
+#    include <immintrin.h>
+#    define NL_TARGET(X) __attribute__((target(X)))
+#endif
+
+#ifndef MIN
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#endif
+
+/* Events per block; scratch arrays are on the stack */
+#define BLOCK 1024
+
+/* Results for one metric over a block */
+struct nl_moments_t {
+    double n, sum, min, max, m2;
+};
+
+/* Index of each metric in the results */
+enum { MV=0, MR=1, MG=2 };
+
+typedef void (*nl_kernel_t)(const double *v, const double *d, size_t n,
+                            double tick_ns, double *rate, double *gap,
+                            struct nl_moments_t *m, double *dsum);
+
+typedef void (*nl_bins_t)(nlcali_T self, const double *rate,
+                          const double *gap, size_t n,
+                          unsigned *rb, unsigned *gb);
+
+/* ---------------------------------------------------------------
+ * Scalar kernels, also used for the tails of the SIMD ones
+ */
+
+static void moments_init(struct nl_moments_t *m)
+{
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        m[k].n = m[k].sum = m[k].m2 = 0;
+        m[k].min = DBL_MAX;
+        m[k].max = -DBL_MAX;
+    }
+}
+
+/* Fold per-lane accumulators into `m` */
+static void moments_lanes(struct nl_moments_t *m, const double *n,
+                          const double *sum, const double *min,
+                          const double *max, int lanes)
+{
+    int j;
+
+    for (j = 0; j < lanes; j++) {
+        m->n += n[j];
+        m->sum += sum[j];
+        if (min[j] < m->min) m->min = min[j];
+        if (max[j] > m->max) m->max = max[j];
+    }
+}
+
+static void block_means(const struct nl_moments_t *m, double *mean)
+{
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        mean[k] = m[k].n > 0 ? m[k].sum / m[k].n : 0;
+    }
+}
+
+#define PASS1(M, X) do {                                \
+        (M).n++;                                        \
+        (M).sum += (X);                                 \
+        if ((X) < (M).min) (M).min = (X);               \
+        if ((X) > (M).max) (M).max = (X);               \
+} while(0)
+
+static void pass1_scalar(const double *v, const double *d, size_t i0,
+                         size_t n, double tick_ns, double *rate, double *gap,
+                         struct nl_moments_t *m, double *dsum)
+{
+    double dur;
+    size_t i;
+
+    for (i = i0; i < n; i++) {
+        *dsum += d[i];
+        dur = d[i] * tick_ns;
+        PASS1(m[MV], v[i]);
+        /* same test and arithmetic as nlcali_add() */
+        if (v[i] != 0 && dur > 0) {
+            rate[i] = v[i] / dur;
+            gap[i] = dur / v[i];
+            PASS1(m[MR], rate[i]);
+            PASS1(m[MG], gap[i]);
+        }
+        else {
+            rate[i] = gap[i] = NAN;
+        }
+    }
+}
+
+static void pass2_scalar(const double *v, const double *rate,
+                         const double *gap, size_t i0, size_t n,
+                         struct nl_moments_t *m, const double *mean)
+{
+    double x;
+    size_t i;
+
+    for (i = i0; i < n; i++) {
+        x = v[i] - mean[MV];
+        m[MV].m2 += x * x;
+        if (rate[i] == rate[i]) {
+            x = rate[i] - mean[MR];
+            m[MR].m2 += x * x;
+            x = gap[i] - mean[MG];
+            m[MG].m2 += x * x;
+        }
+    }
+}
+
+static void kernel_scalar(const double *v, const double *d, size_t n,
+                          double tick_ns, double *rate, double *gap,
+                          struct nl_moments_t *m, double *dsum)
+{
+    double mean[3];
+
+    moments_init(m);
+    *dsum = 0;
+    pass1_scalar(v, d, 0, n, tick_ns, rate, gap, m, dsum);
+    block_means(m, mean);
+    pass2_scalar(v, rate, gap, 0, n, m, mean);
+}
+
+static void bins_scalar(nlcali_T self, const double *rate, const double *gap,
+                        size_t n, unsigned *rb, unsigned *gb)
+{
+    size_t i;
+
+    if (self->h_state == NL_HIST_LOGLINEAR) {
+        for (i = 0; i < n; i++) {
+            NL_HBIN_LL(self, self->h_rbase, rate[i], rb[i]);
+            NL_HBIN_LL(self, self->h_gbase, gap[i], gb[i]);
+        }
+    }
+    else {
+        for (i = 0; i < n; i++) {
+            NL_HBIN_R(self, rate[i], rb[i]);
+            NL_HBIN_G(self, gap[i], gb[i]);
+        }
+    }
+}
+
+#ifdef NL_HAVE_X86_SIMD
+
+/* ---------------------------------------------------------------
+ * AVX2 kernels
+ */
+
+/* Accumulate count, sum, min, max of X where mask OK is set.
+   min/max return their second operand for NaN lanes of X. */
+#define ACC256(A, X, OK) do {                                       \
+        (A)[0] = _mm256_add_pd((A)[0], _mm256_and_pd((OK), one));   \
+        (A)[1] = _mm256_add_pd((A)[1], _mm256_and_pd((OK), (X)));   \
+        (A)[2] = _mm256_min_pd((X), (A)[2]);                        \
+        (A)[3] = _mm256_max_pd((X), (A)[3]);                        \
+} while(0)
+
+NL_TARGET("avx2")
+static double hsum256(__m256d x)
+{
+    __m128d lo = _mm256_castpd256_pd128(x), hi = _mm256_extractf128_pd(x, 1);
+
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+NL_TARGET("avx2")
+static void kernel_avx2(const double *v, const double *d, size_t n,
+                        double tick_ns, double *rate, double *gap,
+                        struct nl_moments_t *m, double *dsum)
+{
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1),
+        ns = _mm256_set1_pd(tick_ns), nan = _mm256_set1_pd(NAN),
+        all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    __m256d acc[3][4], ds = zero, x, dur, r, g, ok, mv, mr, mg, sv, sr, sg;
+    double lanes[4][4], mean[3];
+    size_t i, end = n & ~(size_t)3;
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        acc[k][0] = acc[k][1] = zero;
+        acc[k][2] = _mm256_set1_pd(DBL_MAX);
+        acc[k][3] = _mm256_set1_pd(-DBL_MAX);
+    }
+    for (i = 0; i < end; i += 4) {
+        x = _mm256_loadu_pd(v + i);
+        dur = _mm256_loadu_pd(d + i);
+        ds = _mm256_add_pd(ds, dur);
+        dur = _mm256_mul_pd(dur, ns);
+        ok = _mm256_and_pd(_mm256_cmp_pd(x, zero, _CMP_NEQ_UQ),
+                           _mm256_cmp_pd(dur, zero, _CMP_GT_OQ));
+        r = _mm256_blendv_pd(nan, _mm256_div_pd(x, dur), ok);
+        g = _mm256_blendv_pd(nan, _mm256_div_pd(dur, x), ok);
+        _mm256_storeu_pd(rate + i, r);
+        _mm256_storeu_pd(gap + i, g);
+        ACC256(acc[MV], x, all);
+        ACC256(acc[MR], r, ok);
+        ACC256(acc[MG], g, ok);
+    }
+    moments_init(m);
+    for (k = 0; k < 3; k++) {
+        _mm256_storeu_pd(lanes[0], acc[k][0]);
+        _mm256_storeu_pd(lanes[1], acc[k][1]);
+        _mm256_storeu_pd(lanes[2], acc[k][2]);
+        _mm256_storeu_pd(lanes[3], acc[k][3]);
+        moments_lanes(&m[k], lanes[0], lanes[1], lanes[2], lanes[3], 4);
+    }
+    *dsum = hsum256(ds);
+    pass1_scalar(v, d, end, n, tick_ns, rate, gap, m, dsum);
+
+    block_means(m, mean);
+    mv = _mm256_set1_pd(mean[MV]);
+    mr = _mm256_set1_pd(mean[MR]);
+    mg = _mm256_set1_pd(mean[MG]);
+    sv = sr = sg = zero;
+    for (i = 0; i < end; i += 4) {
+        x = _mm256_sub_pd(_mm256_loadu_pd(v + i), mv);
+        sv = _mm256_add_pd(sv, _mm256_mul_pd(x, x));
+        r = _mm256_loadu_pd(rate + i);
+        ok = _mm256_cmp_pd(r, r, _CMP_ORD_Q);
+        x = _mm256_and_pd(ok, _mm256_sub_pd(r, mr));
+        sr = _mm256_add_pd(sr, _mm256_mul_pd(x, x));
+        x = _mm256_and_pd(ok, _mm256_sub_pd(_mm256_loadu_pd(gap + i), mg));
+        sg = _mm256_add_pd(sg, _mm256_mul_pd(x, x));
+    }
+    m[MV].m2 = hsum256(sv);
+    m[MR].m2 = hsum256(sr);
+    m[MG].m2 = hsum256(sg);
+    pass2_scalar(v, rate, gap, end, n, m, mean);
+}
+
+/* Log-linear bins of 4 values at P, as in NL_HBIN_LL() */
+#define LLBIN256(P, B, R) do {                                          \
+        __m256i u_ = _mm256_castpd_si256(_mm256_loadu_pd(P)), j_;       \
+        j_ = _mm256_sub_epi64(_mm256_srl_epi64(u_, shift), (B));        \
+        j_ = _mm256_blendv_epi8(j_, zero,                               \
+                 _mm256_or_si256(_mm256_cmpgt_epi64(zero, u_),          \
+                                 _mm256_cmpgt_epi64(zero, j_)));        \
+        j_ = _mm256_blendv_epi8(j_, top, _mm256_cmpgt_epi64(j_, top));  \
+        _mm_storeu_si128((__m128i *)(R), _mm256_castsi256_si128(        \
+                             _mm256_permutevar8x32_epi32(j_, low)));    \
+} while(0)
+
+/* Linear bins of 4 values at P, as in NL_HBIN_R() */
+#define LINBIN256(P, MIN, W, R) do {                                    \
+        __m256d x_ = _mm256_div_pd(                                     \
+            _mm256_sub_pd(_mm256_loadu_pd(P), (MIN)), (W));             \
+        x_ = _mm256_min_pd(_mm256_max_pd(x_, zero), top);               \
+        _mm_storeu_si128((__m128i *)(R), _mm256_cvttpd_epi32(x_));      \
+} while(0)
+
+NL_TARGET("avx2")
+static void bins_avx2(nlcali_T self, const double *rate, const double *gap,
+                      size_t n, unsigned *rb, unsigned *gb)
+{
+    size_t i, end = n & ~(size_t)3;
+
+    if (self->h_state == NL_HIST_LOGLINEAR) {
+        const __m128i shift = _mm_cvtsi32_si128(52 - self->h_sub_bits);
+        const __m256i zero = _mm256_setzero_si256(),
+            top = _mm256_set1_epi64x(self->h_num - 1),
+            rbase = _mm256_set1_epi64x(self->h_rbase),
+            gbase = _mm256_set1_epi64x(self->h_gbase),
+            low = _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0);
+        for (i = 0; i < end; i += 4) {
+            LLBIN256(rate + i, rbase, rb + i);
+            LLBIN256(gap + i, gbase, gb + i);
+        }
+    }
+    else {
+        const __m256d zero = _mm256_setzero_pd(),
+            top = _mm256_set1_pd(self->h_num - 1),
+            rmin = _mm256_set1_pd(self->h_rmin),
+            rwidth = _mm256_set1_pd(self->h_rwidth),
+            gmin = _mm256_set1_pd(self->h_gmin),
+            gwidth = _mm256_set1_pd(self->h_gwidth);
+        for (i = 0; i < end; i += 4) {
+            LINBIN256(rate + i, rmin, rwidth, rb + i);
+            LINBIN256(gap + i, gmin, gwidth, gb + i);
+        }
+    }
+    bins_scalar(self, rate + end, gap + end, n - end, rb + end, gb + end);
+}
+
+/* ---------------------------------------------------------------
+ * AVX-512 kernel. Bins use the AVX2 kernel: with no gather/scatter
+ * for the counts, wider bin calculation gains little.
+ */
+
+#define ACC512(A, X, OK) do {                                   \
+        (A)[0] = _mm512_mask_add_pd((A)[0], (OK), (A)[0], one); \
+        (A)[1] = _mm512_mask_add_pd((A)[1], (OK), (A)[1], (X)); \
+        (A)[2] = _mm512_mask_min_pd((A)[2], (OK), (A)[2], (X)); \
+        (A)[3] = _mm512_mask_max_pd((A)[3], (OK), (A)[3], (X)); \
+} while(0)
+
+NL_TARGET("avx512f")
+static void kernel_avx512(const double *v, const double *d, size_t n,
+                          double tick_ns, double *rate, double *gap,
+                          struct nl_moments_t *m, double *dsum)
+{
+    const __m512d zero = _mm512_setzero_pd(), one = _mm512_set1_pd(1),
+        ns = _mm512_set1_pd(tick_ns), nan = _mm512_set1_pd(NAN);
+    __m512d acc[3][4], ds = zero, x, dur, r, g, mv, mr, mg, sv, sr, sg;
+    __mmask8 ok;
+    double lanes[4][8], mean[3];
+    size_t i, end = n & ~(size_t)7;
+    int k;
+
+    for (k = 0; k < 3; k++) {
+        acc[k][0] = acc[k][1] = zero;
+        acc[k][2] = _mm512_set1_pd(DBL_MAX);
+        acc[k][3] = _mm512_set1_pd(-DBL_MAX);
+    }
+    for (i = 0; i < end; i += 8) {
+        x = _mm512_loadu_pd(v + i);
+        dur = _mm512_loadu_pd(d + i);
+        ds = _mm512_add_pd(ds, dur);
+        dur = _mm512_mul_pd(dur, ns);
+        ok = _mm512_cmp_pd_mask(x, zero, _CMP_NEQ_UQ) &
+            _mm512_cmp_pd_mask(dur, zero, _CMP_GT_OQ);
+        r = _mm512_mask_div_pd(nan, ok, x, dur);
+        g = _mm512_mask_div_pd(nan, ok, dur, x);
+        _mm512_storeu_pd(rate + i, r);
+        _mm512_storeu_pd(gap + i, g);
+        ACC512(acc[MV], x, 0xff);
+        ACC512(acc[MR], r, ok);
+        ACC512(acc[MG], g, ok);
+    }
+    moments_init(m);
+    for (k = 0; k < 3; k++) {
+        _mm512_storeu_pd(lanes[0], acc[k][0]);
+        _mm512_storeu_pd(lanes[1], acc[k][1]);
+        _mm512_storeu_pd(lanes[2], acc[k][2]);
+        _mm512_storeu_pd(lanes[3], acc[k][3]);
+        moments_lanes(&m[k], lanes[0], lanes[1], lanes[2], lanes[3], 8);
+    }
+    *dsum = _mm512_reduce_add_pd(ds);
+    pass1_scalar(v, d, end, n, tick_ns, rate, gap, m, dsum);
+
+    block_means(m, mean);
+    mv = _mm512_set1_pd(mean[MV]);
+    mr = _mm512_set1_pd(mean[MR]);
+    mg = _mm512_set1_pd(mean[MG]);
+    sv = sr = sg = zero;
+    for (i = 0; i < end; i += 8) {
+        x = _mm512_sub_pd(_mm512_loadu_pd(v + i), mv);
+        sv = _mm512_add_pd(sv, _mm512_mul_pd(x, x));
+        r = _mm512_loadu_pd(rate + i);
+        ok = _mm512_cmp_pd_mask(r, r, _CMP_ORD_Q);
+        x = _mm512_maskz_sub_pd(ok, r, mr);
+        sr = _mm512_add_pd(sr, _mm512_mul_pd(x, x));
+        x = _mm512_maskz_sub_pd(ok, _mm512_loadu_pd(gap + i), mg);
+        sg = _mm512_add_pd(sg, _mm512_mul_pd(x, x));
+    }
+    m[MV].m2 = _mm512_reduce_add_pd(sv);
+    m[MR].m2 = _mm512_reduce_add_pd(sr);
+    m[MG].m2 = _mm512_reduce_add_pd(sg);
+    pass2_scalar(v, rate, gap, end, n, m, mean);
+}
+
+#endif /* NL_HAVE_X86_SIMD */
+
+/* ---------------------------------------------------------------
+ * Dispatch
+ */
+
+static nl_kernel_t nl_kernel = NULL;
+static nl_bins_t nl_bins = NULL;
+
+int nlcali_batch_simd(netlogger_simd_t simd)
+{
+#ifdef NL_HAVE_X86_SIMD
+    int avx2, avx512;
+
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+    avx512 = __builtin_cpu_supports("avx512f");
+    if (NL_SIMD_AUTO == simd) {
+        simd = avx512 ? NL_SIMD_AVX512 : avx2 ? NL_SIMD_AVX2 : NL_SIMD_SCALAR;
+    }
+#else
+    if (NL_SIMD_AUTO == simd) {
+        simd = NL_SIMD_SCALAR;
+    }
+#endif
+    switch (simd) {
+        case NL_SIMD_SCALAR:
+            nl_kernel = kernel_scalar;
+            nl_bins = bins_scalar;
+            break;
+#ifdef NL_HAVE_X86_SIMD
+        case NL_SIMD_AVX2:
+            if (!avx2)
+                return -1;
+            nl_kernel = kernel_avx2;
+            nl_bins = bins_avx2;
+            break;
+        case NL_SIMD_AVX512:
+            if (!avx512 || !avx2)
+                return -1;
+            nl_kernel = kernel_avx512;
+            nl_bins = bins_avx2;
+            break;
+#endif
+        default:
+            return -1;
+    }
+    return simd;
+}
+
+/* ---------------------------------------------------------------
+ * Batch method
+ */
+
+/* Merge the results for one block into an accumulator (not its count) */
+static void acc_add(struct nlcali_acc_t *acc, const struct nl_moments_t *m)
+{
+    struct netlogger_wvar_t w;
+    struct netlogger_ksum_t k;
+
+    if (m->n == 0) {
+        return;
+    }
+    w.m = m->sum / m->n;
+    w.t = m->m2;
+    w.count = (unsigned)m->n;
+    netlogger_wvar_merge(&acc->var, &w);
+    k.s = m->sum;
+    k.c = 0;
+    netlogger_ksum_merge(&acc->ksum, &k);
+    if (m->min < acc->min) acc->min = m->min;
+    if (m->max > acc->max) acc->max = m->max;
+}
+
+void nlcali_add_batch(nlcali_T self, const double *values,
+                      const double *durations, size_t n)
+{
+    double rate[BLOCK], gap[BLOCK], dsum;
+    unsigned rb[BLOCK], gb[BLOCK];
+    struct nl_moments_t m[3];
+    int bins = self->h_state > NL_HIST_AUTO_PRE;
+    size_t i, j, len;
+
+    if (NULL == nl_kernel) {
+        nlcali_batch_simd(NL_SIMD_AUTO);
+    }
+    for (i = 0; i < n; i += len) {
+        len = MIN(BLOCK, n - i);
+        nl_kernel(values + i, durations + i, len, self->tick_ns,
+                  rate, gap, m, &dsum);
+        if (bins) {
+            nl_bins(self, rate, gap, len, rb, gb);
+        }
+        NL_SEQ_WRITE_BEGIN(self);
+        acc_add(&self->vacc, &m[MV]);
+        acc_add(&self->racc, &m[MR]);
+        acc_add(&self->gacc, &m[MG]);
+        self->vacc.count += len;
+        self->racc.count += (long long)m[MR].n;
+        self->dur_ticks += (nl_ticks_t)(dsum + 0.5);
+        if (bins) {
+            for (j = 0; j < len; j++) {
+                if (rate[j] == rate[j]) {
+                    self->h_rdata[rb[j]]++;
+                    self->h_gdata[gb[j]]++;
+                }
+            }
+        }
+        if (self->opts & NL_OPT_HIST) {
+            for (j = 0; j < len; j++) {
+                NL_HIST_X_ADD(self, durations[i + j] * self->tick_ns,
+                              values[i + j]);
+            }
+        }
+        if (self->vsk) {
+            for (j = 0; j < len; j++) {
+                nl_tdigest_add(self->vsk, values[i + j]);
+                if (rate[j] == rate[j]) {
+                    nl_tdigest_add(self->rsk, rate[j]);
+                    nl_tdigest_add(self->gsk, gap[j]);
+                }
+            }
+        }
+        self->dirty = 1;
+        NL_SEQ_WRITE_END(self);
+    }
+}
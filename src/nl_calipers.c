@@ -6,9 +6,14 @@
  */
 static const volatile char rcsid[] = "$Id$";
  
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
 #include <assert.h>
 #include <float.h>
 #include <math.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,6 +35,7 @@ static const volatile char rcsid[] = "$Id$";
 
 /* Interface */
 #include "nl_calipers.h"
+#include "nl_fmt.h"
 
 /* ---------------------------------------------------------------
  * Utility functions
@@ -104,6 +110,27 @@ void netlogger_wvar_clear(struct netlogger_wvar_t *self)
     self->count = 0;
 }
 
+void netlogger_wvar_merge(struct netlogger_wvar_t *self,
+                          const struct netlogger_wvar_t *other)
+{
+    double n, delta;
+
+    if (other->count == 0) {
+        return;
+    }
+    if (self->count == 0) {
+        self->m = other->m;
+        self->t = other->t;
+        self->count = other->count;
+        return;
+    }
+    n = (double)self->count + other->count;
+    delta = other->m - self->m;
+    self->m += delta * other->count / n;
+    self->t += other->t + delta * delta * self->count * other->count / n;
+    self->count += other->count;
+}
+
 /* ---------------------------------------------------------------
  * Kahan sum methods
  */
@@ -114,25 +141,288 @@ void netlogger_ksum_clear(struct netlogger_ksum_t *self, double x0)
     self->c = 0;
 }
 
+void netlogger_ksum_merge(struct netlogger_ksum_t *self,
+                          const struct netlogger_ksum_t *other)
+{
+    double t, err;
+
+    /* two-sum of the running sums; `c` holds the negated error */
+    t = self->s + other->s;
+    if (fabs(self->s) >= fabs(other->s)) {
+        err = (self->s - t) + other->s;
+    }
+    else {
+        err = (other->s - t) + self->s;
+    }
+    self->s = t;
+    self->c = self->c + other->c - err;
+}
+
+/* ---------------------------------------------------------------
+ * Clock methods
+ */
+
+/* Nanoseconds per tick, by clock; 0 = not yet calibrated */
+static double nl_clock_tick_ns[3] = { 1.0, 1.0, 0.0 };
+
+#ifdef NL_HAVE_TSC
+/* Check CPUID for an invariant (constant-rate, non-stop) TSC */
+static int nl_tsc_invariant(void)
+{
+    uint32_t a, b, c, d;
+
+    __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d)
+                         : "a"(0x80000000));
+    if (a < 0x80000007)
+        return 0;
+    __asm__ __volatile__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d)
+                         : "a"(0x80000007));
+    return (d >> 8) & 1;
+}
+#endif
+
+#define TSC_CALIBRATE_NS 20000000ULL /* 20ms */
+
+double nlcali_clock_calibrate(netlogger_clock_t clock)
+{
+    switch (clock) {
+        case NL_CLOCK_MONOTONIC:
+        case NL_CLOCK_MONOTONIC_RAW:
+            return nl_clock_tick_ns[clock];
+#ifdef NL_HAVE_TSC
+        case NL_CLOCK_TSC: {
+            nl_ticks_t t0, t1, c0, c1;
+            if (!nl_tsc_invariant())
+                return -1;
+            /* spin against the raw monotonic clock */
+            t0 = nl_clock_ticks(NL_CLOCK_MONOTONIC_RAW);
+            c0 = nl_clock_ticks(NL_CLOCK_TSC);
+            do {
+                t1 = nl_clock_ticks(NL_CLOCK_MONOTONIC_RAW);
+            } while (t1 - t0 < TSC_CALIBRATE_NS);
+            c1 = nl_clock_ticks_end(NL_CLOCK_TSC);
+            if (c1 <= c0)
+                return -1;
+            nl_clock_tick_ns[clock] = (double)(t1 - t0) / (double)(c1 - c0);
+            return nl_clock_tick_ns[clock];
+        }
+#endif
+        default:
+            return -1;
+    }
+}
+
 /* ---------------------------------------------------------------
  * NetLogger calipers methods
  */
 
 #define T nlcali_T
 
+/* Check that the groups of fields in struct nlcali_t start on
+   cache lines (the array size is negative if not) */
+#define NL_LINE_CHECK(F, L) \
+    typedef char nl_line_check_##F[ \
+        offsetof(struct nlcali_t, F) == (L) * NL_CACHE_LINE ? 1 : -1]
+NL_LINE_CHECK(vacc, 0);
+NL_LINE_CHECK(racc, 1);
+NL_LINE_CHECK(gacc, 2);
+NL_LINE_CHECK(seq, 3);
+NL_LINE_CHECK(h_state, 4);
+NL_LINE_CHECK(inflight, 5);
+
 static void
 nl_calipers_hist_init(T self, unsigned n, double min, double width);
+static int nl_hist_x_set(T self, struct nlcali_hist_t *h,
+                         const struct nlcali_hist_t *cfg);
+
+/* Duration, value, on- and off-CPU time histograms: the kinds from
+   NL_HIST_DUR on */
+#define NL_HIST_NX 4
      
 T nlcali_new(unsigned min_items)
 {
-    T self = (T)malloc(sizeof(struct nlcali_t));
-    self->vsm.var.min_items = min_items;
-    self->rsm.var.min_items = min_items;
-    self->gsm.var.min_items = min_items;
+    void *p;
+    T self = NULL;
+
+    /* line up the struct's field groups with cache lines */
+    if (0 == posix_memalign(&p, NL_CACHE_LINE, sizeof(struct nlcali_t))) {
+        self = (T)p;
+        nlcali_init(self, min_items);
+    }
+    return self;
+}
+
+void nlcali_init(T self, unsigned min_items)
+{
+    self->vacc.var.min_items = min_items;
+    self->racc.var.min_items = min_items;
+    self->gacc.var.min_items = min_items;
     self->h_state = NL_HIST_OFF;
+    self->h_num = 0;
     self->h_rdata = self->h_gdata = NULL;
+    self->h_slab = NULL;
+    self->h_slab_num = 0;
+    memset(&self->h_dur, 0, sizeof(self->h_dur));
+    memset(&self->h_val, 0, sizeof(self->h_val));
+    memset(&self->h_cpu, 0, sizeof(self->h_cpu));
+    memset(&self->h_wait, 0, sizeof(self->h_wait));
+    self->h_xdata = NULL;
+    self->clock = NL_CLOCK_DEFAULT;
+    self->tick_ns = nl_clock_tick_ns[NL_CLOCK_DEFAULT];
+    self->seq = 0;
+    self->inflight = self->inflight_max = 0;
+    self->vsk = self->rsk = self->gsk = NULL;
+    self->win = NULL;
+    self->trace = NULL;
+    self->smp = NULL;
+    self->perf = NULL;
+    self->cpu = NULL;
+    self->opts = 0;
+    nlcali_clear(self);
+}
+
+void nlcali_init_like(T self, T proto)
+{
+    nlcali_init(self, proto->vacc.var.min_items);
+    nlcali_configure_like(self, proto);
+}
+
+void nlcali_configure_like(T self, T proto)
+{
+    self->clock = proto->clock;
+    self->tick_ns = proto->tick_ns;
+    if (proto->h_state > NL_HIST_AUTO_PRE) {
+        nl_calipers_hist_init(self, proto->h_num, proto->h_rmin,
+                              proto->h_rwidth);
+    }
+    if (proto->h_state > NL_HIST_AUTO_PRE && NULL != self->h_rdata) {
+        self->h_state = proto->h_state == NL_HIST_LOGLINEAR ?
+            NL_HIST_LOGLINEAR : NL_HIST_MANUAL;
+        self->h_gmin = proto->h_gmin;
+        self->h_gwidth = proto->h_gwidth;
+        self->h_sub_bits = proto->h_sub_bits;
+        self->h_rbase = proto->h_rbase;
+        self->h_gbase = proto->h_gbase;
+    }
+    else {
+        nl_calipers_hist_init(self, 0, 0, 0);
+    }
+    nl_hist_x_set(self, &self->h_dur, &proto->h_dur);
+    nl_hist_x_set(self, &self->h_val, &proto->h_val);
+    nl_hist_x_set(self, &self->h_cpu, &proto->h_cpu);
+    nl_hist_x_set(self, &self->h_wait, &proto->h_wait);
+    nlcali_cpu(self, NULL != proto->cpu);
+    nlcali_sketch(self, NULL != proto->vsk ? proto->vsk->compression : 0);
+    nlcali_sample_like(self, proto);
     nlcali_clear(self);
-    return self;
+}
+
+void nlcali_hist_storage(T self, unsigned *bins, unsigned n)
+{
+    nl_calipers_hist_init(self, 0, 0, 0);
+    self->h_slab = bins;
+    self->h_slab_num = NULL != bins ? n : 0;
+}
+
+int nlcali_sketch(T self, double compression)
+{
+    nl_tdigest_free(self->vsk);
+    nl_tdigest_free(self->rsk);
+    nl_tdigest_free(self->gsk);
+    self->vsk = self->rsk = self->gsk = NULL;
+    self->opts &= ~NL_OPT_SKETCH;
+    if (compression <= 0) {
+        return 0;
+    }
+    self->vsk = nl_tdigest_new(compression);
+    self->rsk = nl_tdigest_new(compression);
+    self->gsk = nl_tdigest_new(compression);
+    if (NULL == self->vsk || NULL == self->rsk || NULL == self->gsk) {
+        nlcali_sketch(self, 0);
+        return -1;
+    }
+    self->opts |= NL_OPT_SKETCH;
+    return 0;
+}
+
+double nlcali_quantile(T self, netlogger_metric_t metric, double q)
+{
+    struct nl_tdigest_t *sk;
+
+    switch (metric) {
+        case NL_VALUE: sk = self->vsk; break;
+        case NL_RATE: sk = self->rsk; break;
+        case NL_GAP: sk = self->gsk; break;
+        default: sk = NULL;
+    }
+    if (NULL == sk) {
+        return -1;
+    }
+    return nl_tdigest_quantile(sk, q);
+}
+
+void nlcali_add_opt(T self, nl_ticks_t b, nl_ticks_t e, double v)
+{
+    struct nlcali_trace_t *tr;
+    struct nlcali_trace_rec_t *rec;
+    double dur;
+
+    if (self->opts & NL_OPT_TRACE) {
+        tr = self->trace;
+        rec = &tr->rec[tr->head & tr->mask];
+        rec->begin = b;
+        rec->dur = e - b;
+        rec->value = v;
+        NL_WMB();
+        tr->head++;
+    }
+    if (self->opts & NL_OPT_SKETCH) {
+        nl_tdigest_add(self->vsk, v);
+        dur = (e - b) * self->tick_ns;
+        if (v != 0 && dur > 0) {
+            nl_tdigest_add(self->rsk, v / dur);
+            nl_tdigest_add(self->gsk, dur / v);
+        }
+    }
+    if (self->opts & NL_OPT_WINDOW) {
+        nlcali_window_add(self, b, e, v);
+    }
+    if (self->opts & NL_OPT_SAMPLE) {
+        nlcali_sample_next(self, e);
+    }
+}
+
+int nlcali_set_clock(T self, netlogger_clock_t clock)
+{
+    double tick_ns;
+
+    if (clock < NL_CLOCK_MONOTONIC || clock > NL_CLOCK_TSC) {
+        return -1;
+    }
+    tick_ns = nl_clock_tick_ns[clock];
+    if (tick_ns <= 0) {
+        tick_ns = nlcali_clock_calibrate(clock);
+        if (tick_ns <= 0) {
+            return -1;
+        }
+    }
+    self->clock = clock;
+    self->tick_ns = tick_ns;
+    nlcali_clear(self);
+    if (NULL != self->smp) {
+        /* the costs were measured in ticks of the old clock */
+        if (0 != nlcali_sample(self, self->smp->target > 0 ?
+                               self->smp->max_period : self->smp->period,
+                               self->smp->target * 100)) {
+            return -1;
+        }
+    }
+    if (NULL != self->win) {
+        /* sub-intervals are counted in ticks of the old clock */
+        return nlcali_window(self, self->win->seconds, self->win->k,
+                             self->win->half_life);
+    }
+    return 0;
 }
 
 /* Manual histogram */
@@ -155,75 +445,590 @@ void nlcali_hist_manual(T self, unsigned n, double min, double max)
  {
      self->h_state = NL_HIST_AUTO_PRE;
      self->h_auto_pre = m;
+     if (n > NL_MAX_HIST_BINS) {
+         n = NL_MAX_HIST_BINS;
+     }
      nl_calipers_hist_init(self, n, DBL_MAX, 0);
  }
 
 
+/* Log-linear histogram */
+int nlcali_hist_loglinear(T self, unsigned digits, double min, double max)
+{
+    int bits, r_exp, g_exp, x_exp, octaves;
+    unsigned n;
+
+    if (digits < 1 || digits > NL_MAX_LL_DIGITS || !(min > 0) ||
+        !(max > min)) {
+        return -1;
+    }
+    /* smallest power of two with 2^bits >= 10^digits */
+    bits = (int)ceil(digits * log2(10.0));
+    /* frexp() returns x = f * 2^e, 0.5 <= f < 1, so floor(log2 x) = e-1 */
+    frexp(min, &r_exp);
+    frexp(max, &x_exp);
+    octaves = x_exp - r_exp + 1;
+    frexp(1 / max, &g_exp);
+    frexp(1 / min, &x_exp);
+    octaves = MAX(octaves, x_exp - g_exp + 1);
+    if (((unsigned)octaves << bits) > NL_MAX_LL_BINS) {
+        return -1;
+    }
+    n = (unsigned)octaves << bits;
+    nl_calipers_hist_init(self, n, 0, 0);
+    if (NULL == self->h_rdata) {
+        /* out of memory; the old bins are gone, so leave it off */
+        return -1;
+    }
+    self->h_state = NL_HIST_LOGLINEAR;
+    self->h_sub_bits = bits;
+    self->h_rmin = ldexp(1, r_exp - 1);
+    self->h_gmin = ldexp(1, g_exp - 1);
+    self->h_rwidth = self->h_gwidth = 0;
+    self->h_rbase = (int64_t)(r_exp - 1 + 1023) << bits;
+    self->h_gbase = (int64_t)(g_exp - 1 + 1023) << bits;
+    return 0;
+}
+
+/* Duration, value or CPU time histogram, NULL for rate and gap */
+static struct nlcali_hist_t *nl_hist_x(T self, netlogger_hkind_t kind)
+{
+    switch (kind) {
+        case NL_HIST_DUR: return &self->h_dur;
+        case NL_HIST_VALUE: return &self->h_val;
+        case NL_HIST_CPU: return &self->h_cpu;
+        case NL_HIST_WAIT: return &self->h_wait;
+        default: return NULL;
+    }
+}
+
+/* Bins of all of them, in `h_xdata` */
+static size_t nl_hist_x_bins(T self)
+{
+    return (size_t)self->h_dur.num + self->h_val.num +
+        self->h_cpu.num + self->h_wait.num;
+}
+
+/*
+ * Set up the duration, value or CPU time histogram `h` as `cfg`,
+ * with empty bins. The bins of all of them are in one block, so the
+ * block is replaced and the other histograms' bins are moved to the
+ * new one.
+ */
+static int nl_hist_x_set(T self, struct nlcali_hist_t *h,
+                         const struct nlcali_hist_t *cfg)
+{
+    struct nlcali_hist_t xs[NL_HIST_NX], *old;
+    void *p = NULL;
+    size_t n = 0;
+    unsigned j;
+
+    for (j = 0; j < NL_HIST_NX; j++) {
+        old = nl_hist_x(self, NL_HIST_DUR + j);
+        xs[j] = old == h ? *cfg : *old;
+        n += xs[j].num;
+    }
+    if (n > 0 && 0 != posix_memalign(&p, NL_CACHE_LINE,
+                                     n * sizeof(unsigned))) {
+        return -1;
+    }
+    if (n > 0) {
+        memset(p, 0, n * sizeof(unsigned));
+    }
+    n = 0;
+    for (j = 0; j < NL_HIST_NX; j++) {
+        old = nl_hist_x(self, NL_HIST_DUR + j);
+        xs[j].data = xs[j].num > 0 ? (unsigned *)p + n : NULL;
+        if (old != h && xs[j].num > 0) {
+            memcpy(xs[j].data, old->data, xs[j].num * sizeof(unsigned));
+        }
+        n += xs[j].num;
+    }
+    free(self->h_xdata);
+    self->h_xdata = (unsigned *)p;
+    for (j = 0; j < NL_HIST_NX; j++) {
+        *nl_hist_x(self, NL_HIST_DUR + j) = xs[j];
+    }
+    if (n > 0) {
+        self->opts |= NL_OPT_HIST;
+    }
+    else {
+        self->opts &= ~NL_OPT_HIST;
+    }
+    return 0;
+}
+
+int nlcali_hist_kind_manual(T self, netlogger_hkind_t kind, unsigned n,
+                            double min, double max)
+{
+    struct nlcali_hist_t *h = nl_hist_x(self, kind), cfg;
+
+    if (NULL == h || n > NL_MAX_HIST_BINS || (n > 0 && !(max > min))) {
+        return -1;
+    }
+    memset(&cfg, 0, sizeof(cfg));
+    if (n > 0) {
+        cfg.state = NL_HIST_MANUAL;
+        cfg.num = n;
+        cfg.min = min;
+        cfg.width = (max - min) / n;
+    }
+    return nl_hist_x_set(self, h, &cfg);
+}
+
+int nlcali_hist_kind_loglinear(T self, netlogger_hkind_t kind,
+                               unsigned digits, double min, double max)
+{
+    struct nlcali_hist_t *h = nl_hist_x(self, kind), cfg;
+    int bits, m_exp, x_exp, octaves;
+
+    if (NULL == h || digits < 1 || digits > NL_MAX_LL_DIGITS ||
+        !(min > 0) || !(max > min)) {
+        return -1;
+    }
+    /* as for nlcali_hist_loglinear(), over one range */
+    bits = (int)ceil(digits * log2(10.0));
+    frexp(min, &m_exp);
+    frexp(max, &x_exp);
+    octaves = x_exp - m_exp + 1;
+    if (((unsigned)octaves << bits) > NL_MAX_LL_BINS) {
+        return -1;
+    }
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.state = NL_HIST_LOGLINEAR;
+    cfg.num = (unsigned)octaves << bits;
+    cfg.sub_bits = bits;
+    cfg.min = ldexp(1, m_exp - 1);
+    cfg.base = (int64_t)(m_exp - 1 + 1023) << bits;
+    return nl_hist_x_set(self, h, &cfg);
+}
+
+double nlcali_hist_edge(T self, netlogger_hkind_t kind, unsigned i)
+{
+    const struct nlcali_hist_t *h = nl_hist_x(self, kind);
+    union { double d; uint64_t u; } v;
+
+    if (NULL != h) {
+        if (h->state == NL_HIST_LOGLINEAR) {
+            v.u = (uint64_t)(i + h->base) << (52 - h->sub_bits);
+            return v.d;
+        }
+        return h->min + h->width * i;
+    }
+    if (self->h_state == NL_HIST_LOGLINEAR) {
+        int64_t base = kind == NL_HIST_GAP ? self->h_gbase : self->h_rbase;
+        v.u = (uint64_t)(i + base) << (52 - self->h_sub_bits);
+        return v.d;
+    }
+    if (kind == NL_HIST_GAP) {
+        return self->h_gmin + self->h_gwidth * i;
+    }
+    return self->h_rmin + self->h_rwidth * i;
+}
+
+double nlcali_hist_quantile(T self, netlogger_hkind_t kind, double q)
+{
+    const struct nlcali_hist_t *h = nl_hist_x(self, kind);
+    const unsigned *data;
+    double total = 0, cum = 0, target, lo, hi, x, min, max;
+    unsigned i, n;
+
+    if (NULL != h) {
+        if (h->state == NL_HIST_OFF) {
+            return -1;
+        }
+        data = h->data;
+        n = h->num;
+    }
+    else {
+        if (!NL_HIST_HAS_DATA(self)) {
+            return -1;
+        }
+        data = kind == NL_HIST_GAP ? self->h_gdata : self->h_rdata;
+        n = self->h_num;
+    }
+    for (i = 0; i < n; i++) {
+        total += data[i];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    switch (kind) {
+        case NL_HIST_GAP:
+            min = self->gacc.min;
+            max = self->gacc.max;
+            break;
+        case NL_HIST_VALUE:
+            min = self->vacc.min;
+            max = self->vacc.max;
+            break;
+        case NL_HIST_DUR:
+        case NL_HIST_CPU:
+        case NL_HIST_WAIT:
+            /* not kept; use the outermost bins with data */
+            for (i = 0; 0 == data[i]; i++)
+                ;
+            min = nlcali_hist_edge(self, kind, i);
+            for (i = n - 1; 0 == data[i]; i--)
+                ;
+            max = nlcali_hist_edge(self, kind, i + 1);
+            break;
+        default:
+            min = self->racc.min;
+            max = self->racc.max;
+    }
+    if (q <= 0) {
+        return min;
+    }
+    if (q >= 1) {
+        return max;
+    }
+    target = q * total;
+    for (i = 0; i < n - 1; i++) {
+        if (cum + data[i] >= target) {
+            break;
+        }
+        cum += data[i];
+    }
+    lo = nlcali_hist_edge(self, kind, i);
+    hi = nlcali_hist_edge(self, kind, i + 1);
+    x = data[i] ? lo + (hi - lo) * (target - cum) / data[i] : lo;
+    return MAX(min, MIN(max, x));
+}
+
 /* Internal method for shared constructor code. */
 void nl_calipers_hist_init(T self, unsigned n, double min, double width)
 {
-    if (NULL != self->h_rdata) {
+    void *p;
+
+    /* both histograms share one allocation, or the caller's storage */
+    if (self->h_rdata != self->h_slab) {
         free(self->h_rdata);
-        self->h_rdata = NULL;
     }
-    if (NULL != self->h_gdata) {
-        free(self->h_gdata);
-        self->h_gdata = NULL;
+    self->h_rdata = self->h_gdata = NULL;
+    if (0 != n && n <= self->h_slab_num) {
+        p = self->h_slab;
     }
-    if (0 == n) {
+    else if (0 == n ||
+             0 != posix_memalign(&p, NL_CACHE_LINE,
+                                 2 * sizeof(unsigned) * n)) {
         self->h_state = NL_HIST_OFF;
+        return;
     }
-    else {
-        self->h_num = n;
-        self->h_rmin = min;
-        self->h_rwidth = width;
-        self->h_rdata = (unsigned *)malloc(sizeof(unsigned) * n);
-        memset(self->h_rdata, 0, sizeof(unsigned)*n);
-        self->h_gmin = 1/min;
-        self->h_gwidth = 1/width;
-        self->h_gdata = (unsigned *)malloc(sizeof(unsigned) * n);
-        memset(self->h_gdata, 0, sizeof(unsigned)*n);
-    }
+    self->h_num = n;
+    self->h_rmin = min;
+    self->h_rwidth = width;
+    self->h_rdata = (unsigned *)p;
+    self->h_gmin = 1/min;
+    self->h_gwidth = 1/width;
+    self->h_gdata = self->h_rdata + n;
+    memset(self->h_rdata, 0, 2 * sizeof(unsigned) * n);
+}
+
+static void nl_acc_clear(struct nlcali_acc_t *self)
+{
+    netlogger_ksum_clear(&self->ksum, 0);
+    netlogger_wvar_clear(&self->var);
+    self->min = DBL_MAX;
+    self->max = 0;
+    self->count = 0;
+}
+
+static void nl_summ_clear(struct nlcali_summ_t *self)
+{
+    self->sum = self->mean = self->sd = 0;
+    self->min = DBL_MAX;
+    self->max = 0;
+    self->count = 0;
 }
 
 void nlcali_clear(T self)
 {
-    netlogger_ksum_clear(&self->vsm.ksum, 0);
-    netlogger_ksum_clear(&self->rsm.ksum, 0);
-    netlogger_ksum_clear(&self->gsm.ksum, 0);
-    netlogger_wvar_clear(&self->vsm.var);
-    netlogger_wvar_clear(&self->rsm.var);
-    netlogger_wvar_clear(&self->gsm.var);
-    self->vsm.sd = self->rsm.sd = self->gsm.sd = 0;
-    self->vsm.min = self->rsm.min = self->gsm.min = DBL_MAX;
-    self->vsm.max = self->rsm.max = self->gsm.max = 0;
+    unsigned k;
+
+    /* readers of a live caliper see all of this or none of it */
+    NL_SEQ_WRITE_BEGIN(self);
+    nl_acc_clear(&self->vacc);
+    nl_acc_clear(&self->racc);
+    nl_acc_clear(&self->gacc);
+    nl_summ_clear(&self->vsm);
+    nl_summ_clear(&self->rsm);
+    nl_summ_clear(&self->gsm);
     self->dur = self->dur_sum = 0;
-    memset(&self->first, 0, sizeof(self->first));
-    self->vsm.count = 0;
-    self->rsm.count = 0;
+    self->dur_ticks = 0;
+    self->scale = 1;
+    self->begin = self->end = 0;
+    self->first = NL_TICKS_NONE;
     self->is_begun = 0;
+    /* time the first event, so `first` is set */
+    self->untimed = 0;
+    self->skip = 0;
+    /* intervals still open belong to the next period */
+    self->inflight_max = self->inflight;
     self->dirty = 0;
+    if (NULL != self->smp) {
+        self->smp->n0 = 0;
+    }
+    if (NULL != self->vsk) {
+        nl_tdigest_clear(self->vsk);
+        nl_tdigest_clear(self->rsk);
+        nl_tdigest_clear(self->gsk);
+    }
     if (self->h_state != NL_HIST_OFF) {
         /* clear histogram data */
-        memset(self->h_rdata, 0, sizeof(unsigned)*self->h_num);
-        memset(self->h_gdata, 0, sizeof(unsigned)*self->h_num);
+        memset(self->h_rdata, 0, 2 * sizeof(unsigned) * self->h_num);
+    }
+    if (NULL != self->h_xdata) {
+        memset(self->h_xdata, 0, sizeof(unsigned) * nl_hist_x_bins(self));
+    }
+    if (NULL != self->perf) {
+        for (k = 0; k < NL_PERF_MAX; k++) {
+            nl_acc_clear(&self->perf->acc[k]);
+            nl_summ_clear(&self->perf->sm[k]);
+        }
+    }
+    if (NULL != self->cpu) {
+        nl_acc_clear(&self->cpu->cacc);
+        nl_acc_clear(&self->cpu->wacc);
+        nl_summ_clear(&self->cpu->csm);
+        nl_summ_clear(&self->cpu->wsm);
+    }
+    NL_SEQ_WRITE_END(self);
+}
+
+static void nl_acc_merge(struct nlcali_acc_t *self,
+                         const struct nlcali_acc_t *other)
+{
+    netlogger_ksum_merge(&self->ksum, &other->ksum);
+    netlogger_wvar_merge(&self->var, &other->var);
+    if (other->min < self->min) self->min = other->min;
+    if (other->max > self->max) self->max = other->max;
+    self->count += other->count;
+}
+
+/* Same duration or value histogram bins */
+static int nl_hist_x_same(const struct nlcali_hist_t *a,
+                          const struct nlcali_hist_t *b)
+{
+    return a->state == b->state && a->num == b->num &&
+        a->min == b->min && a->width == b->width &&
+        a->sub_bits == b->sub_bits && a->base == b->base;
+}
+
+static void nl_hist_x_merge(struct nlcali_hist_t *self,
+                            const struct nlcali_hist_t *other)
+{
+    unsigned i;
+
+    for (i = 0; i < self->num; i++) {
+        self->data[i] += other->data[i];
+    }
+}
+
+/* Check whether `other` can be merged into `self` */
+static int nl_merge_check(T self, T other)
+{
+    int self_bins = self->h_state > NL_HIST_AUTO_PRE;
+    int other_bins = other->h_state > NL_HIST_AUTO_PRE;
+
+    if (self->clock != other->clock) {
+        return -1;
+    }
+    if (self_bins != other_bins) {
+        return -1;
+    }
+    if (self_bins && (self->h_num != other->h_num ||
+                      self->h_rmin != other->h_rmin ||
+                      self->h_rwidth != other->h_rwidth)) {
+        return -1;
+    }
+    if ((self->h_state == NL_HIST_LOGLINEAR) !=
+        (other->h_state == NL_HIST_LOGLINEAR)) {
+        return -1;
+    }
+    if (self->h_state == NL_HIST_LOGLINEAR &&
+        (self->h_sub_bits != other->h_sub_bits ||
+         self->h_rbase != other->h_rbase ||
+         self->h_gbase != other->h_gbase)) {
+        return -1;
+    }
+    if (!nl_hist_x_same(&self->h_dur, &other->h_dur) ||
+        !nl_hist_x_same(&self->h_val, &other->h_val) ||
+        !nl_hist_x_same(&self->h_cpu, &other->h_cpu) ||
+        !nl_hist_x_same(&self->h_wait, &other->h_wait)) {
+        return -1;
+    }
+    if ((NULL == self->vsk) != (NULL == other->vsk)) {
+        return -1;
+    }
+    return 0;
+}
+
+int nlcali_merge(T self, T other)
+{
+    unsigned i;
+
+    if (0 != nl_merge_check(self, other)) {
+        return -1;
+    }
+    /* gauges are summed as if the calipers ran at the same time,
+       but their peaks need not have */
+    self->inflight += other->inflight;
+    self->inflight_max = MAX(self->inflight_max, other->inflight_max);
+    if (other->vacc.count == 0) {
+        return 0;
+    }
+    if (other->first < self->first) {
+        self->first = other->first;
+    }
+    if (other->end > self->end) {
+        self->end = other->end;
+    }
+    nl_acc_merge(&self->vacc, &other->vacc);
+    nl_acc_merge(&self->racc, &other->racc);
+    nl_acc_merge(&self->gacc, &other->gacc);
+    self->dur_ticks += other->dur_ticks;
+    self->untimed += other->untimed;
+    if (NULL != self->vsk) {
+        nl_tdigest_merge(self->vsk, other->vsk);
+        nl_tdigest_merge(self->rsk, other->rsk);
+        nl_tdigest_merge(self->gsk, other->gsk);
+    }
+    if (self->h_state > NL_HIST_AUTO_PRE) {
+        /* rate bins, then gap bins */
+        for (i = 0; i < 2 * self->h_num; i++) {
+            self->h_rdata[i] += other->h_rdata[i];
+        }
+    }
+    nl_hist_x_merge(&self->h_dur, &other->h_dur);
+    nl_hist_x_merge(&self->h_val, &other->h_val);
+    nl_hist_x_merge(&self->h_cpu, &other->h_cpu);
+    nl_hist_x_merge(&self->h_wait, &other->h_wait);
+    if (NULL != self->cpu && NULL != other->cpu) {
+        nl_acc_merge(&self->cpu->cacc, &other->cpu->cacc);
+        nl_acc_merge(&self->cpu->wacc, &other->cpu->wacc);
+    }
+    if (NULL != self->perf && NULL != other->perf &&
+        self->perf->events == other->perf->events) {
+        for (i = 0; i < NL_PERF_MAX; i++) {
+            nl_acc_merge(&self->perf->acc[i], &other->perf->acc[i]);
+        }
+    }
+    self->dirty = 1;
+    return 0;
+}
+
+T nlcali_reduce(T *calipers, unsigned n)
+{
+    unsigned i, stride;
+
+    if (0 == n) {
+        return NULL;
+    }
+    for (i = 1; i < n; i++) {
+        if (0 != nl_merge_check(calipers[0], calipers[i])) {
+            return NULL;
+        }
+    }
+    for (stride = 1; stride < n; stride *= 2) {
+        for (i = 0; i + stride < n; i += 2 * stride) {
+            nlcali_merge(calipers[i], calipers[i + stride]);
+        }
+    }
+    return calipers[0];
+}
+
+int nlcali_seq_copy(T live, T snap, nlcali_copy_fn fn, void *arg)
+{
+    unsigned seq, tries = 0;
+
+    do {
+        if (++tries > NL_SEQ_SPINS) {
+            if (tries > NL_SEQ_TRIES) {
+                return -1;
+            }
+            sched_yield();
+        }
+        seq = __atomic_load_n(&live->seq, __ATOMIC_ACQUIRE);
+        memcpy(snap, live, sizeof(struct nlcali_t));
+        if (NULL != fn && 0 != fn(arg, snap, live)) {
+            return -1;
+        }
+        NL_RMB();
+    } while ((seq & 1) || seq != live->seq);
+    return 0;
+}
+
+static void nl_summ_calc(struct nlcali_summ_t *self,
+                         const struct nlcali_acc_t *acc, long long count)
+{
+    self->sum = acc->ksum.s;
+    self->min = acc->min;
+    self->max = acc->max;
+    self->count = count;
+    self->mean = count > 0 ? self->sum / count : 0;
+    self->sd = WVAR_SD(acc->var);
+}
+
+/* Estimate the count and sum of all events from a sample */
+static void nl_summ_scale(struct nlcali_summ_t *self, double scale)
+{
+    self->sum *= scale;
+    self->count = (long long)(self->count * scale + 0.5);
+}
+
+/* Summaries of the perf_event counters, scaled like `rsm` */
+static void nl_perf_calc(T self)
+{
+    struct nlcali_perf_t *pf = self->perf;
+    unsigned k;
+
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        nl_summ_calc(&pf->sm[k], &pf->acc[k], pf->acc[k].count);
+        if (self->scale != 1) {
+            nl_summ_scale(&pf->sm[k], self->scale);
+        }
+    }
+}
+
+/* Summaries of on- and off-CPU time, scaled like `rsm` */
+static void nl_cpu_calc(T self)
+{
+    struct nlcali_cpu_t *cpu = self->cpu;
+
+    nl_summ_calc(&cpu->csm, &cpu->cacc, cpu->cacc.count);
+    nl_summ_calc(&cpu->wsm, &cpu->wacc, cpu->wacc.count);
+    if (self->scale != 1) {
+        nl_summ_scale(&cpu->csm, self->scale);
+        nl_summ_scale(&cpu->wsm, self->scale);
     }
 }
 
 void nlcali_calc(T self)
 {
-    if (self->dirty && (self->vsm.count > 0)) {
-        self->vsm.sum  = self->vsm.ksum.s;
-        self->rsm.sum = self->rsm.ksum.s;
-        self->gsm.sum = self->gsm.ksum.s;
-        self->vsm.mean = self->vsm.sum / self->vsm.count;
-        self->rsm.mean = self->rsm.sum / self->rsm.count;
-        self->gsm.mean = self->gsm.sum / self->rsm.count;
-        self->vsm.sd = WVAR_SD(self->vsm.var);
-        self->rsm.sd = WVAR_SD(self->rsm.var);
-        self->gsm.sd = WVAR_SD(self->gsm.var);
-        self->dur = self->end.tv_sec - self->first.tv_sec + 
-            (self->end.tv_usec - self->first.tv_usec) / 1e6;
+    if (self->dirty && (self->vacc.count > 0)) {
+        /* gap has an event wherever rate does */
+        nl_summ_calc(&self->vsm, &self->vacc, self->vacc.count);
+        nl_summ_calc(&self->rsm, &self->racc, self->racc.count);
+        nl_summ_calc(&self->gsm, &self->gacc, self->racc.count);
+        self->dur_sum = NL_TICKS_SEC(self, self->dur_ticks);
+        /* only some events were timed, see nlcali_sample() */
+        self->scale = 1;
+        if (self->untimed > 0 && self->untimed < self->vacc.count) {
+            self->scale = (double)self->vacc.count /
+                (self->vacc.count - self->untimed);
+            nl_summ_scale(&self->rsm, self->scale);
+            nl_summ_scale(&self->gsm, self->scale);
+            self->dur_sum *= self->scale;
+        }
+        self->dur = NL_TICKS_NONE == self->first ? 0 :
+            NL_TICKS_SEC(self, self->end - self->first);
+        if (NULL != self->perf) {
+            nl_perf_calc(self);
+        }
+        if (NULL != self->cpu) {
+            nl_cpu_calc(self);
+        }
         self->dirty = 0;
         if (self->h_state == NL_HIST_AUTO_PRE) {
             unsigned n;
@@ -269,94 +1074,504 @@ void nlcali_calc(T self)
 }
 
 #define LOG_BUFSZ 1024
-char *nlcali_log(T self, const char *event)
+
+/* Bounded output for log messages. Like snprintf(), counts the
+   full length even when the buffer is too small. */
+struct nl_out_t {
+    char *buf;
+    size_t cap, len;
+};
+
+static void out_mem(struct nl_out_t *o, const char *s, size_t n)
+{
+    if (o->len + n < o->cap) {
+        memcpy(o->buf + o->len, s, n);
+    }
+    else if (o->len + 1 < o->cap) {
+        memcpy(o->buf + o->len, s, o->cap - 1 - o->len);
+    }
+    o->len += n;
+}
+
+#define out_str(O, S) out_mem((O), (S), strlen(S))
+
+static void out_double(struct nl_out_t *o, const char *key, double x)
+{
+    char num[NL_FMT_BUFSZ];
+
+    out_str(o, key);
+    out_mem(o, num, nl_fmt_double(num, x));
+}
+
+static void out_int(struct nl_out_t *o, const char *key, long long x)
+{
+    char num[NL_FMT_BUFSZ];
+
+    out_str(o, key);
+    out_mem(o, num, nl_fmt_int(num, x));
+}
+
+static void out_summ(struct nl_out_t *o, const char *const *keys,
+                     const struct nlcali_summ_t *sm)
+{
+    out_double(o, keys[0], sm->sum);
+    out_double(o, keys[1], sm->min);
+    out_double(o, keys[2], sm->max);
+    out_double(o, keys[3], sm->mean);
+    out_double(o, keys[4], sm->sd);
+}
+
+/* Estimated events in a histogram bin, see `scale` */
+static long long bin_count(T self, unsigned x)
+{
+    return 1 == self->scale ? x : (long long)(x * self->scale + 0.5);
+}
+
+static void out_bins(struct nl_out_t *o, const char *key, T self,
+                     const unsigned *data, unsigned n)
+{
+    char num[NL_FMT_BUFSZ];
+    unsigned i;
+
+    out_str(o, key);
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            out_mem(o, ",", 1);
+        }
+        out_mem(o, num, nl_fmt_int(num, bin_count(self, data[i])));
+    }
+}
+
+/* Keys for the duration, value, on- and off-CPU time histograms,
+   by whether they are log-linear */
+static const char *const hist_x_keys[NL_HIST_NX][2][4] = {
+    { { " h.dm=", " h.dx=", " h.dw=", " h.dd=" },
+      { " h.dp50=", " h.dp99=", " h.dp999=", " h.dpmax=" } },
+    { { " h.vm=", " h.vx=", " h.vw=", " h.vd=" },
+      { " h.vp50=", " h.vp99=", " h.vp999=", " h.vpmax=" } },
+    { { " h.cm=", " h.cx=", " h.cw=", " h.cd=" },
+      { " h.cp50=", " h.cp99=", " h.cp999=", " h.cpmax=" } },
+    { { " h.wm=", " h.wx=", " h.ww=", " h.wd=" },
+      { " h.wp50=", " h.wp99=", " h.wp999=", " h.wpmax=" } }
+};
+
+/* Duration, value or CPU time histogram: quantiles if log-linear,
+   else bins */
+static void out_hist_x(struct nl_out_t *o, T self, netlogger_hkind_t kind)
+{
+    const struct nlcali_hist_t *h = nl_hist_x(self, kind);
+    const char *const *keys;
+
+    if (h->state == NL_HIST_LOGLINEAR) {
+        keys = hist_x_keys[kind - NL_HIST_DUR][1];
+        out_double(o, keys[0], nlcali_hist_quantile(self, kind, 0.5));
+        out_double(o, keys[1], nlcali_hist_quantile(self, kind, 0.99));
+        out_double(o, keys[2], nlcali_hist_quantile(self, kind, 0.999));
+        out_double(o, keys[3], nlcali_hist_quantile(self, kind, 1));
+    }
+    else if (h->state != NL_HIST_OFF) {
+        keys = hist_x_keys[kind - NL_HIST_DUR][0];
+        out_double(o, keys[0], h->min);
+        out_double(o, keys[1], h->min + h->width * h->num);
+        out_double(o, keys[2], h->width);
+        out_bins(o, keys[3], self, h->data, h->num);
+    }
+}
+
+/* Keys of the perf_event summaries, by counter number as in
+   nlcali_perf_names[], then sum, min, max, mean and sd */
+static const char *const perf_keys[NL_PERF_MAX][5] = {
+    { " perf.task_clock.sum=", " perf.task_clock.min=",
+      " perf.task_clock.max=", " perf.task_clock.mean=",
+      " perf.task_clock.sd=" },
+    { " perf.ctx_switches.sum=", " perf.ctx_switches.min=",
+      " perf.ctx_switches.max=", " perf.ctx_switches.mean=",
+      " perf.ctx_switches.sd=" },
+    { " perf.page_faults.sum=", " perf.page_faults.min=",
+      " perf.page_faults.max=", " perf.page_faults.mean=",
+      " perf.page_faults.sd=" },
+    { " perf.migrations.sum=", " perf.migrations.min=",
+      " perf.migrations.max=", " perf.migrations.mean=",
+      " perf.migrations.sd=" },
+    { " perf.cycles.sum=", " perf.cycles.min=",
+      " perf.cycles.max=", " perf.cycles.mean=",
+      " perf.cycles.sd=" },
+    { " perf.instructions.sum=", " perf.instructions.min=",
+      " perf.instructions.max=", " perf.instructions.mean=",
+      " perf.instructions.sd=" },
+    { " perf.cache_misses.sum=", " perf.cache_misses.min=",
+      " perf.cache_misses.max=", " perf.cache_misses.mean=",
+      " perf.cache_misses.sd=" }
+};
+
+/* Summaries of the perf_event counters, as perf.<name>.<stat> */
+static void out_perf(struct nl_out_t *o, T self)
+{
+    const struct nlcali_perf_t *pf = self->perf;
+    unsigned k;
+
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        if (pf->events & (1u << k)) {
+            out_summ(o, perf_keys[k], &pf->sm[k]);
+        }
+    }
+}
+
+static const char *const summ_keys[5][5] = {
+    { " v.sum=", " v.min=", " v.max=", " v.mean=", " v.sd=" },
+    { " r.sum=", " r.min=", " r.max=", " r.mean=", " r.sd=" },
+    { " g.sum=", " g.min=", " g.max=", " g.mean=", " g.sd=" },
+    { " cpu.sum=", " cpu.min=", " cpu.max=", " cpu.mean=", " cpu.sd=" },
+    { " wait.sum=", " wait.min=", " wait.max=", " wait.mean=",
+      " wait.sd=" }
+};
+
+size_t nlcali_log_into(T self, const char *event, char *buf, size_t cap)
 {
     struct timeval now;
-    char *msg;
-    char *ts, *p;
-    int msg_size, len;
+    struct nl_out_t o;
+    char ts[32];
+    int len;
 
     gettimeofday(&now, NULL);
     if (self->dirty) {
         nlcali_calc(self);
-    }    
-    msg_size = LOG_BUFSZ;
-    p = msg = malloc(msg_size);
-    if (NULL == p) {
-        return NULL;
     }
-    strcpy(p, "ts=");
-    p += 3;
-    len = format_iso8601(&now, p);
-    if ( -1 == len ) goto error;
-    p += len;
-#define SF self /* alias, cosmetic */
-    len = sprintf(p, " event=%s "
-            "v.sum=%lf v.min=%lf v.max=%lf v.mean=%lf v.sd=%lf "
-            "r.sum=%lf r.min=%lf r.max=%lf r.mean=%lf r.sd=%lf "
-            "g.sum=%lf g.min=%lf g.max=%lf g.mean=%lf g.sd=%lf "
-            "count=%lld dur=%lf dur.i=%lf",
-            event,
-            SF->vsm.sum, SF->vsm.min, SF->vsm.max, SF->vsm.mean, SF->vsm.sd, 
-            SF->rsm.sum, SF->rsm.min, SF->rsm.max, SF->rsm.mean, SF->rsm.sd,
-            SF->gsm.sum, SF->gsm.min, SF->gsm.max, SF->gsm.mean, SF->gsm.sd,
-            SF->vsm.count, SF->dur, SF->dur_sum);
-#undef SF
-    if (-1 == len) goto error;
-    p += len;
+    o.buf = buf;
+    o.cap = cap;
+    o.len = 0;
+    out_mem(&o, "ts=", 3);
+    len = format_iso8601(&now, ts);
+    if (len > 0) {
+        out_mem(&o, ts, len);
+    }
+    out_str(&o, " event=");
+    out_str(&o, event);
+    out_summ(&o, summ_keys[0], &self->vsm);
+    out_summ(&o, summ_keys[1], &self->rsm);
+    out_summ(&o, summ_keys[2], &self->gsm);
+    out_int(&o, " count=", self->vsm.count);
+    out_double(&o, " dur=", self->dur);
+    out_double(&o, " dur.i=", self->dur_sum);
+    if (NULL != self->cpu) {
+        out_summ(&o, summ_keys[3], &self->cpu->csm);
+        out_summ(&o, summ_keys[4], &self->cpu->wsm);
+    }
+    if (self->scale != 1) {
+        out_double(&o, " scale=", self->scale);
+    }
+    if (self->inflight_max > 0) {
+        out_int(&o, " inflight=", self->inflight);
+        out_int(&o, " inflight.max=", self->inflight_max);
+    }
+    /* quantile sketches */
+    if (NULL != self->vsk) {
+        out_double(&o, " v.p50=", nl_tdigest_quantile(self->vsk, 0.5));
+        out_double(&o, " v.p99=", nl_tdigest_quantile(self->vsk, 0.99));
+        out_double(&o, " v.p999=", nl_tdigest_quantile(self->vsk, 0.999));
+        out_double(&o, " r.p50=", nl_tdigest_quantile(self->rsk, 0.5));
+        out_double(&o, " r.p99=", nl_tdigest_quantile(self->rsk, 0.99));
+        out_double(&o, " r.p999=", nl_tdigest_quantile(self->rsk, 0.999));
+        out_double(&o, " g.p50=", nl_tdigest_quantile(self->gsk, 0.5));
+        out_double(&o, " g.p99=", nl_tdigest_quantile(self->gsk, 0.99));
+        out_double(&o, " g.p999=", nl_tdigest_quantile(self->gsk, 0.999));
+    }
+    /* log-linear histogram: too many bins to list, give quantiles */
+    if (self->h_state == NL_HIST_LOGLINEAR) {
+        out_double(&o, " h.rp50=",
+                   nlcali_hist_quantile(self, NL_HIST_RATE, 0.5));
+        out_double(&o, " h.rp99=",
+                   nlcali_hist_quantile(self, NL_HIST_RATE, 0.99));
+        out_double(&o, " h.rp999=",
+                   nlcali_hist_quantile(self, NL_HIST_RATE, 0.999));
+        out_double(&o, " h.rpmax=",
+                   nlcali_hist_quantile(self, NL_HIST_RATE, 1));
+        out_double(&o, " h.gp50=",
+                   nlcali_hist_quantile(self, NL_HIST_GAP, 0.5));
+        out_double(&o, " h.gp99=",
+                   nlcali_hist_quantile(self, NL_HIST_GAP, 0.99));
+        out_double(&o, " h.gp999=",
+                   nlcali_hist_quantile(self, NL_HIST_GAP, 0.999));
+        out_double(&o, " h.gpmax=",
+                   nlcali_hist_quantile(self, NL_HIST_GAP, 1));
+    }
     /* histogram */
-    if (NL_HIST_HAS_DATA(self)) {
-        int i, need, avail;
-        char numbuf[32];
-        double h_rmax = self->h_rmin + self->h_rwidth * self->h_num;
-        double h_gmax = self->h_gmin + self->h_gwidth * self->h_num;
-        
-        /* see if all values will fit */
-        avail = msg_size - (int)(p - msg) - 1;
-        need = 6*4; /* space + h.rd=, h.rw=, h.rm= h.rx= */
-        need += sprintf(numbuf, "%lf", self->h_rmin);
-        need += sprintf(numbuf, "%lf", h_rmax);
-        need += sprintf(numbuf, "%lf", self->h_rwidth);
-        for (i=0; i < self->h_num; i++) {
-            need += 1 + sprintf(numbuf, "%d", self->h_rdata[i]);
+    else if (NL_HIST_HAS_DATA(self)) {
+        /* - rate - */
+        out_double(&o, " h.rm=", self->h_rmin);
+        out_double(&o, " h.rx=", self->h_rmin + self->h_rwidth * self->h_num);
+        out_double(&o, " h.rw=", self->h_rwidth);
+        out_bins(&o, " h.rd=", self, self->h_rdata, self->h_num);
+        /* - gap - */
+        out_double(&o, " h.gm=", self->h_gmin);
+        out_double(&o, " h.gx=", self->h_gmin + self->h_gwidth * self->h_num);
+        out_double(&o, " h.gw=", self->h_gwidth);
+        out_bins(&o, " h.gd=", self, self->h_gdata, self->h_num);
+    }
+    out_hist_x(&o, self, NL_HIST_DUR);
+    out_hist_x(&o, self, NL_HIST_VALUE);
+    out_hist_x(&o, self, NL_HIST_CPU);
+    out_hist_x(&o, self, NL_HIST_WAIT);
+    if (NULL != self->perf) {
+        out_perf(&o, self);
+    }
+    if (o.len < cap) {
+        buf[o.len] = '\0';
+    }
+    else if (cap > 0) {
+        buf[cap - 1] = '\0';
+    }
+    return o.len;
+}
+
+char *nlcali_log_buf(T self, const char *event, struct nlcali_logbuf_t *lb)
+{
+    size_t len, cap;
+    char *p;
+
+    len = nlcali_log_into(self, event, lb->buf, lb->cap);
+    if (len >= lb->cap) {
+        /* grow, and format again */
+        cap = MAX(len + 1, 2 * lb->cap);
+        p = realloc(lb->buf, cap);
+        if (NULL == p) {
+            return NULL;
+        }
+        lb->buf = p;
+        lb->cap = cap;
+        nlcali_log_into(self, event, lb->buf, lb->cap);
+    }
+    return lb->buf;
+}
+
+void nlcali_logbuf_free(struct nlcali_logbuf_t *lb)
+{
+    free(lb->buf);
+    lb->buf = NULL;
+    lb->cap = 0;
+}
+
+char *nlcali_log(T self, const char *event)
+{
+    struct nlcali_logbuf_t lb;
+
+    lb.cap = LOG_BUFSZ;
+    lb.buf = malloc(lb.cap);
+    if (NULL == lb.buf) {
+        return NULL;
+    }
+    if (NULL == nlcali_log_buf(self, event, &lb)) {
+        nlcali_logbuf_free(&lb);
+        return NULL;
+    }
+    return lb.buf;
+}
+
+/* Keys for the duration, value and CPU time histograms, as for
+   hist_x_keys */
+static const char *const psdata_x_keys[NL_HIST_NX][2][4] = {
+    { { "h_dm", "h_dw", "h_dd", NULL },
+      { "h_dp50", "h_dp99", "h_dp999", "h_dpmax" } },
+    { { "h_vm", "h_vw", "h_vd", NULL },
+      { "h_vp50", "h_vp99", "h_vp999", "h_vpmax" } },
+    { { "h_cm", "h_cw", "h_cd", NULL },
+      { "h_cp50", "h_cp99", "h_cp999", "h_cpmax" } },
+    { { "h_wm", "h_ww", "h_wd", NULL },
+      { "h_wp50", "h_wp99", "h_wp999", "h_wpmax" } }
+};
+
+/* Duration, value or CPU time histogram: quantiles if log-linear,
+   else bins */
+static void psdata_hist_x(T self, bson_buffer *bb, netlogger_hkind_t kind)
+{
+    const struct nlcali_hist_t *h = nl_hist_x(self, kind);
+    const char *const *keys;
+    unsigned i;
+
+    if (h->state == NL_HIST_LOGLINEAR) {
+        keys = psdata_x_keys[kind - NL_HIST_DUR][1];
+        bson_append_double(bb, keys[0],
+                           nlcali_hist_quantile(self, kind, 0.5));
+        bson_append_double(bb, keys[1],
+                           nlcali_hist_quantile(self, kind, 0.99));
+        bson_append_double(bb, keys[2],
+                           nlcali_hist_quantile(self, kind, 0.999));
+        bson_append_double(bb, keys[3],
+                           nlcali_hist_quantile(self, kind, 1));
+    }
+    else if (h->state != NL_HIST_OFF) {
+        keys = psdata_x_keys[kind - NL_HIST_DUR][0];
+        bson_append_double(bb, keys[0], h->min);
+        bson_append_double(bb, keys[1], h->width);
+        bson_append_start_array(bb, keys[2]);
+        for (i = 0; i < h->num; i++) {
+            bson_append_int(bb, bson_numstrs[i],
+                            bin_count(self, h->data[i]));
         }
-        need += 6*4; /* space + h.gd=, h.gw=, h.gm= h.gx= */
-        need += sprintf(numbuf, "%lf", self->h_gmin);
-        need += sprintf(numbuf, "%lf", h_gmax);
-        need += sprintf(numbuf, "%lf", self->h_gwidth);
+        bson_append_finish_object(bb);
+    }
+}
+
+static const char *const psdata_summ_keys[2][5] = {
+    { "sum_cpu", "min_cpu", "max_cpu", "mean_cpu", "sd_cpu" },
+    { "sum_wait", "min_wait", "max_wait", "mean_wait", "sd_wait" }
+};
+
+/* One summary, under `keys` for sum, min, max, mean and sd */
+static void psdata_summ(bson_buffer *bb, const char *const *keys,
+                        const struct nlcali_summ_t *sm)
+{
+    bson_append_double(bb, keys[0], sm->sum);
+    bson_append_double(bb, keys[1], sm->min);
+    bson_append_double(bb, keys[2], sm->max);
+    bson_append_double(bb, keys[3], sm->mean);
+    bson_append_double(bb, keys[4], sm->sd);
+}
+
+/* psdata keys of the perf_event summaries, as <stat>_<name> */
+static const char *const psdata_perf_keys[NL_PERF_MAX][5] = {
+    { "sum_task_clock", "min_task_clock", "max_task_clock",
+      "mean_task_clock", "sd_task_clock" },
+    { "sum_ctx_switches", "min_ctx_switches", "max_ctx_switches",
+      "mean_ctx_switches", "sd_ctx_switches" },
+    { "sum_page_faults", "min_page_faults", "max_page_faults",
+      "mean_page_faults", "sd_page_faults" },
+    { "sum_migrations", "min_migrations", "max_migrations",
+      "mean_migrations", "sd_migrations" },
+    { "sum_cycles", "min_cycles", "max_cycles", "mean_cycles", "sd_cycles" },
+    { "sum_instructions", "min_instructions", "max_instructions",
+      "mean_instructions", "sd_instructions" },
+    { "sum_cache_misses", "min_cache_misses", "max_cache_misses",
+      "mean_cache_misses", "sd_cache_misses" }
+};
+
+static void psdata_perf(T self, bson_buffer *bb)
+{
+    const struct nlcali_perf_t *pf = self->perf;
+    unsigned k;
+
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        if (pf->events & (1u << k)) {
+            psdata_summ(bb, psdata_perf_keys[k], &pf->sm[k]);
+        }
+    }
+}
+
+/* Append the fields of a perfSONAR data block */
+static int psdata_fields(T self, bson_buffer *bb, const char *m_id,
+                         int32_t sample_num, double ts)
+{
+    unsigned i;
+
+    if (self->dirty) {
+        nlcali_calc(self);
+    }
+    bson_append_string(bb, "mid", m_id);
+    bson_append_start_array(bb, "data");
+    bson_append_double(bb, "ts", ts);
+    bson_append_int(bb, "_sample", sample_num);
+    bson_append_double(bb, "sum_v", self->vsm.sum);
+    bson_append_double(bb, "min_v", self->vsm.min);
+    bson_append_double(bb, "max_v", self->vsm.max);
+    bson_append_double(bb, "mean_v", self->vsm.mean);
+    bson_append_double(bb, "sd_v", self->vsm.sd);
+    bson_append_double(bb, "sum_r", self->rsm.sum);
+    bson_append_double(bb, "min_r", self->rsm.min);
+    bson_append_double(bb, "max_r", self->rsm.max);
+    bson_append_double(bb, "sd_r", self->rsm.sd);
+    bson_append_double(bb, "sum_g", self->gsm.sum);
+    bson_append_double(bb, "min_g", self->gsm.min);
+    bson_append_double(bb, "max_g", self->gsm.max);
+    bson_append_double(bb, "sd_g", self->gsm.sd);
+    bson_append_int(bb, "count", self->vsm.count);
+    bson_append_double(bb, "dur", self->dur);
+    bson_append_double(bb, "dur_inst", self->dur_sum);
+    if (NULL != self->cpu) {
+        psdata_summ(bb, psdata_summ_keys[0], &self->cpu->csm);
+        psdata_summ(bb, psdata_summ_keys[1], &self->cpu->wsm);
+    }
+    if (self->scale != 1) {
+        bson_append_double(bb, "scale", self->scale);
+    }
+    if (self->inflight_max > 0) {
+        bson_append_int(bb, "inflight", self->inflight);
+        bson_append_int(bb, "inflight_max", self->inflight_max);
+    }
+    /* quantile sketches */
+    if (NULL != self->vsk) {
+        bson_append_double(bb, "p50_v", nl_tdigest_quantile(self->vsk, 0.5));
+        bson_append_double(bb, "p99_v", nl_tdigest_quantile(self->vsk, 0.99));
+        bson_append_double(bb, "p999_v",
+                           nl_tdigest_quantile(self->vsk, 0.999));
+        bson_append_double(bb, "p50_r", nl_tdigest_quantile(self->rsk, 0.5));
+        bson_append_double(bb, "p99_r", nl_tdigest_quantile(self->rsk, 0.99));
+        bson_append_double(bb, "p999_r",
+                           nl_tdigest_quantile(self->rsk, 0.999));
+        bson_append_double(bb, "p50_g", nl_tdigest_quantile(self->gsk, 0.5));
+        bson_append_double(bb, "p99_g", nl_tdigest_quantile(self->gsk, 0.99));
+        bson_append_double(bb, "p999_g",
+                           nl_tdigest_quantile(self->gsk, 0.999));
+    }
+    /* log-linear histogram, as quantiles */
+    if (self->h_state == NL_HIST_LOGLINEAR) {
+        bson_append_double(bb, "h_rp50",
+                           nlcali_hist_quantile(self, NL_HIST_RATE, 0.5));
+        bson_append_double(bb, "h_rp99",
+                           nlcali_hist_quantile(self, NL_HIST_RATE, 0.99));
+        bson_append_double(bb, "h_rp999",
+                           nlcali_hist_quantile(self, NL_HIST_RATE, 0.999));
+        bson_append_double(bb, "h_rpmax",
+                           nlcali_hist_quantile(self, NL_HIST_RATE, 1));
+        bson_append_double(bb, "h_gp50",
+                           nlcali_hist_quantile(self, NL_HIST_GAP, 0.5));
+        bson_append_double(bb, "h_gp99",
+                           nlcali_hist_quantile(self, NL_HIST_GAP, 0.99));
+        bson_append_double(bb, "h_gp999",
+                           nlcali_hist_quantile(self, NL_HIST_GAP, 0.999));
+        bson_append_double(bb, "h_gpmax",
+                           nlcali_hist_quantile(self, NL_HIST_GAP, 1));
+    }
+    /* add histogram data, if being recorded; there are
+       at most NL_MAX_HIST_BINS, so keys come from a table */
+    else if (NL_HIST_HAS_DATA(self)) {
+        /* rate hist */
+        bson_append_double(bb, "h_rm", self->h_rmin);
+        bson_append_double(bb, "h_rw", self->h_rwidth);
+        bson_append_start_array(bb, "h_rd");
         for (i=0; i < self->h_num; i++) {
-            need += 1 + sprintf(numbuf, "%d", self->h_gdata[i]);
+            bson_append_int(bb, bson_numstrs[i],
+                            bin_count(self, self->h_rdata[i]));
         }
-        /* if they fit, then add histogram */
-        if (need <= avail) {
-            /* - rate - */
-            p += sprintf(p, " h.rm=%lf", self->h_rmin);
-            p += sprintf(p, " h.rx=%lf", h_rmax);
-            p += sprintf(p, " h.rw=%lf", self->h_rwidth);
-            p += sprintf(p, " h.rd=");
-            /* print each buckets' size */
-            for (i=0; i < self->h_num-1; i++) {
-                p += sprintf(p, "%d,", self->h_rdata[i]);
-            }
-            /* final one without trailing delimiter */
-            p += sprintf(p, "%d", self->h_rdata[self->h_num - 1]);
-            /* - gap - */
-            p += sprintf(p, " h.gm=%lf", self->h_gmin);
-            p += sprintf(p, " h.gx=%lf", h_gmax);
-            p += sprintf(p, " h.gw=%lf", self->h_gwidth);
-            p += sprintf(p, " h.gd=");
-            /* print each buckets' size */
-            for (i=0; i < self->h_num-1; i++) {
-                p += sprintf(p, "%d,", self->h_gdata[i]);
-            }
-            /* final one without trailing delimiter */
-            p += sprintf(p, "%d", self->h_gdata[self->h_num - 1]);
+        bson_append_finish_object(bb);
+        /* gap hist */
+        bson_append_double(bb, "h_gm", self->h_gmin);
+        bson_append_double(bb, "h_gw", self->h_gwidth);
+        bson_append_start_array(bb, "h_gd");
+        for (i=0; i < self->h_num; i++) {
+            bson_append_int(bb, bson_numstrs[i],
+                            bin_count(self, self->h_gdata[i]));
         }
+        bson_append_finish_object(bb);
     }
-    return msg;
-error:
-    if (msg) free(msg);
-    return NULL;
+    psdata_hist_x(self, bb, NL_HIST_DUR);
+    psdata_hist_x(self, bb, NL_HIST_VALUE);
+    psdata_hist_x(self, bb, NL_HIST_CPU);
+    psdata_hist_x(self, bb, NL_HIST_WAIT);
+    if (NULL != self->perf) {
+        psdata_perf(self, bb);
+    }
+    if (NULL == bson_append_finish_object(bb)) {
+        return -1;
+    }
+    return 0;
+}
+
+static double psdata_now(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec/1e6;
 }
 
 /**
@@ -365,83 +1580,86 @@ error:
 bson *nlcali_psdata(T self, const char *event, const char *m_id,
                                 int32_t sample_num)
 {
-    struct timeval now;
     bson_buffer bb;
     bson *bp = NULL;
    
     assert(self && event && m_id);
 
-    gettimeofday(&now, NULL);
-    if (self->dirty) {
-        nlcali_calc(self);
-    }
-    
     bson_buffer_init(&bb);
     bson_ensure_space(&bb, LOG_BUFSZ);
-    
-    bson_append_string(&bb, "mid", m_id);
-    bson_append_start_array(&bb, "data");
-    bson_append_double(&bb, "ts", now.tv_sec + now.tv_usec/1e6);
-    bson_append_int(&bb, "_sample", sample_num);
-    bson_append_double(&bb, "sum_v", self->vsm.sum);
-    bson_append_double(&bb, "min_v", self->vsm.min);
-    bson_append_double(&bb, "max_v", self->vsm.max);
-    bson_append_double(&bb, "mean_v", self->vsm.mean);
-    bson_append_double(&bb, "sd_v", self->vsm.sd);
-    bson_append_double(&bb, "sum_r", self->rsm.sum);
-    bson_append_double(&bb, "min_r", self->rsm.min);
-    bson_append_double(&bb, "max_r", self->rsm.max);
-    bson_append_double(&bb, "sd_r", self->rsm.sd);
-    bson_append_double(&bb, "sum_g", self->gsm.sum);
-    bson_append_double(&bb, "min_g", self->gsm.min);
-    bson_append_double(&bb, "max_g", self->gsm.max);
-    bson_append_double(&bb, "sd_g", self->gsm.sd);
-    bson_append_int(&bb, "count", self->vsm.count);
-    bson_append_double(&bb, "dur", self->dur);
-    bson_append_double(&bb, "dur_inst", self->dur_sum);
-    /* add histogram data, if being recorded */
-    if (NL_HIST_HAS_DATA(self)) {
-        int i;
-        char idx[16];
-        /* rate hist */
-        bson_append_double(&bb, "h_rm", self->h_rmin);
-        bson_append_double(&bb, "h_rw", self->h_rwidth);
-        bson_append_start_array(&bb, "h_rd");
-        for (i=0; i < self->h_num; i++) {
-            sprintf(idx, "%d", i);
-            bson_append_int(&bb, idx, self->h_rdata[i]);            
-        }
-        bson_append_finish_object(&bb);
-        /* gap hist */
-        bson_append_double(&bb, "h_gm", self->h_gmin);
-        bson_append_double(&bb, "h_gw", self->h_gwidth);
-        bson_append_start_array(&bb, "h_gd");
-        for (i=0; i < self->h_num; i++) {
-            sprintf(idx, "%d", i);
-            bson_append_int(&bb, idx, self->h_gdata[i]);            
-        }
-        bson_append_finish_object(&bb);
+    if (0 != psdata_fields(self, &bb, m_id, sample_num, psdata_now())) {
+        goto error;
     }
-
-    bson_append_finish_object(&bb);
-
     bp = malloc(sizeof(bson));
+    if (NULL == bp) {
+        goto error;
+    }
     bson_from_buffer(bp, &bb);
 
     return(bp);
 
  error:
-    if (bp) {
-        bson_destroy(bp);
-        free(bp);
-    }
     bson_buffer_destroy(&bb);
     return(NULL);
 }
 
+int nlcali_psdata_append(T self, bson_buffer *bb, const char *m_id,
+                         int32_t sample_num)
+{
+    assert(self && bb && m_id);
+
+    return psdata_fields(self, bb, m_id, sample_num, psdata_now());
+}
+
+const char *nlcali_psdata_multi(bson_buffer *bb, T *calipers,
+                                const char *const *m_ids, unsigned n,
+                                int32_t sample_num)
+{
+    char idx[16];
+    double ts;
+    unsigned i;
+
+    assert(bb);
+
+    ts = psdata_now();
+    bson_append_start_array(bb, "blocks");
+    for (i = 0; i < n; i++) {
+        bson_numstr(idx, i);
+        bson_append_start_object(bb, idx);
+        if (0 != psdata_fields(calipers[i], bb, m_ids[i], sample_num, ts)) {
+            return NULL;
+        }
+        bson_append_finish_object(bb);
+    }
+    bson_append_finish_object(bb);
+    return bson_buffer_finish(bb);
+}
+
+
+void nlcali_fini(T self)
+{
+    if (self) {
+        nl_calipers_hist_init(self, 0, 0, 0);
+        free(self->h_xdata);
+        self->h_xdata = NULL;
+        memset(&self->h_dur, 0, sizeof(self->h_dur));
+        memset(&self->h_val, 0, sizeof(self->h_val));
+        memset(&self->h_cpu, 0, sizeof(self->h_cpu));
+        memset(&self->h_wait, 0, sizeof(self->h_wait));
+        self->opts &= ~NL_OPT_HIST;
+        nlcali_sketch(self, 0);
+        nlcali_window(self, 0, 0, 0);
+        nlcali_trace(self, 0);
+        nlcali_sample(self, 0, 0);
+        nlcali_perf(self, 0);
+        nlcali_cpu(self, 0);
+    }
+}
+
 void nlcali_free(T self)
 {
     if (self) {
+        nlcali_fini(self);
         free(self);
     }
 }
@@ -5,8 +5,10 @@
  * Efficient summarization of measured activites.
  */
  
-#include <string.h> /* for memcpy() in macro */
+#include <stdint.h>
+#include <time.h> /* for clock_gettime() in macro */
 #include "bson.h"
+#include "nl_tdigest.h"
 
 #ifndef NETLOGGER_CALIPERS_INCLUDED
 #    define NETLOGGER_CALIPERS_INCLUDED
@@ -21,6 +23,10 @@ extern "C" {
 /* Limit max # of histogram bins */
 #define NL_MAX_HIST_BINS 100
 
+/* Limits for log-linear histograms */
+#define NL_MAX_LL_BINS 65536
+#define NL_MAX_LL_DIGITS 3
+
 struct netlogger_wvar_t {
 	double m;
 	double t;
@@ -29,19 +35,62 @@ struct netlogger_wvar_t {
 };
 
 struct netlogger_ksum_t {
-	double s, c, y, t;
+	double s, c;
 };
 
+/** Clock sources for timing begin/end pairs.
+ *
+ * All clocks are read as raw 64-bit ticks; ticks are only
+ * converted to seconds when statistics are calculated.
+ */
+typedef enum {
+     NL_CLOCK_MONOTONIC=0,     /* clock_gettime(CLOCK_MONOTONIC), vDSO */
+     NL_CLOCK_MONOTONIC_RAW=1, /* clock_gettime(CLOCK_MONOTONIC_RAW) */
+     NL_CLOCK_TSC=2            /* calibrated rdtsc/rdtscp (x86 only) */
+} netlogger_clock_t;
+
+#define NL_CLOCK_DEFAULT NL_CLOCK_MONOTONIC
+
+/** Raw clock reading */
+typedef uint64_t nl_ticks_t;
+
 typedef enum { 
      NL_HIST_OFF=0,
      NL_HIST_AUTO_PRE=1, /* past this point, add data */
      NL_HIST_MANUAL=2,
      NL_HIST_AUTO_READY=3,
-     NL_HIST_AUTO_FULL=4
+     NL_HIST_AUTO_FULL=4,
+     NL_HIST_LOGLINEAR=5
 } netlogger_hstate_t;
 
+/** Which metric */
+typedef enum {
+     NL_VALUE=0,
+     NL_RATE=1,
+     NL_GAP=2
+} netlogger_metric_t;
+
+/** Which histogram */
+typedef enum {
+     NL_HIST_RATE=0,
+     NL_HIST_GAP=1,
+     NL_HIST_DUR=2,   /* duration, see nlcali_hist_kind_manual() */
+     NL_HIST_VALUE=3, /* value, likewise */
+     NL_HIST_CPU=4,   /* on-CPU time, likewise; see nlcali_cpu() */
+     NL_HIST_WAIT=5   /* off-CPU (wait) time, likewise */
+} netlogger_hkind_t;
+
+/** Instruction sets for nlcali_add_batch() */
+typedef enum {
+     NL_SIMD_AUTO=0,   /* best available */
+     NL_SIMD_SCALAR=1,
+     NL_SIMD_AVX2=2,
+     NL_SIMD_AVX512=3
+} netlogger_simd_t;
+
 /**
  * Summary statistics for caliper metrics.
+ * Set by nlcali_calc().
  */
 struct nlcali_summ_t {
     double sum;      /**< Sum of values */
@@ -50,11 +99,72 @@ struct nlcali_summ_t {
     double mean;     /**< Mean value (=sum/count) */
     double sd;       /**< Standard deviation of value */
     long long count; /**< Count of values */
-    /* internal variables */
-    struct netlogger_wvar_t var; /**< Streaming variance */
+};
+
+/**
+ * Running state for one metric, updated by every event.
+ * Exactly one 64-byte cache line.
+ */
+struct nlcali_acc_t {
     struct netlogger_ksum_t ksum; /**< Kahan sum */
+    struct netlogger_wvar_t var;  /**< Streaming variance */
+    double min;      /**< Smallest value */
+    double max;      /**< Largest value */
+    long long count; /**< Count of values */
 };
 
+/**
+ * Histogram of durations, values or CPU times, set up by
+ * nlcali_hist_kind_manual() or nlcali_hist_kind_loglinear().
+ */
+struct nlcali_hist_t {
+    unsigned *data;     /**< Bins, NULL if off */
+    netlogger_hstate_t state; /**< NL_HIST_OFF, NL_HIST_MANUAL or
+                                   NL_HIST_LOGLINEAR */
+    unsigned num;       /**< Number of bins, 0 if off */
+    unsigned sub_bits;  /**< Log-linear: log2 of the number of bins
+                             per power of two */
+    double min;         /**< Value at left edge of first bin */
+    double width;       /**< Bin width, 0 if log-linear */
+    int64_t base;       /**< Log-linear: bits of `min`, shifted as per
+                             NL_HBIN_LL() */
+};
+
+/* Size of a cache line, for alignment */
+#define NL_CACHE_LINE 64
+
+/* Optional features, bits of `opts` in struct nlcali_t */
+#define NL_OPT_SKETCH 0x1 /* quantile sketches, see nlcali_sketch() */
+#define NL_OPT_WINDOW 0x2 /* recent statistics, see nlcali_window() */
+#define NL_OPT_TRACE  0x4 /* raw event trace, see nlcali_trace() */
+#define NL_OPT_SAMPLE 0x8 /* timing 1 event in N, see nlcali_sample() */
+#define NL_OPT_HIST   0x10 /* duration and value histograms, recorded
+                              inline, see nlcali_hist_kind_manual() */
+#define NL_OPT_PERF   0x20 /* perf_event counters, read inline by
+                              nlcali_begin()/nlcali_end(), see
+                              nlcali_perf() */
+#define NL_OPT_CPU    0x40 /* on-/off-CPU time, read inline by
+                              nlcali_begin()/nlcali_end(), see
+                              nlcali_cpu() */
+/* Options handled inline, rather than by nlcali_add_opt() */
+#define NL_OPT_INLINE (NL_OPT_HIST | NL_OPT_PERF | NL_OPT_CPU)
+
+/* Counters for nlcali_perf(). Counter number k is bit 1 << k. */
+#define NL_PERF_MAX 7
+#define NL_PERF_TASK_CLOCK   0x01 /* ns on a CPU */
+#define NL_PERF_CTX_SWITCHES 0x02 /* context switches */
+#define NL_PERF_PAGE_FAULTS  0x04 /* page faults */
+#define NL_PERF_MIGRATIONS   0x08 /* moves to another CPU */
+#define NL_PERF_CYCLES       0x10 /* CPU cycles */
+#define NL_PERF_INSTRUCTIONS 0x20 /* instructions retired */
+#define NL_PERF_CACHE_MISSES 0x40 /* last-level cache misses */
+#define NL_PERF_SOFTWARE     0x0f /* kernel-counted, always there */
+#define NL_PERF_HARDWARE     0x70 /* PMU, often missing in VMs */
+#define NL_PERF_ALL          0x7f
+
+/** Names of the counters, by number, as used in the output */
+extern const char *const nlcali_perf_names[NL_PERF_MAX];
+
 #define T nlcali_T
 
 /** Hold current values for a single "caliper".
@@ -62,41 +172,334 @@ struct nlcali_summ_t {
  * Each "caliper" tracks statistics for a univariate time-series.
  * Summary statistics tracked include the count, sum, mean, min, max,
  * and standard deviation.
+ *
+ * Fields are grouped by how often they are used. In memory aligned
+ * to NL_CACHE_LINE, as from nlcali_new(), an event with no rate
+ * touches two cache lines (value accumulator and event state); one
+ * with a rate touches five, plus one more and the histogram bins if
+ * those are on, or if it is timed with nlcali_start()/nlcali_stop().
+ * An event sampled out by nlcali_sample() touches three: value
+ * accumulator, event state and the line with `untimed`.
+ * Optional features such as sketches are handled out of line, by
+ * nlcali_add_opt(), and cost one test of `opts` when they are off.
+ * The duration and value histograms are also behind that test, but
+ * recorded inline; together they read two more lines and one block
+ * of bins.
+ * perf_event counters (see nlcali_perf()) and the thread CPU clock
+ * (see nlcali_cpu()) are read by nlcali_begin() and nlcali_end()
+ * after the same test.
+ * Results are only written by nlcali_calc().
  */
 struct nlcali_t {
-    /* summaries */
-    struct nlcali_summ_t vsm; /**< Summary of: value. */
-    struct nlcali_summ_t rsm; /**< Summary of: duration/value (rate). */
-    struct nlcali_summ_t gsm;  /**< Summary of: value/duration (gap). */
-    double dur_sum; /**< Sum of all durations between begin/end. */
-    double dur; /**< Total duration between first begin and last end. */
-    /* histogram */
+    /* lines 0-2: accumulators, written by every event */
+    struct nlcali_acc_t vacc; /**< Accumulator for value */
+    struct nlcali_acc_t racc; /**< Accumulator for rate */
+    struct nlcali_acc_t gacc; /**< Accumulator for gap */
+    /* line 3: event state, written by every event */
+    volatile unsigned seq; /**< Sequence lock, odd while nlcali_end()
+                                is updating the accumulators. */
+    unsigned is_begun;  /**< Are we in the middle of a begin/end?
+                             1 if timed, 2 if sampled out */
+    unsigned dirty;     /**< Flag, has the data been updated since last
+                            call nlcali_calc()? */
+    netlogger_clock_t clock; /**< Clock source for begin/end. */
+    nl_ticks_t begin; /**< Clock ticks for most recent caliper begin */
+    nl_ticks_t end;   /**< Clock ticks for most recent caliper end */
+    nl_ticks_t dur_ticks; /**< Raw clock ticks summed into `dur_sum`. */
+    double tick_ns; /**< Nanoseconds per clock tick. */
+    nl_ticks_t first; /**< Clock ticks for the earliest begin of a timed
+                           event since the last clear(), or NL_TICKS_NONE
+                           if there is none. This is used to calculate
+                           `dur`. */
+    unsigned opts;    /**< Optional features that see every event,
+                           a mask of NL_OPT_* (see nlcali_add_opt()) */
+    unsigned skip;    /**< Events to record untimed before the next
+                           timed one (see nlcali_sample()) */
+    /* line 4: histogram configuration, read by every event */
     netlogger_hstate_t h_state; /**< Current state of histogram data. */
+    unsigned int h_num; /**< Number of histogram bins, 0=none */
+    unsigned h_sub_bits; /**< Log-linear histogram: log2 of the number
+                              of bins per power of two */
     /** Number of pre-init phases left before an automatically
         configured histogram can be filled with data. */
     int h_auto_pre;
-    unsigned int h_num; /**< Number of histogram bins, 0=none */
     double h_rmin;      /**< Histogram of rates, minimum value */
     double h_rwidth;    /**< Histogram of rates, bin width */
-    unsigned *h_rdata;  /**< Data for histogram of rates */
     double h_gmin;      /**< Histogram of gaps, minimum value */
     double h_gwidth;    /**< Histogram of gaps, bin width */
-    unsigned *h_gdata;  /**< Data for histogram of gaps */
-    /* internal variables */
-    unsigned is_begun;  /**< Flag, are we in the middle of a begin/end? */
-    unsigned dirty;     /**< Flag, has the data been updated since last
-                            call nlcali_calc()? */
-    struct timeval begin; /**< Timestamp for most recent caliper begin */
-    struct timeval end;   /**< Timestamp for most recent caliper end */
-    struct timeval first; /**< Timestamp for the first caliper begin since
-                               the last clear(). This is used to calculate
-                               `dur`. */
+    int64_t h_rbase;    /**< Log-linear histogram of rates: bits of the
+                             smallest value, shifted as per NL_HBIN_LL() */
+    int64_t h_gbase;    /**< Log-linear histogram of gaps: same as h_rbase */
+    /* line 5: in-flight gauge, written by nlcali_start()/nlcali_stop();
+       untimed count, written by events that are sampled out; the
+       rest is read by events only if histograms are on */
+    int inflight;     /**< Intervals started and not yet stopped */
+    int inflight_max; /**< Most intervals in flight at once since the
+                           last clear() */
+    long long untimed; /**< Events recorded without timing since the
+                            last clear(), counted in `vacc` only */
+    unsigned *h_rdata;  /**< Data for histogram of rates */
+    unsigned *h_gdata;  /**< Data for histogram of gaps, follows
+                             `h_rdata` in the same allocation */
+    unsigned *h_slab;   /**< Caller-owned histogram storage, NULL if none
+                             (see nlcali_hist_storage()) */
+    unsigned h_slab_num; /**< Bins per histogram that fit in `h_slab` */
+    /* optional features, read by events only if they are on */
+    struct nl_tdigest_t *vsk; /**< Sketch of value, NULL if off */
+    struct nl_tdigest_t *rsk; /**< Sketch of rate, NULL if off */
+    struct nl_tdigest_t *gsk; /**< Sketch of gap, NULL if off */
+    struct nlcali_window_t *win; /**< Recent statistics, NULL if off
+                                      (see nlcali_window()) */
+    struct nlcali_trace_t *trace; /**< Raw event trace, NULL if off
+                                       (see nlcali_trace()) */
+    struct nlcali_sample_t *smp; /**< Sampling state, NULL if off
+                                      (see nlcali_sample()) */
+    struct nlcali_perf_t *perf; /**< perf_event counters, NULL if off
+                                     (see nlcali_perf()) */
+    struct nlcali_cpu_t *cpu; /**< On- and off-CPU time, NULL if off
+                                   (see nlcali_cpu()) */
+    /* duration, value, on- and off-CPU time histograms, read by
+       events only if NL_OPT_HIST is on */
+    struct nlcali_hist_t h_dur; /**< Histogram of durations, in ns */
+    struct nlcali_hist_t h_val; /**< Histogram of values */
+    struct nlcali_hist_t h_cpu; /**< Histogram of on-CPU time, in ns */
+    struct nlcali_hist_t h_wait; /**< Histogram of off-CPU time, in ns */
+    unsigned *h_xdata;  /**< Bins of `h_dur`, `h_val`, `h_cpu` and
+                             `h_wait`, in that order, in one
+                             allocation */
+    /* results, set by nlcali_calc() */
+    struct nlcali_summ_t vsm; /**< Summary of: value. */
+    struct nlcali_summ_t rsm; /**< Summary of: duration/value (rate). */
+    struct nlcali_summ_t gsm;  /**< Summary of: value/duration (gap). */
+    double dur_sum; /**< Sum of all durations between begin/end,
+                         in seconds. */
+    double dur; /**< Total duration between first begin and last end. */
+    double scale; /**< Events per timed event, 1 unless sampling.
+                       Counts and sums over timed events only (`rsm`,
+                       `gsm`, `dur_sum` and histogram bins, including
+                       those of values, when they are output) are
+                       multiplied by it. */
 };
 
 /** Type definition for pointer to Caliper struct.
  */
 typedef struct nlcali_t *T;
 
+/**
+ * Exponentially weighted mean and variance of one metric.
+ * Every weight halves each half-life.
+ */
+struct nlcali_ewma_t {
+    double mean; /**< Weighted mean */
+    double s;    /**< Weighted sum of squared deviations from the mean */
+    double w;    /**< Sum of weights */
+};
+
+/**
+ * Recent statistics of a caliper, kept alongside the cumulative ones.
+ * Set up by nlcali_window().
+ *
+ * The window is a ring of `k` sub-interval calipers, indexed by
+ * the number of the sub-interval that an event ends in, so that an
+ * event only ever clears the one slot it reuses.
+ */
+struct nlcali_window_t {
+    double seconds;        /**< Length of window, 0 if only EWMA */
+    unsigned k;            /**< Number of sub-intervals */
+    unsigned cur;          /**< Slot of the newest sub-interval */
+    nl_ticks_t slot_ticks; /**< Clock ticks per sub-interval */
+    nl_ticks_t slot_begin; /**< Clock ticks at start of newest one */
+    uint64_t newest;       /**< Number of the newest sub-interval */
+    uint64_t *period;      /**< Number of the sub-interval in each slot */
+    T *slot;               /**< Caliper for each slot */
+    T agg;                 /**< Result of nlcali_window_calc() */
+    double half_life;      /**< EWMA half-life in seconds, 0 if off */
+    double ew_per_tick;    /**< Half-lives per clock tick */
+    nl_ticks_t ew_last;    /**< Clock ticks of the last EWMA update */
+    struct nlcali_ewma_t ew[3]; /**< EWMA, by netlogger_metric_t */
+};
+
+/**
+ * One raw event in a trace, also the record format of trace files.
+ */
+struct nlcali_trace_rec_t {
+    uint64_t begin; /**< Clock ticks at beginning of event */
+    uint64_t dur;   /**< Duration, in clock ticks */
+    double value;   /**< Value of event */
+};
+
+/**
+ * Ring of the most recent raw events of a caliper.
+ * Set up by nlcali_trace().
+ *
+ * Only the thread recording into the caliper writes it: it fills
+ * the record at `head & mask`, then advances `head`.
+ */
+struct nlcali_trace_t {
+    uint64_t mask;          /**< Number of records - 1, a power of 2 */
+    volatile uint64_t head; /**< Number of events recorded so far */
+    struct nlcali_trace_rec_t rec[]; /**< Records */
+};
+
+/* First bytes of a trace file */
+#define NL_TRACE_MAGIC "NLTRACE\n"
+/* Trace file version */
+#define NL_TRACE_VERSION 1
+
+/**
+ * Header of a trace file, written by nlcali_trace_dump() and
+ * followed by `count` struct nlcali_trace_rec_t, oldest first.
+ */
+struct nlcali_trace_file_t {
+    char magic[8];     /**< NL_TRACE_MAGIC */
+    uint32_t version;  /**< NL_TRACE_VERSION */
+    uint32_t rec_size; /**< sizeof(struct nlcali_trace_rec_t) */
+    uint64_t first;    /**< Number of the first event in the file;
+                            earlier ones were overwritten */
+    uint64_t count;    /**< Number of records */
+    double tick_ns;    /**< Nanoseconds per clock tick */
+    int32_t clock;     /**< Clock source, a netlogger_clock_t */
+    uint32_t baseline; /**< Baseline of the caliper */
+};
+
+/**
+ * Sampling state of a caliper. Set up by nlcali_sample().
+ *
+ * With a target overhead, the period is adapted every
+ * NL_SAMPLE_ROUND timed events from the measured costs of a timed
+ * and an untimed event and the time that passed.
+ */
+struct nlcali_sample_t {
+    unsigned period;     /**< Mean events per timed event */
+    unsigned max_period; /**< Largest period */
+    double target;       /**< Overhead target, as a fraction of the
+                              time that passes; 0 for a fixed period */
+    double cost_timed;   /**< Clock ticks taken by a timed event */
+    double cost_untimed; /**< Clock ticks taken by an untimed event */
+    nl_ticks_t t0;       /**< Clock ticks at start of this round */
+    long long n0;        /**< Events recorded before this round */
+    unsigned timed;      /**< Timed events in this round */
+    uint64_t rng;        /**< State of the random skip lengths */
+};
+
+/* Timed events between adaptations of the sampling period */
+#define NL_SAMPLE_ROUND 64
+
+/**
+ * perf_event counters of a caliper, read at nlcali_begin() and
+ * nlcali_end(). Set up by nlcali_perf().
+ *
+ * Software counters are read one at a time; hardware counters are
+ * one group, read with rdpmc where the kernel allows it.
+ * Arrays are indexed by counter number (see NL_PERF_MAX).
+ */
+struct nlcali_perf_t {
+    unsigned events;   /**< Counters that are open, mask of NL_PERF_* */
+    int armed;         /**< Counts were read by nlcali_begin() */
+    int rdpmc;         /**< Hardware group is read with rdpmc */
+    int group[2];      /**< First software counter and hardware group
+                            leader, -1 if none; software counters
+                            are read one at a time */
+    unsigned num[2];   /**< Software and hardware counters open */
+    unsigned order[2][NL_PERF_MAX]; /**< Counter number of each member
+                                         of each group, in read order */
+    int fd[NL_PERF_MAX];     /**< File descriptors, -1 if not open */
+    void *page[NL_PERF_MAX]; /**< Mapped pages of the hardware
+                                  counters, for rdpmc */
+    uint64_t begin[NL_PERF_MAX]; /**< Counts at nlcali_begin() */
+    struct nlcali_acc_t acc[NL_PERF_MAX]; /**< Change over each event */
+    struct nlcali_summ_t sm[NL_PERF_MAX]; /**< Summaries of the change,
+                                               set by nlcali_calc() */
+};
+
+/* ---------------------------------------------------------------
+ * Clocks
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#    define NL_HAVE_TSC 1
+#endif
+
+#ifndef NL_INLINE
+#    ifdef __GNUC__
+#        define NL_INLINE static __inline__
+#    else
+#        define NL_INLINE static
+#    endif
+#endif
+
+/**
+ * Read clock `C` at the start of an interval.
+ */
+NL_INLINE nl_ticks_t nl_clock_ticks(netlogger_clock_t c)
+{
+    struct timespec ts;
+#ifdef NL_HAVE_TSC
+    if (c == NL_CLOCK_TSC) {
+        uint32_t lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return ((nl_ticks_t)hi << 32) | lo;
+    }
+#endif
+    clock_gettime(c == NL_CLOCK_MONOTONIC_RAW ?
+                  CLOCK_MONOTONIC_RAW : CLOCK_MONOTONIC, &ts);
+    return (nl_ticks_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Read clock `C` at the end of an interval.
+ * For the TSC this uses rdtscp, which waits for the
+ * measured instructions to retire.
+ */
+NL_INLINE nl_ticks_t nl_clock_ticks_end(netlogger_clock_t c)
+{
+#ifdef NL_HAVE_TSC
+    if (c == NL_CLOCK_TSC) {
+        uint32_t lo, hi, aux;
+        __asm__ __volatile__("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux));
+        return ((nl_ticks_t)hi << 32) | lo;
+    }
+#endif
+    return nl_clock_ticks(c);
+}
+
+/**
+ * CPU time of the calling thread, in ns. Not served by the vDSO on
+ * Linux, so each read is a system call.
+ */
+NL_INLINE int64_t nl_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Convert ticks of caliper `S` to seconds. */
+#define NL_TICKS_SEC(S, X) ((double)(X) * (S)->tick_ns / 1e9)
+
+/** `first` of a caliper with no timed events since the last clear */
+#define NL_TICKS_NONE ((nl_ticks_t)-1)
+
+/* ---------------------------------------------------------------
+ * Sequence lock
+ *
+ * The thread that owns a caliper bumps `seq` around each update
+ * so that other threads can take a consistent copy without
+ * locking. Only stores and compiler/store barriers are used.
+ */
+
+#ifdef __GNUC__
+#    define NL_WMB() __atomic_thread_fence(__ATOMIC_RELEASE)
+#    define NL_RMB() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#else
+#    define NL_WMB()
+#    define NL_RMB()
+#endif
+
+#define NL_SEQ_WRITE_BEGIN(S) do { (S)->seq++; NL_WMB(); } while(0)
+#define NL_SEQ_WRITE_END(S)   do { NL_WMB(); (S)->seq++; } while(0)
+
 /* ---------------------------------------------------------------
  * Methods
  */
@@ -123,6 +526,90 @@ typedef struct nlcali_t *T;
      }                                                              \
 } while(0)
 
+/**
+ * Calculate log-linear histogram bin.
+ *
+ * The exponent and top `h_sub_bits` of the mantissa of a positive
+ * IEEE double are contiguous, so one shift of its bits gives a bin
+ * number that increases with the value; subtracting the shifted
+ * bits of the smallest value (B) makes it zero-based.
+ *
+ * First arg is the calipers struct, second is `h_rbase` or `h_gbase`,
+ * third is the value, fourth is return value of the bin it belongs in.
+ */
+#define NL_HBIN_LL(S, B, V, R) \
+    NL_HBIN_LL_N((S)->h_sub_bits, (S)->h_num, B, V, R)
+
+/* Same, given the sub-bits and number of bins */
+#define NL_HBIN_LL_N(BITS, N, B, V, R) do {                         \
+     union { double d; uint64_t u; } v_;                            \
+     int64_t j_;                                                    \
+     v_.d = (V);                                                    \
+     j_ = (int64_t)(v_.u >> (52 - (BITS))) - (B);                   \
+     if ((int64_t)v_.u < 0 || j_ < 0) { (R) = 0; }                  \
+     else if (j_ >= (int64_t)(N)) { (R) = (N) - 1; }                \
+     else { (R) = (unsigned)j_; }                                   \
+} while(0)
+
+/**
+ * Calculate the bin of a duration or value histogram.
+ *
+ * First arg is a struct nlcali_hist_t that is on, second is the
+ * value, third is return value of the bin it belongs in.
+ */
+#define NL_HBIN_X(H, V, R) do {                                     \
+     if ((H)->state == NL_HIST_LOGLINEAR) {                         \
+         NL_HBIN_LL_N((H)->sub_bits, (H)->num, (H)->base, V, R);    \
+     }                                                              \
+     else if ((V) < (H)->min) { (R) = 0; }                          \
+     else {                                                         \
+         (R) = (unsigned)(((V) - (H)->min) / (H)->width);           \
+         if ((R) >= (H)->num) { (R) = (H)->num - 1; }               \
+     }                                                              \
+} while(0)
+
+/**
+ * Record an event in the duration and value histograms.
+ * Used by nlcali_add() when NL_OPT_HIST is on.
+ *
+ * First arg is the calipers struct, second is the duration in ns,
+ * third is the value.
+ */
+#define NL_HIST_X_ADD(S, D, V) do {                                 \
+     unsigned x_;                                                   \
+     if ((S)->h_dur.num) {                                          \
+         NL_HBIN_X(&(S)->h_dur, D, x_);                             \
+         (S)->h_dur.data[x_]++;                                     \
+     }                                                              \
+     if ((S)->h_val.num) {                                          \
+         NL_HBIN_X(&(S)->h_val, V, x_);                             \
+         (S)->h_val.data[x_]++;                                     \
+     }                                                              \
+} while(0)
+
+/**
+ * Record an event in the rate and gap histograms, if they are set up.
+ * Used by nlcali_add().
+ *
+ * First arg is the calipers struct, second is the rate, third is
+ * the gap.
+ */
+#define NL_HIST_RG_ADD(S, R, G) do {                                \
+     unsigned i_;                                                   \
+     if ((S)->h_state == NL_HIST_LOGLINEAR) {                       \
+         NL_HBIN_LL(S, (S)->h_rbase, R, i_);                        \
+         (S)->h_rdata[i_]++;                                        \
+         NL_HBIN_LL(S, (S)->h_gbase, G, i_);                        \
+         (S)->h_gdata[i_]++;                                        \
+     }                                                              \
+     else if ((S)->h_state > NL_HIST_AUTO_PRE) {                    \
+         NL_HBIN_R(S, R, i_);                                       \
+         (S)->h_rdata[i_]++;                                        \
+         NL_HBIN_G(S, G, i_);                                       \
+         (S)->h_gdata[i_]++;                                        \
+     }                                                              \
+} while(0)
+
 #define NL_WVAR_ADD(W,X) do {                       \
 	    double q,r;                                 \
         if ((W).count == 0) {                       \
@@ -138,13 +625,43 @@ typedef struct nlcali_t *T;
         (W).count++;                                \
     } while(0)
 
+/** 
+ * Combine two streaming variances (Chan et al.).
+ *
+ * \param self Destination, updated in place
+ * \param other Source, unchanged
+ */
+void netlogger_wvar_merge(struct netlogger_wvar_t *self,
+                          const struct netlogger_wvar_t *other);
+
 #define NL_KSUM_ADD( V, X ) do {                \
-        (V).y = X - (V).c;                      \
-        (V).t = (V).s + (V).y;                  \
-        (V).c = ( (V).t - (V).s ) - (V).y;      \
-        (V).s = (V).t;                          \
+        double y_ = (X) - (V).c;                \
+        double t_ = (V).s + y_;                 \
+        (V).c = ( t_ - (V).s ) - y_;            \
+        (V).s = t_;                             \
+} while(0)
+
+/**
+ * Add a value to a struct nlcali_acc_t: its sum, variance, min and
+ * max, but not its count. X is evaluated more than once.
+ */
+#define NL_ACC_ADD(A, X) do {                   \
+        NL_KSUM_ADD((A).ksum, (X));             \
+        NL_WVAR_ADD((A).var, (X));              \
+        if ((X) < (A).min) (A).min = (X);       \
+        if ((X) > (A).max) (A).max = (X);       \
 } while(0)
 
+/** 
+ * Combine two Kahan sums, carrying both compensation terms
+ * (Neumaier's variant, so the larger addend may be either one).
+ *
+ * \param self Destination, updated in place
+ * \param other Source, unchanged
+ */
+void netlogger_ksum_merge(struct netlogger_ksum_t *self,
+                          const struct netlogger_ksum_t *other);
+
 /** 
  * Constructor.
  * Allocates memory and clears values.
@@ -154,6 +671,87 @@ typedef struct nlcali_t *T;
  */
 T nlcali_new(unsigned baseline);
 
+/**
+ * Initialize a caliper in caller-allocated memory.
+ *
+ * \param self Uninitialized caliper
+ * \param baseline Minimum number of values to get a standard deviation.
+ */
+void nlcali_init(T self, unsigned baseline);
+
+/**
+ * Initialize a caliper in caller-allocated memory with the same
+ * baseline, clock and histogram ranges as another one.
+ *
+ * An automatic histogram is copied as a manual one once its
+ * range is known, and is left off while still in the pre-init phase.
+ *
+ * \param self Uninitialized caliper
+ * \param proto Caliper to copy configuration from
+ */
+void nlcali_init_like(T self, T proto);
+
+/**
+ * Copy the clock, histogram and sketch configuration of another
+ * caliper, as nlcali_init_like() does, into an initialized one.
+ * The window (see nlcali_window()) is not copied.
+ *
+ * \param self Calipers object
+ * \param proto Caliper to copy configuration from
+ * \post Clears all values, as with nlcali_clear().
+ */
+void nlcali_configure_like(T self, T proto);
+
+/**
+ * Keep histogram data in caller-owned memory.
+ *
+ * Histograms of up to `n` bins are then placed in `bins` instead of
+ * being allocated, so reconfiguring them does not allocate either.
+ * Larger histograms are still allocated.
+ *
+ * \param self Calipers object
+ * \param bins Room for 2 * `n` bins, aligned to NL_CACHE_LINE;
+ *        must outlive the caliper or the next call. NULL for none.
+ * \param n Bins per histogram
+ * \post The histogram is off; configure it with nlcali_hist_manual()
+ *       or the like.
+ */
+void nlcali_hist_storage(T self, unsigned *bins, unsigned n);
+
+/**
+ * Free memory held by a caliper, but not the caliper itself.
+ * Use this to dispose of calipers set up with nlcali_init().
+ *
+ * \param self Calipers
+ */
+void nlcali_fini(T self);
+
+/**
+ * Select the clock used to time begin/end pairs.
+ *
+ * The default is NL_CLOCK_MONOTONIC. Selecting NL_CLOCK_TSC
+ * calibrates the TSC frequency on first use.
+ *
+ * \param self Calipers object
+ * \param clock Clock source
+ * \post Clears all values, as with nlcali_clear().
+ * \return 0 on success, -1 if the clock is not available
+ *         (e.g. no invariant TSC), in which case the clock is unchanged,
+ *         or if the window could not be restarted (it is then off).
+ */
+int nlcali_set_clock(T self, netlogger_clock_t clock);
+
+/**
+ * Calibrate the clock against CLOCK_MONOTONIC_RAW.
+ *
+ * Called automatically the first time a clock is selected;
+ * call again to force recalibration.
+ *
+ * \param clock Clock source
+ * \return Nanoseconds per tick, or -1 if the clock is not available
+ */
+double nlcali_clock_calibrate(netlogger_clock_t clock);
+
 /**
  * Calculate histogram of calculated gap and rate.
  *
@@ -178,15 +776,400 @@ void nlcali_hist_manual(T self, unsigned n, double min, double max);
  * previous data when called.
  *
  * \param self Calipers object
- * \param n Number of bins, if zero turn off histogram.
+ * \param n Number of bins, up to NL_MAX_HIST_BINS; if zero turn off
+ *        histogram.
  * \param pre Number of pre-init runs, to set ranges
  */
 void nlcali_hist_auto(T self, unsigned n, unsigned pre);
 
+/**
+ * Calculate log-linear histogram of calculated gap and rate.
+ *
+ * Each power of two between `min` and `max` is split into
+ * equal-width bins, so that any value in the range is placed in
+ * a bin whose width is less than 10^-digits of the value.
+ * Values outside the range go in the first or last bin.
+ * The gap histogram covers the reciprocal range.
+ *
+ * \param self Calipers object
+ * \param digits Significant decimal digits, 1 to NL_MAX_LL_DIGITS
+ * \param min Smallest rate of interest, must be positive
+ * \param max Largest rate of interest
+ * \post May be called multiple times, but destroys
+ *       previous data when called.
+ * \return 0 on success, -1 if the arguments are out of range or
+ *         would need more than NL_MAX_LL_BINS bins, in which case
+ *         the histogram is unchanged; or -1 if memory ran out, in
+ *         which case the previous data is gone and the histogram
+ *         is off.
+ */
+int nlcali_hist_loglinear(T self, unsigned digits, double min, double max);
+
+/**
+ * Keep a histogram of durations, values, or on- or off-CPU time,
+ * with linear bins.
+ *
+ * These are independent of the rate and gap histograms and of
+ * each other: each has its own range, and may be linear or
+ * log-linear (see nlcali_hist_kind_loglinear()). Their bins share
+ * one allocation. Times are in nanoseconds; on- and off-CPU time
+ * are only recorded while nlcali_cpu() is on. Only timed events
+ * are counted, so when sampling (see nlcali_sample()) the bins are
+ * scaled on output like those of rate and gap.
+ *
+ * \param self Calipers object
+ * \param kind NL_HIST_DUR, NL_HIST_VALUE, NL_HIST_CPU or NL_HIST_WAIT
+ * \param n Number of bins, up to NL_MAX_HIST_BINS; zero turns the
+ *        histogram off
+ * \param min Value at left edge of first bin
+ * \param max Value at right edge of last bin
+ * \post Destroys previous data of this histogram, but not the others.
+ * \return 0 on success, -1 if the arguments are out of range or
+ *         memory ran out. Histogram is unchanged on error.
+ */
+int nlcali_hist_kind_manual(T self, netlogger_hkind_t kind, unsigned n,
+                            double min, double max);
+
+/**
+ * Keep a histogram of durations, values, or on- or off-CPU time,
+ * with log-linear bins as for nlcali_hist_loglinear().
+ *
+ * \param self Calipers object
+ * \param kind NL_HIST_DUR, NL_HIST_VALUE, NL_HIST_CPU or NL_HIST_WAIT
+ * \param digits Significant decimal digits, 1 to NL_MAX_LL_DIGITS
+ * \param min Smallest value of interest, must be positive
+ * \param max Largest value of interest
+ * \post Destroys previous data of this histogram, but not the others.
+ * \return 0 on success, -1 if the arguments are out of range,
+ *         would need more than NL_MAX_LL_BINS bins, or memory ran
+ *         out. Histogram is unchanged on error.
+ */
+int nlcali_hist_kind_loglinear(T self, netlogger_hkind_t kind,
+                               unsigned digits, double min, double max);
+
+/**
+ * Estimate a quantile from a histogram.
+ *
+ * Interpolates linearly within the bin that holds the quantile,
+ * and clamps to the observed min and max. Durations and on- and
+ * off-CPU times have no observed min and max, so the edges of the
+ * outermost bins with data are used instead.
+ *
+ * \param self Calipers object
+ * \param kind NL_HIST_RATE, NL_HIST_GAP, NL_HIST_DUR, NL_HIST_VALUE,
+ *        NL_HIST_CPU or NL_HIST_WAIT
+ * \param q Quantile, from 0 to 1 (e.g. 0.99)
+ * \return Estimated value, or -1 if the histogram has no data
+ */
+double nlcali_hist_quantile(T self, netlogger_hkind_t kind, double q);
+
+/**
+ * Lower edge of a histogram bin, which is also the upper edge of the
+ * bin before it. Values outside a linear histogram are counted in
+ * its first or last bin.
+ *
+ * \param self Calipers object
+ * \param kind As for nlcali_hist_quantile()
+ * \param i Bin, from 0 to the number of bins (for the upper edge of
+ *        the last one)
+ * \return Edge, in the units of the histogram's values
+ */
+double nlcali_hist_edge(T self, netlogger_hkind_t kind, unsigned i);
+
+/**
+ * Keep quantile sketches of value, rate and gap.
+ *
+ * \param self Calipers object
+ * \param compression Sketch accuracy/size parameter, see nl_tdigest_new().
+ *        Zero turns the sketches off.
+ * \post May be called multiple times, but destroys
+ *       previous data when called.
+ * \return 0 on success, -1 on error (sketches are then off)
+ */
+int nlcali_sketch(T self, double compression);
+
+/**
+ * Estimate a quantile from the sketches.
+ *
+ * \param self Calipers object
+ * \param metric NL_VALUE, NL_RATE or NL_GAP
+ * \param q Quantile, from 0 to 1 (e.g. 0.99)
+ * \return Estimated value, or -1 if sketches are off or empty
+ */
+double nlcali_quantile(T self, netlogger_metric_t metric, double q);
+
+/**
+ * Keep statistics of recent events as well as cumulative ones.
+ *
+ * The sliding window gives exact count, sum, min, max, standard
+ * deviation, histogram and sketches over the last `seconds`, to within
+ * one sub-interval, from a ring of `k` sub-interval calipers with the
+ * clock, histogram and sketch configuration of `self`. Configure those
+ * first: changing them afterwards does not change the window, except
+ * that nlcali_set_clock() restarts it.
+ *
+ * The exponentially weighted moving mean and variance weight each
+ * event by 2^(-age/half_life).
+ *
+ * Both are updated by nlcali_add() and the macros built on it, keyed
+ * by the end time of the event on the caliper's clock; they are not
+ * updated by nlcali_add_batch(), nor merged by nlcali_merge(), and
+ * nlcali_clear() leaves them alone, so a caliper can be cleared every
+ * reporting interval and still answer for the last N seconds.
+ *
+ * \param self Calipers object
+ * \param seconds Length of the sliding window, 0 for none
+ * \param k Number of sub-intervals in the window. Each event updates
+ *        one of them, so more sub-intervals cost memory and query
+ *        time, not event time.
+ * \param half_life Half-life of the moving averages in seconds,
+ *        0 for none. If both this and `seconds` are zero, the window
+ *        is turned off.
+ * \post May be called multiple times, but destroys
+ *       previous data when called.
+ * \return 0 on success, -1 on error (the window is then off)
+ */
+int nlcali_window(T self, double seconds, unsigned k, double half_life);
+
+/**
+ * Keep the most recent raw events in a ring, to see the individual
+ * events behind a summary.
+ *
+ * Each event recorded by nlcali_add() and the macros built on it
+ * (not by nlcali_add_batch()) is written to the ring as a
+ * struct nlcali_trace_rec_t, overwriting the oldest once it is full.
+ * nlcali_clear() leaves the ring alone.
+ *
+ * \param self Calipers object
+ * \param capacity Number of events to keep, rounded up to a power
+ *        of 2; 0 turns the trace off
+ * \post May be called multiple times, but destroys
+ *       previous data when called.
+ * \return 0 on success, -1 on error (the trace is then off)
+ */
+int nlcali_trace(T self, unsigned capacity);
+
+/**
+ * Write the events in the trace ring to a file, oldest first,
+ * after a struct nlcali_trace_file_t header, in one writev() call
+ * where the file allows. Use examples/trace_replay to read it back.
+ *
+ * Call from the thread that records into the caliper, or while it is
+ * not recording; otherwise the oldest records written may be
+ * overwritten while they are being written.
+ *
+ * \param self Calipers object
+ * \param fd File descriptor to write to
+ * \return Number of events written, or -1 on error or if the
+ *         trace is off
+ */
+long long nlcali_trace_dump(T self, int fd);
+
+/**
+ * Time only some of the events recorded with nlcali_begin() and
+ * nlcali_end(), to cut the cost of instrumenting tight loops.
+ *
+ * Every event is still counted and its value recorded exactly; only
+ * the clock is read less often. Rates and gaps come from the timed
+ * events, which are a random sample of all of them: skips between
+ * timed events are drawn uniformly so that the mean period is N and
+ * periodic work does not line up with the sampling. nlcali_calc()
+ * then scales the estimated counts and sums by `scale` (the events
+ * per timed event); means, extremes and quantiles need no scaling.
+ * Sketches, windows and traces only see the timed events.
+ *
+ * The first event after nlcali_clear() is always timed.
+ * Events from nlcali_add(), nlcali_stop() and nlcali_add_batch() are
+ * always timed.
+ *
+ * \param self Calipers object
+ * \param n Time 1 event in `n` on average; with a target overhead,
+ *        the largest period to use (0 for no limit). 0 or 1 with no
+ *        target turns sampling off.
+ * \param max_overhead Target overhead in percent of the time that
+ *        passes, 0 for a fixed period. The costs of a timed and an
+ *        untimed event are measured in a tight loop when this is
+ *        called; between real work, with colder caches, timing
+ *        costs more, so aim below the overhead you can afford.
+ * \post May be called multiple times; keeps the data recorded so far.
+ *       nlcali_configure_like() copies the setup.
+ * \return 0 on success, -1 on error (sampling is then off)
+ */
+int nlcali_sample(T self, unsigned n, double max_overhead);
+
+/**
+ * On-CPU and off-CPU (wait) time of the timed events of a caliper,
+ * from the thread CPU clock read at nlcali_begin() and nlcali_end().
+ * Set up by nlcali_cpu(). Times are in ns.
+ */
+struct nlcali_cpu_t {
+    int64_t begin;  /**< Thread CPU time at nlcali_begin() */
+    struct nlcali_acc_t cacc; /**< Accumulator for on-CPU time */
+    struct nlcali_acc_t wacc; /**< Accumulator for off-CPU time, the
+                                   rest of the duration */
+    struct nlcali_summ_t csm; /**< Summary of on-CPU time, set by
+                                   nlcali_calc() */
+    struct nlcali_summ_t wsm; /**< Summary of off-CPU time, likewise */
+};
+
+/**
+ * Sample like another caliper, with the costs it measured.
+ * Called by nlcali_configure_like().
+ *
+ * \param self Calipers object
+ * \param proto Caliper to copy the sampling setup of
+ * \return 0 on success, -1 on error (sampling is then off)
+ */
+int nlcali_sample_like(T self, T proto);
+
+/**
+ * Read Linux perf_event counters around each timed event.
+ *
+ * nlcali_begin() and nlcali_end() then also read the counters that
+ * could be opened, and the change in each over the event is
+ * summarized (sum, min, max, mean, sd) in `perf->sm`, logged as
+ * `perf.<name>.*` and in psdata as `<stat>_<name>`, so that latency
+ * can be set against faults, context switches and migrations. The
+ * software counters are always there on Linux; hardware ones are
+ * left out where the CPU or VM has none, or if they cannot be
+ * opened. Events sampled out by nlcali_sample(), and those from
+ * nlcali_add(), nlcali_stop() and nlcali_add_batch(), are not
+ * counted; with sampling, the sums are scaled like `rsm`.
+ *
+ * The counters count the calling thread, which must be the one that
+ * records the events. Each takes a file descriptor, and reading them
+ * costs a system call per software counter, plus one for the hardware
+ * group unless rdpmc can be used, so this is for calipers around work
+ * of several microseconds or more. Not copied by
+ * nlcali_configure_like(); merging combines the counters only if both
+ * calipers have the same ones.
+ *
+ * \param self Calipers object
+ * \param events Counters wanted, a mask of NL_PERF_*; 0 turns them off
+ * \post Clears the counter summaries, but no other data.
+ * \return Mask of the counters opened, 0 if none could be (e.g. not
+ *         Linux, or not allowed by perf_event_paranoid), or -1 if
+ *         memory ran out.
+ */
+int nlcali_perf(T self, unsigned events);
+
+/**
+ * Read the counters at the beginning of a timed event. Called by
+ * nlcali_begin() when the counters are on.
+ *
+ * \param self Calipers object
+ */
+void nlcali_perf_begin(T self);
+
+/**
+ * Read the counters at the end of a timed event and record the
+ * change. Called by nlcali_end() when the counters are on.
+ *
+ * \param self Calipers object
+ */
+void nlcali_perf_end(T self);
+
+/**
+ * Split the duration of each timed event into on-CPU and off-CPU
+ * (wait) time.
+ *
+ * nlcali_begin() and nlcali_end() then also read the CPU time of the
+ * calling thread. Time on the CPU is summarized in `cpu->csm` and
+ * the rest of the duration, spent blocked or waiting to run, in
+ * `cpu->wsm`, logged as `cpu.*` and `wait.*` and in psdata as
+ * `<stat>_cpu` and `<stat>_wait`, so that a slowdown can be told to
+ * be compute or blocking. Both can also have histograms (see
+ * nlcali_hist_kind_manual(), NL_HIST_CPU and NL_HIST_WAIT). Events
+ * are counted as for nlcali_perf(): only those timed by
+ * nlcali_begin()/nlcali_end(), with sums scaled like `rsm` when
+ * sampling.
+ *
+ * The caliper must be used by a single thread. Each read of the CPU
+ * clock is a system call (a few hundred ns), and the clock may be
+ * coarser than the caliper's, so on-CPU time is clipped to the
+ * duration. Copied by nlcali_configure_like(); merging combines the
+ * summaries if both calipers have them.
+ *
+ * \param self Calipers object
+ * \param on 1 to turn on, 0 to turn off
+ * \post Clears the on- and off-CPU summaries, but no other data.
+ * \return 0 on success, -1 if memory ran out (then off)
+ */
+int nlcali_cpu(T self, int on);
+
+/**
+ * Record the on- and off-CPU time of a timed event. Called by
+ * nlcali_end() when NL_OPT_CPU is on.
+ *
+ * \param self Calipers object
+ * \param cpu Thread CPU time at end of event, from nl_cpu_ns()
+ * \param e Clock ticks at end of event
+ */
+void nlcali_cpu_end(T self, int64_t cpu, nl_ticks_t e);
+
+/**
+ * Choose how many events to leave untimed after a timed one, and
+ * adapt the sampling period. Called by nlcali_add_opt().
+ *
+ * \param self Calipers object
+ * \param e Clock ticks at end of the timed event
+ */
+void nlcali_sample_next(T self, nl_ticks_t e);
+
+/**
+ * Record an event for the optional features that are on (see `opts`
+ * in struct nlcali_t), other than those of NL_OPT_INLINE, which the
+ * caller handles. Called by nlcali_add().
+ *
+ * \param self Calipers object
+ * \param b Clock ticks at beginning of event
+ * \param e Clock ticks at end of event
+ * \param v Value of event
+ */
+void nlcali_add_opt(T self, nl_ticks_t b, nl_ticks_t e, double v);
+
+/**
+ * Record an event in the window. Called by nlcali_add_opt() when the
+ * window is on.
+ *
+ * \param self Calipers object
+ * \param b Clock ticks at beginning of event
+ * \param e Clock ticks at end of event
+ * \param v Value of event
+ */
+void nlcali_window_add(T self, nl_ticks_t b, nl_ticks_t e, double v);
+
+/**
+ * Calculate statistics for the sliding window.
+ *
+ * Merges the sub-intervals that end within the last `seconds` of the
+ * caliper's clock into a caliper owned by the window, and calls
+ * nlcali_calc() on it. Read its summaries, or pass it to
+ * nlcali_hist_quantile(), nlcali_quantile(), nlcali_log() and so on,
+ * until the next call. Not thread-safe: call from the thread that
+ * records the events.
+ *
+ * \param self Calipers object
+ * \return Window caliper, or NULL if there is no sliding window
+ */
+T nlcali_window_calc(T self);
+
+/**
+ * Read an exponentially weighted moving average.
+ *
+ * \param self Calipers object
+ * \param metric NL_VALUE, NL_RATE or NL_GAP
+ * \param mean Set to the weighted mean
+ * \param sd Set to the weighted standard deviation, may be NULL
+ * \return 0 on success, -1 if the averages are off or have no data
+ */
+int nlcali_ewma(T self, netlogger_metric_t metric, double *mean, double *sd);
+
 /* Check if histogram has data to show */ 
 #define NL_HIST_HAS_DATA(X) (\
  (X)->h_state == NL_HIST_MANUAL || \
- (X)->h_state == NL_HIST_AUTO_FULL)
+ (X)->h_state == NL_HIST_AUTO_FULL || \
+ (X)->h_state == NL_HIST_LOGLINEAR)
 
 /** 
  * \brief Begin a timed event.
@@ -196,14 +1179,143 @@ void nlcali_hist_auto(T self, unsigned n, unsigned pre);
  * \param S Calipers obj
  * \return None
  */
-#define nlcali_begin(S)  do {                               \
-        gettimeofday(&(S)->begin, NULL);                                \
-        if ((S)->vsm.count == 0) {                                          \
-            memcpy(&(S)->first, &(S)->begin, sizeof((S)->first));       \
-        }                                                               \
-        (S)->is_begun = 1;                                              \
+#define nlcali_begin(S)  do {                                   \
+        if ((S)->skip) {                                            \
+            /* sampled out, see nlcali_sample() */                  \
+            (S)->is_begun = 2;                                      \
+        }                                                           \
+        else {                                                      \
+            if ((S)->opts & NL_OPT_PERF) {                          \
+                nlcali_perf_begin(S);                               \
+            }                                                       \
+            (S)->begin = nl_clock_ticks((S)->clock);                \
+            if ((S)->opts & NL_OPT_CPU) {                           \
+                (S)->cpu->begin = nl_cpu_ns();                      \
+            }                                                       \
+            (S)->is_begun = 1;                                      \
+        }                                                           \
     } while(0)
 
+/** Start time of an interval, from nlcali_start() */
+typedef nl_ticks_t nlcali_token_t;
+
+/**
+ * \brief Start a timed interval that may overlap others.
+ *
+ * Unlike nlcali_begin(), nothing about the interval is kept in the
+ * caliper, so any number of intervals can be open at once (e.g.
+ * requests in flight, or recursive calls); pass the token to
+ * nlcali_stop() when the interval ends. Only the in-flight gauge
+ * is updated.
+ *
+ * \param self Calipers object
+ * \return Token for nlcali_stop()
+ */
+NL_INLINE nlcali_token_t nlcali_start(T self)
+{
+    NL_SEQ_WRITE_BEGIN(self);
+    if (++self->inflight > self->inflight_max) {
+        self->inflight_max = self->inflight;
+    }
+    NL_SEQ_WRITE_END(self);
+    return nl_clock_ticks(self->clock);
+}
+
+/**
+ * \brief Stop a timed interval started with nlcali_start().
+ * Defined as a macro for performance.
+ *
+ * \param S Calipers obj
+ * \param TOK Token returned by nlcali_start()
+ * \param V Value of event
+ * \return None
+ */
+#define nlcali_stop(S,TOK,V) do {                               \
+        nl_ticks_t stop_ = nl_clock_ticks_end((S)->clock);      \
+        nlcali_token_t tok_ = (TOK);                            \
+        NL_SEQ_WRITE_BEGIN(S);                                  \
+        (S)->inflight--;                                        \
+        NL_EVENT_ADD(S, tok_, stop_, V);                        \
+        NL_SEQ_WRITE_END(S);                                    \
+    } while(0)
+
+/** 
+ * Body of nlcali_add(), without the sequence lock, for callers that
+ * update other fields in the same write section (see nlcali_stop()).
+ *
+ * \param S Calipers obj
+ * \param B Clock ticks at beginning of event
+ * \param E Clock ticks at end of event
+ * \param V Value of event
+ * \return None
+ */
+#define NL_EVENT_ADD(S,B,E,V) do {                              \
+        double dur_, rate_, gap_;                               \
+        nl_ticks_t b_ = (B), e_ = (E);                          \
+        if (b_ < (S)->first) (S)->first = b_;                   \
+        (S)->end = e_;                                          \
+        (S)->dur_ticks += e_ - b_;                              \
+        dur_ = (e_ - b_) * (S)->tick_ns;                        \
+        NL_ACC_ADD((S)->vacc, (V));                             \
+        if ((V) != 0 && dur_ > 0) {                             \
+            gap_ = dur_ / (V);                                  \
+            rate_ = (V) / dur_;                                 \
+            NL_ACC_ADD((S)->racc, rate_);                       \
+            NL_ACC_ADD((S)->gacc, gap_);                        \
+            (S)->racc.count++;                                  \
+            NL_HIST_RG_ADD(S, rate_, gap_);                     \
+        }                                                       \
+        (S)->vacc.count++;                                      \
+        if ((S)->opts) {                                        \
+            if ((S)->opts & NL_OPT_HIST) {                      \
+                NL_HIST_X_ADD(S, dur_, (V));                    \
+            }                                                   \
+            if ((S)->opts & ~NL_OPT_INLINE) {                   \
+                nlcali_add_opt(S, b_, e_, (V));                 \
+            }                                                   \
+        }                                                       \
+        (S)->dirty = 1;                                         \
+} while(0)
+
+/** 
+ * Record an event that was timed elsewhere.
+ * Modifies the input argument in-place.
+ * Defined as a macro for performance.
+ *
+ * \param S Calipers obj
+ * \param B Clock ticks at beginning of event
+ * \param E Clock ticks at end of event
+ * \param V Value of event
+ * \return None
+ */
+#define nlcali_add(S,B,E,V) do {                                \
+        NL_SEQ_WRITE_BEGIN(S);                                  \
+        NL_EVENT_ADD(S, B, E, V);                               \
+        NL_SEQ_WRITE_END(S);                                    \
+} while(0)
+
+/**
+ * Record the value of an event that was not timed, because it was
+ * sampled out (see nlcali_sample()). Used by nlcali_end().
+ * Defined as a macro for performance.
+ *
+ * \param S Calipers obj
+ * \param V Value of event
+ * \return None
+ */
+#define nlcali_add_untimed(S,V) do {                            \
+        NL_SEQ_WRITE_BEGIN(S);                                  \
+        NL_KSUM_ADD(((S)->vacc.ksum), (V));                     \
+        NL_WVAR_ADD((S)->vacc.var, (V));                        \
+        if ((V) < (S)->vacc.min) (S)->vacc.min = (V);           \
+        if ((V) > (S)->vacc.max) (S)->vacc.max = (V);           \
+        (S)->vacc.count++;                                      \
+        (S)->untimed++;                                         \
+        (S)->skip--;                                            \
+        (S)->dirty = 1;                                         \
+        NL_SEQ_WRITE_END(S);                                    \
+} while(0)
+
 /** 
  * End a timed event.
  * Modifies the input argument in-place.
@@ -214,42 +1326,56 @@ void nlcali_hist_auto(T self, unsigned n, unsigned pre);
  * \return None
  */
 #define nlcali_end(S,V) do {                                    \
-    if ((S)->is_begun) {                                        \
-        register double dur, rate, gap;                         \
-        gettimeofday(&(S)->end, NULL);                          \
-        dur = (S)->end.tv_sec - (S)->begin.tv_sec +             \
-            ((S)->end.tv_usec - (S)->begin.tv_usec) / 1e6;      \
-        (S)->dur_sum += dur;                                    \
-        NL_KSUM_ADD(((S)->vsm.ksum), (V));                      \
-        NL_WVAR_ADD((S)->vsm.var, (V));                         \
-        if ((V) < (S)->vsm.min) (S)->vsm.min = (V);             \
-        if ((V) > (S)->vsm.max) (S)->vsm.max = (V);             \
-        if ((V) != 0 && dur > 0) {                              \
-            gap = (1e9*dur) / (V);                              \
-            rate = (V) / (1e9*dur);                             \
-            NL_KSUM_ADD(((S)->rsm.ksum), rate);                 \
-            NL_WVAR_ADD((S)->rsm.var, rate);                    \
-            NL_KSUM_ADD(((S)->gsm.ksum), gap);                  \
-            NL_WVAR_ADD((S)->gsm.var, gap);                     \
-            if (rate < (S)->rsm.min) (S)->rsm.min = rate;       \
-            if (gap < (S)->gsm.min) (S)->gsm.min = gap;         \
-            if (rate > (S)->rsm.max) (S)->rsm.max = rate;       \
-            if (gap > (S)->gsm.max) (S)->gsm.max = gap;         \
-            (S)->rsm.count++;                                   \
-            if ((S)->h_state > NL_HIST_AUTO_PRE) {              \
-                int i;                                          \
-                NL_HBIN_R(S, rate, i);                          \
-                (S)->h_rdata[i]++;                              \
-                NL_HBIN_G(S, gap, i);                           \
-                (S)->h_gdata[i]++;                              \
-            }                                                   \
-        }                                                       \
-        (S)->vsm.count++;                                       \
+    if ((S)->is_begun == 1) {                                   \
+        int64_t cpu_ = (S)->opts & NL_OPT_CPU ? nl_cpu_ns() : 0; \
+        nl_ticks_t end_ = nl_clock_ticks_end((S)->clock);       \
+        if ((S)->opts & NL_OPT_PERF) nlcali_perf_end(S);        \
+        if ((S)->opts & NL_OPT_CPU) nlcali_cpu_end(S, cpu_, end_); \
+        nlcali_add(S, (S)->begin, end_, V);                     \
+        (S)->is_begun = 0;                                      \
+    }                                                           \
+    else if ((S)->is_begun) {                                   \
+        nlcali_add_untimed(S, V);                               \
         (S)->is_begun = 0;                                      \
-        (S)->dirty = 1;                                         \
     }                                                           \
 } while(0)
 
+/**
+ * \brief Record many events that were timed elsewhere.
+ *
+ * Gives the same statistics, up to rounding, as calling nlcali_add()
+ * once per event, but the block sums, min/max and variances are
+ * computed with SIMD instructions and then merged into the summaries
+ * (see nlcali_merge()), and the rate and gap histogram bins are
+ * computed in a separate vectorized pass. Duration and value
+ * histograms, if on, are filled one event at a time.
+ *
+ * Events have no timestamps, so they do not change `dur`, which
+ * runs from the first begin to the last end of the events that
+ * were timed, and is 0 if there are none.
+ *
+ * \param self Calipers object
+ * \param values Value of each event
+ * \param durations Duration of each event, in clock ticks as for
+ *        `E - B` in nlcali_add(); nanoseconds for the default clock
+ * \param n Number of events
+ */
+void nlcali_add_batch(T self, const double *values, const double *durations,
+                      size_t n);
+
+/**
+ * Choose the instruction set used by nlcali_add_batch().
+ *
+ * The default, NL_SIMD_AUTO, picks the best one the CPU supports
+ * when nlcali_add_batch() is first called. This setting is
+ * process-wide.
+ *
+ * \param simd Instruction set
+ * \return The instruction set now in use, or -1 if `simd` is not
+ *         supported by this CPU or build (the setting is unchanged).
+ */
+int nlcali_batch_simd(netlogger_simd_t simd);
+
 /**
  * \brief Calculate values for all events so far.
  *
@@ -284,7 +1410,16 @@ void nlcali_calc(T self);
     - count: Number of samples
     - dur: Wallclock duration (seconds)
     - dur.inst: Total time spent between calipers start/end (seconds)
+    - inflight, inflight.max: Intervals open now, and the most open
+      at once, if any were timed with nlcali_start()
+    - h.rp50, h.rp99, h.rp999, h.rpmax: Quantiles of rate, from a
+      log-linear histogram (likewise h.gp* for gap)
+    - {metric}.p50, {metric}.p99, {metric}.p999: Quantiles of metric,
+      from the sketches, if on
  \endverbatim
+ * Numbers are written in the shortest form that reads back
+ * as the same double.
+ *
  * \post As if nlcali_calc() was called
  * \param self Calipers
  * \param event NetLogger event name
@@ -292,6 +1427,53 @@ void nlcali_calc(T self);
  */
 char *nlcali_log(T self, const char *event);
 
+/**
+ * \brief Format NetLogger BP log message into a buffer.
+ *
+ * Same message as nlcali_log(), without allocating memory.
+ * Like snprintf(), the result is always NUL-terminated and
+ * truncated if it does not fit.
+ *
+ * \post As if nlcali_calc() was called
+ * \param self Calipers
+ * \param event NetLogger event name
+ * \param buf Output buffer, may be NULL if `cap` is zero
+ * \param cap Size of output buffer
+ * \return Length of the full message, not counting the NUL.
+ *         If this is `cap` or more, the message was truncated.
+ */
+size_t nlcali_log_into(T self, const char *event, char *buf, size_t cap);
+
+/**
+ * Reusable buffer for nlcali_log_buf().
+ * Zero-initialize before first use.
+ */
+struct nlcali_logbuf_t {
+    char *buf;  /**< Last message */
+    size_t cap; /**< Allocated size of `buf` */
+};
+
+/**
+ * \brief Format NetLogger BP log message into a reusable buffer.
+ *
+ * The buffer grows as needed, so after the first few calls
+ * messages are formatted without allocating memory.
+ *
+ * \post As if nlcali_calc() was called
+ * \param self Calipers
+ * \param event NetLogger event name
+ * \param lb Buffer
+ * \return `lb->buf`, holding the message, or NULL if out of memory
+ */
+char *nlcali_log_buf(T self, const char *event, struct nlcali_logbuf_t *lb);
+
+/**
+ * Free memory held by a log buffer.
+ *
+ * \param lb Buffer
+ */
+void nlcali_logbuf_free(struct nlcali_logbuf_t *lb);
+
 /**
  * \brief Build perfSONAR data block.
  *
@@ -310,6 +1492,110 @@ char *nlcali_log(T self, const char *event);
 bson *nlcali_psdata(T self, const char *event, const char *m_id,
                             int32_t sample_num);
 
+/**
+ * \brief Append perfSONAR data block to a BSON buffer.
+ *
+ * Adds the same fields as nlcali_psdata() to a document being
+ * built by the caller, so that one buffer can be reset with
+ * bson_buffer_reset() and reused for every report.
+ *
+ * \post As if nlcali_calc was called
+ * \param self Calipers
+ * \param bb BSON buffer, not finished
+ * \param m_id Metadata ID
+ * \param sample_num Sample number
+ * \return 0 on success, -1 on error
+ */
+int nlcali_psdata_append(T self, bson_buffer *bb, const char *m_id,
+                         int32_t sample_num);
+
+/**
+ * \brief Build one BSON document with the data blocks of many calipers.
+ *
+ * The document is `{blocks: [{mid: .., data: ..}, ...]}`, where each
+ * block has the fields of nlcali_psdata() and all share one timestamp.
+ *
+ * \post As if nlcali_calc was called on each caliper
+ * \param bb BSON buffer, new or reset with bson_buffer_reset().
+ *        It is finished on return, and owns the document.
+ * \param calipers Calipers
+ * \param m_ids Metadata ID for each caliper
+ * \param n Number of calipers
+ * \param sample_num Sample number
+ * \return BSON data, valid until the buffer is reset or destroyed,
+ *         or NULL on error
+ */
+const char *nlcali_psdata_multi(bson_buffer *bb, T *calipers,
+                                const char *const *m_ids, unsigned n,
+                                int32_t sample_num);
+
+/**
+ * \brief Merge the events of one caliper into another.
+ *
+ * The result is the same, up to rounding, as if all of the events
+ * recorded by `other` had been recorded by `self`: counts, sums
+ * (compensated), min/max, variances (Chan et al.), durations,
+ * first/last timestamps and histogram bins are all combined.
+ *
+ * Both calipers must use the same clock and, if either one is
+ * collecting histogram data, identical histogram bins.
+ *
+ * \param self Calipers to merge into
+ * \param other Calipers to merge from, unchanged
+ * \return 0 on success, -1 if the calipers are not compatible,
+ *         in which case `self` is unchanged.
+ */
+int nlcali_merge(T self, T other);
+
+/**
+ * \brief Merge N calipers by pairwise tree reduction.
+ *
+ * Pairs are merged in log2(N) rounds, which keeps the
+ * rounding error of the sums and variances low.
+ *
+ * \param calipers Array of calipers. The result is placed in
+ *        the first one; the others are left holding partial results.
+ * \param n Number of calipers
+ * \return `calipers[0]`, or NULL if `n` is zero or any of the
+ *         calipers are not compatible (in which case none are changed).
+ */
+T nlcali_reduce(T *calipers, unsigned n);
+
+/* Spin this many times on a caliper in the middle of an update, then
+   yield (the writer may have been preempted), and give up after
+   NL_SEQ_TRIES in all (the writer may have died mid-update) */
+#define NL_SEQ_SPINS 100
+#define NL_SEQ_TRIES 10000
+
+/**
+ * Copy the parts of a caliper that are not in struct nlcali_t, for
+ * nlcali_seq_copy(). Sizes and pointers must be read from `snap`,
+ * not `live`, so that they match what is copied.
+ *
+ * \param arg User argument given to nlcali_seq_copy()
+ * \param snap Copy of the caliper made in this try
+ * \param live Caliper being copied
+ * \return 0 on success, -1 to give up
+ */
+typedef int (*nlcali_copy_fn)(void *arg, T snap, T live);
+
+/**
+ * \brief Copy a caliper that another thread may be writing.
+ *
+ * Copies `live` into `snap`, and calls `fn` to copy whatever else must
+ * match it, until a copy is made that no write overlapped (see
+ * NL_SEQ_WRITE_BEGIN()). `snap` still points at the writer's memory,
+ * e.g. for histogram bins, until the caller repoints it.
+ *
+ * \param live Caliper being written
+ * \param snap Where to copy it
+ * \param fn Copies the other parts, or NULL
+ * \param arg User argument for `fn`
+ * \return 0 on success, -1 if `fn` gave up or no whole copy was made
+ *         in NL_SEQ_TRIES tries
+ */
+int nlcali_seq_copy(T live, T snap, nlcali_copy_fn fn, void *arg);
+
 /** 
  * Clear all values in bucket.
  * Do this before restarting a new time-series.
@@ -0,0 +1,368 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_calipers.hpp
+ * C++17 wrapper for calipers, header-only.
+ *
+ * calipers::Caliper<Features...> holds a struct nlcali_t and records
+ * into it with code chosen at compile time: a feature that is not in
+ * the list costs one test per event, that c() was not set up for it
+ * at run time, where the C macros test for each one. If c() was set
+ * up for more than the features cover, events go through the C
+ * macros instead, so nothing is dropped. The struct is the one the
+ * C API uses, so c() can be passed to nlcali_log(), nlcali_psdata(),
+ * nlcali_merge() and so on.
+ *
+ * \code
+ * calipers::Caliper<calipers::RateGap> io;
+ * {
+ *     auto t = io.time(nbytes);   // timed until the end of the scope
+ *     write(fd, buf, nbytes);
+ * }
+ * puts(io.log("io.write").c_str());
+ * \endcode
+ */
+
+#ifndef NETLOGGER_CALIPERS_HPP_INCLUDED
+#    define NETLOGGER_CALIPERS_HPP_INCLUDED
+
+/* C++ always has <stdint.h> */
+#ifndef MONGO_HAVE_STDINT
+#    define MONGO_HAVE_STDINT
+#endif
+#include "nl_calipers.h"
+
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace calipers {
+
+/** Feature: rate and gap summaries. Without it, only values and
+    durations are kept. */
+struct RateGap {};
+
+/** Feature: histograms of rate and gap, set up at run time on c()
+    with nlcali_hist_manual() and the like (only kept with RateGap),
+    and of duration and value, with nlcali_hist_kind_manual() and the
+    like. */
+struct Histogram {};
+
+/** Feature: the optional C features, set up at run time on c():
+    sketches, windows, traces, sampling, perf_event counters and the
+    on-/off-CPU time split. */
+struct Extras {};
+
+/** Feature: clock to time events with, NL_CLOCK_DEFAULT if absent.
+    Do not change it on c() with nlcali_set_clock(). */
+template <netlogger_clock_t C>
+struct Clock {
+    static constexpr netlogger_clock_t value = C;
+};
+
+namespace detail {
+
+template <class F, class... Fs>
+inline constexpr bool has = (std::is_same_v<F, Fs> || ...);
+
+template <class... Fs>
+struct clock_of {
+    static constexpr netlogger_clock_t value = NL_CLOCK_DEFAULT;
+};
+
+template <netlogger_clock_t C, class... Fs>
+struct clock_of<Clock<C>, Fs...> {
+    static constexpr netlogger_clock_t value = C;
+};
+
+template <class F, class... Fs>
+struct clock_of<F, Fs...> : clock_of<Fs...> {};
+
+} /* namespace detail */
+
+/**
+ * Times a scope: the interval runs from construction to destruction,
+ * or to stop(). Take one from Caliper::time(). Timers may overlap and
+ * nest, as with nlcali_start()/nlcali_stop(), and can be moved, e.g.
+ * returned from a function, but not copied.
+ */
+template <class Cali>
+class ScopedTimer {
+public:
+    /** Start timing an event of `cali` with the given value. */
+    explicit ScopedTimer(Cali &cali, double value = 1.0) noexcept
+        : cali_(&cali), value_(value), tok_(cali.start()) {}
+
+    ScopedTimer(ScopedTimer &&other) noexcept
+        : cali_(std::exchange(other.cali_, nullptr)),
+          value_(other.value_), tok_(other.tok_) {}
+
+    ScopedTimer &operator=(ScopedTimer &&other) noexcept
+    {
+        if (this != &other) {
+            stop();
+            cali_ = std::exchange(other.cali_, nullptr);
+            value_ = other.value_;
+            tok_ = other.tok_;
+        }
+        return *this;
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+
+    ~ScopedTimer() { stop(); }
+
+    /** Set the value recorded with the event, e.g. bytes moved. */
+    void value(double v) noexcept { value_ = v; }
+
+    /** Record the event now, rather than at the end of the scope. */
+    void stop() noexcept
+    {
+        if (nullptr != cali_) {
+            cali_->stop(tok_, value_);
+            cali_ = nullptr;
+        }
+    }
+
+    /** Record nothing. */
+    void cancel() noexcept
+    {
+        if (nullptr != cali_) {
+            cali_->drop(tok_);
+            cali_ = nullptr;
+        }
+    }
+
+private:
+    Cali *cali_;
+    double value_;
+    nlcali_token_t tok_;
+};
+
+/**
+ * Caliper with the features given as template arguments: any of
+ * RateGap, Histogram, Extras and a Clock<>. Caliper<> keeps values
+ * and durations only. Only one thread may record into it, as for
+ * the C calipers; other threads may read c() the same ways.
+ */
+template <class... Features>
+class Caliper {
+public:
+    static constexpr bool kRateGap = detail::has<RateGap, Features...>;
+    static constexpr bool kHistogram = detail::has<Histogram, Features...>;
+    static constexpr bool kExtras = detail::has<Extras, Features...>;
+    static constexpr netlogger_clock_t kClock =
+        detail::clock_of<Features...>::value;
+
+    /**
+     * \param baseline Number of values before the standard deviation
+     *        is calculated, as for nlcali_new()
+     * \throw std::runtime_error if the clock is not available
+     */
+    explicit Caliper(unsigned baseline = 2)
+    {
+        nlcali_init(&c_, baseline);
+        if (kClock != NL_CLOCK_DEFAULT && 0 != nlcali_set_clock(&c_, kClock)) {
+            nlcali_fini(&c_);
+            throw std::runtime_error("calipers: clock not available");
+        }
+    }
+
+    ~Caliper() { nlcali_fini(&c_); }
+
+    Caliper(const Caliper &) = delete;
+    Caliper &operator=(const Caliper &) = delete;
+
+    /** The C caliper, for the functions of nl_calipers.h */
+    nlcali_T c() noexcept { return &c_; }
+    const struct nlcali_t *c() const noexcept { return &c_; }
+
+    /** Begin a timed event, as nlcali_begin(). */
+    void begin() noexcept
+    {
+        if (generic()) {
+            nlcali_begin(&c_);
+            return;
+        }
+        if constexpr (kExtras) {
+            if (c_.skip) {
+                c_.is_begun = 2;
+                return;
+            }
+            if (c_.opts & NL_OPT_PERF) {
+                nlcali_perf_begin(&c_);
+            }
+        }
+        c_.begin = nl_clock_ticks(kClock);
+        if constexpr (kExtras) {
+            if (c_.opts & NL_OPT_CPU) {
+                c_.cpu->begin = nl_cpu_ns();
+            }
+        }
+        c_.is_begun = 1;
+    }
+
+    /** End a timed event, as nlcali_end(). */
+    void end(double v) noexcept
+    {
+        if (generic()) {
+            nlcali_end(&c_, v);
+            return;
+        }
+        if (c_.is_begun == 1) {
+            int64_t cpu = 0;
+            if constexpr (kExtras) {
+                if (c_.opts & NL_OPT_CPU) {
+                    cpu = nl_cpu_ns();
+                }
+            }
+            nl_ticks_t e = nl_clock_ticks_end(kClock);
+            if constexpr (kExtras) {
+                if (c_.opts & NL_OPT_PERF) {
+                    nlcali_perf_end(&c_);
+                }
+                if (c_.opts & NL_OPT_CPU) {
+                    nlcali_cpu_end(&c_, cpu, e);
+                }
+            }
+            add(c_.begin, e, v);
+            c_.is_begun = 0;
+        }
+        else if constexpr (kExtras) {
+            if (c_.is_begun) {
+                nlcali_add_untimed(&c_, v);
+                c_.is_begun = 0;
+            }
+        }
+    }
+
+    /** Record an event that was timed elsewhere, as nlcali_add(). */
+    void add(nl_ticks_t b, nl_ticks_t e, double v) noexcept
+    {
+        NL_SEQ_WRITE_BEGIN(&c_);
+        add_event(b, e, v);
+        NL_SEQ_WRITE_END(&c_);
+    }
+
+    /** Start an interval that may overlap others, as nlcali_start(). */
+    nlcali_token_t start() noexcept
+    {
+        NL_SEQ_WRITE_BEGIN(&c_);
+        if (++c_.inflight > c_.inflight_max) {
+            c_.inflight_max = c_.inflight;
+        }
+        NL_SEQ_WRITE_END(&c_);
+        return nl_clock_ticks(kClock);
+    }
+
+    /** Stop an interval from start(), as nlcali_stop(). */
+    void stop(nlcali_token_t tok, double v) noexcept
+    {
+        nl_ticks_t e = nl_clock_ticks_end(kClock);
+
+        NL_SEQ_WRITE_BEGIN(&c_);
+        c_.inflight--;
+        add_event(tok, e, v);
+        NL_SEQ_WRITE_END(&c_);
+    }
+
+    /** Forget an interval from start() without recording it. */
+    void drop(nlcali_token_t) noexcept
+    {
+        NL_SEQ_WRITE_BEGIN(&c_);
+        c_.inflight--;
+        NL_SEQ_WRITE_END(&c_);
+    }
+
+    /** Time the rest of the scope, see ScopedTimer. */
+    [[nodiscard]] ScopedTimer<Caliper> time(double value = 1.0) noexcept
+    {
+        return ScopedTimer<Caliper>(*this, value);
+    }
+
+    /** Calculate the summaries, as nlcali_calc(). */
+    void calc() noexcept { nlcali_calc(&c_); }
+
+    /** Clear the data, as nlcali_clear(). */
+    void clear() noexcept { nlcali_clear(&c_); }
+
+    /** Log message for the data, as nlcali_log(). */
+    std::string log(const char *event)
+    {
+        std::string out(256, '\0');
+        size_t n;
+
+        while ((n = nlcali_log_into(&c_, event, out.data(), out.size())) >=
+               out.size()) {
+            out.resize(n + 1);
+        }
+        out.resize(n);
+        return out;
+    }
+
+private:
+    /* Options that the features cover */
+    static constexpr unsigned kOpts =
+        (kHistogram ? NL_OPT_HIST : 0u) | (kExtras ? ~NL_OPT_HIST : 0u);
+
+    /* Whether c() was set up at run time for more than the features
+       cover, so that events must go through the C macros */
+    bool generic() const noexcept
+    {
+        return 0 != (c_.opts & ~kOpts) ||
+            (!(kRateGap && kHistogram) && NL_HIST_OFF != c_.h_state);
+    }
+
+    /* nlcali_add() without the sequence lock, see NL_EVENT_ADD(),
+       built from its pieces for the features in the list */
+    void add_event(nl_ticks_t b, nl_ticks_t e, double v) noexcept
+    {
+        if (generic()) {
+            NL_EVENT_ADD(&c_, b, e, v);
+            return;
+        }
+        if (b < c_.first) {
+            c_.first = b;
+        }
+        c_.end = e;
+        c_.dur_ticks += e - b;
+        NL_ACC_ADD(c_.vacc, v);
+        if constexpr (kRateGap) {
+            double dur = (e - b) * c_.tick_ns;
+            if (v != 0 && dur > 0) {
+                double rate = v / dur, gap = dur / v;
+                NL_ACC_ADD(c_.racc, rate);
+                NL_ACC_ADD(c_.gacc, gap);
+                c_.racc.count++;
+                if constexpr (kHistogram) {
+                    NL_HIST_RG_ADD(&c_, rate, gap);
+                }
+            }
+        }
+        c_.vacc.count++;
+        if constexpr (kHistogram || kExtras) {
+            if (c_.opts) {
+                if constexpr (kHistogram) {
+                    if (c_.opts & NL_OPT_HIST) {
+                        double dur = (e - b) * c_.tick_ns;
+                        NL_HIST_X_ADD(&c_, dur, v);
+                    }
+                }
+                if constexpr (kExtras) {
+                    if (c_.opts & ~NL_OPT_INLINE) {
+                        nlcali_add_opt(&c_, b, e, v);
+                    }
+                }
+            }
+        }
+        c_.dirty = 1;
+    }
+
+    alignas(NL_CACHE_LINE) struct nlcali_t c_;
+};
+
+} /* namespace calipers */
+
+#endif /* NETLOGGER_CALIPERS_HPP_INCLUDED */
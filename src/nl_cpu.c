@@ -0,0 +1,78 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_cpu.c
+ * Splitting the duration of timed events into on- and off-CPU time.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <float.h>
+#include <stdlib.h>
+
+/* Interface */
+#include "nl_calipers.h"
+
+#define T nlcali_T
+
+int nlcali_cpu(T self, int on)
+{
+    struct nlcali_cpu_t *cpu;
+
+    free(self->cpu);
+    self->cpu = NULL;
+    self->opts &= ~NL_OPT_CPU;
+    if (!on) {
+        return 0;
+    }
+    cpu = (struct nlcali_cpu_t *)calloc(1, sizeof(*cpu));
+    if (NULL == cpu) {
+        return -1;
+    }
+    cpu->cacc.var.min_items = cpu->wacc.var.min_items =
+        self->vacc.var.min_items;
+    cpu->cacc.min = cpu->wacc.min = DBL_MAX;
+    cpu->csm.min = cpu->wsm.min = DBL_MAX;
+    self->cpu = cpu;
+    self->opts |= NL_OPT_CPU;
+    return 0;
+}
+
+/* Add `x` to an accumulator, as nlcali_add() does for values */
+#define CPU_ACC_ADD(A, X) do {                  \
+        NL_KSUM_ADD((A)->ksum, X);              \
+        NL_WVAR_ADD((A)->var, X);               \
+        if ((X) < (A)->min) (A)->min = (X);     \
+        if ((X) > (A)->max) (A)->max = (X);     \
+        (A)->count++;                           \
+    } while (0)
+
+void nlcali_cpu_end(T self, int64_t cpu_end, nl_ticks_t e)
+{
+    struct nlcali_cpu_t *cpu = self->cpu;
+    double dur = (e - self->begin) * self->tick_ns;
+    double on = (double)(cpu_end - cpu->begin), off;
+    unsigned x;
+
+    /* the CPU clock is read inside the interval, but may be coarser */
+    if (on > dur) on = dur;
+    if (on < 0) on = 0;
+    off = dur - on;
+    NL_SEQ_WRITE_BEGIN(self);
+    CPU_ACC_ADD(&cpu->cacc, on);
+    CPU_ACC_ADD(&cpu->wacc, off);
+    if (self->h_cpu.num) {
+        NL_HBIN_X(&self->h_cpu, on, x);
+        self->h_cpu.data[x]++;
+    }
+    if (self->h_wait.num) {
+        NL_HBIN_X(&self->h_wait, off, x);
+        self->h_wait.data[x]++;
+    }
+    self->dirty = 1;
+    NL_SEQ_WRITE_END(self);
+}
+
+#undef T
@@ -0,0 +1,373 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_fmt.c
+ * Fast number formatting, used internally for log output.
+ *
+ * Doubles are converted with Grisu2 (F. Loitsch, "Printing
+ * floating-point numbers quickly and accurately with integers",
+ * PLDI 2010): the value and its rounding boundaries are scaled by
+ * a cached power of ten into 64-bit fixed point, and digits are
+ * generated until the result is inside the boundaries. The output
+ * always reads back as the same double, and is the shortest such
+ * string in all but a tiny fraction of cases.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <string.h>
+
+/* Interface */
+#include "nl_fmt.h"
+
+/* Two decimal digits for each number 0..99 */
+static const char digits2[201] =
+    "00010203040506070809101112131415161718192021222324"
+    "25262728293031323334353637383940414243444546474849"
+    "50515253545556575859606162636465666768697071727374"
+    "75767778798081828384858687888990919293949596979899";
+
+/* ---------------------------------------------------------------
+ * Integers
+ */
+
+static int fmt_uint64(char *buf, uint64_t x)
+{
+    char tmp[20], *p = tmp + sizeof(tmp);
+    int len;
+
+    while (x >= 100) {
+        unsigned i = (unsigned)(x % 100) * 2;
+        x /= 100;
+        *--p = digits2[i + 1];
+        *--p = digits2[i];
+    }
+    if (x >= 10) {
+        *--p = digits2[x * 2 + 1];
+        *--p = digits2[x * 2];
+    }
+    else {
+        *--p = (char)('0' + x);
+    }
+    len = (int)(tmp + sizeof(tmp) - p);
+    memcpy(buf, p, len);
+    return len;
+}
+
+int nl_fmt_int(char *buf, long long x)
+{
+    if (x < 0) {
+        *buf = '-';
+        return 1 + fmt_uint64(buf + 1, 0 - (uint64_t)x);
+    }
+    return fmt_uint64(buf, (uint64_t)x);
+}
+
+/* ---------------------------------------------------------------
+ * Doubles
+ */
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+/* "Do-it-yourself" floating point: f * 2^e */
+struct diyfp {
+    uint64_t f;
+    int e;
+};
+
+/* Normalized 10^k for k = -348, -340, ..., 340 */
+static const uint64_t cached_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL,
+    0x8b16fb203055ac76ULL, 0xcf42894a5dce35eaULL,
+    0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL,
+    0xbe5691ef416bd60cULL, 0x8dd01fad907ffc3cULL,
+    0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL,
+    0x823c12795db6ce57ULL, 0xc21094364dfb5637ULL,
+    0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL,
+    0xb23867fb2a35b28eULL, 0x84c8d4dfd2c63f3bULL,
+    0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL,
+    0xf3e2f893dec3f126ULL, 0xb5b5ada8aaff80b8ULL,
+    0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL,
+    0xa6dfbd9fb8e5b88fULL, 0xf8a95fcf88747d94ULL,
+    0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL,
+    0xe45c10c42a2b3b06ULL, 0xaa242499697392d3ULL,
+    0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL,
+    0x9c40000000000000ULL, 0xe8d4a51000000000ULL,
+    0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL,
+    0xd5d238a4abe98068ULL, 0x9f4f2726179a2245ULL,
+    0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL,
+    0x924d692ca61be758ULL, 0xda01ee641a708deaULL,
+    0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL,
+    0xc83553c5c8965d3dULL, 0x952ab45cfa97a0b3ULL,
+    0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL,
+    0x88fcf317f22241e2ULL, 0xcc20ce9bd35c78a5ULL,
+    0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL,
+    0xbb764c4ca7a44410ULL, 0x8bab8eefb6409c1aULL,
+    0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL,
+    0x80444b5e7aa7cf85ULL, 0xbf21e44003acdd2dULL,
+    0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL,
+    0xaf87023b9bf0ee6bULL,
+};
+static const short cached_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_64[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+    10000000000000000000ULL
+};
+
+static struct diyfp diyfp_mul(struct diyfp x, struct diyfp y)
+{
+    const uint64_t m32 = 0xFFFFFFFFULL;
+    uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+    uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d, tmp;
+    struct diyfp r;
+
+    tmp = (bd >> 32) + (ad & m32) + (bc & m32);
+    tmp += 1ULL << 31; /* round */
+    r.f = ac + (ad >> 32) + (bc >> 32) + (tmp >> 32);
+    r.e = x.e + y.e + 64;
+    return r;
+}
+
+static struct diyfp diyfp_normalize(struct diyfp x)
+{
+    int s = __builtin_clzll(x.f);
+
+    x.f <<= s;
+    x.e -= s;
+    return x;
+}
+
+/* Boundaries m- and m+ of `v`, normalized to the same exponent */
+static void normalized_boundaries(struct diyfp v, struct diyfp *minus,
+                                  struct diyfp *plus)
+{
+    struct diyfp pl, mi;
+
+    pl.f = (v.f << 1) + 1;
+    pl.e = v.e - 1;
+    pl = diyfp_normalize(pl);
+    if (v.f == DP_HIDDEN_BIT) {
+        mi.f = (v.f << 2) - 1;
+        mi.e = v.e - 2;
+    }
+    else {
+        mi.f = (v.f << 1) - 1;
+        mi.e = v.e - 1;
+    }
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+    *minus = mi;
+    *plus = pl;
+}
+
+/* Cached power c = 10^-K such that c * 2^e has its exponent
+   in a small range just above -64 */
+static struct diyfp cached_power(int e, int *K)
+{
+    struct diyfp c;
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    unsigned i;
+
+    if (dk - k > 0.0)
+        k++;
+    i = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(i << 3));
+    c.f = cached_f[i];
+    c.e = cached_e[i];
+    return c;
+}
+
+static void grisu_round(char *buf, int len, uint64_t delta, uint64_t rest,
+                        uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w ||
+            wp_w - rest > rest + ten_kappa - wp_w)) {
+        buf[len - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_digits32(uint32_t n)
+{
+    int d = 1;
+
+    while (d < 10 && n >= pow10_64[d])
+        d++;
+    return d;
+}
+
+static int digit_gen(struct diyfp w, struct diyfp mp, uint64_t delta,
+                     char *buf, int *K)
+{
+    struct diyfp one;
+    uint64_t wp_w = mp.f - w.f, p2, tmp;
+    uint32_t p1, d;
+    int kappa, len = 0;
+
+    one.f = 1ULL << -mp.e;
+    one.e = mp.e;
+    p1 = (uint32_t)(mp.f >> -one.e);
+    p2 = mp.f & (one.f - 1);
+    kappa = count_digits32(p1);
+    /* integer part */
+    while (kappa > 0) {
+        d = p1 / (uint32_t)pow10_64[kappa - 1];
+        p1 %= (uint32_t)pow10_64[kappa - 1];
+        if (d || len)
+            buf[len++] = (char)('0' + d);
+        kappa--;
+        tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta) {
+            *K += kappa;
+            grisu_round(buf, len, delta, tmp, pow10_64[kappa] << -one.e,
+                        wp_w);
+            return len;
+        }
+    }
+    /* fraction */
+    for (;;) {
+        p2 *= 10;
+        delta *= 10;
+        d = (uint32_t)(p2 >> -one.e);
+        if (d || len)
+            buf[len++] = (char)('0' + d);
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta) {
+            *K += kappa;
+            grisu_round(buf, len, delta, p2, one.f,
+                        -kappa < 20 ? wp_w * pow10_64[-kappa] : 0);
+            return len;
+        }
+    }
+}
+
+/* Shortest digits of positive `x`, value is digits * 10^K */
+static int grisu2(double x, char *buf, int *K)
+{
+    union { double d; uint64_t u; } u;
+    struct diyfp v, w, wm, wp, c;
+    int biased_e;
+
+    u.d = x;
+    biased_e = (int)((u.u & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    v.f = u.u & DP_SIGNIFICAND_MASK;
+    if (biased_e != 0) {
+        v.f += DP_HIDDEN_BIT;
+        v.e = biased_e - DP_EXPONENT_BIAS;
+    }
+    else {
+        v.e = DP_MIN_EXPONENT + 1;
+    }
+    normalized_boundaries(v, &wm, &wp);
+    c = cached_power(wp.e, K);
+    w = diyfp_mul(diyfp_normalize(v), c);
+    wp = diyfp_mul(wp, c);
+    wm = diyfp_mul(wm, c);
+    wm.f++;
+    wp.f--;
+    return digit_gen(w, wp, wp.f - wm.f, buf, K);
+}
+
+/* Lay out `len` digits times 10^k in plain or exponent notation */
+static int prettify(char *buf, int len, int k)
+{
+    int kk = len + k; /* 10^(kk-1) <= v < 10^kk */
+    int i, off;
+
+    if (0 <= k && kk <= 21) {
+        /* 1234e7 -> 12340000000 */
+        for (i = len; i < kk; i++)
+            buf[i] = '0';
+        return kk;
+    }
+    if (0 < kk && kk <= 21) {
+        /* 1234e-2 -> 12.34 */
+        memmove(buf + kk + 1, buf + kk, len - kk);
+        buf[kk] = '.';
+        return len + 1;
+    }
+    if (-6 < kk && kk <= 0) {
+        /* 1234e-6 -> 0.001234 */
+        off = 2 - kk;
+        memmove(buf + off, buf, len);
+        buf[0] = '0';
+        buf[1] = '.';
+        for (i = 2; i < off; i++)
+            buf[i] = '0';
+        return len + off;
+    }
+    if (len == 1) {
+        /* 1e30 */
+        buf[1] = 'e';
+        return 2 + nl_fmt_int(buf + 2, kk - 1);
+    }
+    /* 1234e30 -> 1.234e33 */
+    memmove(buf + 2, buf + 1, len - 1);
+    buf[1] = '.';
+    buf[len + 1] = 'e';
+    return len + 2 + nl_fmt_int(buf + len + 2, kk - 1);
+}
+
+int nl_fmt_double(char *buf, double x)
+{
+    int len, K, sign = 0;
+
+    if (x != x) {
+        memcpy(buf, "nan", 3);
+        return 3;
+    }
+    if (x < 0) {
+        *buf++ = '-';
+        x = -x;
+        sign = 1;
+    }
+    if (x == 0) {
+        *buf = '0';
+        return sign + 1;
+    }
+    if (x > 1.7976931348623157e308) {
+        memcpy(buf, "inf", 3);
+        return sign + 3;
+    }
+    len = grisu2(x, buf, &K);
+    return sign + prettify(buf, len, K);
+}
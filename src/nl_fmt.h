@@ -0,0 +1,36 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_fmt.h
+ * Fast number formatting, used internally for log output.
+ */
+
+#include <stdint.h>
+
+#ifndef NETLOGGER_FMT_INCLUDED
+#    define NETLOGGER_FMT_INCLUDED
+
+/* Buffer size enough for any number */
+#define NL_FMT_BUFSZ 32
+
+/**
+ * Format a double as the shortest decimal string that reads back
+ * (with strtod) as the same value, using the Grisu2 algorithm.
+ * Uses plain notation for exponents from -6 to 20, else "1.5e-7".
+ *
+ * \param buf Output, at least NL_FMT_BUFSZ bytes. Not NUL-terminated.
+ * \param x Value
+ * \return Number of characters written
+ */
+int nl_fmt_double(char *buf, double x);
+
+/**
+ * Format an integer in decimal.
+ *
+ * \param buf Output, at least NL_FMT_BUFSZ bytes. Not NUL-terminated.
+ * \param x Value
+ * \return Number of characters written
+ */
+int nl_fmt_int(char *buf, long long x);
+
+#endif /* NETLOGGER_FMT_INCLUDED */
@@ -0,0 +1,304 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_perf.c
+ * Linux perf_event counters read around the events of a caliper.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <errno.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#    include <linux/perf_event.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    include <unistd.h>
+#endif
+
+/* Interface */
+#include "nl_calipers.h"
+
+#define T nlcali_T
+
+const char *const nlcali_perf_names[NL_PERF_MAX] = {
+    "task_clock", "ctx_switches", "page_faults", "migrations",
+    "cycles", "instructions", "cache_misses"
+};
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+/* Event of each counter number */
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[NL_PERF_MAX] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES }
+};
+
+#ifndef PERF_FLAG_FD_CLOEXEC
+#    define PERF_FLAG_FD_CLOEXEC 0
+#endif
+
+/* Open counter `k` of the calling thread, in `group` if not -1.
+ * Hardware counters share a group so they count over the same
+ * cycles; software ones are always counting, and some kernels never
+ * count software group members at all, so they stand alone. */
+static int perf_open(unsigned k, int group)
+{
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[k].type;
+    attr.config = perf_events[k].config;
+    if (PERF_TYPE_HARDWARE == attr.type) {
+        attr.read_format = PERF_FORMAT_GROUP;
+    }
+    attr.exclude_hv = 1;
+    /* switches and migrations happen in the kernel, so count it
+       there if allowed */
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                      PERF_FLAG_FD_CLOEXEC);
+    if (fd < 0 && (EACCES == errno || EPERM == errno)) {
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group,
+                          PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t perf_rdpmc(uint32_t c)
+{
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdpmc" : "=a"(lo), "=d"(hi) : "c"(c));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Map the pages of the hardware counters; 1 if rdpmc can read all */
+static int perf_map(struct nlcali_perf_t *pf)
+{
+    struct perf_event_mmap_page *pc;
+    long size = sysconf(_SC_PAGESIZE);
+    unsigned i, k;
+    void *p;
+
+    for (i = 0; i < pf->num[1]; i++) {
+        k = pf->order[1][i];
+        p = mmap(NULL, size, PROT_READ, MAP_SHARED, pf->fd[k], 0);
+        if (MAP_FAILED == p) {
+            return 0;
+        }
+        pf->page[k] = p;
+        pc = (struct perf_event_mmap_page *)p;
+        if (!pc->cap_user_rdpmc) {
+            return 0;
+        }
+    }
+    return pf->num[1] > 0;
+}
+
+/*
+ * Read the hardware counters in user space, as described in
+ * <linux/perf_event.h>. -1 if one is not on a PMU counter right now.
+ */
+static int perf_read_rdpmc(struct nlcali_perf_t *pf, uint64_t *counts)
+{
+    volatile struct perf_event_mmap_page *pc;
+    uint32_t seq, idx;
+    uint64_t count;
+    int64_t pmc;
+    unsigned i, k, shift;
+
+    for (i = 0; i < pf->num[1]; i++) {
+        k = pf->order[1][i];
+        pc = (volatile struct perf_event_mmap_page *)pf->page[k];
+        do {
+            seq = pc->lock;
+            __asm__ __volatile__("" ::: "memory");
+            idx = pc->index;
+            count = pc->offset;
+            if (pc->cap_user_rdpmc && idx) {
+                shift = 64 - pc->pmc_width;
+                pmc = (int64_t)(perf_rdpmc(idx - 1) << shift) >> shift;
+                count += pmc;
+            }
+            __asm__ __volatile__("" ::: "memory");
+        } while (pc->lock != seq);
+        if (0 == idx) {
+            return -1;
+        }
+        counts[k] = count;
+    }
+    return 0;
+}
+#else
+#    define perf_map(PF) 0
+#    define perf_read_rdpmc(PF, C) -1
+#endif
+
+/* Read all open counters, by counter number */
+static int perf_read(struct nlcali_perf_t *pf, uint64_t *counts)
+{
+    uint64_t buf[1 + NL_PERF_MAX];
+    size_t size;
+    unsigned i, k;
+
+    for (i = 0; i < pf->num[0]; i++) {
+        k = pf->order[0][i];
+        if (read(pf->fd[k], &counts[k], sizeof(uint64_t)) !=
+            (ssize_t)sizeof(uint64_t)) {
+            return -1;
+        }
+    }
+    if (pf->group[1] < 0 ||
+        (pf->rdpmc && 0 == perf_read_rdpmc(pf, counts))) {
+        return 0;
+    }
+    /* { nr, value of each member } */
+    size = (1 + pf->num[1]) * sizeof(uint64_t);
+    if (read(pf->group[1], buf, size) != (ssize_t)size) {
+        return -1;
+    }
+    for (i = 0; i < pf->num[1]; i++) {
+        counts[pf->order[1][i]] = buf[1 + i];
+    }
+    return 0;
+}
+
+static void perf_close(struct nlcali_perf_t *pf)
+{
+    long size = sysconf(_SC_PAGESIZE);
+    unsigned k;
+
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        if (NULL != pf->page[k]) {
+            munmap(pf->page[k], size);
+        }
+        if (pf->fd[k] >= 0) {
+            close(pf->fd[k]);
+        }
+    }
+    free(pf);
+}
+
+int nlcali_perf(T self, unsigned events)
+{
+    struct nlcali_perf_t *pf;
+    unsigned k, g;
+    int fd;
+
+    if (NULL != self->perf) {
+        perf_close(self->perf);
+    }
+    self->perf = NULL;
+    self->opts &= ~NL_OPT_PERF;
+    events &= NL_PERF_ALL;
+    if (0 == events) {
+        return 0;
+    }
+    pf = (struct nlcali_perf_t *)calloc(1, sizeof(*pf));
+    if (NULL == pf) {
+        return -1;
+    }
+    pf->group[0] = pf->group[1] = -1;
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        pf->fd[k] = -1;
+        pf->acc[k].var.min_items = self->vacc.var.min_items;
+        pf->acc[k].min = DBL_MAX;
+    }
+    /* counters that cannot be opened are left out */
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        if (0 == (events & (1u << k))) {
+            continue;
+        }
+        g = (events & (1u << k) & NL_PERF_HARDWARE) ? 1 : 0;
+        fd = perf_open(k, g ? pf->group[1] : -1);
+        if (fd < 0) {
+            continue;
+        }
+        if (pf->group[g] < 0) {
+            pf->group[g] = fd;
+        }
+        pf->fd[k] = fd;
+        pf->order[g][pf->num[g]++] = k;
+        pf->events |= 1u << k;
+    }
+    if (0 == pf->events) {
+        perf_close(pf);
+        return 0;
+    }
+    pf->rdpmc = perf_map(pf);
+    self->perf = pf;
+    self->opts |= NL_OPT_PERF;
+    return (int)pf->events;
+}
+
+#else
+
+/* No perf_event: nothing can be opened */
+#    define perf_read(PF, C) -1
+#    define perf_close(PF) free(PF)
+
+int nlcali_perf(T self, unsigned events)
+{
+    (void)events;
+    perf_close(self->perf);
+    self->perf = NULL;
+    self->opts &= ~NL_OPT_PERF;
+    return 0;
+}
+
+#endif /* HAVE_LINUX_PERF_EVENT_H */
+
+void nlcali_perf_begin(T self)
+{
+    struct nlcali_perf_t *pf = self->perf;
+
+    pf->armed = 0 == perf_read(pf, pf->begin);
+}
+
+void nlcali_perf_end(T self)
+{
+    struct nlcali_perf_t *pf = self->perf;
+    struct nlcali_acc_t *acc;
+    uint64_t now[NL_PERF_MAX];
+    double x;
+    unsigned k;
+
+    if (!pf->armed || 0 != perf_read(pf, now)) {
+        pf->armed = 0;
+        return;
+    }
+    pf->armed = 0;
+    NL_SEQ_WRITE_BEGIN(self);
+    for (k = 0; k < NL_PERF_MAX; k++) {
+        if (0 == (pf->events & (1u << k))) {
+            continue;
+        }
+        acc = &pf->acc[k];
+        x = (double)(now[k] - pf->begin[k]);
+        NL_KSUM_ADD(acc->ksum, x);
+        NL_WVAR_ADD(acc->var, x);
+        if (x < acc->min) acc->min = x;
+        if (x > acc->max) acc->max = x;
+        acc->count++;
+    }
+    self->dirty = 1;
+    NL_SEQ_WRITE_END(self);
+}
+
+#undef T
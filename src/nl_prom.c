@@ -0,0 +1,801 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_prom.c
+ * Prometheus exposition of calipers, and an HTTP listener for it.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "nl_fmt.h"
+#include "nl_registry.h"
+/* Interface */
+#include "nl_prom.h"
+
+#define T nlcali_T
+
+/* First size of the output buffer */
+#define PROM_BUFSZ 65536
+
+/* Longest HTTP request head read */
+#define PROM_REQ_MAX 4096
+
+/* Seconds a client may take to send its request, or to read */
+#define PROM_IO_TIMEOUT 5
+
+/* Quantiles given for log-linear bins */
+static const double prom_q[3] = { 0.5, 0.99, 0.999 };
+static const char *const prom_q_labels[3] = {
+    "{quantile=\"0.5\"}", "{quantile=\"0.99\"}", "{quantile=\"0.999\"}"
+};
+
+struct nlcali_prom_t {
+    char *prefix;          /* start of every metric name */
+    unsigned flags;        /* of the current rendering */
+    char *buf;             /* rendering */
+    size_t len, cap;
+    int err;               /* memory ran out during this rendering */
+    char name[NL_PROM_NAME_MAX]; /* metric name of the current caliper */
+    size_t name_len;
+    struct nlcali_t snap;  /* copy of the current caliper */
+    struct nlcali_cpu_t cpu; /* its CPU times */
+    unsigned *bins;        /* its histogram bins */
+    size_t bins_cap;
+};
+
+typedef struct nlcali_prom_t *P;
+
+/* ---------------------------------------------------------------
+ * Output
+ */
+
+/* Room for `n` more bytes, growing the buffer if needed */
+static int out_room(P self, size_t n)
+{
+    size_t cap;
+    char *p;
+
+    if (self->len + n <= self->cap) {
+        return 0;
+    }
+    cap = self->cap > 0 ? self->cap : PROM_BUFSZ;
+    while (cap < self->len + n) {
+        cap *= 2;
+    }
+    p = (char *)realloc(self->buf, cap);
+    if (NULL == p) {
+        self->err = 1;
+        return -1;
+    }
+    self->buf = p;
+    self->cap = cap;
+    return 0;
+}
+
+static void out_mem(P self, const char *s, size_t n)
+{
+    if (0 == out_room(self, n)) {
+        memcpy(self->buf + self->len, s, n);
+        self->len += n;
+    }
+}
+
+static void out_str(P self, const char *s)
+{
+    out_mem(self, s, strlen(s));
+}
+
+/* Number, with Prometheus' spellings of NaN and infinities */
+static void out_num(P self, double x)
+{
+    char num[NL_FMT_BUFSZ];
+
+    if (x != x) {
+        out_mem(self, "NaN", 3);
+    }
+    else if (x > 1.7976931348623157e308) {
+        out_mem(self, "+Inf", 4);
+    }
+    else if (x < -1.7976931348623157e308) {
+        out_mem(self, "-Inf", 4);
+    }
+    else {
+        out_mem(self, num, nl_fmt_double(num, x));
+    }
+}
+
+static void out_int(P self, long long x)
+{
+    char num[NL_FMT_BUFSZ];
+
+    out_mem(self, num, nl_fmt_int(num, x));
+}
+
+/* "# TYPE <name><suffix> <type>" */
+static void out_type(P self, const char *suffix, const char *type)
+{
+    out_mem(self, "# TYPE ", 7);
+    out_mem(self, self->name, self->name_len);
+    out_str(self, suffix);
+    out_mem(self, " ", 1);
+    out_str(self, type);
+    out_mem(self, "\n", 1);
+}
+
+/* "<name><suffix><labels> <x>" */
+static void out_sample(P self, const char *suffix, const char *labels,
+                       double x)
+{
+    out_mem(self, self->name, self->name_len);
+    out_str(self, suffix);
+    if (NULL != labels) {
+        out_str(self, labels);
+    }
+    out_mem(self, " ", 1);
+    out_num(self, x);
+    out_mem(self, "\n", 1);
+}
+
+/* "<name><suffix>_bucket{le="<le>"} <n>" */
+static void out_bucket(P self, const char *suffix, double le, long long n)
+{
+    out_mem(self, self->name, self->name_len);
+    out_str(self, suffix);
+    out_mem(self, "_bucket{le=\"", 12);
+    out_num(self, le);
+    out_mem(self, "\"} ", 3);
+    out_int(self, n);
+    out_mem(self, "\n", 1);
+}
+
+/* ---------------------------------------------------------------
+ * Calipers
+ */
+
+/* Metric name of a caliper: prefix and name, with other characters
+   than [a-zA-Z0-9_:] as '_' */
+static void prom_name(P self, const char *name)
+{
+    size_t n = 0;
+    const char *s;
+    char ch;
+
+    for (s = self->prefix; *s && n < sizeof(self->name); s++) {
+        self->name[n++] = *s;
+    }
+    if (0 == n && *name >= '0' && *name <= '9') {
+        self->name[n++] = '_';
+    }
+    for (s = name; *s && n < sizeof(self->name); s++) {
+        ch = *s;
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+              (ch >= '0' && ch <= '9') || ch == '_' || ch == ':')) {
+            ch = '_';
+        }
+        self->name[n++] = ch;
+    }
+    self->name_len = n;
+}
+
+static int prom_bins(P self, size_t n)
+{
+    unsigned *p = (unsigned *)realloc(self->bins, n * sizeof(unsigned));
+
+    if (NULL == p) {
+        return -1;
+    }
+    self->bins = p;
+    self->bins_cap = n;
+    return 0;
+}
+
+/* Bins of the rate and gap, and of the other histograms, of `snap` */
+static size_t prom_nr(T snap)
+{
+    return snap->h_state > NL_HIST_AUTO_PRE && NULL != snap->h_rdata ?
+        2 * (size_t)snap->h_num : 0;
+}
+
+static size_t prom_nx(T snap)
+{
+    return (size_t)snap->h_dur.num + snap->h_val.num + snap->h_cpu.num +
+        snap->h_wait.num;
+}
+
+/* Copy the bins and CPU times of `live` into our own memory, for
+   nlcali_seq_copy() */
+static int prom_copy(void *arg, T snap, T live)
+{
+    P self = (P)arg;
+    size_t nr = prom_nr(snap), nx = prom_nx(snap);
+
+    (void)live;
+    if (nr + nx > self->bins_cap && 0 != prom_bins(self, nr + nx)) {
+        self->err = 1;
+        return -1;
+    }
+    if (nr > 0) {
+        memcpy(self->bins, snap->h_rdata, nr * sizeof(unsigned));
+    }
+    if (nx > 0) {
+        memcpy(self->bins + nr, snap->h_xdata, nx * sizeof(unsigned));
+    }
+    if (NULL != snap->cpu) {
+        memcpy(&self->cpu, snap->cpu, sizeof(self->cpu));
+    }
+    return 0;
+}
+
+/*
+ * Copy a caliper that another thread may be writing into `snap`,
+ * under its sequence lock, with its bins and CPU times in our own
+ * memory, and calculate its summaries. Fails if memory runs out, or
+ * if the caliper stays in the middle of an update.
+ */
+static int prom_snapshot(P self, T live)
+{
+    T snap = &self->snap;
+    struct nlcali_hist_t *x[4];
+    unsigned i, *p;
+    size_t nr;
+
+    if (0 != nlcali_seq_copy(live, snap, prom_copy, self)) {
+        return -1;
+    }
+    x[0] = &snap->h_dur;
+    x[1] = &snap->h_val;
+    x[2] = &snap->h_cpu;
+    x[3] = &snap->h_wait;
+    nr = prom_nr(snap);
+    if (nr > 0) {
+        snap->h_rdata = self->bins;
+        snap->h_gdata = self->bins + snap->h_num;
+    }
+    else {
+        /* ranges not chosen yet; nothing to show */
+        snap->h_state = NL_HIST_OFF;
+        snap->h_num = 0;
+        snap->h_rdata = snap->h_gdata = NULL;
+    }
+    p = self->bins + nr;
+    snap->h_xdata = prom_nx(snap) > 0 ? p : NULL;
+    for (i = 0; i < 4; i++) {
+        x[i]->data = x[i]->num > 0 ? p : NULL;
+        p += x[i]->num;
+    }
+    snap->h_slab = NULL;
+    snap->h_slab_num = 0;
+    snap->vsk = snap->rsk = snap->gsk = NULL;
+    snap->win = NULL;
+    snap->trace = NULL;
+    snap->smp = NULL;
+    snap->perf = NULL;
+    if (NULL != snap->cpu) {
+        snap->cpu = &self->cpu;
+    }
+    snap->opts = 0;
+    snap->dirty = 1;
+    nlcali_calc(snap);
+    return 0;
+}
+
+/* Events in a bin, estimated for all events when sampling */
+static long long prom_bin(T c, unsigned x)
+{
+    return 1 == c->scale ? x : (long long)(x * c->scale + 0.5);
+}
+
+/*
+ * One distribution: a histogram if it has linear bins, else a summary,
+ * with quantiles if it has log-linear bins. Bin edges are divided by
+ * `div`, which is exact for decimal edges; `sum` and `count` are used
+ * as they are.
+ */
+static void prom_dist(P self, const char *suffix, netlogger_hkind_t kind,
+                      double sum, long long count, double div)
+{
+    T c = &self->snap;
+    const struct nlcali_hist_t *h = NULL;
+    const unsigned *data = NULL;
+    netlogger_hstate_t state = NL_HIST_OFF;
+    double min = 0, width = 0;
+    long long cum = 0;
+    unsigned i, n = 0;
+
+    switch (kind) {
+        case NL_HIST_DUR: h = &c->h_dur; break;
+        case NL_HIST_VALUE: h = &c->h_val; break;
+        case NL_HIST_CPU: h = &c->h_cpu; break;
+        case NL_HIST_WAIT: h = &c->h_wait; break;
+        default:
+            if (NL_HIST_HAS_DATA(c)) {
+                state = c->h_state;
+                n = c->h_num;
+                data = kind == NL_HIST_GAP ? c->h_gdata : c->h_rdata;
+                min = kind == NL_HIST_GAP ? c->h_gmin : c->h_rmin;
+                width = kind == NL_HIST_GAP ? c->h_gwidth : c->h_rwidth;
+            }
+    }
+    if (NULL != h) {
+        state = h->state;
+        n = h->num;
+        data = h->data;
+        min = h->min;
+        width = h->width;
+    }
+    if (n > 0 && state != NL_HIST_LOGLINEAR) {
+        /* the last bin also holds values above its upper edge */
+        out_type(self, suffix, "histogram");
+        for (i = 0; i + 1 < n; i++) {
+            cum += prom_bin(c, data[i]);
+            out_bucket(self, suffix, (min + width * (i + 1)) / div, cum);
+        }
+        cum += prom_bin(c, data[n - 1]);
+        out_bucket(self, suffix, 1.0 / 0.0, cum);
+        count = cum;
+    }
+    else {
+        out_type(self, suffix, "summary");
+        for (i = 0; n > 0 && i < 3; i++) {
+            double q = nlcali_hist_quantile(c, kind, prom_q[i]);
+            out_sample(self, suffix, prom_q_labels[i],
+                       q < 0 ? 0.0 / 0.0 : q / div);
+        }
+    }
+    out_mem(self, self->name, self->name_len);
+    out_str(self, suffix);
+    out_mem(self, "_sum ", 5);
+    out_num(self, sum);
+    out_mem(self, "\n", 1);
+    out_mem(self, self->name, self->name_len);
+    out_str(self, suffix);
+    out_mem(self, "_count ", 7);
+    out_int(self, count);
+    out_mem(self, "\n", 1);
+}
+
+/* Gauges for the min, max and sd of a summary, divided by `div` */
+static void prom_minmax(P self, const char *const *suffixes,
+                        const struct nlcali_summ_t *sm, double div)
+{
+    double nan = 0.0 / 0.0;
+    int some = sm->count > 0;
+
+    out_type(self, suffixes[0], "gauge");
+    out_sample(self, suffixes[0], NULL, some ? sm->min / div : nan);
+    out_type(self, suffixes[1], "gauge");
+    out_sample(self, suffixes[1], NULL, some ? sm->max / div : nan);
+    out_type(self, suffixes[2], "gauge");
+    out_sample(self, suffixes[2], NULL, sm->sd >= 0 ? sm->sd / div : nan);
+}
+
+static const char *const prom_mm[5][3] = {
+    { "_value_min", "_value_max", "_value_sd" },
+    { "_rate_min", "_rate_max", "_rate_sd" },
+    { "_gap_min", "_gap_max", "_gap_sd" },
+    { "_cpu_seconds_min", "_cpu_seconds_max", "_cpu_seconds_sd" },
+    { "_wait_seconds_min", "_wait_seconds_max", "_wait_seconds_sd" }
+};
+
+/* ---------------------------------------------------------------
+ * Exporter methods
+ */
+
+nlcali_prom_T nlcali_prom_new(const char *prefix)
+{
+    P self = (P)calloc(1, sizeof(struct nlcali_prom_t));
+
+    if (NULL == self) {
+        return NULL;
+    }
+    self->prefix = strdup(prefix ? prefix : "");
+    if (NULL == self->prefix) {
+        free(self);
+        return NULL;
+    }
+    return self;
+}
+
+void nlcali_prom_begin(nlcali_prom_T self, unsigned flags)
+{
+    self->flags = flags;
+    self->len = 0;
+    self->err = 0;
+}
+
+int nlcali_prom_add(nlcali_prom_T self, const char *name, T cali)
+{
+    T c = &self->snap;
+    int om = self->flags & NL_PROM_OPENMETRICS;
+
+    if (0 != prom_snapshot(self, cali)) {
+        /* out of memory (`err` is set), or stuck mid-update */
+        return -1;
+    }
+    prom_name(self, name);
+    /* OpenMetrics names the counter family without its suffix */
+    out_type(self, om ? "_events" : "_events_total", "counter");
+    out_sample(self, "_events_total", NULL, (double)c->vsm.count);
+    prom_dist(self, "_value", NL_HIST_VALUE, c->vsm.sum, c->vsm.count, 1);
+    prom_minmax(self, prom_mm[0], &c->vsm, 1);
+    prom_dist(self, "_duration_seconds", NL_HIST_DUR, c->dur_sum,
+              c->vsm.count, 1e9);
+    prom_dist(self, "_rate", NL_HIST_RATE, c->rsm.sum, c->rsm.count, 1);
+    prom_minmax(self, prom_mm[1], &c->rsm, 1);
+    prom_dist(self, "_gap", NL_HIST_GAP, c->gsm.sum, c->gsm.count, 1);
+    prom_minmax(self, prom_mm[2], &c->gsm, 1);
+    if (NULL != c->cpu) {
+        prom_dist(self, "_cpu_seconds", NL_HIST_CPU, c->cpu->csm.sum / 1e9,
+                  c->cpu->csm.count, 1e9);
+        prom_minmax(self, prom_mm[3], &c->cpu->csm, 1e9);
+        prom_dist(self, "_wait_seconds", NL_HIST_WAIT,
+                  c->cpu->wsm.sum / 1e9, c->cpu->wsm.count, 1e9);
+        prom_minmax(self, prom_mm[4], &c->cpu->wsm, 1e9);
+    }
+    if (c->inflight_max > 0) {
+        out_type(self, "_inflight", "gauge");
+        out_sample(self, "_inflight", NULL, c->inflight);
+        out_type(self, "_inflight_max", "gauge");
+        out_sample(self, "_inflight_max", NULL, c->inflight_max);
+    }
+    return self->err ? -1 : 0;
+}
+
+const char *nlcali_prom_end(nlcali_prom_T self, size_t *len)
+{
+    if (self->flags & NL_PROM_OPENMETRICS) {
+        out_mem(self, "# EOF\n", 6);
+    }
+    if (0 != out_room(self, 1) || self->err) {
+        return NULL;
+    }
+    self->buf[self->len] = '\0';
+    if (NULL != len) {
+        *len = self->len;
+    }
+    return self->buf;
+}
+
+static void prom_registered(void *arg, const char *name, T cali)
+{
+    nlcali_prom_add((P)arg, name, cali);
+}
+
+const char *nlcali_prom_registry(nlcali_prom_T self, unsigned flags,
+                                 size_t *len)
+{
+    nlcali_prom_begin(self, flags);
+    nlcali_registry_foreach(prom_registered, self);
+    return nlcali_prom_end(self, len);
+}
+
+void nlcali_prom_free(nlcali_prom_T self)
+{
+    if (self) {
+        free(self->prefix);
+        free(self->buf);
+        free(self->bins);
+        free(self);
+    }
+}
+
+/* ---------------------------------------------------------------
+ * HTTP listener
+ */
+
+struct nlcali_prom_server_t {
+    P prom;                /* renders for this server only */
+    nlcali_prom_fn fn;     /* renders the calipers, NULL for registry */
+    void *arg;             /* argument for `fn` */
+    int fd;                /* listening socket */
+    int wake[2];           /* pipe; written to stop the thread */
+    int port;              /* TCP port, 0 for a UNIX socket */
+    char *path;            /* UNIX socket path, NULL for TCP */
+    pthread_t thread;
+    char req[PROM_REQ_MAX]; /* request head */
+};
+
+typedef struct nlcali_prom_server_t *S;
+
+/* Send all of `head` then `body`; 0 on success */
+static int send_all(int fd, const char *head, size_t hlen,
+                    const char *body, size_t blen)
+{
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t n;
+
+    iov[0].iov_base = (void *)head;
+    iov[0].iov_len = hlen;
+    iov[1].iov_base = (void *)body;
+    iov[1].iov_len = blen;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    while (iov[0].iov_len + iov[1].iov_len > 0) {
+        /* no SIGPIPE if the client has gone */
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        if ((size_t)n < iov[0].iov_len) {
+            iov[0].iov_base = (char *)iov[0].iov_base + n;
+            iov[0].iov_len -= n;
+            continue;
+        }
+        n -= iov[0].iov_len;
+        iov[0].iov_len = 0;
+        iov[1].iov_base = (char *)iov[1].iov_base + n;
+        iov[1].iov_len -= n;
+    }
+    return 0;
+}
+
+static void respond(int fd, const char *status, const char *type,
+                    const char *body, size_t blen, int head_only)
+{
+    char head[256];
+    int hlen;
+
+    hlen = snprintf(head, sizeof(head),
+                    "HTTP/1.1 %s\r\nContent-Type: %s\r\n"
+                    "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                    status, type, (unsigned long)blen);
+    (void)send_all(fd, head, (size_t)hlen, body, head_only ? 0 : blen);
+}
+
+/* Read and answer one request */
+static void serve_one(S self, int fd)
+{
+    struct timeval tv;
+    const char *body, *path;
+    size_t n = 0, len, plen;
+    ssize_t r;
+    unsigned flags = 0;
+    int head_only;
+
+    tv.tv_sec = PROM_IO_TIMEOUT;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    do {
+        r = read(fd, self->req + n, sizeof(self->req) - 1 - n);
+        if (r <= 0) {
+            return;
+        }
+        n += r;
+        self->req[n] = '\0';
+    } while (NULL == strstr(self->req, "\r\n\r\n") &&
+             NULL == strstr(self->req, "\n\n") &&
+             n < sizeof(self->req) - 1);
+
+    head_only = 0 == strncmp(self->req, "HEAD ", 5);
+    if (!head_only && 0 != strncmp(self->req, "GET ", 4)) {
+        respond(fd, "405 Method Not Allowed", "text/plain", "", 0, 0);
+        return;
+    }
+    path = self->req + (head_only ? 5 : 4);
+    plen = strcspn(path, " ?\r\n");
+    if (!((1 == plen && 0 == strncmp(path, "/", 1)) ||
+          (8 == plen && 0 == strncmp(path, "/metrics", 8)))) {
+        respond(fd, "404 Not Found", "text/plain", "", 0, 0);
+        return;
+    }
+    if (NULL != strstr(self->req, "application/openmetrics-text")) {
+        flags = NL_PROM_OPENMETRICS;
+    }
+    if (NULL != self->fn) {
+        nlcali_prom_begin(self->prom, flags);
+        self->fn(self->arg, self->prom);
+        body = nlcali_prom_end(self->prom, &len);
+    }
+    else {
+        body = nlcali_prom_registry(self->prom, flags, &len);
+    }
+    if (NULL == body) {
+        respond(fd, "500 Internal Server Error", "text/plain", "", 0, 0);
+        return;
+    }
+    respond(fd, "200 OK", flags ?
+            "application/openmetrics-text; version=1.0.0; charset=utf-8" :
+            "text/plain; version=0.0.4; charset=utf-8",
+            body, len, head_only);
+}
+
+static void *server_main(void *arg)
+{
+    S self = (S)arg;
+    struct pollfd pfd[2];
+    int fd;
+
+    pfd[0].fd = self->fd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = self->wake[0];
+    pfd[1].events = POLLIN;
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (pfd[0].revents & POLLIN) {
+            fd = accept(self->fd, NULL, NULL);
+            if (fd >= 0) {
+                serve_one(self, fd);
+                close(fd);
+            }
+        }
+    }
+    return NULL;
+}
+
+static int listen_unix(S self, const char *path)
+{
+    struct sockaddr_un sa;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    self->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (self->fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (0 != bind(self->fd, (struct sockaddr *)&sa, sizeof(sa))) {
+        return -1;
+    }
+    self->path = strdup(path);
+    return NULL == self->path ? -1 : 0;
+}
+
+static int listen_tcp(S self, const char *addr)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    struct sockaddr_storage ss;
+    socklen_t sslen = sizeof(ss);
+    char host[256];
+    const char *port = strrchr(addr, ':');
+    size_t hlen = 0;
+    int one = 1;
+
+    if (NULL == port) {
+        port = addr;
+    }
+    else {
+        hlen = port - addr;
+        port++;
+        /* "[::1]:9100" */
+        if (hlen >= 2 && '[' == addr[0] && ']' == addr[hlen - 1]) {
+            addr++;
+            hlen -= 2;
+        }
+    }
+    if (hlen >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, addr, hlen);
+    host[hlen] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (0 != getaddrinfo(hlen > 0 ? host : NULL, port, &hints, &res)) {
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        self->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                          ai->ai_protocol);
+        if (self->fd < 0) {
+            continue;
+        }
+        setsockopt(self->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (0 == bind(self->fd, ai->ai_addr, ai->ai_addrlen)) {
+            break;
+        }
+        close(self->fd);
+        self->fd = -1;
+    }
+    freeaddrinfo(res);
+    if (self->fd < 0 ||
+        0 != getsockname(self->fd, (struct sockaddr *)&ss, &sslen)) {
+        return -1;
+    }
+    self->port = ntohs(AF_INET6 == ss.ss_family ?
+                       ((struct sockaddr_in6 *)&ss)->sin6_port :
+                       ((struct sockaddr_in *)&ss)->sin_port);
+    return 0;
+}
+
+nlcali_prom_server_T nlcali_prom_serve(const char *addr, const char *prefix,
+                                       nlcali_prom_fn fn, void *arg)
+{
+    S self = (S)calloc(1, sizeof(struct nlcali_prom_server_t));
+
+    if (NULL == self) {
+        return NULL;
+    }
+    self->fd = self->wake[0] = self->wake[1] = -1;
+    self->fn = fn;
+    self->arg = arg;
+    self->prom = nlcali_prom_new(prefix);
+    if (NULL == self->prom) {
+        goto error;
+    }
+    if (0 == strncmp(addr, "unix:", 5) ? 0 != listen_unix(self, addr + 5) :
+        0 != listen_tcp(self, addr)) {
+        goto error;
+    }
+    if (0 != listen(self->fd, SOMAXCONN) || 0 != pipe(self->wake)) {
+        goto error;
+    }
+    if (0 != pthread_create(&self->thread, NULL, server_main, self)) {
+        goto error;
+    }
+    return self;
+
+ error:
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+    if (self->wake[0] >= 0) {
+        close(self->wake[0]);
+        close(self->wake[1]);
+    }
+    if (NULL != self->path) {
+        unlink(self->path);
+        free(self->path);
+    }
+    nlcali_prom_free(self->prom);
+    free(self);
+    return NULL;
+}
+
+int nlcali_prom_server_port(nlcali_prom_server_T self)
+{
+    return self->port;
+}
+
+void nlcali_prom_server_free(nlcali_prom_server_T self)
+{
+    if (NULL == self) {
+        return;
+    }
+    (void)write(self->wake[1], "x", 1);
+    pthread_join(self->thread, NULL);
+    close(self->fd);
+    close(self->wake[0]);
+    close(self->wake[1]);
+    if (NULL != self->path) {
+        unlink(self->path);
+        free(self->path);
+    }
+    nlcali_prom_free(self->prom);
+    free(self);
+}
+
+#undef T
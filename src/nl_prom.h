@@ -0,0 +1,161 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_prom.h
+ * Prometheus exposition of calipers.
+ *
+ * An exporter renders calipers in the Prometheus text format, or in
+ * OpenMetrics, into a buffer that it keeps and reuses, so that after
+ * the first few renderings it allocates no memory. Each caliper is
+ * copied under its sequence lock first, as by nlcali_merge_live(),
+ * so the threads recording into it are never blocked, and every
+ * series of one caliper comes from the same instant.
+ *
+ * A caliper registered as "svc.db.query", with prefix "nlcali_",
+ * gives these metric families, all prefixed "nlcali_svc_db_query":
+ *   - `_events_total`: counter of events;
+ *   - `_value`, `_duration_seconds`, `_rate`, `_gap` and, with
+ *     nlcali_cpu(), `_cpu_seconds` and `_wait_seconds`: a histogram
+ *     with cumulative `_bucket{le="..."}` series where the caliper has
+ *     linear bins for it, else a summary with `_sum` and `_count`, and
+ *     `{quantile="..."}` series for log-linear bins;
+ *   - `_value_min`, `_value_max`, `_value_sd` and likewise for rate,
+ *     gap and CPU times: gauges, NaN while there are no events;
+ *   - `_inflight` and `_inflight_max`: gauges, if nlcali_start() has
+ *     been used.
+ * Characters other than letters, digits, '_' and ':' in names become
+ * '_'. Quantile sketches, windows and perf_event counters are not
+ * exported.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_PROM_INCLUDED
+#    define NETLOGGER_PROM_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+/* Render OpenMetrics rather than the Prometheus text format 0.0.4 */
+#define NL_PROM_OPENMETRICS 0x1
+
+/* Longest metric name prefix, with the caliper name, that is kept */
+#define NL_PROM_NAME_MAX 200
+
+struct nlcali_prom_t;
+typedef struct nlcali_prom_t *nlcali_prom_T;
+
+struct nlcali_prom_server_t;
+typedef struct nlcali_prom_server_t *nlcali_prom_server_T;
+
+/**
+ * Callback that renders calipers for a server, by calling
+ * nlcali_prom_add() for each.
+ *
+ * \param arg User argument given to nlcali_prom_serve()
+ * \param out Exporter to add the calipers to
+ */
+typedef void (*nlcali_prom_fn)(void *arg, nlcali_prom_T out);
+
+/**
+ * Create an exporter.
+ *
+ * \param prefix Prefix of every metric name, e.g. "nlcali_"; copied
+ * \return New exporter, or NULL if memory is exhausted
+ */
+nlcali_prom_T nlcali_prom_new(const char *prefix);
+
+/**
+ * Start a rendering, discarding the previous one.
+ *
+ * \param self Exporter
+ * \param flags 0, or NL_PROM_OPENMETRICS
+ */
+void nlcali_prom_begin(nlcali_prom_T self, unsigned flags);
+
+/**
+ * Render one caliper. It may be recorded into by another thread
+ * meanwhile, but not reconfigured.
+ *
+ * \param self Exporter
+ * \param name Caliper name, used in the metric names
+ * \param cali Caliper, unchanged
+ * \return 0 on success, -1 if memory ran out, or if the caliper
+ *         stayed in the middle of an update (see nlcali_seq_copy()),
+ *         in which case it is left out and the rest still rendered
+ */
+int nlcali_prom_add(nlcali_prom_T self, const char *name, T cali);
+
+/**
+ * Finish a rendering.
+ *
+ * \param self Exporter
+ * \param len Set to the length of the rendering, if not NULL
+ * \return Rendering, NUL-terminated, valid until the next call of
+ *         nlcali_prom_begin(); or NULL if memory ran out during it
+ */
+const char *nlcali_prom_end(nlcali_prom_T self, size_t *len);
+
+/**
+ * Render every registered caliper (see nl_registry.h), in order of
+ * registration. New names cannot be registered meanwhile.
+ *
+ * \param self Exporter
+ * \param flags As for nlcali_prom_begin()
+ * \param len As for nlcali_prom_end()
+ * \return As for nlcali_prom_end()
+ */
+const char *nlcali_prom_registry(nlcali_prom_T self, unsigned flags,
+                                 size_t *len);
+
+/**
+ * Free an exporter and its buffers.
+ *
+ * \param self Exporter
+ */
+void nlcali_prom_free(nlcali_prom_T self);
+
+/**
+ * Serve renderings over HTTP, from a thread of the server's own.
+ *
+ * A GET (or HEAD) of "/metrics" or "/" renders the calipers when
+ * it is received, in OpenMetrics if the request accepts
+ * "application/openmetrics-text", and in the text format otherwise.
+ * Connections are served one at a time and then closed.
+ *
+ * \param addr "unix:PATH" for a UNIX socket, replacing any file at
+ *        PATH; else "HOST:PORT", ":PORT" or "PORT" for TCP, on all
+ *        addresses if HOST is empty. Port 0 picks a free port (see
+ *        nlcali_prom_server_port()).
+ * \param prefix As for nlcali_prom_new()
+ * \param fn Callback that renders the calipers, or NULL to render
+ *        the registered ones
+ * \param arg Passed to `fn`
+ * \return New server, listening, or NULL on error
+ */
+nlcali_prom_server_T nlcali_prom_serve(const char *addr, const char *prefix,
+                                       nlcali_prom_fn fn, void *arg);
+
+/**
+ * TCP port a server listens on.
+ *
+ * \param self Server
+ * \return Port, or 0 for a UNIX socket
+ */
+int nlcali_prom_server_port(nlcali_prom_server_T self);
+
+/**
+ * Stop a server, and free it. A UNIX socket is removed.
+ *
+ * \param self Server
+ */
+void nlcali_prom_server_free(nlcali_prom_server_T self);
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_PROM_INCLUDED */
@@ -0,0 +1,261 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_registry.c
+ * Process-wide registry of named calipers.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Interface */
+#include "nl_registry.h"
+
+#define T nlcali_T
+
+/* Smallest hash table; tables grow at half full */
+#define MIN_SLOTS 64
+
+/*
+ * A registered caliper. The caliper comes first, so a handle
+ * returned by nlcali_get() is also a pointer to its entry.
+ */
+struct nl_reg_entry_t {
+    struct nlcali_t cali;
+    uint64_t hash;
+    struct nl_reg_entry_t *next; /* in order of registration */
+    char name[1];                /* interned name, allocated to fit */
+};
+
+typedef struct nl_reg_entry_t *E;
+
+/*
+ * Open-addressing hash table with linear probing. Slots only go
+ * from empty to full, and a full table is replaced rather than
+ * resized, so readers need no lock. Replaced tables are kept on
+ * the `old` list until the registry is freed, since a reader may
+ * still be probing one.
+ */
+struct nl_reg_table_t {
+    unsigned mask;                 /* number of slots - 1 */
+    struct nl_reg_table_t *old;    /* table this one replaced */
+    E slot[1];                     /* allocated to fit */
+};
+
+static struct nl_reg_table_t *reg_table = NULL;
+static pthread_mutex_t reg_lock = PTHREAD_MUTEX_INITIALIZER;
+static E reg_head = NULL, reg_tail = NULL;
+static unsigned reg_count = 0;
+static struct nlcali_t reg_proto;
+static int reg_have_proto = 0;
+
+/* FNV-1a */
+static uint64_t name_hash(const char *name)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static E table_find(struct nl_reg_table_t *t, const char *name,
+                    uint64_t hash)
+{
+    unsigned i = (unsigned)hash & t->mask;
+    E e;
+
+    while (NULL != (e = __atomic_load_n(&t->slot[i], __ATOMIC_ACQUIRE))) {
+        if (e->hash == hash && 0 == strcmp(e->name, name)) {
+            return e;
+        }
+        i = (i + 1) & t->mask;
+    }
+    return NULL;
+}
+
+static void table_put(struct nl_reg_table_t *t, E e)
+{
+    unsigned i = (unsigned)e->hash & t->mask;
+
+    while (NULL != t->slot[i]) {
+        i = (i + 1) & t->mask;
+    }
+    __atomic_store_n(&t->slot[i], e, __ATOMIC_RELEASE);
+}
+
+/* Replace the table with one twice the size; called with the lock held */
+static int table_grow(void)
+{
+    struct nl_reg_table_t *t;
+    unsigned n = reg_table ? 2 * (reg_table->mask + 1) : MIN_SLOTS;
+    E e;
+
+    t = (struct nl_reg_table_t *)calloc(1, sizeof(struct nl_reg_table_t) +
+                                        (n - 1) * sizeof(E));
+    if (NULL == t) {
+        return -1;
+    }
+    t->mask = n - 1;
+    t->old = reg_table;
+    for (e = reg_head; e; e = e->next) {
+        table_put(t, e);
+    }
+    __atomic_store_n(&reg_table, t, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Slow path of nlcali_get(): register a name */
+static T registry_add(const char *name, uint64_t hash)
+{
+    size_t len = strlen(name), size;
+    void *p;
+    E e = NULL;
+
+    pthread_mutex_lock(&reg_lock);
+    /* another thread may have registered it */
+    if (reg_table && NULL != (e = table_find(reg_table, name, hash))) {
+        goto done;
+    }
+    if ((NULL == reg_table || 2 * (reg_count + 1) > reg_table->mask + 1) &&
+        0 != table_grow()) {
+        goto done;
+    }
+    /* whole cache lines, so calipers used by different threads
+       never share one */
+    size = sizeof(struct nl_reg_entry_t) + len;
+    size = (size + NL_CACHE_LINE - 1) / NL_CACHE_LINE * NL_CACHE_LINE;
+    if (0 != posix_memalign(&p, NL_CACHE_LINE, size)) {
+        goto done;
+    }
+    e = (E)p;
+    if (reg_have_proto) {
+        nlcali_init_like(&e->cali, &reg_proto);
+    }
+    else {
+        nlcali_init(&e->cali, NL_REGISTRY_BASELINE);
+    }
+    e->hash = hash;
+    e->next = NULL;
+    memcpy(e->name, name, len + 1);
+    if (reg_tail) {
+        reg_tail->next = e;
+    }
+    else {
+        reg_head = e;
+    }
+    reg_tail = e;
+    reg_count++;
+    table_put(reg_table, e);
+
+ done:
+    pthread_mutex_unlock(&reg_lock);
+    return e ? &e->cali : NULL;
+}
+
+/* ---------------------------------------------------------------
+ * Registry methods
+ */
+
+T nlcali_get(const char *name)
+{
+    struct nl_reg_table_t *t = __atomic_load_n(&reg_table, __ATOMIC_ACQUIRE);
+    uint64_t hash = name_hash(name);
+    E e;
+
+    if (t && NULL != (e = table_find(t, name, hash))) {
+        return &e->cali;
+    }
+    return registry_add(name, hash);
+}
+
+const char *nlcali_registry_name(T cali)
+{
+    return ((E)cali)->name;
+}
+
+void nlcali_registry_proto(T proto)
+{
+    pthread_mutex_lock(&reg_lock);
+    if (reg_have_proto) {
+        nlcali_fini(&reg_proto);
+    }
+    nlcali_init_like(&reg_proto, proto);
+    reg_have_proto = 1;
+    pthread_mutex_unlock(&reg_lock);
+}
+
+unsigned nlcali_registry_foreach(nlcali_registry_fn fn, void *arg)
+{
+    unsigned n;
+    E e;
+
+    pthread_mutex_lock(&reg_lock);
+    for (e = reg_head; e; e = e->next) {
+        fn(arg, e->name, &e->cali);
+    }
+    n = reg_count;
+    pthread_mutex_unlock(&reg_lock);
+    return n;
+}
+
+int nlcali_registry_aggregate(const char *prefix, T out)
+{
+    size_t len = prefix ? strlen(prefix) : 0;
+    int n = 0;
+    E e;
+
+    if (len >= 2 && 0 == strcmp(prefix + len - 2, ".*")) {
+        len -= 2;
+    }
+    pthread_mutex_lock(&reg_lock);
+    for (e = reg_head; e; e = e->next) {
+        if (len > 0 && (0 != strncmp(e->name, prefix, len) ||
+                        (e->name[len] != '\0' && e->name[len] != '.'))) {
+            continue;
+        }
+        if (0 != nlcali_merge_live(out, &e->cali)) {
+            n = -1;
+            break;
+        }
+        n++;
+    }
+    pthread_mutex_unlock(&reg_lock);
+    nlcali_calc(out);
+    return n;
+}
+
+void nlcali_registry_free(void)
+{
+    struct nl_reg_table_t *t, *old;
+    E e, next;
+
+    pthread_mutex_lock(&reg_lock);
+    for (t = reg_table; t; t = old) {
+        old = t->old;
+        free(t);
+    }
+    reg_table = NULL;
+    for (e = reg_head; e; e = next) {
+        next = e->next;
+        nlcali_fini(&e->cali);
+        free(e);
+    }
+    reg_head = reg_tail = NULL;
+    reg_count = 0;
+    if (reg_have_proto) {
+        nlcali_fini(&reg_proto);
+        reg_have_proto = 0;
+    }
+    pthread_mutex_unlock(&reg_lock);
+}
+
+#undef T
@@ -0,0 +1,133 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_registry.h
+ * Process-wide registry of named calipers.
+ *
+ * nlcali_get() maps a hierarchical, dot-separated event name such as
+ * "svc.db.query" to a caliper that lives until nlcali_registry_free().
+ * The first lookup of a name registers it under a lock; after that,
+ * lookups only read the hash table and never lock. The usual rule
+ * still applies to the caliper itself: one thread records into it.
+ */
+
+#include "nl_sharded.h"
+
+#ifndef NETLOGGER_REGISTRY_INCLUDED
+#    define NETLOGGER_REGISTRY_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+/* Baseline of registered calipers when no prototype is set */
+#define NL_REGISTRY_BASELINE 2
+
+/**
+ * Registry iteration callback.
+ *
+ * \param arg User argument given to nlcali_registry_foreach()
+ * \param name Registered name
+ * \param cali Registered caliper
+ */
+typedef void (*nlcali_registry_fn)(void *arg, const char *name, T cali);
+
+/**
+ * Find or register the caliper for a name.
+ *
+ * \param name Event name, copied on first use
+ * \return Caliper for `name`, the same one on every call,
+ *         or NULL if memory is exhausted
+ */
+T nlcali_get(const char *name);
+
+/**
+ * Name under which a caliper was registered.
+ *
+ * \param cali Caliper returned by nlcali_get()
+ * \return Registered name
+ */
+const char *nlcali_registry_name(T cali);
+
+/**
+ * Set the baseline, clock and histogram configuration of calipers
+ * registered from now on, as with nlcali_init_like().
+ *
+ * \param proto Caliper to copy configuration from
+ */
+void nlcali_registry_proto(T proto);
+
+/**
+ * Call a function for each registered caliper, in order of
+ * registration. Registration of new names waits until it returns;
+ * lookups of existing names do not.
+ *
+ * \param fn Callback
+ * \param arg Passed to `fn`
+ * \return Number of registered calipers
+ */
+unsigned nlcali_registry_foreach(nlcali_registry_fn fn, void *arg);
+
+/**
+ * Merge all calipers at or below a point in the name hierarchy.
+ *
+ * A name matches if it equals `prefix` or starts with `prefix`
+ * followed by a dot, so "svc.db" matches "svc.db" and "svc.db.query"
+ * but not "svc.dbx". A trailing ".*" on `prefix` is ignored.
+ * Calipers are merged with nlcali_merge_live(), so their threads
+ * may keep recording.
+ *
+ * \param prefix Name prefix; NULL or "" matches every caliper
+ * \param out Initialized caliper to merge into, with the same clock
+ *        and histogram bins as the registered calipers
+ * \post As if nlcali_calc() was called on `out`
+ * \return Number of calipers merged, or -1 on error
+ */
+int nlcali_registry_aggregate(const char *prefix, T out);
+
+/**
+ * Free every registered caliper. No thread may still be using
+ * a caliper returned by nlcali_get().
+ */
+void nlcali_registry_free(void);
+
+#ifdef __GNUC__
+/**
+ * Define a file-scope caliper handle that is looked up once, when
+ * the program (or library) is loaded, so that call sites use it
+ * directly with no lookup at all. For example:
+ *
+ *     NLCALI_STATIC(db_query, "svc.db.query");
+ *     ...
+ *     nlcali_begin(db_query);
+ *
+ * Calipers defined this way are registered before main() runs, so
+ * they do not see a prototype set with nlcali_registry_proto().
+ */
+#define NLCALI_STATIC(V, NAME)                                      \
+    static nlcali_T V;                                              \
+    static void __attribute__((constructor)) V##_nl_get_(void)      \
+    {                                                               \
+        V = nlcali_get(NAME);                                       \
+    }
+
+/**
+ * Caliper for a name, looked up on the first call at this call site
+ * and cached in a static variable after that.
+ */
+#define nlcali_get_static(NAME) __extension__ ({                    \
+        static nlcali_T h_;                                         \
+        if (__builtin_expect(NULL == h_, 0)) {                      \
+            h_ = nlcali_get(NAME);                                  \
+        }                                                           \
+        h_;                                                         \
+    })
+#endif
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_REGISTRY_INCLUDED */
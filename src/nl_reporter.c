@@ -0,0 +1,308 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_reporter.c
+ * Background reporting of calipers.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/* Interface */
+#include "nl_reporter.h"
+
+#define T nlcali_T
+
+/* Reported calipers are aligned to this many bytes */
+#define REP_ALIGN 64
+
+/* Longest wait for measured threads to acknowledge a flip */
+#define MAX_GRACE_SEC 0.01
+
+struct nlcali_reporter_t {
+    double interval;       /* seconds between reports */
+    unsigned max_calipers; /* size of `cali` */
+    volatile unsigned num; /* calipers in `cali` */
+    nlcali_rep_T *cali;    /* reported calipers */
+    int fd;                /* output, if no callback */
+    nlcali_sink_fn fn;     /* output callback */
+    void *arg;             /* argument for callback */
+    struct nlcali_logbuf_t lb; /* formatted line, for `fd` */
+    pthread_t thread;
+    pthread_mutex_t lock;  /* guards all but the hot-path fields */
+    pthread_cond_t cond;   /* wakes the thread, and flush() callers */
+    int stop;              /* thread should exit */
+    int flush_req;         /* flush() is waiting */
+    unsigned flushes;      /* number of flushes done */
+};
+
+typedef struct nlcali_reporter_t *R;
+
+/* ---------------------------------------------------------------
+ * Time
+ */
+
+static void ts_add(struct timespec *ts, double sec)
+{
+    long ns = (long)((sec - (long)sec) * 1e9);
+
+    ts->tv_sec += (time_t)sec;
+    ts->tv_nsec += ns;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* ---------------------------------------------------------------
+ * Reporting
+ */
+
+static void report(R self, const char *name, T c)
+{
+    struct iovec iov[2];
+    char *line;
+
+    nlcali_calc(c);
+    if (NULL != self->fn) {
+        self->fn(self->arg, name, c);
+    }
+    else if (self->fd >= 0) {
+        line = nlcali_log_buf(c, name, &self->lb);
+        if (NULL != line) {
+            iov[0].iov_base = line;
+            iov[0].iov_len = strlen(line);
+            iov[1].iov_base = "\n";
+            iov[1].iov_len = 1;
+            (void)writev(self->fd, iov, 2);
+        }
+    }
+}
+
+/* Ask for a flip of every caliper whose last flip was reported */
+static void request_flips(R self)
+{
+    nlcali_rep_T r;
+    unsigned i;
+
+    for (i = 0; i < self->num; i++) {
+        r = self->cali[i];
+        if (r->req == r->done) {
+            NL_WMB(); /* retired accumulator was cleared */
+            r->req++;
+        }
+    }
+}
+
+/* Report the retired accumulator of every acknowledged flip */
+static void collect_flips(R self)
+{
+    nlcali_rep_T r;
+    T c;
+    unsigned i;
+
+    for (i = 0; i < self->num; i++) {
+        r = self->cali[i];
+        if (r->ack == r->req && r->done != r->req) {
+            NL_RMB();
+            c = &r->acc[r->active ^ 1];
+            report(self, r->name, c);
+            nlcali_clear(c);
+            r->done = r->req;
+        }
+    }
+}
+
+/* One reporting cycle; called with the lock held */
+static void cycle(R self)
+{
+    struct timespec grace;
+    double sec = self->interval / 10;
+
+    if (sec > MAX_GRACE_SEC) {
+        sec = MAX_GRACE_SEC;
+    }
+    request_flips(self);
+    grace.tv_sec = 0;
+    grace.tv_nsec = 0;
+    ts_add(&grace, sec);
+    pthread_mutex_unlock(&self->lock);
+    nanosleep(&grace, NULL);
+    pthread_mutex_lock(&self->lock);
+    collect_flips(self);
+}
+
+static void *reporter_main(void *arg)
+{
+    R self = (R)arg;
+    struct timespec next, now;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    ts_add(&next, self->interval);
+    pthread_mutex_lock(&self->lock);
+    while (!self->stop) {
+        rc = 0;
+        while (!self->stop && !self->flush_req && rc != ETIMEDOUT) {
+            rc = pthread_cond_timedwait(&self->cond, &self->lock, &next);
+        }
+        if (self->stop) {
+            break;
+        }
+        if (rc == ETIMEDOUT) {
+            /* keep to the schedule, skipping ticks if running late */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            do {
+                ts_add(&next, self->interval);
+            } while (ts_before(&next, &now));
+        }
+        cycle(self);
+        if (self->flush_req) {
+            self->flush_req = 0;
+            self->flushes++;
+            pthread_cond_broadcast(&self->cond);
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------
+ * Reporter methods
+ */
+
+nlcali_reporter_T nlcali_reporter_new(double interval, unsigned max_calipers,
+                                      int fd, nlcali_sink_fn fn, void *arg)
+{
+    pthread_condattr_t attr;
+    R self;
+
+    if (!(interval > 0) || 0 == max_calipers) {
+        return NULL;
+    }
+    self = (R)calloc(1, sizeof(struct nlcali_reporter_t));
+    if (NULL == self) {
+        goto error;
+    }
+    self->cali = (nlcali_rep_T *)calloc(max_calipers, sizeof(nlcali_rep_T));
+    if (NULL == self->cali) {
+        goto error;
+    }
+    self->interval = interval;
+    self->max_calipers = max_calipers;
+    self->fd = fd;
+    self->fn = fn;
+    self->arg = arg;
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&self->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (0 != pthread_create(&self->thread, NULL, reporter_main, self)) {
+        pthread_cond_destroy(&self->cond);
+        pthread_mutex_destroy(&self->lock);
+        goto error;
+    }
+    return self;
+
+ error:
+    if (self) {
+        free(self->cali);
+        free(self);
+    }
+    return NULL;
+}
+
+nlcali_rep_T nlcali_reporter_add(nlcali_reporter_T self, const char *name,
+                                 T proto)
+{
+    nlcali_rep_T r = NULL;
+    void *mem;
+
+    pthread_mutex_lock(&self->lock);
+    if (self->num == self->max_calipers) {
+        goto error;
+    }
+    if (0 != posix_memalign(&mem, REP_ALIGN, sizeof(struct nlcali_rep_t))) {
+        goto error;
+    }
+    r = (nlcali_rep_T)mem;
+    r->name = strdup(name);
+    if (NULL == r->name) {
+        free(r);
+        r = NULL;
+        goto error;
+    }
+    nlcali_init_like(&r->acc[0], proto);
+    nlcali_init_like(&r->acc[1], proto);
+    r->active = r->req = r->ack = r->done = 0;
+    self->cali[self->num] = r;
+    NL_WMB();
+    self->num++;
+
+ error:
+    pthread_mutex_unlock(&self->lock);
+    return r;
+}
+
+void nlcali_reporter_flush(nlcali_reporter_T self)
+{
+    unsigned flushes;
+
+    pthread_mutex_lock(&self->lock);
+    flushes = self->flushes;
+    self->flush_req = 1;
+    pthread_cond_broadcast(&self->cond);
+    while (self->flushes == flushes && !self->stop) {
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+void nlcali_reporter_free(nlcali_reporter_T self)
+{
+    nlcali_rep_T r;
+    unsigned i;
+
+    if (NULL == self) {
+        return;
+    }
+    pthread_mutex_lock(&self->lock);
+    self->stop = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+    pthread_join(self->thread, NULL);
+
+    /* report what is left, oldest first */
+    collect_flips(self);
+    for (i = 0; i < self->num; i++) {
+        r = self->cali[i];
+        if (nlcali_rep_cali(r)->vacc.count > 0) {
+            report(self, r->name, nlcali_rep_cali(r));
+        }
+        nlcali_fini(&r->acc[0]);
+        nlcali_fini(&r->acc[1]);
+        free(r->name);
+        free(r);
+    }
+    nlcali_logbuf_free(&self->lb);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    free(self->cali);
+    free(self);
+}
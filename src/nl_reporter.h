@@ -0,0 +1,157 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_reporter.h
+ * Background reporting of calipers.
+ *
+ * A reporter owns a set of reported calipers and a thread. Each
+ * reported caliper has two accumulators: the measured thread records
+ * into the active one, and at every interval the reporter asks it to
+ * switch to the other. The measured thread acknowledges the request
+ * at its next nlcali_rep_end(), by flipping an index, so it never
+ * waits; the reporter then calculates, formats and writes the retired
+ * accumulator on its own thread, and clears it for the next flip.
+ *
+ * A caliper that records no events after a flip request keeps its
+ * data until its next event, and it is reported at the next interval.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_REPORTER_INCLUDED
+#    define NETLOGGER_REPORTER_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+/**
+ * Caliper with two accumulators, for use with a reporter.
+ * Only one thread may record into it.
+ */
+struct nlcali_rep_t {
+    struct nlcali_t acc[2];   /**< Accumulators */
+    volatile unsigned active; /**< Index of accumulator being recorded */
+    volatile unsigned req;    /**< Flip requests, by the reporter */
+    volatile unsigned ack;    /**< Flips done, by the recording thread */
+    unsigned done;            /**< Flips reported, by the reporter */
+    char *name;               /**< Event name */
+};
+
+typedef struct nlcali_rep_t *nlcali_rep_T;
+
+/**
+ * Reporter output callback.
+ *
+ * \param arg User argument given to nlcali_reporter_new()
+ * \param name Event name of the reported caliper
+ * \param cali Statistics for the interval, after nlcali_calc().
+ *        Valid only during the call.
+ */
+typedef void (*nlcali_sink_fn)(void *arg, const char *name, T cali);
+
+struct nlcali_reporter_t;
+typedef struct nlcali_reporter_t *nlcali_reporter_T;
+
+/**
+ * Create a reporter, and start its thread.
+ *
+ * \param interval Seconds between reports
+ * \param max_calipers Maximum number of calipers to report
+ * \param fd If `fn` is NULL, write one nlcali_log() line
+ *        per caliper per interval to this file descriptor
+ * \param fn Callback for each caliper each interval, or NULL
+ * \param arg Passed to `fn`
+ * \return New reporter, or NULL on error
+ */
+nlcali_reporter_T nlcali_reporter_new(double interval, unsigned max_calipers,
+                                      int fd, nlcali_sink_fn fn, void *arg);
+
+/**
+ * Add a caliper to a reporter.
+ *
+ * \param self Reporter
+ * \param name Event name for the caliper's reports
+ * \param proto Caliper whose baseline, clock and histogram
+ *        configuration is copied into the accumulators
+ * \return Caliper to record into, or NULL if there are already
+ *         `max_calipers` or memory is exhausted. It belongs to the
+ *         reporter and is freed with it.
+ */
+nlcali_rep_T nlcali_reporter_add(nlcali_reporter_T self, const char *name,
+                                 T proto);
+
+/**
+ * Report all calipers now, without waiting for the interval.
+ * Blocks until the reports have been written; calipers whose
+ * threads have not acknowledged the flip are left for later.
+ *
+ * \param self Reporter
+ */
+void nlcali_reporter_flush(nlcali_reporter_T self);
+
+/**
+ * Stop the reporter thread, report whatever remains in every
+ * caliper, and free the reporter and its calipers.
+ * No thread may still be recording.
+ *
+ * \param self Reporter
+ */
+void nlcali_reporter_free(nlcali_reporter_T self);
+
+/**
+ * Accumulator currently being recorded into.
+ */
+#define nlcali_rep_cali(R) (&(R)->acc[(R)->active])
+
+/**
+ * Acknowledge a pending flip request.
+ * Called after each event by nlcali_rep_end() and nlcali_rep_add().
+ */
+#define nlcali_rep_poll(R) do {                                 \
+        if ((R)->req != (R)->ack) {                             \
+            NL_RMB();                                           \
+            (R)->active ^= 1;                                   \
+            NL_WMB();                                           \
+            (R)->ack = (R)->req;                                \
+        }                                                       \
+    } while(0)
+
+/**
+ * Begin a timed event.
+ *
+ * \param R Reported caliper
+ */
+#define nlcali_rep_begin(R) nlcali_begin(nlcali_rep_cali(R))
+
+/**
+ * End a timed event.
+ *
+ * \param R Reported caliper
+ * \param V Value of event
+ */
+#define nlcali_rep_end(R,V) do {                                \
+        nlcali_end(nlcali_rep_cali(R), (V));                    \
+        nlcali_rep_poll(R);                                     \
+    } while(0)
+
+/**
+ * Record an event that was timed elsewhere.
+ *
+ * \param R Reported caliper
+ * \param B Clock ticks at beginning of event
+ * \param E Clock ticks at end of event
+ * \param V Value of event
+ */
+#define nlcali_rep_add(R,B,E,V) do {                            \
+        nlcali_add(nlcali_rep_cali(R), (B), (E), (V));          \
+        nlcali_rep_poll(R);                                     \
+    } while(0)
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_REPORTER_INCLUDED */
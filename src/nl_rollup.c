@@ -0,0 +1,234 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_rollup.c
+ * Multi-resolution history of caliper summaries.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <math.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Interface */
+#include "nl_rollup.h"
+
+#define T nlcali_T
+
+/* Bucket number of a ring slot that holds nothing */
+#define NL_BUCKET_NONE INT64_MIN
+
+/* One resolution: a ring of `n` buckets of `res` seconds; bucket
+   number b covers [b * res, (b + 1) * res) and lives in slot b % n */
+struct nl_level_t {
+    double res;
+    unsigned n;
+    int64_t newest;  /* newest bucket number, NL_BUCKET_NONE if none */
+    int64_t *index;  /* bucket number held by each slot */
+    T *cali;         /* caliper for each slot */
+};
+
+struct nlcali_rollup_t {
+    unsigned nlevels;
+    struct nl_level_t *levels;
+};
+
+typedef struct nlcali_rollup_t *R;
+
+static double rollup_now(void)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec/1e6;
+}
+
+/* Range of held bucket numbers that start in [from, to);
+   returns 0 if there are none */
+static int level_range(struct nl_level_t *l, double from, double to,
+                       int64_t *lo, int64_t *hi)
+{
+    double a = ceil(from / l->res), b = ceil(to / l->res) - 1;
+
+    if (NL_BUCKET_NONE == l->newest) {
+        return 0;
+    }
+    *lo = l->newest - (int64_t)l->n + 1;
+    *hi = l->newest;
+    if (a > (double)*lo) {
+        *lo = (int64_t)a;
+    }
+    if (b < (double)*hi) {
+        *hi = (int64_t)b;
+    }
+    return *lo <= *hi;
+}
+
+/* Caliper for bucket `b`, or NULL if its slot holds another one */
+static T level_get(struct nl_level_t *l, int64_t b)
+{
+    unsigned i = (unsigned)(((b % l->n) + l->n) % l->n);
+
+    return l->index[i] == b ? l->cali[i] : NULL;
+}
+
+nlcali_rollup_T nlcali_rollup_new(T proto, unsigned nlevels,
+                                  const double *res,
+                                  const unsigned *buckets)
+{
+    R self;
+    struct nl_level_t *l;
+    unsigned i, j;
+
+    if (0 == nlevels) {
+        return NULL;
+    }
+    self = (R)calloc(1, sizeof(struct nlcali_rollup_t));
+    if (NULL == self) {
+        return NULL;
+    }
+    self->levels = (struct nl_level_t *)calloc(nlevels,
+                                               sizeof(struct nl_level_t));
+    if (NULL == self->levels) {
+        goto error;
+    }
+    self->nlevels = nlevels;
+    for (i = 0; i < nlevels; i++) {
+        l = &self->levels[i];
+        if (res[i] <= 0 || 0 == buckets[i]) {
+            goto error;
+        }
+        l->res = res[i];
+        l->newest = NL_BUCKET_NONE;
+        l->index = (int64_t *)malloc(buckets[i] * sizeof(int64_t));
+        l->cali = (T *)calloc(buckets[i], sizeof(T));
+        if (NULL == l->index || NULL == l->cali) {
+            goto error;
+        }
+        l->n = buckets[i];
+        for (j = 0; j < l->n; j++) {
+            l->index[j] = NL_BUCKET_NONE;
+            l->cali[j] = nlcali_new(proto->vacc.var.min_items);
+            if (NULL == l->cali[j]) {
+                goto error;
+            }
+            nlcali_configure_like(l->cali[j], proto);
+        }
+    }
+    return self;
+
+ error:
+    nlcali_rollup_free(self);
+    return NULL;
+}
+
+int nlcali_rollup_push(nlcali_rollup_T self, T cali, double t)
+{
+    struct nl_level_t *l;
+    int64_t b;
+    unsigned i, j;
+    int added = 0;
+
+    if (t <= 0) {
+        t = rollup_now();
+    }
+    for (i = 0; i < self->nlevels; i++) {
+        l = &self->levels[i];
+        b = (int64_t)floor(t / l->res);
+        if (NL_BUCKET_NONE != l->newest && b <= l->newest - (int64_t)l->n) {
+            continue;
+        }
+        j = (unsigned)(((b % l->n) + l->n) % l->n);
+        if (l->index[j] != b) {
+            nlcali_clear(l->cali[j]);
+            l->index[j] = b;
+        }
+        if (0 != nlcali_merge(l->cali[j], cali)) {
+            return -1;
+        }
+        if (NL_BUCKET_NONE == l->newest || b > l->newest) {
+            l->newest = b;
+        }
+        added++;
+    }
+    return added;
+}
+
+unsigned nlcali_rollup_foreach(nlcali_rollup_T self, unsigned level,
+                               double from, double to,
+                               nlcali_rollup_fn fn, void *arg)
+{
+    struct nl_level_t *l;
+    int64_t b, lo, hi;
+    unsigned count = 0;
+    T cali;
+
+    if (level >= self->nlevels) {
+        return 0;
+    }
+    l = &self->levels[level];
+    if (!level_range(l, from, to, &lo, &hi)) {
+        return 0;
+    }
+    for (b = lo; b <= hi; b++) {
+        cali = level_get(l, b);
+        if (NULL != cali) {
+            nlcali_calc(cali);
+            fn(arg, b * l->res, cali);
+            count++;
+        }
+    }
+    return count;
+}
+
+int nlcali_rollup_merge(nlcali_rollup_T self, unsigned level,
+                        double from, double to, T out)
+{
+    struct nl_level_t *l;
+    int64_t b, lo, hi;
+    int count = 0;
+    T cali;
+
+    if (level >= self->nlevels) {
+        return 0;
+    }
+    l = &self->levels[level];
+    if (!level_range(l, from, to, &lo, &hi)) {
+        return 0;
+    }
+    for (b = lo; b <= hi; b++) {
+        cali = level_get(l, b);
+        if (NULL != cali) {
+            if (0 != nlcali_merge(out, cali)) {
+                return -1;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+void nlcali_rollup_free(nlcali_rollup_T self)
+{
+    struct nl_level_t *l;
+    unsigned i, j;
+
+    if (NULL == self) {
+        return;
+    }
+    for (i = 0; NULL != self->levels && i < self->nlevels; i++) {
+        l = &self->levels[i];
+        for (j = 0; NULL != l->cali && j < l->n; j++) {
+            nlcali_free(l->cali[j]);
+        }
+        free(l->cali);
+        free(l->index);
+    }
+    free(self->levels);
+    free(self);
+}
+
+#undef T
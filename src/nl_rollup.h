@@ -0,0 +1,117 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_rollup.h
+ * Multi-resolution history of caliper summaries.
+ *
+ * A rollup keeps the statistics of past reporting intervals at
+ * several resolutions, e.g. per second for the last minute, per
+ * minute for the last hour and per hour for the last day. Each
+ * resolution is a fixed ring of calipers, one per time bucket, all
+ * allocated up front, so memory does not grow with uptime. Pushing an
+ * interval merges it into the bucket that holds it at every resolution
+ * (see nlcali_merge()), so counts, compensated sums, variances, min/max
+ * and histogram bins of a bucket are exact; a bucket that falls off
+ * the end of its ring is reused for the newest one.
+ *
+ * A rollup is not thread-safe: push and query from one thread,
+ * e.g. from a reporter's output callback, or lock around it.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_ROLLUP_INCLUDED
+#    define NETLOGGER_ROLLUP_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+struct nlcali_rollup_t;
+typedef struct nlcali_rollup_t *nlcali_rollup_T;
+
+/**
+ * Rollup query callback.
+ *
+ * \param arg User argument given to nlcali_rollup_foreach()
+ * \param start Start of the bucket, in seconds since the epoch
+ * \param cali Statistics for the bucket, after nlcali_calc().
+ *        Valid until the next push.
+ */
+typedef void (*nlcali_rollup_fn)(void *arg, double start, T cali);
+
+/**
+ * Create a rollup.
+ *
+ * \param proto Caliper whose baseline, clock and histogram
+ *        configuration is copied into every bucket, as with
+ *        nlcali_init_like(). Pushed calipers must match it.
+ * \param nlevels Number of resolutions
+ * \param res Seconds per bucket, for each resolution
+ *        (e.g. 1, 60, 3600)
+ * \param buckets Number of buckets kept, for each resolution
+ *        (e.g. 60, 60, 24)
+ * \return New rollup, or NULL on error
+ */
+nlcali_rollup_T nlcali_rollup_new(T proto, unsigned nlevels,
+                                  const double *res,
+                                  const unsigned *buckets);
+
+/**
+ * Add the events of one interval to every resolution.
+ *
+ * \param self Rollup
+ * \param cali Caliper holding the interval's events, unchanged,
+ *        its sketches included (see nlcali_merge())
+ * \param t Time of the interval, in seconds since the epoch,
+ *        or 0 for now. Use a time inside the interval, such as
+ *        its midpoint, so that it falls in one bucket.
+ * \return Number of resolutions it was added to (it is too old for
+ *         the others), or -1 if `cali` does not match the prototype
+ */
+int nlcali_rollup_push(nlcali_rollup_T self, T cali, double t);
+
+/**
+ * Call a function for each bucket of one resolution that starts
+ * in a time range and holds data, oldest first.
+ *
+ * \param self Rollup
+ * \param level Index of the resolution, as given to nlcali_rollup_new()
+ * \param from Start of range, in seconds since the epoch
+ * \param to End of range (not included), in seconds since the epoch
+ * \param fn Callback
+ * \param arg Passed to `fn`
+ * \return Number of buckets
+ */
+unsigned nlcali_rollup_foreach(nlcali_rollup_T self, unsigned level,
+                               double from, double to,
+                               nlcali_rollup_fn fn, void *arg);
+
+/**
+ * Merge the buckets of one resolution that start in a time range.
+ *
+ * \param self Rollup
+ * \param level Index of the resolution
+ * \param from Start of range, in seconds since the epoch
+ * \param to End of range (not included), in seconds since the epoch
+ * \param out Caliper to merge into, configured like the prototype
+ *        (e.g. with nlcali_init_like()); call nlcali_calc() on it after
+ * \return Number of buckets merged, or -1 if `out` does not match
+ */
+int nlcali_rollup_merge(nlcali_rollup_T self, unsigned level,
+                        double from, double to, T out);
+
+/**
+ * Free the rollup and all of its buckets.
+ *
+ * \param self Rollup
+ */
+void nlcali_rollup_free(nlcali_rollup_T self);
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_ROLLUP_INCLUDED */
@@ -0,0 +1,177 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_sample.c
+ * Timing only a sample of the events of a caliper.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Interface */
+#include "nl_calipers.h"
+
+#define T nlcali_T
+
+/* Events timed to measure the cost of an event */
+#define NL_SAMPLE_CALIBRATE 2000
+
+/* Largest period, so that skips up to 2 * period fit */
+#define NL_SAMPLE_MAX_PERIOD (UINT_MAX / 2)
+
+/* Time timed and untimed events on a copy of the caliper */
+static int measure_costs(T self, struct nlcali_sample_t *smp)
+{
+    nl_ticks_t t0;
+    T c;
+    int i;
+
+    c = nlcali_new(self->vacc.var.min_items);
+    if (NULL == c) {
+        return -1;
+    }
+    nlcali_configure_like(c, self);
+    t0 = nl_clock_ticks(c->clock);
+    for (i = 0; i < NL_SAMPLE_CALIBRATE; i++) {
+        nlcali_begin(c);
+        nlcali_end(c, 1.0);
+    }
+    smp->cost_timed = (double)(nl_clock_ticks(c->clock) - t0) /
+        NL_SAMPLE_CALIBRATE;
+    c->skip = NL_SAMPLE_CALIBRATE + 1;
+    t0 = nl_clock_ticks(c->clock);
+    for (i = 0; i < NL_SAMPLE_CALIBRATE; i++) {
+        nlcali_begin(c);
+        nlcali_end(c, 1.0);
+    }
+    smp->cost_untimed = (double)(nl_clock_ticks(c->clock) - t0) /
+        NL_SAMPLE_CALIBRATE;
+    nlcali_free(c);
+    return 0;
+}
+
+int nlcali_sample(T self, unsigned n, double max_overhead)
+{
+    struct nlcali_sample_t *smp;
+
+    free(self->smp);
+    self->smp = NULL;
+    self->opts &= ~NL_OPT_SAMPLE;
+    /* an event sampled out by nlcali_begin() still ends untimed */
+    self->skip = 2 == self->is_begun;
+    if (max_overhead < 0 || max_overhead >= 100) {
+        return -1;
+    }
+    if (0 == max_overhead && n <= 1) {
+        return 0;
+    }
+    smp = (struct nlcali_sample_t *)calloc(1, sizeof(*smp));
+    if (NULL == smp) {
+        return -1;
+    }
+    if (0 == n || n > NL_SAMPLE_MAX_PERIOD) {
+        n = NL_SAMPLE_MAX_PERIOD;
+    }
+    if (max_overhead > 0) {
+        smp->target = max_overhead / 100;
+        smp->max_period = n;
+        smp->period = 1;
+        if (0 != measure_costs(self, smp)) {
+            free(smp);
+            return -1;
+        }
+    }
+    else {
+        smp->period = smp->max_period = n;
+    }
+    smp->t0 = nl_clock_ticks(self->clock);
+    smp->n0 = self->vacc.count;
+    smp->rng = ((uint64_t)(uintptr_t)self ^ smp->t0) | 1;
+    self->smp = smp;
+    self->opts |= NL_OPT_SAMPLE;
+    return 0;
+}
+
+int nlcali_sample_like(T self, T proto)
+{
+    struct nlcali_sample_t *smp;
+
+    if (NULL == proto->smp) {
+        return nlcali_sample(self, 0, 0);
+    }
+    smp = (struct nlcali_sample_t *)malloc(sizeof(*smp));
+    if (NULL == smp) {
+        nlcali_sample(self, 0, 0);
+        return -1;
+    }
+    *smp = *proto->smp;
+    smp->timed = 0;
+    smp->t0 = nl_clock_ticks(self->clock);
+    smp->n0 = self->vacc.count;
+    smp->rng = ((uint64_t)(uintptr_t)self ^ smp->t0) | 1;
+    free(self->smp);
+    self->smp = smp;
+    self->opts |= NL_OPT_SAMPLE;
+    return 0;
+}
+
+/* Period that would have cost `target` of the time in this round */
+static double adapt_period(T self, struct nlcali_sample_t *smp,
+                           nl_ticks_t e)
+{
+    double events, budget;
+
+    events = (double)(self->vacc.count - smp->n0);
+    budget = smp->target * (double)(e - smp->t0) -
+        events * smp->cost_untimed;
+    if (smp->cost_timed <= smp->cost_untimed) {
+        /* timing is free */
+        return 1;
+    }
+    if (budget <= 0) {
+        /* too many events to afford even the untimed ones */
+        return smp->max_period;
+    }
+    return events * (smp->cost_timed - smp->cost_untimed) / budget;
+}
+
+void nlcali_sample_next(T self, nl_ticks_t e)
+{
+    struct nlcali_sample_t *smp = self->smp;
+    double p;
+
+    if (smp->target > 0 && ++smp->timed >= NL_SAMPLE_ROUND) {
+        if (self->vacc.count > smp->n0 && e > smp->t0) {
+            p = adapt_period(self, smp, e);
+            /* move at most a factor 4 a round, against noise */
+            if (p > 4.0 * smp->period) {
+                p = 4.0 * smp->period;
+            }
+            if (p < smp->period / 4.0) {
+                p = smp->period / 4.0;
+            }
+            if (p > smp->max_period) {
+                p = smp->max_period;
+            }
+            smp->period = p < 1 ? 1 : (unsigned)(p + 0.5);
+        }
+        /* a new round */
+        smp->t0 = e;
+        smp->n0 = self->vacc.count;
+        smp->timed = 0;
+    }
+    if (smp->period > 1) {
+        /* xorshift64; skips are uniform with mean period - 1 */
+        smp->rng ^= smp->rng << 13;
+        smp->rng ^= smp->rng >> 7;
+        smp->rng ^= smp->rng << 17;
+        self->skip = (unsigned)(smp->rng % (2 * (uint64_t)smp->period - 1));
+    }
+}
+
+#undef T
@@ -0,0 +1,310 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_sharded.c
+ * Per-thread sharded calipers.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Interface */
+#include "nl_sharded.h"
+
+#define T nlcali_T
+
+/* ---------------------------------------------------------------
+ * Thread slots
+ *
+ * Every thread that touches a sharded caliper gets a small integer
+ * slot, shared by all sharded calipers. Slots are returned to the
+ * pool when the thread exits, so the number in use is bounded by
+ * the number of live threads.
+ */
+
+__thread int nl_shard_slot = -1;
+
+static pthread_mutex_t slot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slot_key;
+static unsigned char slot_used[NL_MAX_SHARDS];
+
+/* Thread-exit destructor; key value is slot + 1 */
+static void slot_release(void *arg)
+{
+    int slot = (int)(intptr_t)arg - 1;
+
+    pthread_mutex_lock(&slot_lock);
+    slot_used[slot] = 0;
+    pthread_mutex_unlock(&slot_lock);
+}
+
+static void slot_key_init(void)
+{
+    pthread_key_create(&slot_key, slot_release);
+}
+
+static int slot_acquire(void)
+{
+    int i, slot = -1;
+
+    pthread_once(&slot_once, slot_key_init);
+    pthread_mutex_lock(&slot_lock);
+    for (i = 0; i < NL_MAX_SHARDS; i++) {
+        if (!slot_used[i]) {
+            slot_used[i] = 1;
+            slot = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&slot_lock);
+    if (slot >= 0) {
+        pthread_setspecific(slot_key, (void *)(intptr_t)(slot + 1));
+        nl_shard_slot = slot;
+    }
+    return slot;
+}
+
+/* ---------------------------------------------------------------
+ * Sharded calipers methods
+ */
+
+nlcali_sharded_T nlcali_sharded_new(T proto, unsigned max_threads)
+{
+    nlcali_sharded_T self;
+
+    if (0 == max_threads || max_threads > NL_MAX_SHARDS) {
+        max_threads = NL_MAX_SHARDS;
+    }
+    self = (nlcali_sharded_T)malloc(sizeof(struct nlcali_sharded_t));
+    if (NULL == self) {
+        return NULL;
+    }
+    self->shards = (T *)calloc(max_threads, sizeof(T));
+    if (NULL == self->shards) {
+        free(self);
+        return NULL;
+    }
+    self->num_shards = max_threads;
+    nlcali_init_like(&self->proto, proto);
+    return self;
+}
+
+T nlcali_shard_get(nlcali_sharded_T self)
+{
+    T shard;
+    void *p;
+    size_t size;
+    int slot = nl_shard_slot;
+
+    if (slot < 0 && (slot = slot_acquire()) < 0) {
+        return NULL;
+    }
+    if ((unsigned)slot >= self->num_shards) {
+        return NULL;
+    }
+    shard = __atomic_load_n(&self->shards[slot], __ATOMIC_ACQUIRE);
+    if (NULL != shard) {
+        return shard;
+    }
+    /* pad to whole cache lines, so no two shards share one */
+    size = (sizeof(struct nlcali_t) + NL_CACHE_LINE - 1) /
+        NL_CACHE_LINE * NL_CACHE_LINE;
+    if (0 != posix_memalign(&p, NL_CACHE_LINE, size)) {
+        return NULL;
+    }
+    shard = (T)p;
+    nlcali_init_like(shard, &self->proto);
+    __atomic_store_n(&self->shards[slot], shard, __ATOMIC_RELEASE);
+    return shard;
+}
+
+/* Heap parts of a caliper copied by merge_live() */
+struct live_parts_t {
+    unsigned *hist;
+    unsigned n;
+    struct nlcali_perf_t perf;
+    struct nlcali_cpu_t cpu;
+    struct nl_tdigest_t **sk;
+};
+
+/* Copy the bins, counters, CPU times and sketches of `live`, for
+   nlcali_seq_copy() */
+static int live_parts_copy(void *arg, T snap, T live)
+{
+    struct live_parts_t *lp = (struct live_parts_t *)arg;
+    unsigned nx;
+
+    (void)live;
+    if (lp->n > 0) {
+        memcpy(lp->hist, snap->h_rdata, 2 * lp->n * sizeof(unsigned));
+    }
+    nx = snap->h_dur.num + snap->h_val.num + snap->h_cpu.num +
+        snap->h_wait.num;
+    if (nx > 0) {
+        memcpy(lp->hist + 2 * lp->n, snap->h_xdata, nx * sizeof(unsigned));
+    }
+    if (NULL != snap->perf) {
+        memcpy(&lp->perf, snap->perf, sizeof(lp->perf));
+    }
+    if (NULL != snap->cpu) {
+        memcpy(&lp->cpu, snap->cpu, sizeof(lp->cpu));
+    }
+    if (NULL != lp->sk[0]) {
+        nl_tdigest_copy(lp->sk[0], snap->vsk);
+        nl_tdigest_copy(lp->sk[1], snap->rsk);
+        nl_tdigest_copy(lp->sk[2], snap->gsk);
+    }
+    return 0;
+}
+
+/*
+ * Merge a caliper that another thread may be writing, copying it
+ * under its sequence lock. `hist` has room for 2 * `n` bins, then
+ * those of the duration, value and CPU time histograms, and `sk`
+ * holds three sketches if the caliper has them.
+ */
+static int merge_live(T out, T live, unsigned *hist, unsigned n,
+                      struct nl_tdigest_t **sk)
+{
+    struct nlcali_t copy;
+    struct live_parts_t lp;
+    unsigned nx;
+
+    lp.hist = hist;
+    lp.n = n;
+    lp.sk = sk;
+    if (0 != nlcali_seq_copy(live, &copy, live_parts_copy, &lp)) {
+        return -1;
+    }
+    nx = copy.h_dur.num + copy.h_val.num + copy.h_cpu.num +
+        copy.h_wait.num;
+    copy.h_rdata = hist;
+    copy.h_gdata = n > 0 ? hist + n : NULL;
+    if (nx > 0) {
+        copy.h_xdata = hist + 2 * n;
+        copy.h_dur.data = copy.h_xdata;
+        copy.h_val.data = copy.h_xdata + copy.h_dur.num;
+        copy.h_cpu.data = copy.h_val.data + copy.h_val.num;
+        copy.h_wait.data = copy.h_cpu.data + copy.h_cpu.num;
+    }
+    if (NULL != copy.perf) {
+        copy.perf = &lp.perf;
+    }
+    if (NULL != copy.cpu) {
+        copy.cpu = &lp.cpu;
+    }
+    copy.vsk = sk[0];
+    copy.rsk = sk[1];
+    copy.gsk = sk[2];
+    return nlcali_merge(out, &copy);
+}
+
+/* Scratch space for the parts of a caliper that are on the heap */
+static int scratch_new(T like, unsigned **hist, unsigned *n,
+                       struct nl_tdigest_t **sk)
+{
+    unsigned i, nx;
+
+    *hist = NULL;
+    sk[0] = sk[1] = sk[2] = NULL;
+    *n = like->h_state == NL_HIST_OFF ? 0 : like->h_num;
+    nx = like->h_dur.num + like->h_val.num + like->h_cpu.num +
+        like->h_wait.num;
+    if (*n > 0 || nx > 0) {
+        *hist = (unsigned *)malloc((2 * *n + nx) * sizeof(unsigned));
+        if (NULL == *hist) {
+            return -1;
+        }
+    }
+    if (NULL != like->vsk) {
+        for (i = 0; i < 3; i++) {
+            sk[i] = nl_tdigest_new(like->vsk->compression);
+            if (NULL == sk[i]) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void scratch_free(unsigned *hist, struct nl_tdigest_t **sk)
+{
+    unsigned i;
+
+    free(hist);
+    for (i = 0; i < 3; i++) {
+        nl_tdigest_free(sk[i]);
+    }
+}
+
+int nlcali_snapshot(nlcali_sharded_T self, T out)
+{
+    struct nl_tdigest_t *sk[3];
+    unsigned *hist;
+    unsigned i, n;
+    int status = 0;
+    T shard;
+
+    assert(self && out);
+
+    nlcali_fini(out);
+    nlcali_init_like(out, &self->proto);
+    if (0 != scratch_new(out, &hist, &n, sk)) {
+        status = -1;
+        goto done;
+    }
+    for (i = 0; i < self->num_shards; i++) {
+        shard = __atomic_load_n(&self->shards[i], __ATOMIC_ACQUIRE);
+        if (NULL == shard) {
+            continue;
+        }
+        if (0 != merge_live(out, shard, hist, n, sk)) {
+            status = -1;
+        }
+    }
+    nlcali_calc(out);
+ done:
+    scratch_free(hist, sk);
+    return status;
+}
+
+int nlcali_merge_live(T self, T other)
+{
+    struct nl_tdigest_t *sk[3];
+    unsigned *hist;
+    unsigned n;
+    int status = -1;
+
+    if (0 == scratch_new(other, &hist, &n, sk)) {
+        status = merge_live(self, other, hist, n, sk);
+    }
+    scratch_free(hist, sk);
+    return status;
+}
+
+void nlcali_sharded_free(nlcali_sharded_T self)
+{
+    unsigned i;
+
+    if (self) {
+        for (i = 0; i < self->num_shards; i++) {
+            if (self->shards[i]) {
+                nlcali_fini(self->shards[i]);
+                free(self->shards[i]);
+            }
+        }
+        free(self->shards);
+        nlcali_fini(&self->proto);
+        free(self);
+    }
+}
+
+#undef T
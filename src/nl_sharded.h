@@ -0,0 +1,144 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_sharded.h
+ * Per-thread sharded calipers.
+ *
+ * A sharded caliper gives every thread its own cache-line aligned
+ * struct nlcali_t (a "shard"), so begin/end never touch memory that
+ * another thread writes. A reader merges all shards into an ordinary
+ * caliper with nlcali_snapshot().
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_SHARDED_INCLUDED
+#    define NETLOGGER_SHARDED_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+/* Default and upper limit on number of concurrent threads */
+#define NL_MAX_SHARDS 256
+
+/**
+ * Caliper with one shard per thread.
+ */
+struct nlcali_sharded_t {
+    struct nlcali_t proto; /**< Configuration copied into each shard. */
+    unsigned num_shards;   /**< Number of shard slots. */
+    struct nlcali_t **shards; /**< Shards, by thread slot; NULL until
+                                   that thread first uses the caliper. */
+};
+
+typedef struct nlcali_sharded_t *nlcali_sharded_T;
+
+/** Slot of the calling thread, -1 until assigned. */
+extern __thread int nl_shard_slot;
+
+/**
+ * Constructor.
+ *
+ * \param proto Caliper whose baseline, clock and histogram
+ *              configuration is copied into each shard.
+ * \param max_threads Maximum number of threads that will use
+ *              the caliper at the same time, 0 for NL_MAX_SHARDS.
+ * \return New sharded caliper, or NULL on error
+ */
+nlcali_sharded_T nlcali_sharded_new(T proto, unsigned max_threads);
+
+/**
+ * Find or create the calling thread's shard.
+ * Slow path of nlcali_shard().
+ *
+ * \param self Sharded caliper
+ * \return Shard, or NULL if there are more than `max_threads`
+ *         threads or memory is exhausted.
+ */
+T nlcali_shard_get(nlcali_sharded_T self);
+
+/**
+ * Return the calling thread's shard.
+ *
+ * The shard is a plain caliper, used with nlcali_begin() and
+ * nlcali_end() as usual, but must only be used by the calling thread.
+ */
+NL_INLINE T nlcali_shard(nlcali_sharded_T self)
+{
+    int slot = nl_shard_slot;
+    T shard;
+
+    if (slot >= 0 && (unsigned)slot < self->num_shards &&
+        NULL != (shard = self->shards[slot])) {
+        return shard;
+    }
+    return nlcali_shard_get(self);
+}
+
+/**
+ * Begin a timed event on the calling thread's shard.
+ *
+ * \param S Sharded caliper
+ */
+#define nlcali_sharded_begin(S) do {                \
+        nlcali_T shard_ = nlcali_shard(S);          \
+        if (shard_) nlcali_begin(shard_);           \
+    } while(0)
+
+/**
+ * End a timed event on the calling thread's shard.
+ *
+ * \param S Sharded caliper
+ * \param V Value of event
+ */
+#define nlcali_sharded_end(S,V) do {                \
+        nlcali_T shard_ = nlcali_shard(S);          \
+        if (shard_) nlcali_end(shard_, (V));        \
+    } while(0)
+
+/**
+ * \brief Merge all shards into one caliper.
+ *
+ * Each shard is copied under its sequence lock, so this never
+ * blocks the threads that are writing to it. Shards accumulate
+ * until the sharded caliper is freed; the snapshot is cumulative.
+ *
+ * \param self Sharded caliper
+ * \param out Caliper to merge into. It is cleared first and
+ *            reconfigured to match the prototype's clock and histogram.
+ * \post As if nlcali_calc() was called on `out`
+ * \return 0 on success, -1 on error, or if a shard stayed in the
+ *         middle of an update (see nlcali_seq_copy())
+ */
+int nlcali_snapshot(nlcali_sharded_T self, T out);
+
+/**
+ * Merge a caliper that another thread may still be updating.
+ *
+ * Like nlcali_merge(), but `other` is copied under its sequence
+ * lock first, so the thread writing to it is never blocked.
+ *
+ * \param self Destination caliper, owned by the calling thread
+ * \param other Caliper to merge, unchanged
+ * \return 0 on success, -1 on error, if the calipers' clocks or
+ *         histogram bins differ, or if `other` stayed in the middle of
+ *         an update (see nlcali_seq_copy())
+ */
+int nlcali_merge_live(T self, T other);
+
+/**
+ * Free memory for sharded caliper and all its shards.
+ * No thread may be using it.
+ *
+ * \param self Sharded caliper
+ */
+void nlcali_sharded_free(nlcali_sharded_T self);
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_SHARDED_INCLUDED */
@@ -0,0 +1,369 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_shm.c
+ * Live export of calipers through POSIX shared memory.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Interface */
+#include "nl_shm.h"
+
+#define T nlcali_T
+
+#define ROUND_LINE(X) (((X) + NL_CACHE_LINE - 1) / NL_CACHE_LINE * NL_CACHE_LINE)
+
+struct nlcali_shm_t {
+    char *name;
+    char *base;
+    size_t size;
+    struct nlcali_shm_header_t *hdr;
+};
+
+struct nlcali_shm_reader_t {
+    char *base;
+    size_t size;
+    const struct nlcali_shm_header_t *hdr;
+    T snap;          /* copy returned by nlcali_shm_read() */
+    unsigned *bins;  /* histogram bins of `snap` */
+};
+
+#define RECORD(B, H, I) ((B) + (H)->header_size + (size_t)(I) * (H)->record_size)
+#define RECORD_REC(R, H) ((struct nlcali_shm_rec_t *)((R) + (H)->rec_offset))
+
+/* ---------------------------------------------------------------
+ * Writer
+ */
+
+nlcali_shm_T nlcali_shm_create(const char *name, unsigned capacity,
+                               unsigned hist_bins)
+{
+    nlcali_shm_T self;
+    struct nlcali_shm_header_t *hdr;
+    size_t header_size, bins_offset, rec_offset, record_size;
+    int fd;
+    void *p;
+
+    if (0 == capacity) {
+        return NULL;
+    }
+    self = (nlcali_shm_T)calloc(1, sizeof(struct nlcali_shm_t));
+    if (NULL == self) {
+        return NULL;
+    }
+    self->name = strdup(name);
+    if (NULL == self->name) {
+        goto error;
+    }
+    /* caliper and bins on whole cache lines, as in an arena */
+    header_size = ROUND_LINE(sizeof(struct nlcali_shm_header_t));
+    bins_offset = ROUND_LINE(sizeof(struct nlcali_t));
+    rec_offset = ROUND_LINE(bins_offset + 2 * sizeof(unsigned) * hist_bins);
+    record_size = ROUND_LINE(rec_offset + sizeof(struct nlcali_shm_rec_t));
+    self->size = header_size + capacity * record_size;
+
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        goto error;
+    }
+    if (0 != ftruncate(fd, self->size)) {
+        close(fd);
+        shm_unlink(name);
+        goto error;
+    }
+    p = mmap(NULL, self->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p) {
+        shm_unlink(name);
+        goto error;
+    }
+    self->base = (char *)p;
+
+    /* new pages are zero, so every record starts out not ready */
+    hdr = self->hdr = (struct nlcali_shm_header_t *)p;
+    hdr->version = NL_SHM_VERSION;
+    hdr->header_size = header_size;
+    hdr->record_size = record_size;
+    hdr->cali_size = sizeof(struct nlcali_t);
+    hdr->bins_offset = bins_offset;
+    hdr->hist_bins = hist_bins;
+    hdr->rec_offset = rec_offset;
+    hdr->capacity = capacity;
+    hdr->count = 0;
+    hdr->pid = getpid();
+    hdr->off_seq = offsetof(struct nlcali_t, seq);
+    hdr->off_vacc = offsetof(struct nlcali_t, vacc);
+    hdr->off_racc = offsetof(struct nlcali_t, racc);
+    hdr->off_gacc = offsetof(struct nlcali_t, gacc);
+    hdr->off_dur_ticks = offsetof(struct nlcali_t, dur_ticks);
+    hdr->off_tick_ns = offsetof(struct nlcali_t, tick_ns);
+    /* readers check the magic last */
+    NL_WMB();
+    memcpy(hdr->magic, NL_SHM_MAGIC, sizeof(hdr->magic));
+    return self;
+
+ error:
+    free(self->name);
+    free(self);
+    return NULL;
+}
+
+/* Claim the next record, or return NULL if there are none */
+static char *record_take(nlcali_shm_T self)
+{
+    uint32_t n = __atomic_load_n(&self->hdr->count, __ATOMIC_RELAXED);
+
+    do {
+        if (n >= self->hdr->capacity) {
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&self->hdr->count, &n, n + 1, 0,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_RELAXED));
+    return RECORD(self->base, self->hdr, n);
+}
+
+static void record_publish(nlcali_shm_T self, char *r, const char *event)
+{
+    struct nlcali_shm_rec_t *rec = RECORD_REC(r, self->hdr);
+
+    strncpy(rec->name, event, NL_SHM_NAME_MAX - 1);
+    rec->name[NL_SHM_NAME_MAX - 1] = '\0';
+    __atomic_store_n(&rec->ready, 1, __ATOMIC_RELEASE);
+}
+
+T nlcali_shm_alloc(nlcali_shm_T self, const char *event, unsigned baseline)
+{
+    char *r = record_take(self);
+    T cali;
+
+    if (NULL == r) {
+        return NULL;
+    }
+    cali = (T)r;
+    nlcali_init(cali, baseline);
+    nlcali_hist_storage(cali, self->hdr->hist_bins > 0 ?
+                        (unsigned *)(r + self->hdr->bins_offset) : NULL,
+                        self->hdr->hist_bins);
+    record_publish(self, r, event);
+    return cali;
+}
+
+T nlcali_shm_alloc_like(nlcali_shm_T self, const char *event, T proto)
+{
+    char *r = record_take(self);
+    T cali;
+
+    if (NULL == r) {
+        return NULL;
+    }
+    cali = (T)r;
+    nlcali_init(cali, proto->vacc.var.min_items);
+    nlcali_hist_storage(cali, self->hdr->hist_bins > 0 ?
+                        (unsigned *)(r + self->hdr->bins_offset) : NULL,
+                        self->hdr->hist_bins);
+    nlcali_configure_like(cali, proto);
+    record_publish(self, r, event);
+    return cali;
+}
+
+void nlcali_shm_free(nlcali_shm_T self, int unlink)
+{
+    uint32_t i;
+    char *r;
+
+    if (NULL == self) {
+        return;
+    }
+    for (i = 0; i < self->hdr->count; i++) {
+        r = RECORD(self->base, self->hdr, i);
+        if (RECORD_REC(r, self->hdr)->ready) {
+            nlcali_fini((T)r);
+        }
+    }
+    munmap(self->base, self->size);
+    if (unlink) {
+        shm_unlink(self->name);
+    }
+    free(self->name);
+    free(self);
+}
+
+/* ---------------------------------------------------------------
+ * Reader
+ */
+
+nlcali_shm_reader_T nlcali_shm_open(const char *name)
+{
+    nlcali_shm_reader_T self;
+    const struct nlcali_shm_header_t *hdr;
+    struct stat st;
+    int fd;
+    void *p;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (0 != fstat(fd, &st) ||
+        (size_t)st.st_size < sizeof(struct nlcali_shm_header_t)) {
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == p) {
+        return NULL;
+    }
+    hdr = (const struct nlcali_shm_header_t *)p;
+    if (0 != memcmp(hdr->magic, NL_SHM_MAGIC, sizeof(hdr->magic))) {
+        goto unmap;
+    }
+    NL_RMB();
+    if (hdr->version != NL_SHM_VERSION ||
+        hdr->cali_size != sizeof(struct nlcali_t) ||
+        hdr->header_size + (size_t)hdr->capacity * hdr->record_size >
+        (size_t)st.st_size) {
+        goto unmap;
+    }
+    self = (nlcali_shm_reader_T)calloc(1,
+                                       sizeof(struct nlcali_shm_reader_t));
+    if (NULL == self) {
+        goto unmap;
+    }
+    self->base = (char *)p;
+    self->size = st.st_size;
+    self->hdr = hdr;
+    if (0 != posix_memalign(&p, NL_CACHE_LINE, sizeof(struct nlcali_t))) {
+        goto error;
+    }
+    self->snap = (T)p;
+    if (hdr->hist_bins > 0) {
+        self->bins = (unsigned *)malloc(2 * sizeof(unsigned) *
+                                        hdr->hist_bins);
+        if (NULL == self->bins) {
+            goto error;
+        }
+    }
+    return self;
+
+ error:
+    nlcali_shm_close(self);
+    return NULL;
+ unmap:
+    munmap(p, st.st_size);
+    return NULL;
+}
+
+unsigned nlcali_shm_count(nlcali_shm_reader_T self)
+{
+    uint32_t n = __atomic_load_n(&self->hdr->count, __ATOMIC_ACQUIRE);
+
+    return n < self->hdr->capacity ? n : self->hdr->capacity;
+}
+
+const struct nlcali_shm_header_t *
+nlcali_shm_header(nlcali_shm_reader_T self)
+{
+    return self->hdr;
+}
+
+const char *nlcali_shm_event(nlcali_shm_reader_T self, unsigned i)
+{
+    const struct nlcali_shm_rec_t *rec;
+
+    if (i >= nlcali_shm_count(self)) {
+        return NULL;
+    }
+    rec = RECORD_REC(RECORD(self->base, self->hdr, i), self->hdr);
+    if (!__atomic_load_n(&rec->ready, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return rec->name;
+}
+
+/* Copy the bins in a record, for nlcali_seq_copy() */
+static int shm_copy(void *arg, T snap, T live)
+{
+    nlcali_shm_reader_T self = (nlcali_shm_reader_T)arg;
+    const struct nlcali_shm_header_t *hdr = self->hdr;
+
+    (void)snap;
+    if (hdr->hist_bins > 0) {
+        memcpy(self->bins, (const char *)live + hdr->bins_offset,
+               2 * sizeof(unsigned) * hdr->hist_bins);
+    }
+    return 0;
+}
+
+T nlcali_shm_read(nlcali_shm_reader_T self, unsigned i)
+{
+    const struct nlcali_shm_header_t *hdr = self->hdr;
+    T snap = self->snap;
+    int in_shm;
+
+    if (NULL == nlcali_shm_event(self, i)) {
+        return NULL;
+    }
+    if (0 != nlcali_seq_copy((T)RECORD(self->base, hdr, i), snap,
+                             shm_copy, self)) {
+        return NULL;
+    }
+
+    /* point the copy at our own memory; histograms that did not fit
+       in the record are in the writer's memory */
+    in_shm = snap->h_rdata != NULL && snap->h_rdata == snap->h_slab &&
+        snap->h_num <= hdr->hist_bins;
+    if (snap->h_state > NL_HIST_AUTO_PRE && in_shm) {
+        snap->h_rdata = self->bins;
+        snap->h_gdata = self->bins + snap->h_num;
+    }
+    else {
+        snap->h_state = NL_HIST_OFF;
+        snap->h_num = 0;
+        snap->h_rdata = snap->h_gdata = NULL;
+    }
+    snap->h_slab = self->bins;
+    snap->h_slab_num = hdr->hist_bins;
+    /* duration, value and CPU time histograms are not exported */
+    memset(&snap->h_dur, 0, sizeof(snap->h_dur));
+    memset(&snap->h_val, 0, sizeof(snap->h_val));
+    memset(&snap->h_cpu, 0, sizeof(snap->h_cpu));
+    memset(&snap->h_wait, 0, sizeof(snap->h_wait));
+    snap->h_xdata = NULL;
+    snap->vsk = snap->rsk = snap->gsk = NULL;
+    snap->win = NULL;
+    snap->trace = NULL;
+    snap->smp = NULL;
+    snap->perf = NULL;
+    snap->cpu = NULL;
+    snap->opts = 0;
+    snap->dirty = 1;
+    nlcali_calc(snap);
+    return snap;
+}
+
+void nlcali_shm_close(nlcali_shm_reader_T self)
+{
+    if (NULL == self) {
+        return;
+    }
+    munmap(self->base, self->size);
+    free(self->snap);
+    free(self->bins);
+    free(self);
+}
+
+#undef T
@@ -0,0 +1,194 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_shm.h
+ * Live export of calipers through POSIX shared memory.
+ *
+ * A writer creates a named segment and takes calipers from it; they
+ * are recorded into as usual, with no formatting or system calls.
+ * Any other process can open the segment read-only and take a
+ * consistent copy of any caliper at any time, under the caliper's
+ * sequence lock, without the writer's cooperation.
+ *
+ * The segment starts with a struct nlcali_shm_header_t, which gives
+ * the version and the layout of the records that follow it. Record
+ * `i` starts at `header_size + i * record_size` and holds:
+ *   - at offset 0, a struct nlcali_t (`cali_size` bytes);
+ *   - at `bins_offset`, room for `hist_bins` rate bins followed by
+ *     `hist_bins` gap bins (unsigned), used by histograms of up to
+ *     that many bins;
+ *   - at `rec_offset`, a struct nlcali_shm_rec_t with the event name.
+ * Pointers inside the struct nlcali_t are the writer's and must not
+ * be followed. Quantile sketches and windows stay in the writer's
+ * memory, and are not exported.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_SHM_INCLUDED
+#    define NETLOGGER_SHM_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+/* First bytes of a segment */
+#define NL_SHM_MAGIC "NLCALI\n"
+/* Layout version; changes whenever the layout of a segment,
+   including struct nlcali_t, does */
+#define NL_SHM_VERSION 1
+/* Longest event name, with its NUL */
+#define NL_SHM_NAME_MAX 60
+
+/**
+ * Header at the start of a segment.
+ *
+ * The `off_*` fields give the offsets of fields of struct nlcali_t
+ * in a record, so that readers written in other languages can take
+ * the counts, sums, min/max and variances of each metric (each a
+ * struct nlcali_acc_t) under the sequence lock.
+ */
+struct nlcali_shm_header_t {
+    char magic[8];         /**< NL_SHM_MAGIC */
+    uint32_t version;      /**< NL_SHM_VERSION */
+    uint32_t header_size;  /**< Offset of the first record */
+    uint32_t record_size;  /**< Bytes per record */
+    uint32_t cali_size;    /**< sizeof(struct nlcali_t) */
+    uint32_t bins_offset;  /**< Offset of histogram bins in a record */
+    uint32_t hist_bins;    /**< Bins per histogram in each record */
+    uint32_t rec_offset;   /**< Offset of struct nlcali_shm_rec_t */
+    uint32_t capacity;     /**< Number of records */
+    volatile uint32_t count; /**< Records taken; each is ready when
+                                  its `ready` flag is set */
+    int32_t pid;           /**< Process ID of the writer */
+    uint32_t off_seq;      /**< Offset of `seq`, odd during updates */
+    uint32_t off_vacc;     /**< Offset of `vacc` */
+    uint32_t off_racc;     /**< Offset of `racc` */
+    uint32_t off_gacc;     /**< Offset of `gacc` */
+    uint32_t off_dur_ticks; /**< Offset of `dur_ticks` */
+    uint32_t off_tick_ns;  /**< Offset of `tick_ns` */
+};
+
+/**
+ * Description of a record, after its caliper.
+ */
+struct nlcali_shm_rec_t {
+    volatile uint32_t ready;     /**< Set once the caliper is set up */
+    char name[NL_SHM_NAME_MAX];  /**< Event name, NUL-terminated */
+};
+
+struct nlcali_shm_t;
+typedef struct nlcali_shm_t *nlcali_shm_T;
+
+struct nlcali_shm_reader_t;
+typedef struct nlcali_shm_reader_t *nlcali_shm_reader_T;
+
+/**
+ * Create a shared-memory segment for calipers.
+ *
+ * \param name Segment name for shm_open(), e.g. "/myapp.calipers".
+ *        An existing segment of that name is replaced.
+ * \param capacity Number of calipers it holds
+ * \param hist_bins Bins per histogram to reserve for each caliper;
+ *        histograms with more bins are kept in the writer's memory
+ *        and not exported
+ * \return New segment, or NULL on error
+ */
+nlcali_shm_T nlcali_shm_create(const char *name, unsigned capacity,
+                               unsigned hist_bins);
+
+/**
+ * Take a caliper from the segment, initialized as with nlcali_init(),
+ * and publish it under an event name.
+ *
+ * May be called from any thread. Configure histograms before
+ * recording; the caliper is otherwise used like any other, by one
+ * thread at a time, and belongs to the segment.
+ *
+ * \param self Segment
+ * \param event Event name, truncated to NL_SHM_NAME_MAX - 1 bytes
+ * \param baseline Minimum number of values to get a standard deviation.
+ * \return Caliper, or NULL if the segment is full
+ */
+T nlcali_shm_alloc(nlcali_shm_T self, const char *event, unsigned baseline);
+
+/**
+ * Take a caliper from the segment, initialized as with
+ * nlcali_init_like(), and publish it under an event name.
+ *
+ * \param self Segment
+ * \param event Event name
+ * \param proto Caliper to copy configuration from
+ * \return Caliper, or NULL if the segment is full
+ */
+T nlcali_shm_alloc_like(nlcali_shm_T self, const char *event, T proto);
+
+/**
+ * Free the writer's side of a segment and its calipers.
+ * No thread may still be recording.
+ *
+ * \param self Segment
+ * \param unlink If nonzero, also remove the segment's name, so new
+ *        readers cannot open it; readers that have it open keep it.
+ */
+void nlcali_shm_free(nlcali_shm_T self, int unlink);
+
+/**
+ * Open a segment for reading.
+ *
+ * \param name Segment name given to nlcali_shm_create()
+ * \return Reader, or NULL if the segment does not exist, or its
+ *         version or layout does not match this library
+ */
+nlcali_shm_reader_T nlcali_shm_open(const char *name);
+
+/**
+ * Number of records in the segment, which grows as the writer
+ * takes calipers. Some of the newest may not be ready yet.
+ *
+ * \param self Reader
+ */
+unsigned nlcali_shm_count(nlcali_shm_reader_T self);
+
+/**
+ * Header of the segment.
+ *
+ * \param self Reader
+ */
+const struct nlcali_shm_header_t *
+nlcali_shm_header(nlcali_shm_reader_T self);
+
+/**
+ * Event name of a record.
+ *
+ * \param self Reader
+ * \param i Record index, less than nlcali_shm_count()
+ * \return Name, or NULL if the record is not ready
+ */
+const char *nlcali_shm_event(nlcali_shm_reader_T self, unsigned i);
+
+/**
+ * Take a consistent copy of a caliper, and calculate its statistics.
+ *
+ * \param self Reader
+ * \param i Record index, less than nlcali_shm_count()
+ * \return Copy, after nlcali_calc(), owned by the reader and valid
+ *         until the next call; or NULL if the record is not ready or
+ *         stayed in the middle of an update (e.g. the writer died)
+ */
+T nlcali_shm_read(nlcali_shm_reader_T self, unsigned i);
+
+/**
+ * Close a reader.
+ *
+ * \param self Reader
+ */
+void nlcali_shm_close(nlcali_shm_reader_T self);
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_SHM_INCLUDED */
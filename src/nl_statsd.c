@@ -0,0 +1,439 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_statsd.c
+ * StatsD export of calipers, in batches of datagrams.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+/* sendmmsg() */
+#define _GNU_SOURCE
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "nl_fmt.h"
+/* Interface */
+#include "nl_statsd.h"
+
+#define T nlcali_T
+
+/* Longest line: name, suffix, two numbers, type and tags */
+#define STATSD_LINE_MAX NL_STATSD_MTU_MIN
+
+struct nlcali_statsd_t {
+    int fd;                /* connected to the agent */
+    unsigned flags;
+    size_t mtu;
+    char *prefix;          /* start of every metric name */
+    char tags[NL_STATSD_TAGS_MAX + 2]; /* "|#<tags>", or empty */
+    size_t tags_len;
+    char *buf;             /* NL_STATSD_BATCH datagrams of `mtu` bytes */
+    struct iovec iov[NL_STATSD_BATCH]; /* datagrams, as filled so far */
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[NL_STATSD_BATCH];
+#endif
+    unsigned cur;          /* datagram being filled */
+    char name[NL_STATSD_NAME_MAX]; /* metric name of the current caliper */
+    size_t name_len;
+    char line[STATSD_LINE_MAX];
+    struct nlcali_statsd_stats_t stats;
+};
+
+typedef struct nlcali_statsd_t *S;
+
+/* ---------------------------------------------------------------
+ * Sending
+ */
+
+/* Send datagrams 0 to n-1 and empty them; 0 if all were sent */
+static int statsd_send(S self, unsigned n)
+{
+    unsigned i = 0, k;
+    int r, ret = 0;
+
+    while (i < n) {
+#ifdef HAVE_SENDMMSG
+        r = sendmmsg(self->fd, self->msgs + i, n - i, 0);
+#else
+        r = send(self->fd, self->iov[i].iov_base, self->iov[i].iov_len, 0);
+        r = r < 0 ? -1 : 1;
+#endif
+        self->stats.syscalls++;
+        if (r < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ret = -1;
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                /* the agent's socket is full; so are the others */
+                self->stats.dropped += n - i;
+                break;
+            }
+            /* e.g. an earlier datagram was refused; go on after this one */
+            self->stats.dropped++;
+            i++;
+            continue;
+        }
+        for (k = i; k < i + (unsigned)r; k++) {
+            self->stats.packets++;
+            self->stats.bytes += self->iov[k].iov_len;
+        }
+        i += r;
+    }
+    for (i = 0; i < n; i++) {
+        self->iov[i].iov_len = 0;
+    }
+    self->cur = 0;
+    return ret;
+}
+
+/* Add a line to the datagram being filled, or send it alone */
+static void statsd_put(S self, const char *line, size_t n)
+{
+    struct iovec *v = &self->iov[self->cur];
+
+    self->stats.lines++;
+    if (self->flags & NL_STATSD_PER_LINE) {
+        self->stats.syscalls++;
+        if (send(self->fd, line, n, 0) < 0) {
+            self->stats.dropped++;
+        }
+        else {
+            self->stats.packets++;
+            self->stats.bytes += n;
+        }
+        return;
+    }
+    if (v->iov_len > 0 && v->iov_len + 1 + n > self->mtu) {
+        if (++self->cur == NL_STATSD_BATCH) {
+            (void)statsd_send(self, NL_STATSD_BATCH);
+        }
+        v = &self->iov[self->cur];
+    }
+    if (v->iov_len > 0) {
+        ((char *)v->iov_base)[v->iov_len++] = '\n';
+    }
+    memcpy((char *)v->iov_base + v->iov_len, line, n);
+    v->iov_len += n;
+}
+
+/* ---------------------------------------------------------------
+ * Lines
+ */
+
+/* "<name><suffix>:<x>|<type>[|@<rate>][|#<tags>]" */
+static void statsd_line(S self, const char *suffix, double x,
+                        const char *type, double rate)
+{
+    char *p = self->line;
+    size_t n;
+
+    memcpy(p, self->name, self->name_len);
+    p += self->name_len;
+    n = strlen(suffix);
+    memcpy(p, suffix, n);
+    p += n;
+    *p++ = ':';
+    p += nl_fmt_double(p, x);
+    *p++ = '|';
+    n = strlen(type);
+    memcpy(p, type, n);
+    p += n;
+    if (rate < 1) {
+        *p++ = '|';
+        *p++ = '@';
+        p += nl_fmt_double(p, rate);
+    }
+    memcpy(p, self->tags, self->tags_len);
+    p += self->tags_len;
+    statsd_put(self, self->line, p - self->line);
+}
+
+static void statsd_gauge(S self, const char *suffix, double x)
+{
+    if (x < 0 && !(self->flags & NL_STATSD_DOGSTATSD)) {
+        /* StatsD reads a leading '-' as a decrement */
+        statsd_line(self, suffix, 0, "g", 1);
+    }
+    statsd_line(self, suffix, x, "g", 1);
+}
+
+static const char *const statsd_summ_keys[4][5] = {
+    { ".value.sum", ".value.mean", ".value.min", ".value.max", ".value.sd" },
+    { ".rate.sum", ".rate.mean", ".rate.min", ".rate.max", ".rate.sd" },
+    { ".cpu.sum", ".cpu.mean", ".cpu.min", ".cpu.max", ".cpu.sd" },
+    { ".wait.sum", ".wait.mean", ".wait.min", ".wait.max", ".wait.sd" }
+};
+
+/* Gauges of a summary, divided by `div`, if it has events */
+static void statsd_summ(S self, const char *const *keys,
+                        const struct nlcali_summ_t *sm, double div)
+{
+    if (sm->count <= 0) {
+        return;
+    }
+    statsd_gauge(self, keys[0], sm->sum / div);
+    statsd_gauge(self, keys[1], sm->mean / div);
+    statsd_gauge(self, keys[2], sm->min / div);
+    statsd_gauge(self, keys[3], sm->max / div);
+    if (sm->sd >= 0) {
+        statsd_gauge(self, keys[4], sm->sd / div);
+    }
+}
+
+/* One line per bin with events, at its middle divided by `div` */
+static void statsd_bins(S self, T c, const char *suffix,
+                        netlogger_hkind_t kind, double div)
+{
+    const struct nlcali_hist_t *h = NULL;
+    const unsigned *data = NULL;
+    const char *type = self->flags & NL_STATSD_DOGSTATSD ? "d" : "ms";
+    unsigned i, n = 0;
+    long long count;
+    double lo, hi;
+
+    switch (kind) {
+        case NL_HIST_DUR: h = &c->h_dur; break;
+        case NL_HIST_VALUE: h = &c->h_val; break;
+        case NL_HIST_CPU: h = &c->h_cpu; break;
+        case NL_HIST_WAIT: h = &c->h_wait; break;
+        default:
+            if (NL_HIST_HAS_DATA(c)) {
+                n = c->h_num;
+                data = kind == NL_HIST_GAP ? c->h_gdata : c->h_rdata;
+            }
+    }
+    if (NULL != h && h->state != NL_HIST_OFF) {
+        n = h->num;
+        data = h->data;
+    }
+    hi = n > 0 ? nlcali_hist_edge(c, kind, 0) : 0;
+    for (i = 0; i < n; i++) {
+        lo = hi;
+        hi = nlcali_hist_edge(c, kind, i + 1);
+        if (0 == data[i]) {
+            continue;
+        }
+        /* estimated events when sampling, see `scale` */
+        count = 1 == c->scale ? data[i] :
+            (long long)(data[i] * c->scale + 0.5);
+        if (count > 0) {
+            statsd_line(self, suffix, (lo + hi) / 2 / div, type,
+                        1.0 / count);
+        }
+    }
+}
+
+/* Metric name of a caliper: prefix and name, with characters that
+   StatsD uses as separators as '_' */
+static void statsd_name(S self, const char *name)
+{
+    const char *s = self->prefix;
+    size_t n = 0;
+    char ch;
+
+    for (;;) {
+        if ('\0' == *s) {
+            if (NULL == name) {
+                break;
+            }
+            s = name;
+            name = NULL;
+            continue;
+        }
+        if (n == sizeof(self->name)) {
+            break;
+        }
+        ch = *s++;
+        if (ch == ':' || ch == '|' || ch == '@' || ch == '#' || ch == ',' ||
+            (unsigned char)ch <= ' ') {
+            ch = '_';
+        }
+        self->name[n++] = ch;
+    }
+    self->name_len = n;
+}
+
+/* ---------------------------------------------------------------
+ * Methods
+ */
+
+/* Socket connected to "unix:PATH" or "HOST:PORT", or -1 */
+static int statsd_connect(const char *addr, int *is_unix)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    struct sockaddr_un sa;
+    char host[256];
+    const char *port;
+    size_t hlen;
+    int fd = -1;
+
+    *is_unix = 0 == strncmp(addr, "unix:", 5);
+    if (*is_unix) {
+        if (strlen(addr + 5) >= sizeof(sa.sun_path)) {
+            return -1;
+        }
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        strcpy(sa.sun_path, addr + 5);
+        fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && 0 != connect(fd, (struct sockaddr *)&sa, sizeof(sa))) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+    port = strrchr(addr, ':');
+    if (NULL == port) {
+        return -1;
+    }
+    hlen = port++ - addr;
+    /* "[::1]:8125" */
+    if (hlen >= 2 && '[' == addr[0] && ']' == addr[hlen - 1]) {
+        addr++;
+        hlen -= 2;
+    }
+    if (hlen >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, addr, hlen);
+    host[hlen] = '\0';
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (0 != getaddrinfo(hlen > 0 ? host : NULL, port, &hints, &res)) {
+        return -1;
+    }
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (0 == connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+nlcali_statsd_T nlcali_statsd_new(const char *addr, const char *prefix,
+                                  const char *tags, size_t mtu,
+                                  unsigned flags)
+{
+    S self;
+    int is_unix;
+    unsigned i;
+
+    if (0 != mtu && mtu < NL_STATSD_MTU_MIN) {
+        return NULL;
+    }
+    if (NULL != tags && strlen(tags) > NL_STATSD_TAGS_MAX) {
+        return NULL;
+    }
+    self = (S)calloc(1, sizeof(struct nlcali_statsd_t));
+    if (NULL == self) {
+        return NULL;
+    }
+    self->fd = statsd_connect(addr, &is_unix);
+    if (self->fd < 0) {
+        goto error;
+    }
+    self->flags = flags;
+    self->mtu = mtu ? mtu : is_unix ? NL_STATSD_MTU_UNIX : NL_STATSD_MTU_UDP;
+    if ((flags & NL_STATSD_DOGSTATSD) && NULL != tags && '\0' != *tags) {
+        self->tags_len = strlen(tags) + 2;
+        self->tags[0] = '|';
+        self->tags[1] = '#';
+        memcpy(self->tags + 2, tags, self->tags_len - 2);
+    }
+    self->prefix = strdup(prefix ? prefix : "");
+    self->buf = (char *)malloc(NL_STATSD_BATCH * self->mtu);
+    if (NULL == self->prefix || NULL == self->buf) {
+        goto error;
+    }
+    for (i = 0; i < NL_STATSD_BATCH; i++) {
+        self->iov[i].iov_base = self->buf + i * self->mtu;
+#ifdef HAVE_SENDMMSG
+        self->msgs[i].msg_hdr.msg_iov = &self->iov[i];
+        self->msgs[i].msg_hdr.msg_iovlen = 1;
+#endif
+    }
+    return self;
+
+ error:
+    if (self->fd >= 0) {
+        close(self->fd);
+    }
+    free(self->prefix);
+    free(self->buf);
+    free(self);
+    return NULL;
+}
+
+void nlcali_statsd_add(nlcali_statsd_T self, const char *name, T cali)
+{
+    nlcali_calc(cali);
+    statsd_name(self, name);
+    statsd_line(self, ".count", (double)cali->vsm.count, "c", 1);
+    if (cali->vsm.count > 0) {
+        statsd_summ(self, statsd_summ_keys[0], &cali->vsm, 1);
+        statsd_summ(self, statsd_summ_keys[1], &cali->rsm, 1);
+        statsd_gauge(self, ".duration.sum", cali->dur_sum * 1e3);
+        statsd_gauge(self, ".duration.mean",
+                     cali->dur_sum * 1e3 / cali->vsm.count);
+    }
+    if (NULL != cali->cpu) {
+        statsd_summ(self, statsd_summ_keys[2], &cali->cpu->csm, 1e6);
+        statsd_summ(self, statsd_summ_keys[3], &cali->cpu->wsm, 1e6);
+    }
+    if (cali->inflight_max > 0) {
+        statsd_gauge(self, ".inflight", cali->inflight);
+        statsd_gauge(self, ".inflight.max", cali->inflight_max);
+    }
+    statsd_bins(self, cali, ".value", NL_HIST_VALUE, 1);
+    statsd_bins(self, cali, ".duration", NL_HIST_DUR, 1e6);
+    statsd_bins(self, cali, ".rate", NL_HIST_RATE, 1);
+    statsd_bins(self, cali, ".gap", NL_HIST_GAP, 1);
+    statsd_bins(self, cali, ".cpu", NL_HIST_CPU, 1e6);
+    statsd_bins(self, cali, ".wait", NL_HIST_WAIT, 1e6);
+}
+
+int nlcali_statsd_flush(nlcali_statsd_T self)
+{
+    unsigned n = self->cur + (self->iov[self->cur].iov_len > 0);
+
+    return n > 0 ? statsd_send(self, n) : 0;
+}
+
+const struct nlcali_statsd_stats_t *nlcali_statsd_stats(nlcali_statsd_T self)
+{
+    return &self->stats;
+}
+
+void nlcali_statsd_free(nlcali_statsd_T self)
+{
+    if (self) {
+        (void)nlcali_statsd_flush(self);
+        close(self->fd);
+        free(self->prefix);
+        free(self->buf);
+        free(self);
+    }
+}
+
+#undef T
@@ -0,0 +1,138 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_statsd.h
+ * StatsD and DogStatsD export of calipers, over UDP or a UNIX
+ * datagram socket.
+ *
+ * An exporter turns each caliper's summaries and histogram bins into
+ * StatsD lines, and packs the lines into datagrams of at most `mtu`
+ * bytes. Full datagrams are kept until a batch of them is full, or
+ * until nlcali_statsd_flush(), and then sent together with one
+ * sendmmsg() call. All its memory is allocated when it is created.
+ *
+ * A caliper named "svc.db.query", with prefix "app.", gives these
+ * lines, all starting "app.svc.db.query":
+ *   - `.count:N|c`: events;
+ *   - `.value.sum`, `.value.mean`, `.value.min`, `.value.max`,
+ *     `.value.sd`, and likewise `.rate.*`: gauges;
+ *   - `.duration.sum` and `.duration.mean`, and with nlcali_cpu()
+ *     `.cpu.*` and `.wait.*`: gauges, in milliseconds;
+ *   - `.inflight` and `.inflight.max`: gauges, if nlcali_start() has
+ *     been used;
+ *   - `.value`, `.duration`, `.rate`, `.gap`, `.cpu` and `.wait`:
+ *     one timer (`|ms`) line per histogram bin with events, at the
+ *     middle of the bin, with a sample rate of 1 over the bin's count
+ *     (`|@0.01` for 100 events), so that the agent counts every event.
+ *     DogStatsD gets distributions (`|d`) instead.
+ * Gauges with no events are left out. A negative gauge is sent after
+ * a zero one, because StatsD reads a leading '-' as a decrement; not
+ * for DogStatsD, which does not. The characters ':', '|', '@',
+ * '#', ',' and white space in names become '_'.
+ */
+
+#include "nl_calipers.h"
+
+#ifndef NETLOGGER_STATSD_INCLUDED
+#    define NETLOGGER_STATSD_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define T nlcali_T
+
+/* DogStatsD: distributions for bins, and tags on every line */
+#define NL_STATSD_DOGSTATSD 0x1
+/* Send each line in its own datagram, as it is made (for comparison) */
+#define NL_STATSD_PER_LINE 0x2
+
+/* Longest metric name prefix, with the caliper name, that is kept */
+#define NL_STATSD_NAME_MAX 200
+/* Longest tags string */
+#define NL_STATSD_TAGS_MAX 200
+/* Smallest datagram size; any line fits in it */
+#define NL_STATSD_MTU_MIN 512
+/* Default datagram sizes: Ethernet less IP and UDP headers, and the
+   size DogStatsD agents read from UNIX sockets */
+#define NL_STATSD_MTU_UDP 1432
+#define NL_STATSD_MTU_UNIX 8192
+/* Datagrams sent per system call */
+#define NL_STATSD_BATCH 64
+
+struct nlcali_statsd_t;
+typedef struct nlcali_statsd_t *nlcali_statsd_T;
+
+/**
+ * Counts of what an exporter has done since it was created.
+ */
+struct nlcali_statsd_stats_t {
+    unsigned long long lines;     /**< Lines made */
+    unsigned long long packets;   /**< Datagrams sent */
+    unsigned long long bytes;     /**< Bytes sent */
+    unsigned long long syscalls;  /**< System calls made to send */
+    unsigned long long dropped;   /**< Datagrams that could not be sent,
+                                     e.g. no agent was listening or its
+                                     UNIX socket was full */
+};
+
+/**
+ * Create an exporter, with a non-blocking socket connected to the
+ * agent.
+ *
+ * \param addr "unix:PATH" for a UNIX datagram socket, else "HOST:PORT"
+ *        for UDP (HOST may be "[ADDR]" for IPv6)
+ * \param prefix Prefix of every metric name, e.g. "app."; copied
+ * \param tags DogStatsD tags for every line, e.g. "env:prod,host:a",
+ *        or NULL; copied. Ignored without NL_STATSD_DOGSTATSD.
+ * \param mtu Largest datagram, at least NL_STATSD_MTU_MIN; 0 for
+ *        NL_STATSD_MTU_UDP or NL_STATSD_MTU_UNIX
+ * \param flags 0, or NL_STATSD_DOGSTATSD and/or NL_STATSD_PER_LINE
+ * \return New exporter, or NULL if the arguments are bad, the address
+ *         cannot be resolved or connected to, or memory is exhausted
+ */
+nlcali_statsd_T nlcali_statsd_new(const char *addr, const char *prefix,
+                                  const char *tags, size_t mtu,
+                                  unsigned flags);
+
+/**
+ * Add the lines of one caliper, sending a batch of datagrams if it
+ * fills up. Calls nlcali_calc() on the caliper, so it must not be
+ * recorded into meanwhile: use a finished interval, such as the one
+ * given to a reporter's output callback (see nl_reporter.h), or a
+ * merged copy.
+ *
+ * \param self Exporter
+ * \param name Caliper name, used in the metric names
+ * \param cali Caliper
+ */
+void nlcali_statsd_add(nlcali_statsd_T self, const char *name, T cali);
+
+/**
+ * Send every datagram that has lines in it.
+ *
+ * \param self Exporter
+ * \return 0 if all were sent, -1 if some of them were dropped
+ */
+int nlcali_statsd_flush(nlcali_statsd_T self);
+
+/**
+ * Counts of lines, datagrams and system calls so far.
+ *
+ * \param self Exporter
+ * \return Counts, owned by the exporter
+ */
+const struct nlcali_statsd_stats_t *nlcali_statsd_stats(nlcali_statsd_T self);
+
+/**
+ * Flush and free an exporter, closing its socket.
+ *
+ * \param self Exporter
+ */
+void nlcali_statsd_free(nlcali_statsd_T self);
+
+#undef T
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_STATSD_INCLUDED */
@@ -0,0 +1,298 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_tdigest.c
+ * Streaming quantile sketch (merging t-digest).
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Interface */
+#include "nl_tdigest.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* Buffered values per unit of compression */
+#define BUF_FACTOR 5
+
+/* Serialized header */
+#define TD_MAGIC 0x44544c4eU /* "NLTD" */
+#define TD_VERSION 1
+
+struct nl_tdigest_hdr_t {
+    uint32_t magic;
+    uint32_t version;
+    double compression;
+    double min;
+    double max;
+    uint32_t num;
+    uint32_t pad;
+};
+
+/* ---------------------------------------------------------------
+ * Scale function
+ *
+ * k(q) = delta/(2 pi) * asin(2q - 1); adjacent centroids may only be
+ * merged while they span less than one unit of k.
+ */
+
+static double k_scale(double q, double delta)
+{
+    return delta / (2 * M_PI) * asin(2 * q - 1);
+}
+
+static double k_inverse(double k, double delta)
+{
+    return (sin(k * 2 * M_PI / delta) + 1) / 2;
+}
+
+static int cmp_centroid(const void *a, const void *b)
+{
+    double x = ((const struct nl_centroid_t *)a)->m;
+    double y = ((const struct nl_centroid_t *)b)->m;
+    return x < y ? -1 : x > y;
+}
+
+/* ---------------------------------------------------------------
+ * Methods
+ */
+
+nl_tdigest_T nl_tdigest_new(double compression)
+{
+    nl_tdigest_T self;
+    unsigned d;
+
+    if (compression <= 0) {
+        compression = NL_TDIGEST_COMPRESSION;
+    }
+    d = (unsigned)ceil(compression);
+    self = (nl_tdigest_T)malloc(sizeof(struct nl_tdigest_t));
+    if (NULL == self) {
+        return NULL;
+    }
+    self->compression = compression;
+    /* the scale function allows at most about `d` centroids */
+    self->cap = 2 * d + 8;
+    self->buf_cap = BUF_FACTOR * d;
+    self->c = (struct nl_centroid_t *)malloc(
+        (self->cap + self->buf_cap) * sizeof(struct nl_centroid_t));
+    if (NULL == self->c) {
+        free(self);
+        return NULL;
+    }
+    nl_tdigest_clear(self);
+    return self;
+}
+
+void nl_tdigest_clear(nl_tdigest_T self)
+{
+    self->num = self->buf_num = 0;
+    self->total = 0;
+    self->min = DBL_MAX;
+    self->max = -DBL_MAX;
+}
+
+void nl_tdigest_flush(nl_tdigest_T self)
+{
+    struct nl_centroid_t *c = self->c, cur;
+    double total, so_far, q_limit;
+    unsigned i, n, out;
+
+    if (0 == self->buf_num) {
+        return;
+    }
+    /* bring buffered values next to the centroids and sort them all */
+    memmove(c + self->num, c + self->cap,
+            self->buf_num * sizeof(struct nl_centroid_t));
+    n = self->num + self->buf_num;
+    total = self->total;
+    for (i = self->num; i < n; i++) {
+        total += c[i].w;
+    }
+    qsort(c, n, sizeof(struct nl_centroid_t), cmp_centroid);
+    /* one pass, merging neighbours while the scale function allows */
+    out = 0;
+    so_far = 0;
+    cur = c[0];
+    q_limit = k_inverse(k_scale(0, self->compression) + 1,
+                        self->compression);
+    for (i = 1; i < n; i++) {
+        if ((so_far + cur.w + c[i].w) / total <= q_limit ||
+            out == self->cap - 1) {
+            cur.m += (c[i].m - cur.m) * c[i].w / (cur.w + c[i].w);
+            cur.w += c[i].w;
+        }
+        else {
+            c[out++] = cur;
+            so_far += cur.w;
+            q_limit = k_inverse(k_scale(so_far / total, self->compression)
+                                + 1, self->compression);
+            cur = c[i];
+        }
+    }
+    c[out++] = cur;
+    self->num = out;
+    self->buf_num = 0;
+    self->total = total;
+}
+
+double nl_tdigest_count(nl_tdigest_T self)
+{
+    double total = self->total;
+    unsigned i;
+
+    for (i = 0; i < self->buf_num; i++) {
+        total += self->c[self->cap + i].w;
+    }
+    return total;
+}
+
+double nl_tdigest_quantile(nl_tdigest_T self, double q)
+{
+    struct nl_centroid_t *c;
+    double index, left, right, so_far;
+    unsigned i;
+
+    nl_tdigest_flush(self);
+    if (0 == self->num) {
+        return -1;
+    }
+    if (q <= 0) {
+        return self->min;
+    }
+    if (q >= 1) {
+        return self->max;
+    }
+    c = self->c;
+    index = q * self->total;
+    /* before the center of the first centroid */
+    if (index < c[0].w / 2) {
+        return self->min + (c[0].m - self->min) * index / (c[0].w / 2);
+    }
+    /* between the centers of two centroids */
+    so_far = 0;
+    for (i = 0; i + 1 < self->num; i++) {
+        left = so_far + c[i].w / 2;
+        right = so_far + c[i].w + c[i + 1].w / 2;
+        if (index < right) {
+            return c[i].m + (c[i + 1].m - c[i].m) *
+                (index - left) / (right - left);
+        }
+        so_far += c[i].w;
+    }
+    /* after the center of the last centroid */
+    left = self->total - c[i].w / 2;
+    if (index <= left) {
+        return c[i].m;
+    }
+    return c[i].m + (self->max - c[i].m) *
+        (index - left) / (self->total - left);
+}
+
+void nl_tdigest_merge(nl_tdigest_T self, const struct nl_tdigest_t *other)
+{
+    const struct nl_centroid_t *c;
+    unsigned i, n = other->num + other->buf_num;
+
+    /* centroids, then buffered values, as they are: flushing `other`
+       would change it, and it may be in use elsewhere */
+    for (i = 0; i < n; i++) {
+        c = i < other->num ? &other->c[i] :
+            &other->c[other->cap + i - other->num];
+        if (self->buf_num == self->buf_cap) {
+            nl_tdigest_flush(self);
+        }
+        self->c[self->cap + self->buf_num++] = *c;
+    }
+    if (other->min < self->min) self->min = other->min;
+    if (other->max > self->max) self->max = other->max;
+}
+
+int nl_tdigest_copy(nl_tdigest_T self, const struct nl_tdigest_t *other)
+{
+    if (self->compression != other->compression) {
+        return -1;
+    }
+    self->num = other->num;
+    self->buf_num = other->buf_num;
+    self->total = other->total;
+    self->min = other->min;
+    self->max = other->max;
+    memcpy(self->c, other->c, other->num * sizeof(struct nl_centroid_t));
+    memcpy(self->c + self->cap, other->c + other->cap,
+           other->buf_num * sizeof(struct nl_centroid_t));
+    return 0;
+}
+
+size_t nl_tdigest_serialize(nl_tdigest_T self, void *buf, size_t len)
+{
+    struct nl_tdigest_hdr_t hdr;
+    size_t need;
+
+    nl_tdigest_flush(self);
+    need = sizeof(hdr) + self->num * sizeof(struct nl_centroid_t);
+    if (need <= len) {
+        hdr.magic = TD_MAGIC;
+        hdr.version = TD_VERSION;
+        hdr.compression = self->compression;
+        hdr.min = self->min;
+        hdr.max = self->max;
+        hdr.num = self->num;
+        hdr.pad = 0;
+        memcpy(buf, &hdr, sizeof(hdr));
+        memcpy((char *)buf + sizeof(hdr), self->c,
+               self->num * sizeof(struct nl_centroid_t));
+    }
+    return need;
+}
+
+nl_tdigest_T nl_tdigest_deserialize(const void *buf, size_t len)
+{
+    struct nl_tdigest_hdr_t hdr;
+    nl_tdigest_T self;
+    unsigned i;
+
+    if (len < sizeof(hdr)) {
+        return NULL;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.magic != TD_MAGIC || hdr.version != TD_VERSION ||
+        len < sizeof(hdr) + hdr.num * sizeof(struct nl_centroid_t)) {
+        return NULL;
+    }
+    self = nl_tdigest_new(hdr.compression);
+    if (NULL == self) {
+        return NULL;
+    }
+    if (hdr.num > self->cap) {
+        nl_tdigest_free(self);
+        return NULL;
+    }
+    memcpy(self->c, (const char *)buf + sizeof(hdr),
+           hdr.num * sizeof(struct nl_centroid_t));
+    self->num = hdr.num;
+    self->min = hdr.min;
+    self->max = hdr.max;
+    for (i = 0; i < self->num; i++) {
+        self->total += self->c[i].w;
+    }
+    return self;
+}
+
+void nl_tdigest_free(nl_tdigest_T self)
+{
+    if (self) {
+        free(self->c);
+        free(self);
+    }
+}
@@ -0,0 +1,170 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_tdigest.h
+ * Streaming quantile sketch (merging t-digest).
+ *
+ * Values are appended to a buffer and periodically merged into
+ * a sorted set of weighted centroids, whose sizes are limited by
+ * the arcsine scale function so that the tails are kept at much
+ * finer resolution than the middle. Memory is fixed by the
+ * compression parameter; a digest of compression 100 holds at most
+ * a few hundred centroids and gives quantiles in the far tails to
+ * a small fraction of a percent.
+ */
+
+#include <stddef.h>
+
+#ifndef NETLOGGER_TDIGEST_INCLUDED
+#    define NETLOGGER_TDIGEST_INCLUDED
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef NL_INLINE
+#    ifdef __GNUC__
+#        define NL_INLINE static __inline__
+#    else
+#        define NL_INLINE static
+#    endif
+#endif
+
+/* Default compression, roughly the number of centroids kept */
+#define NL_TDIGEST_COMPRESSION 100
+
+struct nl_centroid_t {
+    double m; /**< Mean */
+    double w; /**< Weight (count) */
+};
+
+/**
+ * Merging t-digest.
+ */
+struct nl_tdigest_t {
+    double compression;  /**< Scale parameter, delta */
+    unsigned cap;        /**< Max. number of centroids */
+    unsigned num;        /**< Number of merged centroids */
+    unsigned buf_cap;    /**< Max. number of buffered values */
+    unsigned buf_num;    /**< Number of buffered values */
+    double total;        /**< Total weight of merged centroids */
+    double min;          /**< Smallest value */
+    double max;          /**< Largest value */
+    struct nl_centroid_t *c; /**< Centroids, sorted by mean,
+                                  then the buffered values */
+};
+
+typedef struct nl_tdigest_t *nl_tdigest_T;
+
+/**
+ * Constructor.
+ *
+ * \param compression Scale parameter; higher is more accurate
+ *        and uses more memory. 0 for NL_TDIGEST_COMPRESSION.
+ * \return New digest, or NULL on error
+ */
+nl_tdigest_T nl_tdigest_new(double compression);
+
+/**
+ * Merge buffered values into the centroids.
+ * Called automatically when the buffer fills.
+ *
+ * \param self Digest
+ */
+void nl_tdigest_flush(nl_tdigest_T self);
+
+/**
+ * Add one value.
+ *
+ * \param self Digest
+ * \param x Value
+ */
+NL_INLINE void nl_tdigest_add(nl_tdigest_T self, double x)
+{
+    struct nl_centroid_t *c;
+
+    if (self->buf_num == self->buf_cap) {
+        nl_tdigest_flush(self);
+    }
+    c = &self->c[self->cap + self->buf_num++];
+    c->m = x;
+    c->w = 1;
+    if (x < self->min) self->min = x;
+    if (x > self->max) self->max = x;
+}
+
+/**
+ * Estimate a quantile.
+ *
+ * \param self Digest
+ * \param q Quantile, from 0 to 1
+ * \return Estimated value, or -1 if the digest is empty
+ */
+double nl_tdigest_quantile(nl_tdigest_T self, double q);
+
+/**
+ * Total number of values added.
+ *
+ * \param self Digest
+ */
+double nl_tdigest_count(nl_tdigest_T self);
+
+/**
+ * Merge another digest into this one.
+ *
+ * \param self Digest to merge into
+ * \param other Digest to merge from, unchanged. Its buffered
+ *        values are merged as they are, without flushing it.
+ */
+void nl_tdigest_merge(nl_tdigest_T self, const struct nl_tdigest_t *other);
+
+/**
+ * Overwrite a digest with a copy of another of the same compression.
+ *
+ * \param self Digest to copy into
+ * \param other Digest to copy from
+ * \return 0 on success, -1 if the compressions differ
+ */
+int nl_tdigest_copy(nl_tdigest_T self, const struct nl_tdigest_t *other);
+
+/**
+ * Remove all values.
+ *
+ * \param self Digest
+ */
+void nl_tdigest_clear(nl_tdigest_T self);
+
+/**
+ * Serialize the digest into a buffer.
+ *
+ * The format is a fixed header followed by the centroids, in
+ * host byte order; it can be passed to nl_tdigest_deserialize()
+ * and the result merged into another digest.
+ *
+ * \param self Digest; its buffer is flushed first.
+ * \param buf Output buffer
+ * \param len Size of output buffer
+ * \return Number of bytes needed. If this is more than `len`,
+ *         nothing was written.
+ */
+size_t nl_tdigest_serialize(nl_tdigest_T self, void *buf, size_t len);
+
+/**
+ * Create a digest from serialized data.
+ *
+ * \param buf Data from nl_tdigest_serialize()
+ * \param len Length of data
+ * \return New digest, or NULL if the data is not valid
+ */
+nl_tdigest_T nl_tdigest_deserialize(const void *buf, size_t len);
+
+/**
+ * Free memory for digest.
+ *
+ * \param self Digest
+ */
+void nl_tdigest_free(nl_tdigest_T self);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* NETLOGGER_TDIGEST_INCLUDED */
@@ -0,0 +1,119 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_trace.c
+ * Ring of raw caliper events, and dumping it to a file.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+/* Interface */
+#include "nl_calipers.h"
+
+#define T nlcali_T
+
+int nlcali_trace(T self, unsigned capacity)
+{
+    struct nlcali_trace_t *tr;
+    uint64_t n;
+    void *p;
+
+    free(self->trace);
+    self->trace = NULL;
+    self->opts &= ~NL_OPT_TRACE;
+    if (0 == capacity) {
+        return 0;
+    }
+    for (n = 1; n < capacity; n <<= 1)
+        ;
+    if (0 != posix_memalign(&p, NL_CACHE_LINE, sizeof(struct nlcali_trace_t) +
+                            n * sizeof(struct nlcali_trace_rec_t))) {
+        return -1;
+    }
+    tr = (struct nlcali_trace_t *)p;
+    tr->mask = n - 1;
+    tr->head = 0;
+    self->trace = tr;
+    self->opts |= NL_OPT_TRACE;
+    return 0;
+}
+
+/* writev() all of `iov`, resuming after short writes */
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+    ssize_t w;
+
+    while (n > 0) {
+        w = writev(fd, iov, n);
+        if (w < 0) {
+            if (EINTR == errno) {
+                continue;
+            }
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+long long nlcali_trace_dump(T self, int fd)
+{
+    struct nlcali_trace_t *tr = self->trace;
+    struct nlcali_trace_file_t hdr;
+    struct iovec iov[3];
+    uint64_t head, count, cap, i, run;
+    int n = 1;
+
+    if (NULL == tr) {
+        return -1;
+    }
+    cap = tr->mask + 1;
+    head = tr->head;
+    NL_RMB();
+    count = head < cap ? head : cap;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, NL_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = NL_TRACE_VERSION;
+    hdr.rec_size = sizeof(struct nlcali_trace_rec_t);
+    hdr.first = head - count;
+    hdr.count = count;
+    hdr.tick_ns = self->tick_ns;
+    hdr.clock = self->clock;
+    hdr.baseline = self->vacc.var.min_items;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    /* the oldest records run to the end of the ring, then wrap */
+    i = hdr.first & tr->mask;
+    run = cap - i < count ? cap - i : count;
+    if (run > 0) {
+        iov[n].iov_base = &tr->rec[i];
+        iov[n].iov_len = run * sizeof(struct nlcali_trace_rec_t);
+        n++;
+    }
+    if (count > run) {
+        iov[n].iov_base = &tr->rec[0];
+        iov[n].iov_len = (count - run) * sizeof(struct nlcali_trace_rec_t);
+        n++;
+    }
+    if (0 != writev_all(fd, iov, n)) {
+        return -1;
+    }
+    return (long long)count;
+}
+
+#undef T
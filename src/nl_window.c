@@ -0,0 +1,217 @@
+/* Copyright 2012 The Regents of the University of California */
+/* See COPYING for information about copying and redistribution.*/
+
+/** \file nl_window.c
+ * Sliding-window and exponentially weighted statistics of calipers.
+ */
+static const volatile char rcsid[] = "$Id$";
+
+#ifdef HAVE_CONFIG_H
+#    include "nlconfig.h"
+#endif
+#include <math.h>
+#include <stdlib.h>
+
+/* Interface */
+#include "nl_calipers.h"
+
+#define T nlcali_T
+
+/* Sub-interval number of a slot that holds nothing */
+#define NL_PERIOD_NONE UINT64_MAX
+
+typedef struct nlcali_window_t *W;
+
+static void window_free(W w)
+{
+    unsigned i;
+
+    if (NULL == w) {
+        return;
+    }
+    if (NULL != w->slot) {
+        for (i = 0; i < w->k; i++) {
+            nlcali_free(w->slot[i]);
+        }
+        free(w->slot);
+    }
+    nlcali_free(w->agg);
+    free(w->period);
+    free(w);
+}
+
+/* Fold one observation into a moving average, after decaying
+   the old weights by `d` */
+static void ewma_add(struct nlcali_ewma_t *e, double d, double x)
+{
+    double diff;
+
+    e->w = e->w * d + 1;
+    e->s *= d;
+    diff = x - e->mean;
+    e->mean += diff / e->w;
+    e->s += diff * (x - e->mean);
+}
+
+static void ewma_decay(struct nlcali_ewma_t *e, double d)
+{
+    e->w *= d;
+    e->s *= d;
+}
+
+int nlcali_window(T self, double seconds, unsigned k, double half_life)
+{
+    W w;
+    unsigned i;
+    double ticks;
+
+    window_free(self->win);
+    self->win = NULL;
+    self->opts &= ~NL_OPT_WINDOW;
+    if (seconds < 0 || half_life < 0 || (seconds > 0 && 0 == k)) {
+        return -1;
+    }
+    if (0 == seconds && 0 == half_life) {
+        return 0;
+    }
+    w = (W)calloc(1, sizeof(struct nlcali_window_t));
+    if (NULL == w) {
+        return -1;
+    }
+    w->seconds = seconds;
+    w->half_life = half_life;
+    if (half_life > 0) {
+        w->ew_per_tick = self->tick_ns / (half_life * 1e9);
+    }
+    if (seconds > 0) {
+        w->k = k;
+        ticks = seconds / k * 1e9 / self->tick_ns;
+        w->slot_ticks = ticks < 1 ? 1 : (nl_ticks_t)ticks;
+        w->period = (uint64_t *)malloc(k * sizeof(uint64_t));
+        w->slot = (T *)calloc(k, sizeof(T));
+        if (NULL == w->period || NULL == w->slot) {
+            goto error;
+        }
+        /* self->win is NULL, so the copies have no window of their own */
+        for (i = 0; i < k; i++) {
+            w->slot[i] = nlcali_new(self->vacc.var.min_items);
+            if (NULL == w->slot[i]) {
+                goto error;
+            }
+            nlcali_configure_like(w->slot[i], self);
+            w->period[i] = NL_PERIOD_NONE;
+        }
+        w->agg = nlcali_new(self->vacc.var.min_items);
+        if (NULL == w->agg) {
+            goto error;
+        }
+        nlcali_configure_like(w->agg, self);
+        /* slot 0 starts out holding sub-interval 0 */
+        w->period[0] = 0;
+    }
+    self->win = w;
+    self->opts |= NL_OPT_WINDOW;
+    return 0;
+
+ error:
+    window_free(w);
+    return -1;
+}
+
+void nlcali_window_add(T self, nl_ticks_t b, nl_ticks_t e, double v)
+{
+    W w = self->win;
+    T slot;
+    uint64_t p;
+    unsigned i;
+    double d, dur;
+
+    if (w->k > 0) {
+        /* usually the event is in the newest sub-interval; if it is
+           before its start, the unsigned difference is large */
+        if (e - w->slot_begin < w->slot_ticks) {
+            i = w->cur;
+        }
+        else {
+            p = e / w->slot_ticks;
+            if (p > w->newest) {
+                w->newest = p;
+                w->cur = (unsigned)(p % w->k);
+                w->slot_begin = p * w->slot_ticks;
+            }
+            else if (p + w->k <= w->newest) {
+                /* older than the whole window */
+                goto ewma;
+            }
+            i = (unsigned)(p % w->k);
+            if (w->period[i] != p) {
+                nlcali_clear(w->slot[i]);
+                w->period[i] = p;
+            }
+        }
+        slot = w->slot[i];
+        nlcali_add(slot, b, e, v);
+    }
+ ewma:
+    if (w->half_life > 0) {
+        d = 1.0;
+        if (e > w->ew_last) {
+            d = exp2(-(double)(e - w->ew_last) * w->ew_per_tick);
+            w->ew_last = e;
+        }
+        ewma_add(&w->ew[NL_VALUE], d, v);
+        dur = (e - b) * self->tick_ns;
+        if (v != 0 && dur > 0) {
+            ewma_add(&w->ew[NL_RATE], d, v / dur);
+            ewma_add(&w->ew[NL_GAP], d, dur / v);
+        }
+        else {
+            ewma_decay(&w->ew[NL_RATE], d);
+            ewma_decay(&w->ew[NL_GAP], d);
+        }
+    }
+}
+
+T nlcali_window_calc(T self)
+{
+    W w = self->win;
+    uint64_t now;
+    unsigned i;
+
+    if (NULL == w || 0 == w->k) {
+        return NULL;
+    }
+    now = nl_clock_ticks(self->clock) / w->slot_ticks;
+    nlcali_clear(w->agg);
+    for (i = 0; i < w->k; i++) {
+        if (w->period[i] != NL_PERIOD_NONE && w->period[i] <= now &&
+            w->period[i] + w->k > now) {
+            if (0 != nlcali_merge(w->agg, w->slot[i])) {
+                return NULL;
+            }
+        }
+    }
+    nlcali_calc(w->agg);
+    return w->agg;
+}
+
+int nlcali_ewma(T self, netlogger_metric_t metric, double *mean, double *sd)
+{
+    struct nlcali_ewma_t *e;
+
+    if (NULL == self->win || 0 == self->win->half_life ||
+        metric < NL_VALUE || metric > NL_GAP) {
+        return -1;
+    }
+    e = &self->win->ew[metric];
+    if (e->w <= 0) {
+        return -1;
+    }
+    *mean = e->mean;
+    if (NULL != sd) {
+        *sd = sqrt(e->s / e->w);
+    }
+    return 0;
+}
+
+#undef T